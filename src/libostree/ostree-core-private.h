@@ -66,6 +66,22 @@ G_BEGIN_DECLS
 GVariant *_ostree_zlib_file_header_new (GFileInfo         *file_info,
                                         GVariant          *xattrs);
 
+gboolean _ostree_zlib_compress_parallel (GInputStream   *input,
+                                         const guint8   *prefix,
+                                         gsize           prefix_len,
+                                         GOutputStream  *output,
+                                         int             level,
+                                         guint           n_threads,
+                                         guint64        *out_bytes_read,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+
+gboolean _ostree_checksum_zlib_file (GFile            *content_path,
+                                     guchar          **out_csum,
+                                     guint64          *out_size,
+                                     GCancellable     *cancellable,
+                                     GError          **error);
+
 gboolean _ostree_write_variant_with_size (GOutputStream      *output,
                                           GVariant           *variant,
                                           guint64             alignment_offset,
@@ -861,6 +861,83 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
   return ret;
 }
 
+/*
+ * _ostree_checksum_zlib_file:
+ * @content_path: Path to a compressed (archive-z2) content object
+ * @out_csum: (out) (array fixed-size=32): Return location for binary checksum
+ * @out_size: (out) (allow-none): Return location for uncompressed size
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compute the OSTree checksum of the object stored in @content_path,
+ * inflating the content as it is hashed rather than materializing it.
+ * The uncompressed size recorded in the header is checked against the
+ * actual content, since it is not covered by the checksum.
+ */
+gboolean
+_ostree_checksum_zlib_file (GFile            *content_path,
+                            guchar          **out_csum,
+                            guint64          *out_size,
+                            GCancellable     *cancellable,
+                            GError          **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GInputStream *in = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_variant GVariant *file_header = NULL;
+  gs_free guchar *ret_csum = NULL;
+  GChecksum *checksum = NULL;
+  guint64 size = 0;
+
+  if (!ostree_content_file_parse (TRUE, content_path, FALSE,
+                                  &in, &file_info, &xattrs,
+                                  cancellable, error))
+    goto out;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  file_header = file_header_new (file_info, xattrs);
+  if (!write_file_header_update_checksum (NULL, file_header, checksum,
+                                          cancellable, error))
+    goto out;
+
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      guchar buf[8192];
+      gsize bytes_read;
+
+      do
+        {
+          if (!g_input_stream_read_all (in, buf, sizeof (buf), &bytes_read,
+                                        cancellable, error))
+            goto out;
+          g_checksum_update (checksum, buf, bytes_read);
+          size += bytes_read;
+        }
+      while (bytes_read > 0);
+
+      if (size != (guint64) g_file_info_get_size (file_info))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted archive file; header size %" G_GUINT64_FORMAT
+                       " but uncompressed size %" G_GUINT64_FORMAT,
+                       (guint64) g_file_info_get_size (file_info), size);
+          goto out;
+        }
+    }
+
+  ret_csum = ot_csum_from_gchecksum (checksum);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_csum, &ret_csum);
+  if (out_size)
+    *out_size = size;
+ out:
+  g_clear_pointer (&checksum, (GDestroyNotify)g_checksum_free);
+  return ret;
+}
+
 /**
  * ostree_checksum_file:
  * @f: File path
@@ -22,6 +22,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "ostree.h"
 #include "otutil.h"
 #include "libgsystem.h"
@@ -182,6 +184,553 @@ diff_add_dir_recurse (GFile          *d,
   return ret;
 }
 
+/*
+ * The tree diff works directly on dirtree objects.  Directories whose
+ * contents checksums are equal are skipped without being loaded, and
+ * since dirtree entries are sorted by name, the entries of two
+ * directories are matched up by walking them in step.
+ *
+ * Differences are reported in the same order as ostree_diff_dirs()
+ * finds them: for each directory, the entries of the source (files,
+ * then subdirectories, recursing into those in both trees), then the
+ * entries only in the target.  A removed directory is reported once;
+ * an added directory is reported along with everything below it.
+ */
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeDiffTreeFunc func;
+  gpointer user_data;
+  GCancellable *cancellable;
+  GString *path;
+} OstreeDiffTreesData;
+
+typedef struct {
+  GVariant *files;
+  GVariant *dirs;
+  const char **file_names;
+  const char **dir_names;
+  guint n_files;
+  guint n_dirs;
+} OstreeDiffTree;
+
+static void
+diff_tree_clear (OstreeDiffTree *tree)
+{
+  g_clear_pointer (&tree->files, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&tree->dirs, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&tree->file_names, g_free);
+  g_clear_pointer (&tree->dir_names, g_free);
+}
+
+static gboolean
+diff_tree_load (OstreeRepo      *repo,
+                const char      *contents_checksum,
+                OstreeDiffTree  *tree,
+                GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *tree_variant = NULL;
+  guint i;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents_checksum,
+                                 &tree_variant, error))
+    goto out;
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  tree->files = g_variant_get_child_value (tree_variant, 0);
+  tree->n_files = g_variant_n_children (tree->files);
+  tree->file_names = g_new (const char *, tree->n_files);
+  for (i = 0; i < tree->n_files; i++)
+    g_variant_get_child (tree->files, i, "(&s@ay)", &tree->file_names[i], NULL);
+
+  tree->dirs = g_variant_get_child_value (tree_variant, 1);
+  tree->n_dirs = g_variant_n_children (tree->dirs);
+  tree->dir_names = g_new (const char *, tree->n_dirs);
+  for (i = 0; i < tree->n_dirs; i++)
+    g_variant_get_child (tree->dirs, i, "(&s@ay@ay)", &tree->dir_names[i], NULL, NULL);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Advance @inout_pos in the sorted @names past entries before @name;
+ * returns %TRUE if the entry there is @name.  Called with increasing
+ * names, this walks @names once.
+ */
+static gboolean
+diff_names_seek (const char   **names,
+                 guint          n_names,
+                 guint         *inout_pos,
+                 const char    *name)
+{
+  while (*inout_pos < n_names && strcmp (names[*inout_pos], name) < 0)
+    (*inout_pos)++;
+  return *inout_pos < n_names && strcmp (names[*inout_pos], name) == 0;
+}
+
+static void
+diff_tree_get_file (OstreeDiffTree  *tree,
+                    guint            i,
+                    GVariant       **out_csum_v)
+{
+  g_variant_get_child (tree->files, i, "(&s@ay)", NULL, out_csum_v);
+}
+
+static void
+diff_tree_get_dir (OstreeDiffTree  *tree,
+                   guint            i,
+                   GVariant       **out_contents_csum_v,
+                   GVariant       **out_metadata_csum_v)
+{
+  g_variant_get_child (tree->dirs, i, "(&s@ay@ay)", NULL,
+                       out_contents_csum_v, out_metadata_csum_v);
+}
+
+static gboolean
+diff_csum_equal (GVariant *a,
+                 GVariant *b)
+{
+  return g_variant_get_size (a) == 32 && g_variant_get_size (b) == 32
+    && memcmp (ostree_checksum_bytes_peek (a), ostree_checksum_bytes_peek (b), 32) == 0;
+}
+
+/* Report @name below the current path */
+static gboolean
+diff_report (OstreeDiffTreesData   *data,
+             OstreeDiffChangeType   change,
+             const char            *name,
+             gboolean               src_is_dir,
+             GVariant              *src_csum_v,
+             gboolean               target_is_dir,
+             GVariant              *target_csum_v,
+             GError               **error)
+{
+  gboolean ret;
+  gsize len = data->path->len;
+  gs_free char *src_checksum = NULL;
+  gs_free char *target_checksum = NULL;
+
+  if (len > 0)
+    g_string_append_c (data->path, '/');
+  g_string_append (data->path, name);
+
+  if (src_csum_v)
+    src_checksum = ostree_checksum_from_bytes_v (src_csum_v);
+  if (target_csum_v)
+    target_checksum = ostree_checksum_from_bytes_v (target_csum_v);
+
+  ret = data->func (change, data->path->str,
+                    src_is_dir, src_checksum, target_is_dir, target_checksum,
+                    data->user_data, error);
+
+  g_string_truncate (data->path, len);
+  return ret;
+}
+
+static gboolean
+diff_trees_add_recurse (OstreeDiffTreesData  *data,
+                        const char           *contents_checksum,
+                        int                   depth,
+                        GError              **error)
+{
+  gboolean ret = FALSE;
+  OstreeDiffTree tree = { 0, };
+  guint i;
+
+  if (depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during diff");
+      goto out;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (data->cancellable, error))
+    goto out;
+
+  if (!diff_tree_load (data->repo, contents_checksum, &tree, error))
+    goto out;
+
+  for (i = 0; i < tree.n_files; i++)
+    {
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      diff_tree_get_file (&tree, i, &csum_v);
+      if (!diff_report (data, OSTREE_DIFF_ADDED, tree.file_names[i],
+                        FALSE, NULL, FALSE, csum_v, error))
+        goto out;
+    }
+
+  for (i = 0; i < tree.n_dirs; i++)
+    {
+      const char *name = tree.dir_names[i];
+      gsize len = data->path->len;
+      gs_unref_variant GVariant *contents_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+      gs_free char *child_contents_checksum = NULL;
+      gboolean success;
+
+      diff_tree_get_dir (&tree, i, &contents_csum_v, &metadata_csum_v);
+      if (!diff_report (data, OSTREE_DIFF_ADDED, name,
+                        FALSE, NULL, TRUE, metadata_csum_v, error))
+        goto out;
+
+      child_contents_checksum = ostree_checksum_from_bytes_v (contents_csum_v);
+      if (len > 0)
+        g_string_append_c (data->path, '/');
+      g_string_append (data->path, name);
+      success = diff_trees_add_recurse (data, child_contents_checksum, depth + 1, error);
+      g_string_truncate (data->path, len);
+      if (!success)
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  diff_tree_clear (&tree);
+  return ret;
+}
+
+static gboolean
+diff_trees_recurse (OstreeDiffTreesData  *data,
+                    const char           *src_contents_checksum,
+                    const char           *target_contents_checksum,
+                    int                   depth,
+                    GError              **error)
+{
+  gboolean ret = FALSE;
+  OstreeDiffTree src = { 0, };
+  OstreeDiffTree target = { 0, };
+  guint pos_files, pos_dirs;
+  guint i;
+
+  if (depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during diff");
+      goto out;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (data->cancellable, error))
+    goto out;
+
+  if (!diff_tree_load (data->repo, src_contents_checksum, &src, error))
+    goto out;
+  if (!diff_tree_load (data->repo, target_contents_checksum, &target, error))
+    goto out;
+
+  /* Entries of the source; a name which is a file on one side and a
+   * directory on the other is modified.
+   */
+  pos_files = pos_dirs = 0;
+  for (i = 0; i < src.n_files; i++)
+    {
+      const char *name = src.file_names[i];
+      gs_unref_variant GVariant *src_csum_v = NULL;
+      gboolean reported;
+
+      diff_tree_get_file (&src, i, &src_csum_v);
+
+      if (diff_names_seek (target.file_names, target.n_files, &pos_files, name))
+        {
+          gs_unref_variant GVariant *target_csum_v = NULL;
+
+          diff_tree_get_file (&target, pos_files, &target_csum_v);
+          reported = diff_csum_equal (src_csum_v, target_csum_v)
+            || diff_report (data, OSTREE_DIFF_MODIFIED, name,
+                            FALSE, src_csum_v, FALSE, target_csum_v, error);
+        }
+      else if (diff_names_seek (target.dir_names, target.n_dirs, &pos_dirs, name))
+        {
+          gs_unref_variant GVariant *target_metadata_csum_v = NULL;
+
+          diff_tree_get_dir (&target, pos_dirs, NULL, &target_metadata_csum_v);
+          reported = diff_report (data, OSTREE_DIFF_MODIFIED, name,
+                                  FALSE, src_csum_v, TRUE, target_metadata_csum_v, error);
+        }
+      else
+        reported = diff_report (data, OSTREE_DIFF_REMOVED, name,
+                                FALSE, src_csum_v, FALSE, NULL, error);
+      if (!reported)
+        goto out;
+    }
+
+  pos_files = pos_dirs = 0;
+  for (i = 0; i < src.n_dirs; i++)
+    {
+      const char *name = src.dir_names[i];
+      gs_unref_variant GVariant *src_contents_csum_v = NULL;
+      gs_unref_variant GVariant *src_metadata_csum_v = NULL;
+
+      diff_tree_get_dir (&src, i, &src_contents_csum_v, &src_metadata_csum_v);
+
+      if (diff_names_seek (target.dir_names, target.n_dirs, &pos_dirs, name))
+        {
+          gs_unref_variant GVariant *target_contents_csum_v = NULL;
+          gs_unref_variant GVariant *target_metadata_csum_v = NULL;
+
+          diff_tree_get_dir (&target, pos_dirs, &target_contents_csum_v, &target_metadata_csum_v);
+
+          if (!diff_csum_equal (src_metadata_csum_v, target_metadata_csum_v)
+              && !diff_report (data, OSTREE_DIFF_MODIFIED, name,
+                               TRUE, src_metadata_csum_v, TRUE, target_metadata_csum_v, error))
+            goto out;
+
+          /* Identical subtrees are skipped without loading them */
+          if (!diff_csum_equal (src_contents_csum_v, target_contents_csum_v))
+            {
+              gsize len = data->path->len;
+              gs_free char *src_child_checksum = ostree_checksum_from_bytes_v (src_contents_csum_v);
+              gs_free char *target_child_checksum = ostree_checksum_from_bytes_v (target_contents_csum_v);
+              gboolean success;
+
+              if (len > 0)
+                g_string_append_c (data->path, '/');
+              g_string_append (data->path, name);
+              success = diff_trees_recurse (data, src_child_checksum, target_child_checksum,
+                                            depth + 1, error);
+              g_string_truncate (data->path, len);
+              if (!success)
+                goto out;
+            }
+        }
+      else if (diff_names_seek (target.file_names, target.n_files, &pos_files, name))
+        {
+          gs_unref_variant GVariant *target_csum_v = NULL;
+
+          diff_tree_get_file (&target, pos_files, &target_csum_v);
+          if (!diff_report (data, OSTREE_DIFF_MODIFIED, name,
+                            TRUE, src_metadata_csum_v, FALSE, target_csum_v, error))
+            goto out;
+        }
+      else
+        {
+          if (!diff_report (data, OSTREE_DIFF_REMOVED, name,
+                            TRUE, src_metadata_csum_v, FALSE, NULL, error))
+            goto out;
+        }
+    }
+
+  /* Entries only in the target */
+  pos_files = pos_dirs = 0;
+  for (i = 0; i < target.n_files; i++)
+    {
+      const char *name = target.file_names[i];
+      gs_unref_variant GVariant *target_csum_v = NULL;
+
+      if (diff_names_seek (src.file_names, src.n_files, &pos_files, name)
+          || diff_names_seek (src.dir_names, src.n_dirs, &pos_dirs, name))
+        continue;
+
+      diff_tree_get_file (&target, i, &target_csum_v);
+      if (!diff_report (data, OSTREE_DIFF_ADDED, name,
+                        FALSE, NULL, FALSE, target_csum_v, error))
+        goto out;
+    }
+
+  pos_files = pos_dirs = 0;
+  for (i = 0; i < target.n_dirs; i++)
+    {
+      const char *name = target.dir_names[i];
+      gsize len = data->path->len;
+      gs_unref_variant GVariant *contents_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+      gs_free char *child_contents_checksum = NULL;
+      gboolean success;
+
+      if (diff_names_seek (src.dir_names, src.n_dirs, &pos_dirs, name)
+          || diff_names_seek (src.file_names, src.n_files, &pos_files, name))
+        continue;
+
+      diff_tree_get_dir (&target, i, &contents_csum_v, &metadata_csum_v);
+      if (!diff_report (data, OSTREE_DIFF_ADDED, name,
+                        FALSE, NULL, TRUE, metadata_csum_v, error))
+        goto out;
+
+      child_contents_checksum = ostree_checksum_from_bytes_v (contents_csum_v);
+      if (len > 0)
+        g_string_append_c (data->path, '/');
+      g_string_append (data->path, name);
+      success = diff_trees_add_recurse (data, child_contents_checksum, depth + 1, error);
+      g_string_truncate (data->path, len);
+      if (!success)
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  diff_tree_clear (&src);
+  diff_tree_clear (&target);
+  return ret;
+}
+
+/**
+ * ostree_diff_trees:
+ * @repo: Repo
+ * @src_contents_checksum: Checksum of the source dirtree
+ * @target_contents_checksum: Checksum of the target dirtree
+ * @func: (scope call): Called for each difference
+ * @user_data: User data for @func
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compute the difference between two trees stored in @repo, such as
+ * the root trees of two commits, calling @func for each difference as
+ * it is found.  Only directories whose contents differ are loaded,
+ * so this costs roughly the size of the difference rather than the
+ * size of the trees.
+ *
+ * A removed directory is reported once; an added directory is
+ * reported along with everything below it, as ostree_diff_dirs()
+ * does.
+ */
+gboolean
+ostree_diff_trees (OstreeRepo          *repo,
+                   const char          *src_contents_checksum,
+                   const char          *target_contents_checksum,
+                   OstreeDiffTreeFunc   func,
+                   gpointer             user_data,
+                   GCancellable        *cancellable,
+                   GError             **error)
+{
+  gboolean ret;
+  OstreeDiffTreesData data = { 0, };
+
+  if (strcmp (src_contents_checksum, target_contents_checksum) == 0)
+    return TRUE;
+
+  data.repo = repo;
+  data.func = func;
+  data.user_data = user_data;
+  data.cancellable = cancellable;
+  data.path = g_string_new ("");
+
+  ret = diff_trees_recurse (&data, src_contents_checksum, target_contents_checksum,
+                            0, error);
+
+  g_string_free (data.path, TRUE);
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  GFile *a;
+  GFile *b;
+  GPtrArray *modified;
+  GPtrArray *removed;
+  GPtrArray *added;
+  GCancellable *cancellable;
+} OstreeDiffDirsData;
+
+/* Build the info for a modified entry from the object the tree diff
+ * found, rather than looking @path up again, which would load every
+ * dirtree above it.
+ */
+static gboolean
+diff_dirs_query_info (OstreeRepo      *repo,
+                      const char      *path,
+                      gboolean         is_dir,
+                      const char      *checksum,
+                      GFileInfo      **out_info,
+                      GCancellable    *cancellable,
+                      GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileInfo *ret_info = NULL;
+  gs_unref_variant GVariant *dirmeta = NULL;
+  gs_free char *name = NULL;
+
+  if (is_dir)
+    {
+      guint32 uid, gid, mode;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                     &dirmeta, error))
+        goto out;
+
+      /* PARSE OSTREE_OBJECT_TYPE_DIR_META */
+      g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, NULL);
+
+      ret_info = g_file_info_new ();
+      g_file_info_set_attribute_uint32 (ret_info, "standard::type", G_FILE_TYPE_DIRECTORY);
+      g_file_info_set_attribute_uint32 (ret_info, "unix::uid", GUINT32_FROM_BE (uid));
+      g_file_info_set_attribute_uint32 (ret_info, "unix::gid", GUINT32_FROM_BE (gid));
+      g_file_info_set_attribute_uint32 (ret_info, "unix::mode", GUINT32_FROM_BE (mode));
+    }
+  else
+    {
+      if (!ostree_repo_load_file (repo, checksum, NULL, &ret_info, NULL,
+                                  cancellable, error))
+        goto out;
+    }
+
+  name = g_path_get_basename (path);
+  g_file_info_set_attribute_byte_string (ret_info, "standard::name", name);
+  g_file_info_set_attribute_string (ret_info, "standard::display-name", name);
+  if (*name == '.')
+    g_file_info_set_is_hidden (ret_info, TRUE);
+
+  ret = TRUE;
+  ot_transfer_out_value(out_info, &ret_info);
+ out:
+  return ret;
+}
+
+static gboolean
+diff_dirs_collect (OstreeDiffChangeType   change,
+                   const char            *path,
+                   gboolean               src_is_dir,
+                   const char            *src_checksum,
+                   gboolean               target_is_dir,
+                   const char            *target_checksum,
+                   gpointer               user_data,
+                   GError               **error)
+{
+  gboolean ret = FALSE;
+  OstreeDiffDirsData *data = user_data;
+  gs_unref_object GFile *child_a = NULL;
+  gs_unref_object GFile *child_b = NULL;
+  gs_unref_object GFileInfo *child_a_info = NULL;
+  gs_unref_object GFileInfo *child_b_info = NULL;
+  gboolean same_type;
+
+  switch (change)
+    {
+    case OSTREE_DIFF_ADDED:
+      g_ptr_array_add (data->added, g_file_resolve_relative_path (data->b, path));
+      break;
+    case OSTREE_DIFF_REMOVED:
+      g_ptr_array_add (data->removed, g_file_resolve_relative_path (data->a, path));
+      break;
+    case OSTREE_DIFF_MODIFIED:
+      child_a = g_file_resolve_relative_path (data->a, path);
+      child_b = g_file_resolve_relative_path (data->b, path);
+
+      if (!diff_dirs_query_info (data->repo, path, src_is_dir, src_checksum,
+                                 &child_a_info, data->cancellable, error))
+        goto out;
+      if (!diff_dirs_query_info (data->repo, path, target_is_dir, target_checksum,
+                                 &child_b_info, data->cancellable, error))
+        goto out;
+
+      /* Like ostree_diff_dirs(), only compare checksums of the same
+       * type; a symlink replacing a regular file has none.
+       */
+      same_type = (g_file_info_get_file_type (child_a_info)
+                   == g_file_info_get_file_type (child_b_info));
+      g_ptr_array_add (data->modified,
+                       diff_item_new (child_a, child_a_info, child_b, child_b_info,
+                                      same_type ? (char*)src_checksum : NULL,
+                                      same_type ? (char*)target_checksum : NULL));
+      break;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 /**
  * ostree_diff_dirs:
  * @a: First directory path
@@ -237,6 +786,22 @@ ostree_diff_dirs (GFile          *a,
           ret = TRUE;
           goto out;
         }
+
+      /* Both trees are in the same repository; diff the dirtrees */
+      if (ostree_repo_file_get_repo (a_repof) == ostree_repo_file_get_repo (b_repof))
+        {
+          OstreeDiffDirsData data = { ostree_repo_file_get_repo (a_repof),
+                                      a, b, modified, removed, added, cancellable };
+
+          if (!ostree_diff_trees (ostree_repo_file_get_repo (a_repof),
+                                  ostree_repo_file_tree_get_contents_checksum (a_repof),
+                                  ostree_repo_file_tree_get_contents_checksum (b_repof),
+                                  diff_dirs_collect, &data, cancellable, error))
+            goto out;
+
+          ret = TRUE;
+          goto out;
+        }
     }
 
   g_clear_object (&child_a_info);
@@ -55,6 +55,52 @@ gboolean ostree_diff_dirs (GFile          *a,
                            GCancellable   *cancellable,
                            GError        **error);
 
+/**
+ * OstreeDiffChangeType:
+ * @OSTREE_DIFF_ADDED: Only in the target tree
+ * @OSTREE_DIFF_REMOVED: Only in the source tree
+ * @OSTREE_DIFF_MODIFIED: Different content or metadata, or a different type
+ */
+typedef enum {
+  OSTREE_DIFF_ADDED,
+  OSTREE_DIFF_REMOVED,
+  OSTREE_DIFF_MODIFIED
+} OstreeDiffChangeType;
+
+/**
+ * OstreeDiffTreeFunc:
+ * @change: Type of change
+ * @path: Path relative to the roots of the trees
+ * @src_is_dir: Whether @path is a directory in the source tree
+ * @src_checksum: (allow-none): Checksum in the source tree, %NULL if added
+ * @target_is_dir: Whether @path is a directory in the target tree
+ * @target_checksum: (allow-none): Checksum in the target tree, %NULL if removed
+ * @user_data: User data
+ * @error: Error
+ *
+ * Called by ostree_diff_trees() for each difference.  The checksum
+ * of a file is that of its content object, and the checksum of a
+ * directory that of its metadata object.
+ *
+ * Returns: %FALSE to stop the diff with @error set
+ */
+typedef gboolean (*OstreeDiffTreeFunc) (OstreeDiffChangeType   change,
+                                        const char            *path,
+                                        gboolean               src_is_dir,
+                                        const char            *src_checksum,
+                                        gboolean               target_is_dir,
+                                        const char            *target_checksum,
+                                        gpointer               user_data,
+                                        GError               **error);
+
+gboolean ostree_diff_trees (OstreeRepo          *repo,
+                            const char          *src_contents_checksum,
+                            const char          *target_contents_checksum,
+                            OstreeDiffTreeFunc   func,
+                            gpointer             user_data,
+                            GCancellable        *cancellable,
+                            GError             **error);
+
 void ostree_diff_print (GFile          *a,
                         GFile          *b,
                         GPtrArray      *modified,
@@ -27,6 +27,24 @@
 #include "otutil.h"
 #include "libgsystem.h"
 
+/* Requests are served from the first non-empty queue, so metadata
+ * objects, which gate the discovery of further objects, go ahead of
+ * content; small content goes ahead of content of unknown size,
+ * which goes ahead of large content.
+ */
+typedef enum {
+  OSTREE_FETCHER_QUEUE_METADATA,
+  OSTREE_FETCHER_QUEUE_SMALL,
+  OSTREE_FETCHER_QUEUE_DEFAULT,
+  OSTREE_FETCHER_QUEUE_LARGE,
+  OSTREE_FETCHER_N_QUEUES
+} OstreeFetcherQueue;
+
+#define OSTREE_FETCHER_SMALL_OBJECT_SIZE (64 * 1024)
+
+/* A cached response: ETag, Last-Modified (either may be empty) and body */
+#define OSTREE_FETCHER_CACHE_FORMAT "(ssay)"
+
 typedef enum {
   OSTREE_FETCHER_STATE_PENDING,
   OSTREE_FETCHER_STATE_DOWNLOADING,
@@ -43,12 +61,32 @@ typedef struct {
   SoupRequest *request;
 
   gboolean is_stream;
+  gboolean is_membuf;
   GInputStream *request_body;
   GFile *out_tmpfile;
   GOutputStream *out_stream;
+  GByteArray *membuf_data;
+  GBytes *membuf;
+  OstreeFetcherQueue queue;
+
+  /* For ostree_fetcher_request_uri_range_to_membuf_async(); a zero
+   * length means the whole file */
+  guint64 range_start;
+  guint64 range_length;
+
+  /* For conditional requests; see ostree_fetcher_request_uri_cached_async() */
+  GFile *cache_file;
+  GBytes *cached_body;
+  char *etag;
+  char *last_modified;
 
   guint64 content_length;
 
+  /* Time between sending the request and getting the response
+   * headers, in microseconds */
+  gint64 send_time;
+  gint64 rtt;
+
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
 } OstreeFetcherPendingURI;
@@ -67,6 +105,13 @@ pending_uri_free (OstreeFetcherPendingURI *pending)
   g_clear_object (&pending->request);
   g_clear_object (&pending->request_body);
   g_clear_object (&pending->out_stream);
+  if (pending->membuf_data)
+    g_byte_array_unref (pending->membuf_data);
+  g_clear_pointer (&pending->membuf, g_bytes_unref);
+  g_clear_object (&pending->cache_file);
+  g_clear_pointer (&pending->cached_body, g_bytes_unref);
+  g_free (pending->etag);
+  g_free (pending->last_modified);
   g_clear_object (&pending->cancellable);
   g_free (pending);
 }
@@ -76,6 +121,7 @@ struct OstreeFetcher
   GObject parent_instance;
 
   GFile *tmpdir;
+  GFile *cache_dir;
 
   SoupSession *session;
   SoupRequester *requester;
@@ -89,8 +135,22 @@ struct OstreeFetcher
 
   /* Queue for libsoup, see bgo#708591 */
   gint outstanding;
-  GQueue pending_queue;
+  GQueue pending_queues[OSTREE_FETCHER_N_QUEUES];
+  gboolean prioritize_small;
+
+  /* The number of outstanding requests is adjusted between
+   * min_outstanding and max_outstanding; see adapt_window().
+   */
+  gint window;
+  gint min_outstanding;
   gint max_outstanding;
+  gint64 min_rtt;
+  gint64 period_start;
+  guint64 period_bytes;
+  guint period_completed;
+  gint64 period_rtt_total;
+  guint period_rtt_count;
+  guint64 prev_throughput;
 };
 
 G_DEFINE_TYPE (OstreeFetcher, ostree_fetcher, G_TYPE_OBJECT)
@@ -99,16 +159,19 @@ static void
 ostree_fetcher_finalize (GObject *object)
 {
   OstreeFetcher *self;
+  guint i;
 
   self = OSTREE_FETCHER (object);
 
   g_clear_object (&self->session);
   g_clear_object (&self->tmpdir);
+  g_clear_object (&self->cache_dir);
 
   g_hash_table_destroy (self->sending_messages);
   g_hash_table_destroy (self->message_to_request);
 
-  g_queue_clear (&self->pending_queue);
+  for (i = 0; i < OSTREE_FETCHER_N_QUEUES; i++)
+    g_queue_clear (&self->pending_queues[i]);
 
   G_OBJECT_CLASS (ostree_fetcher_parent_class)->finalize (object);
 }
@@ -145,8 +208,11 @@ static void
 ostree_fetcher_init (OstreeFetcher *self)
 {
   gint max_conns;
+  guint i;
 
-  g_queue_init (&self->pending_queue);
+  for (i = 0; i < OSTREE_FETCHER_N_QUEUES; i++)
+    g_queue_init (&self->pending_queues[i]);
+  self->prioritize_small = TRUE;
   self->session = soup_session_async_new_with_options (SOUP_SESSION_USER_AGENT, "ostree ",
                                                        SOUP_SESSION_SSL_USE_SYSTEM_CA_FILE, TRUE,
                                                        SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
@@ -154,7 +220,9 @@ ostree_fetcher_init (OstreeFetcher *self)
                                                        NULL);
   self->requester = (SoupRequester *)soup_session_get_feature (self->session, SOUP_TYPE_REQUESTER);
   g_object_get (self->session, "max-conns-per-host", &max_conns, NULL);
-  self->max_outstanding = 3 * max_conns;
+  self->window = 3 * max_conns;
+  self->min_outstanding = max_conns;
+  self->max_outstanding = self->window;
 
   g_signal_connect (self->session, "request-started",
                     G_CALLBACK (on_request_started), self);
@@ -180,18 +248,92 @@ ostree_fetcher_new (GFile                    *tmpdir,
   return self;
 }
 
+/**
+ * ostree_fetcher_set_concurrency:
+ * @self: Fetcher
+ * @min_outstanding: Lower bound on concurrent requests
+ * @max_outstanding: Upper bound on concurrent requests
+ *
+ * The number of concurrent object requests is adjusted automatically
+ * within these bounds; set them equal for a fixed limit.
+ */
+void
+ostree_fetcher_set_concurrency (OstreeFetcher       *self,
+                                guint                min_outstanding,
+                                guint                max_outstanding)
+{
+  gint max_conns;
+
+  g_return_if_fail (min_outstanding > 0);
+  g_return_if_fail (min_outstanding <= max_outstanding);
+
+  self->min_outstanding = min_outstanding;
+  self->max_outstanding = max_outstanding;
+  self->window = CLAMP (self->window, self->min_outstanding, self->max_outstanding);
+
+  /* Keep the same ratio of requests to connections as by default */
+  g_object_get (self->session, "max-conns-per-host", &max_conns, NULL);
+  max_conns = MAX (max_conns, (self->max_outstanding + 2) / 3);
+  g_object_set (self->session,
+                "max-conns-per-host", max_conns,
+                "max-conns", MAX (max_conns, 10),
+                NULL);
+}
+
+/**
+ * ostree_fetcher_set_prioritize_small:
+ * @self: Fetcher
+ * @prioritize_small: Whether to fetch small content first
+ *
+ * If %TRUE (the default), content requests with a small expected size
+ * are sent before ones with an unknown or large size.
+ */
+void
+ostree_fetcher_set_prioritize_small (OstreeFetcher       *self,
+                                     gboolean             prioritize_small)
+{
+  self->prioritize_small = prioritize_small;
+}
+
+/**
+ * ostree_fetcher_set_cache_dir:
+ * @self: Fetcher
+ * @cache_dir: (allow-none): Directory for cached responses
+ *
+ * Responses to ostree_fetcher_request_uri_cached_async() are stored
+ * in @cache_dir, which must exist.  If %NULL (the default), nothing is
+ * cached.
+ */
+void
+ostree_fetcher_set_cache_dir (OstreeFetcher       *self,
+                              GFile               *cache_dir)
+{
+  g_clear_object (&self->cache_dir);
+  if (cache_dir)
+    self->cache_dir = g_object_ref (cache_dir);
+}
+
 static void
 on_request_sent (GObject        *object, GAsyncResult   *result, gpointer        user_data);
 
 static void
 ostree_fetcher_process_pending_queue (OstreeFetcher *self)
 {
+  guint i = 0;
 
-  while (g_queue_peek_head (&self->pending_queue) != NULL &&
-         self->outstanding < self->max_outstanding)
+  while (i < OSTREE_FETCHER_N_QUEUES &&
+         self->outstanding < self->window)
     {
-      OstreeFetcherPendingURI *next = g_queue_pop_head (&self->pending_queue);
+      OstreeFetcherPendingURI *next = g_queue_pop_head (&self->pending_queues[i]);
+
+      if (next == NULL)
+        {
+          i++;
+          continue;
+        }
+
       self->outstanding++;
+      next->send_time = g_get_monotonic_time ();
       soup_request_send_async (next->request, next->cancellable,
                                on_request_sent, next);
     }
@@ -199,15 +341,176 @@ ostree_fetcher_process_pending_queue (OstreeFetcher *self)
 
 static void
 ostree_fetcher_queue_pending_uri (OstreeFetcher *self,
-                                  OstreeFetcherPendingURI *pending)
+                                  OstreeFetcherPendingURI *pending,
+                                  gboolean                 is_meta,
+                                  guint64                  expected_size)
 {
+  OstreeFetcherQueue queue;
+
   g_assert (!pending->is_stream);
 
-  g_queue_push_tail (&self->pending_queue, pending);
+  if (is_meta)
+    queue = OSTREE_FETCHER_QUEUE_METADATA;
+  else if (!self->prioritize_small || expected_size == 0)
+    queue = OSTREE_FETCHER_QUEUE_DEFAULT;
+  else if (expected_size < OSTREE_FETCHER_SMALL_OBJECT_SIZE)
+    queue = OSTREE_FETCHER_QUEUE_SMALL;
+  else
+    queue = OSTREE_FETCHER_QUEUE_LARGE;
+
+  pending->queue = queue;
+  g_queue_push_tail (&self->pending_queues[queue], pending);
+
+  ostree_fetcher_process_pending_queue (self);
+}
+
+/*
+ * Adjust the number of concurrent requests, in the spirit of TCP
+ * Vegas.  Each period lasts until as many requests have completed as
+ * the current window.  If throughput grew compared to the previous
+ * period, there is spare capacity and the window grows.  If it
+ * didn't, and requests are waiting well above the best round trip
+ * time we have seen, they are just queueing somewhere on the way and
+ * the window shrinks.  Otherwise it stays.
+ */
+static void
+adapt_window (OstreeFetcher           *self,
+              OstreeFetcherPendingURI *pending,
+              guint64                  bytes)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 elapsed;
+  guint64 throughput;
+  gint64 avg_rtt;
+  gboolean gaining;
+
+  if (self->period_start == 0)
+    self->period_start = pending->send_time;
+
+  self->period_bytes += bytes;
+  self->period_completed++;
+  if (pending->rtt > 0)
+    {
+      if (self->min_rtt == 0 || pending->rtt < self->min_rtt)
+        self->min_rtt = pending->rtt;
+      self->period_rtt_total += pending->rtt;
+      self->period_rtt_count++;
+    }
+
+  elapsed = now - self->period_start;
+  if (self->period_completed < (guint) self->window || elapsed <= 0)
+    return;
+
+  throughput = self->period_bytes * G_USEC_PER_SEC / elapsed;
+  avg_rtt = self->period_rtt_count > 0 ? self->period_rtt_total / self->period_rtt_count : 0;
+  gaining = throughput > self->prev_throughput + self->prev_throughput / 20;
+
+  if (gaining)
+    self->window += MAX (1, self->window / 4);
+  else if (avg_rtt > 2 * self->min_rtt)
+    self->window -= MAX (1, self->window / 4);
+  self->window = CLAMP (self->window, self->min_outstanding, self->max_outstanding);
+
+  self->prev_throughput = throughput;
+  self->period_start = now;
+  self->period_bytes = 0;
+  self->period_completed = 0;
+  self->period_rtt_total = 0;
+  self->period_rtt_count = 0;
+}
 
+/* Called exactly once for each queued request, when it's done */
+static void
+ostree_fetcher_request_done (OstreeFetcherPendingURI *pending,
+                             guint64                  bytes)
+{
+  OstreeFetcher *self = pending->self;
+
+  if (pending->is_stream)
+    return;
+
+  self->outstanding--;
+  adapt_window (self, pending, bytes);
   ostree_fetcher_process_pending_queue (self);
 }
 
+/* Request the remainder of a partially downloaded in-memory object */
+static void
+ostree_fetcher_resend_membuf (OstreeFetcherPendingURI *pending)
+{
+  OstreeFetcher *self = pending->self;
+
+  g_clear_object (&pending->request_body);
+  g_clear_object (&pending->out_stream);
+  g_clear_object (&pending->request);
+  pending->state = OSTREE_FETCHER_STATE_PENDING;
+  pending->request = soup_requester_request_uri (self->requester, pending->uri, NULL);
+
+  if (SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      SoupMessage *msg;
+
+      msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+      if (pending->cache_file)
+        {
+          /* Cached URIs can change between requests, so only resume
+           * if the server can tell us whether the rest still belongs
+           * to what we have; otherwise start over.
+           */
+          if (pending->etag && !g_str_has_prefix (pending->etag, "W/"))
+            soup_message_headers_replace (msg->request_headers, "If-Range", pending->etag);
+          else if (pending->last_modified)
+            soup_message_headers_replace (msg->request_headers, "If-Range", pending->last_modified);
+          else
+            g_byte_array_set_size (pending->membuf_data, 0);
+        }
+
+      if (pending->range_length > 0)
+        soup_message_headers_set_range (msg->request_headers,
+                                        pending->range_start + pending->membuf_data->len,
+                                        pending->range_start + pending->range_length - 1);
+      else if (pending->membuf_data->len > 0)
+        soup_message_headers_set_range (msg->request_headers, pending->membuf_data->len, -1);
+      /* Transfers the message reference */
+      g_hash_table_insert (self->message_to_request, msg, pending);
+      pending->refcount++;
+    }
+
+  g_queue_push_head (&self->pending_queues[pending->queue], pending);
+  ostree_fetcher_process_pending_queue (self);
+}
+
+/* Store the body of a response along with its validators, so that the
+ * next request for the same URI can be conditional.
+ */
+static void
+save_cached_response (OstreeFetcherPendingURI *pending)
+{
+  gs_unref_variant GVariant *data = NULL;
+
+  if (!pending->etag && !pending->last_modified)
+    {
+      /* Nothing to revalidate with; don't keep a stale copy */
+      (void) g_file_delete (pending->cache_file, NULL, NULL);
+      return;
+    }
+
+  data = g_variant_new ("(ss@ay)",
+                        pending->etag ? pending->etag : "",
+                        pending->last_modified ? pending->last_modified : "",
+                        ot_gvariant_new_ay_bytes (pending->membuf));
+  g_variant_ref_sink (data);
+
+  /* The cache is only an optimization, so failing to write it isn't
+   * an error.
+   */
+  (void) g_file_replace_contents (pending->cache_file,
+                                  g_variant_get_data (data),
+                                  g_variant_get_size (data),
+                                  NULL, FALSE, 0, NULL,
+                                  pending->cancellable, NULL);
+}
+
 static void
 on_splice_complete (GObject        *object,
                     GAsyncResult   *result,
@@ -217,20 +520,63 @@ on_splice_complete (GObject        *object,
   gs_unref_object GFileInfo *file_info = NULL;
   goffset filesize;
   GError *local_error = NULL;
+  gssize bytes_written;
 
   pending->state = OSTREE_FETCHER_STATE_COMPLETE;
+
+  /* Now that we've finished downloading, continue with other queued
+   * requests.
+   */
+  bytes_written = g_output_stream_splice_finish ((GOutputStream*)object, result, NULL);
+  ostree_fetcher_request_done (pending, MAX (bytes_written, 0));
+
+  if (pending->is_membuf)
+    {
+      gsize len = g_memory_output_stream_get_data_size ((GMemoryOutputStream*)pending->out_stream);
+      gboolean incomplete;
+
+      g_byte_array_append (pending->membuf_data,
+                           g_memory_output_stream_get_data ((GMemoryOutputStream*)pending->out_stream),
+                           len);
+      pending->self->total_downloaded += len;
+
+      if (pending->range_length > 0)
+        incomplete = pending->membuf_data->len < pending->range_length;
+      else
+        incomplete = len < pending->content_length;
+
+      if (incomplete)
+        {
+          /* As long as we're making progress, ask for the rest */
+          if (len > 0)
+            {
+              (void) g_input_stream_close (pending->request_body, NULL, NULL);
+              ostree_fetcher_resend_membuf (pending);
+              return;
+            }
+          g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED, "Download incomplete");
+          goto out;
+        }
+      else if (pending->range_length > 0 && pending->membuf_data->len != pending->range_length)
+        {
+          g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Server sent more than the requested range");
+          goto out;
+        }
+
+      pending->membuf = g_byte_array_free_to_bytes (pending->membuf_data);
+      pending->membuf_data = NULL;
+      if (pending->cache_file)
+        save_cached_response (pending);
+      goto out;
+    }
+
   file_info = g_file_query_info (pending->out_tmpfile, OSTREE_GIO_FAST_QUERYINFO,
                                  G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                  pending->cancellable, &local_error);
   if (!file_info)
     goto out;
 
-  /* Now that we've finished downloading, continue with other queued
-   * requests.
-   */
-  pending->self->outstanding--;
-  ostree_fetcher_process_pending_queue (pending->self);
-
   filesize = g_file_info_get_size (file_info);
   if (filesize < pending->content_length)
     {
@@ -250,6 +596,42 @@ on_splice_complete (GObject        *object,
   g_object_unref (pending->result);
 }
 
+/* Read the requested range of a response which isn't HTTP, and so
+ * can't have been asked for just that range.
+ */
+static gboolean
+read_range_sync (OstreeFetcherPendingURI  *pending,
+                 GError                  **error)
+{
+  gsize bytes_read;
+
+  if (!G_IS_SEEKABLE (pending->request_body)
+      || !g_seekable_can_seek ((GSeekable*) pending->request_body))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Range requests are not supported for this URI");
+      return FALSE;
+    }
+
+  if (!g_seekable_seek ((GSeekable*) pending->request_body, pending->range_start,
+                        G_SEEK_SET, pending->cancellable, error))
+    return FALSE;
+
+  g_byte_array_set_size (pending->membuf_data, pending->range_length);
+  if (!g_input_stream_read_all (pending->request_body, pending->membuf_data->data,
+                                pending->range_length, &bytes_read,
+                                pending->cancellable, error))
+    return FALSE;
+  if (bytes_read != pending->range_length)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Requested range extends past end of file");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 on_request_sent (GObject        *object,
                  GAsyncResult   *result,
@@ -263,6 +645,8 @@ on_request_sent (GObject        *object,
   pending->state = OSTREE_FETCHER_STATE_COMPLETE;
   pending->request_body = soup_request_send_finish ((SoupRequest*) object,
                                                    result, &local_error);
+  if (pending->send_time > 0)
+    pending->rtt = g_get_monotonic_time () - pending->send_time;
 
   if (!pending->request_body)
     goto out;
@@ -270,10 +654,26 @@ on_request_sent (GObject        *object,
   if (SOUP_IS_REQUEST_HTTP (object))
     {
       msg = soup_request_http_get_message ((SoupRequestHTTP*) object);
-      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE
+          && pending->range_length == 0)
         {
           // We already have the whole file, so just use it.
           pending->state = OSTREE_FETCHER_STATE_COMPLETE;
+          ostree_fetcher_request_done (pending, 0);
+          if (pending->is_membuf)
+            {
+              pending->membuf = g_byte_array_free_to_bytes (pending->membuf_data);
+              pending->membuf_data = NULL;
+            }
+          (void) g_input_stream_close (pending->request_body, NULL, NULL);
+          g_simple_async_result_complete (pending->result);
+          g_object_unref (pending->result);
+          return;
+        }
+      else if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && pending->cached_body)
+        {
+          ostree_fetcher_request_done (pending, 0);
+          pending->membuf = g_bytes_ref (pending->cached_body);
           (void) g_input_stream_close (pending->request_body, NULL, NULL);
           g_simple_async_result_complete (pending->result);
           g_object_unref (pending->result);
@@ -298,16 +698,57 @@ on_request_sent (GObject        *object,
         }
     }
 
+  if (pending->cache_file && msg)
+    {
+      g_free (pending->etag);
+      pending->etag = g_strdup (soup_message_headers_get_one (msg->response_headers, "ETag"));
+      g_free (pending->last_modified);
+      pending->last_modified = g_strdup (soup_message_headers_get_one (msg->response_headers, "Last-Modified"));
+    }
+
+  if (pending->range_length > 0)
+    {
+      if (!msg)
+        {
+          /* Not HTTP, e.g. a file:// remote; read the range directly */
+          if (!read_range_sync (pending, &local_error))
+            goto out;
+          ostree_fetcher_request_done (pending, pending->range_length);
+          pending->self->total_downloaded += pending->range_length;
+          pending->membuf = g_byte_array_free_to_bytes (pending->membuf_data);
+          pending->membuf_data = NULL;
+          (void) g_input_stream_close (pending->request_body, NULL, NULL);
+          g_simple_async_result_complete (pending->result);
+          g_object_unref (pending->result);
+          return;
+        }
+      else if (msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+        {
+          g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Server does not support range requests");
+          goto out;
+        }
+    }
+
+  /* The server ignored our range request and is sending everything */
+  if (pending->is_membuf && msg && msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+    g_byte_array_set_size (pending->membuf_data, 0);
+
   pending->state = OSTREE_FETCHER_STATE_DOWNLOADING;
   
   pending->content_length = soup_request_get_content_length (pending->request);
 
   if (!pending->is_stream)
     {
-      pending->out_stream = G_OUTPUT_STREAM (g_file_append_to (pending->out_tmpfile, G_FILE_CREATE_NONE,
-                                                               pending->cancellable, &local_error));
-      if (!pending->out_stream)
-        goto out;
+      if (pending->is_membuf)
+        pending->out_stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+      else
+        {
+          pending->out_stream = G_OUTPUT_STREAM (g_file_append_to (pending->out_tmpfile, G_FILE_CREATE_NONE,
+                                                                   pending->cancellable, &local_error));
+          if (!pending->out_stream)
+            goto out;
+        }
       g_output_stream_splice_async (pending->out_stream, pending->request_body, flags, G_PRIORITY_DEFAULT,
                                     pending->cancellable, on_splice_complete, pending);
     }
@@ -319,6 +760,7 @@ on_request_sent (GObject        *object,
  out:
   if (local_error)
     {
+      ostree_fetcher_request_done (pending, 0);
       g_simple_async_result_take_error (pending->result, local_error);
       g_simple_async_result_complete (pending->result);
     }
@@ -328,6 +770,7 @@ static OstreeFetcherPendingURI *
 ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
                                      SoupURI               *uri,
                                      gboolean               is_stream,
+                                     gboolean               is_membuf,
                                      GCancellable          *cancellable,
                                      GAsyncReadyCallback    callback,
                                      gpointer               user_data,
@@ -341,7 +784,10 @@ ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
   pending->self = g_object_ref (self);
   pending->uri = soup_uri_copy (uri);
   pending->is_stream = is_stream;
-  if (!is_stream)
+  pending->is_membuf = is_membuf;
+  if (is_membuf)
+    pending->membuf_data = g_byte_array_new ();
+  if (!is_stream && !is_membuf)
     {
       gs_free char *uristring = soup_uri_to_string (uri, FALSE);
       gs_free char *hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uristring, strlen (uristring));
@@ -364,9 +810,22 @@ ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
   return pending;
 }
 
+/**
+ * ostree_fetcher_request_uri_with_partial_async:
+ * @self: Fetcher
+ * @uri: URI to download
+ * @is_meta: Whether this is a metadata object
+ * @expected_size: Download size if known, or 0
+ *
+ * Download @uri into a temporary file, resuming a previous partial
+ * download if there is one.  @is_meta and @expected_size are used to
+ * prioritize the request.
+ */
 void
 ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
                                                SoupURI               *uri,
+                                               gboolean               is_meta,
+                                               guint64                expected_size,
                                                GCancellable          *cancellable,
                                                GAsyncReadyCallback    callback,
                                                gpointer               user_data)
@@ -377,7 +836,7 @@ ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
 
   self->total_requests++;
 
-  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, cancellable,
+  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, FALSE, cancellable,
                                                  callback, user_data,
                                                  ostree_fetcher_request_uri_with_partial_async);
 
@@ -398,7 +857,7 @@ ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
                            pending);
     }
 
-  ostree_fetcher_queue_pending_uri (self, pending);
+  ostree_fetcher_queue_pending_uri (self, pending, is_meta, expected_size);
 
  out:
   if (local_error != NULL)
@@ -426,6 +885,209 @@ ostree_fetcher_request_uri_with_partial_finish (OstreeFetcher         *self,
   return g_object_ref (pending->out_tmpfile);
 }
 
+/**
+ * ostree_fetcher_request_uri_to_membuf_async:
+ * @self: Fetcher
+ * @uri: URI to download
+ * @is_meta: Whether this is a metadata object
+ * @expected_size: Download size if known, or 0
+ *
+ * Download @uri into memory; this is meant for small objects, which
+ * aren't worth writing to disk just to read them back.  If the
+ * connection closes early, the rest is requested with a range
+ * request, as long as each attempt makes progress.  Unlike
+ * ostree_fetcher_request_uri_with_partial_async(), nothing is kept
+ * on disk, so a download interrupted by the process exiting starts
+ * over.
+ */
+void
+ostree_fetcher_request_uri_to_membuf_async (OstreeFetcher         *self,
+                                            SoupURI               *uri,
+                                            gboolean               is_meta,
+                                            guint64                expected_size,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               user_data)
+{
+  ostree_fetcher_request_uri_range_to_membuf_async (self, uri, 0, 0, is_meta, expected_size,
+                                                    cancellable, callback, user_data);
+}
+
+/**
+ * ostree_fetcher_request_uri_range_to_membuf_async:
+ * @self: Fetcher
+ * @uri: URI to download
+ * @offset: Offset of the first byte to download
+ * @length: Number of bytes to download, or 0 for the whole file
+ * @is_meta: Whether this is a metadata object
+ * @expected_size: Download size if known, or 0
+ *
+ * Like ostree_fetcher_request_uri_to_membuf_async(), but download
+ * only @length bytes of @uri starting at @offset, with a range
+ * request; it fails if the server doesn't support those.  Complete
+ * with ostree_fetcher_request_uri_to_membuf_finish().
+ */
+void
+ostree_fetcher_request_uri_range_to_membuf_async (OstreeFetcher         *self,
+                                                  SoupURI               *uri,
+                                                  guint64                offset,
+                                                  guint64                length,
+                                                  gboolean               is_meta,
+                                                  guint64                expected_size,
+                                                  GCancellable          *cancellable,
+                                                  GAsyncReadyCallback    callback,
+                                                  gpointer               user_data)
+{
+  OstreeFetcherPendingURI *pending;
+
+  g_return_if_fail (length == 0 || offset <= G_MAXUINT64 - length);
+
+  self->total_requests++;
+
+  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, TRUE, cancellable,
+                                                 callback, user_data,
+                                                 ostree_fetcher_request_uri_to_membuf_async);
+  pending->range_start = offset;
+  pending->range_length = length;
+
+  if (SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      SoupMessage *msg;
+
+      msg = soup_request_http_get_message ((SoupRequestHTTP*)pending->request);
+      if (length > 0)
+        soup_message_headers_set_range (msg->request_headers, offset, offset + length - 1);
+      /* Transfers the message reference */
+      g_hash_table_insert (self->message_to_request, msg, pending);
+    }
+
+  ostree_fetcher_queue_pending_uri (self, pending, is_meta, expected_size);
+}
+
+/* Load a response saved by save_cached_response(), and make the
+ * request conditional on it still being current.
+ */
+static void
+load_cached_response (OstreeFetcherPendingURI *pending)
+{
+  const char *etag;
+  const char *last_modified;
+  SoupMessage *msg;
+  gs_free char *contents = NULL;
+  gsize len;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_variant GVariant *data = NULL;
+  gs_unref_variant GVariant *body = NULL;
+
+  if (!SOUP_IS_REQUEST_HTTP (pending->request))
+    return;
+
+  if (!g_file_load_contents (pending->cache_file, pending->cancellable,
+                             &contents, &len, NULL, NULL))
+    return;
+  bytes = g_bytes_new_take (contents, len);
+  contents = NULL;
+
+  data = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_FETCHER_CACHE_FORMAT), bytes, FALSE);
+  g_variant_ref_sink (data);
+  g_variant_get (data, "(&s&s@ay)", &etag, &last_modified, &body);
+
+  if (!*etag && !*last_modified)
+    return;
+
+  msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+  if (*etag)
+    soup_message_headers_replace (msg->request_headers, "If-None-Match", etag);
+  if (*last_modified)
+    soup_message_headers_replace (msg->request_headers, "If-Modified-Since", last_modified);
+  g_object_unref (msg);
+
+  pending->cached_body = g_variant_get_data_as_bytes (body);
+}
+
+/**
+ * ostree_fetcher_request_uri_cached_async:
+ * @self: Fetcher
+ * @uri: URI to download
+ *
+ * Download @uri into memory, like
+ * ostree_fetcher_request_uri_to_membuf_async().  If a cache directory
+ * was set with ostree_fetcher_set_cache_dir(), the response is kept
+ * there along with its ETag and Last-Modified headers, and the next
+ * request for @uri asks the server to send it only if it changed.  If
+ * it didn't, the cached copy is returned.
+ *
+ * This is meant for small, frequently polled files like refs.
+ */
+void
+ostree_fetcher_request_uri_cached_async (OstreeFetcher         *self,
+                                         SoupURI               *uri,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data)
+{
+  OstreeFetcherPendingURI *pending;
+
+  self->total_requests++;
+
+  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, TRUE, cancellable,
+                                                 callback, user_data,
+                                                 ostree_fetcher_request_uri_cached_async);
+
+  if (self->cache_dir)
+    {
+      gs_free char *uristring = soup_uri_to_string (uri, FALSE);
+      gs_free char *hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uristring, strlen (uristring));
+      pending->cache_file = g_file_get_child (self->cache_dir, hash);
+      load_cached_response (pending);
+    }
+
+  if (SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      g_hash_table_insert (self->message_to_request,
+                           soup_request_http_get_message ((SoupRequestHTTP*)pending->request),
+                           pending);
+    }
+
+  ostree_fetcher_queue_pending_uri (self, pending, TRUE, 0);
+}
+
+GBytes *
+ostree_fetcher_request_uri_cached_finish (OstreeFetcher         *self,
+                                          GAsyncResult          *result,
+                                          GError               **error)
+{
+  GSimpleAsyncResult *simple;
+  OstreeFetcherPendingURI *pending;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, (GObject*)self, ostree_fetcher_request_uri_cached_async), FALSE);
+
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+  pending = g_simple_async_result_get_op_res_gpointer (simple);
+
+  return g_bytes_ref (pending->membuf);
+}
+
+GBytes *
+ostree_fetcher_request_uri_to_membuf_finish (OstreeFetcher         *self,
+                                             GAsyncResult          *result,
+                                             GError               **error)
+{
+  GSimpleAsyncResult *simple;
+  OstreeFetcherPendingURI *pending;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, (GObject*)self, ostree_fetcher_request_uri_to_membuf_async), FALSE);
+
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+  pending = g_simple_async_result_get_op_res_gpointer (simple);
+
+  return g_bytes_ref (pending->membuf);
+}
+
 void
 ostree_fetcher_stream_uri_async (OstreeFetcher         *self,
                                  SoupURI               *uri,
@@ -437,7 +1099,7 @@ ostree_fetcher_stream_uri_async (OstreeFetcher         *self,
 
   self->total_requests++;
 
-  pending = ostree_fetcher_request_uri_internal (self, uri, TRUE, cancellable,
+  pending = ostree_fetcher_request_uri_internal (self, uri, TRUE, FALSE, cancellable,
                                                  callback, user_data,
                                                  ostree_fetcher_stream_uri_async);
 
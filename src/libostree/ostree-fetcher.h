@@ -54,6 +54,16 @@ GType   ostree_fetcher_get_type (void) G_GNUC_CONST;
 OstreeFetcher *ostree_fetcher_new (GFile                     *tmpdir,
                                    OstreeFetcherConfigFlags   flags);
 
+void ostree_fetcher_set_concurrency (OstreeFetcher       *self,
+                                     guint                min_outstanding,
+                                     guint                max_outstanding);
+
+void ostree_fetcher_set_prioritize_small (OstreeFetcher       *self,
+                                          gboolean             prioritize_small);
+
+void ostree_fetcher_set_cache_dir (OstreeFetcher       *self,
+                                   GFile               *cache_dir);
+
 char * ostree_fetcher_query_state_text (OstreeFetcher              *self);
 
 guint64 ostree_fetcher_bytes_transferred (OstreeFetcher       *self);
@@ -62,6 +72,8 @@ guint ostree_fetcher_get_n_requests (OstreeFetcher       *self);
 
 void ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
                                                     SoupURI               *uri,
+                                                    gboolean               is_meta,
+                                                    guint64                expected_size,
                                                     GCancellable          *cancellable,
                                                     GAsyncReadyCallback    callback,
                                                     gpointer               user_data);
@@ -70,6 +82,38 @@ GFile *ostree_fetcher_request_uri_with_partial_finish (OstreeFetcher *self,
                                                        GAsyncResult  *result,
                                                        GError       **error);
 
+void ostree_fetcher_request_uri_to_membuf_async (OstreeFetcher         *self,
+                                                 SoupURI               *uri,
+                                                 gboolean               is_meta,
+                                                 guint64                expected_size,
+                                                 GCancellable          *cancellable,
+                                                 GAsyncReadyCallback    callback,
+                                                 gpointer               user_data);
+
+void ostree_fetcher_request_uri_range_to_membuf_async (OstreeFetcher         *self,
+                                                       SoupURI               *uri,
+                                                       guint64                offset,
+                                                       guint64                length,
+                                                       gboolean               is_meta,
+                                                       guint64                expected_size,
+                                                       GCancellable          *cancellable,
+                                                       GAsyncReadyCallback    callback,
+                                                       gpointer               user_data);
+
+GBytes *ostree_fetcher_request_uri_to_membuf_finish (OstreeFetcher *self,
+                                                     GAsyncResult  *result,
+                                                     GError       **error);
+
+void ostree_fetcher_request_uri_cached_async (OstreeFetcher         *self,
+                                              SoupURI               *uri,
+                                              GCancellable          *cancellable,
+                                              GAsyncReadyCallback    callback,
+                                              gpointer               user_data);
+
+GBytes *ostree_fetcher_request_uri_cached_finish (OstreeFetcher *self,
+                                                  GAsyncResult  *result,
+                                                  GError       **error);
+
 void ostree_fetcher_stream_uri_async (OstreeFetcher         *self,
                                        SoupURI               *uri,
                                        GCancellable          *cancellable,
@@ -0,0 +1,301 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-object-set.h"
+
+/*
+ * A set of object names, for traversals over millions of objects.
+ * Where a #GHashTable of serialized object names costs a hex string,
+ * a #GVariant and a hash node per object, this is a single open
+ * addressing table of (binary checksum, type) entries, 33 bytes each.
+ * Checksums are uniformly distributed, so their first bytes make a
+ * good hash, and linear probing keeps lookups within a cache line or
+ * two.  Since object types start at 1, a zero type marks an empty
+ * slot.
+ */
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+} OstreeObjectSetEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeObjectSetEntry) == 33);
+
+#define OSTREE_OBJECT_SET_MIN_SLOTS 256
+
+struct OstreeObjectSet {
+  volatile gint refcount;
+
+  OstreeObjectSetEntry *entries;
+  /* Always zero or a power of two */
+  gsize n_slots;
+  gsize n_entries;
+};
+
+typedef struct {
+  OstreeObjectSet *set;
+  gsize position;
+} RealObjectSetIter;
+
+G_STATIC_ASSERT (sizeof (RealObjectSetIter) <= sizeof (OstreeObjectSetIter));
+
+/**
+ * ostree_object_set_new:
+ *
+ * Returns: (transfer full): A new empty set of object names
+ */
+OstreeObjectSet *
+ostree_object_set_new (void)
+{
+  OstreeObjectSet *set = g_new0 (OstreeObjectSet, 1);
+  set->refcount = 1;
+  return set;
+}
+
+OstreeObjectSet *
+ostree_object_set_ref (OstreeObjectSet *set)
+{
+  g_atomic_int_inc (&set->refcount);
+  return set;
+}
+
+void
+ostree_object_set_unref (OstreeObjectSet *set)
+{
+  if (!g_atomic_int_dec_and_test (&set->refcount))
+    return;
+
+  g_free (set->entries);
+  g_free (set);
+}
+
+G_DEFINE_BOXED_TYPE(OstreeObjectSet, ostree_object_set,
+                    ostree_object_set_ref,
+                    ostree_object_set_unref);
+
+/* Returns the slot holding @csum and @objtype, or the empty slot where
+ * it would go.  There must be at least one empty slot.
+ */
+static OstreeObjectSetEntry *
+object_set_lookup (OstreeObjectSet   *set,
+                   const guchar      *csum,
+                   guint8             objtype)
+{
+  gsize mask = set->n_slots - 1;
+  guint64 hash;
+  gsize i;
+
+  memcpy (&hash, csum, sizeof (hash));
+  i = (gsize) (hash ^ objtype) & mask;
+
+  while (TRUE)
+    {
+      OstreeObjectSetEntry *entry = &set->entries[i];
+
+      if (entry->objtype == 0)
+        return entry;
+      if (entry->objtype == objtype && memcmp (entry->csum, csum, 32) == 0)
+        return entry;
+      i = (i + 1) & mask;
+    }
+}
+
+static void
+object_set_resize (OstreeObjectSet   *set,
+                   gsize              n_slots)
+{
+  OstreeObjectSetEntry *old_entries = set->entries;
+  gsize old_n_slots = set->n_slots;
+  gsize i;
+
+  set->entries = g_new0 (OstreeObjectSetEntry, n_slots);
+  set->n_slots = n_slots;
+
+  for (i = 0; i < old_n_slots; i++)
+    {
+      OstreeObjectSetEntry *entry = &old_entries[i];
+
+      if (entry->objtype != 0)
+        *object_set_lookup (set, entry->csum, entry->objtype) = *entry;
+    }
+
+  g_free (old_entries);
+}
+
+/**
+ * ostree_object_set_size:
+ * @set: Set
+ *
+ * Returns: The number of objects in @set
+ */
+guint
+ostree_object_set_size (OstreeObjectSet *set)
+{
+  return set->n_entries;
+}
+
+/**
+ * ostree_object_set_add_bytes:
+ * @set: Set
+ * @csum: (array fixed-size=32): Binary checksum
+ * @objtype: Object type
+ *
+ * Add the object @csum of type @objtype to @set.
+ *
+ * Returns: %TRUE if the object was not in @set before
+ */
+gboolean
+ostree_object_set_add_bytes (OstreeObjectSet   *set,
+                             const guchar      *csum,
+                             OstreeObjectType   objtype)
+{
+  OstreeObjectSetEntry *entry;
+
+  g_return_val_if_fail (objtype >= OSTREE_OBJECT_TYPE_FILE
+                        && objtype <= OSTREE_OBJECT_TYPE_LAST, FALSE);
+
+  /* Keep the load factor under 3/4 */
+  if ((set->n_entries + 1) * 4 > set->n_slots * 3)
+    object_set_resize (set, MAX (set->n_slots * 2, OSTREE_OBJECT_SET_MIN_SLOTS));
+
+  entry = object_set_lookup (set, csum, objtype);
+  if (entry->objtype != 0)
+    return FALSE;
+
+  memcpy (entry->csum, csum, 32);
+  entry->objtype = objtype;
+  set->n_entries++;
+  return TRUE;
+}
+
+/**
+ * ostree_object_set_add:
+ * @set: Set
+ * @checksum: ASCII SHA256 checksum
+ * @objtype: Object type
+ *
+ * Add the object @checksum of type @objtype to @set.
+ *
+ * Returns: %TRUE if the object was not in @set before
+ */
+gboolean
+ostree_object_set_add (OstreeObjectSet   *set,
+                       const char        *checksum,
+                       OstreeObjectType   objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return ostree_object_set_add_bytes (set, csum, objtype);
+}
+
+/**
+ * ostree_object_set_contains_bytes:
+ * @set: Set
+ * @csum: (array fixed-size=32): Binary checksum
+ * @objtype: Object type
+ *
+ * Returns: %TRUE if the object @csum of type @objtype is in @set
+ */
+gboolean
+ostree_object_set_contains_bytes (OstreeObjectSet   *set,
+                                  const guchar      *csum,
+                                  OstreeObjectType   objtype)
+{
+  if (set->n_entries == 0)
+    return FALSE;
+
+  return object_set_lookup (set, csum, objtype)->objtype != 0;
+}
+
+/**
+ * ostree_object_set_contains:
+ * @set: Set
+ * @checksum: ASCII SHA256 checksum
+ * @objtype: Object type
+ *
+ * Returns: %TRUE if the object @checksum of type @objtype is in @set
+ */
+gboolean
+ostree_object_set_contains (OstreeObjectSet   *set,
+                            const char        *checksum,
+                            OstreeObjectType   objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return ostree_object_set_contains_bytes (set, csum, objtype);
+}
+
+/**
+ * ostree_object_set_iter_init:
+ * @iter: An uninitialized iterator
+ * @set: Set
+ *
+ * Prepare to iterate over @set with ostree_object_set_iter_next().
+ * @set must not be modified while iterating.
+ */
+void
+ostree_object_set_iter_init (OstreeObjectSetIter *iter,
+                             OstreeObjectSet     *set)
+{
+  RealObjectSetIter *ri = (RealObjectSetIter*) iter;
+
+  ri->set = set;
+  ri->position = 0;
+}
+
+/**
+ * ostree_object_set_iter_next:
+ * @iter: Iterator
+ * @out_csum: (out) (transfer none): Binary checksum, valid as long as the set is unmodified
+ * @out_objtype: (out): Object type
+ *
+ * Advance @iter to the next object; objects are returned in no
+ * particular order.
+ *
+ * Returns: %FALSE if there are no more objects
+ */
+gboolean
+ostree_object_set_iter_next (OstreeObjectSetIter   *iter,
+                             const guchar         **out_csum,
+                             OstreeObjectType      *out_objtype)
+{
+  RealObjectSetIter *ri = (RealObjectSetIter*) iter;
+  OstreeObjectSet *set = ri->set;
+
+  while (ri->position < set->n_slots)
+    {
+      OstreeObjectSetEntry *entry = &set->entries[ri->position++];
+
+      if (entry->objtype != 0)
+        {
+          *out_csum = entry->csum;
+          *out_objtype = entry->objtype;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
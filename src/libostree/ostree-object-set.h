@@ -0,0 +1,67 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core.h"
+
+G_BEGIN_DECLS
+
+typedef struct OstreeObjectSet OstreeObjectSet;
+
+typedef struct {
+  /*< private >*/
+  gpointer dummy1;
+  gsize dummy2;
+} OstreeObjectSetIter;
+
+GType ostree_object_set_get_type (void);
+
+OstreeObjectSet *ostree_object_set_new (void);
+
+OstreeObjectSet *ostree_object_set_ref (OstreeObjectSet *set);
+void ostree_object_set_unref (OstreeObjectSet *set);
+
+guint ostree_object_set_size (OstreeObjectSet *set);
+
+gboolean ostree_object_set_add (OstreeObjectSet   *set,
+                                const char        *checksum,
+                                OstreeObjectType   objtype);
+
+gboolean ostree_object_set_add_bytes (OstreeObjectSet   *set,
+                                      const guchar      *csum,
+                                      OstreeObjectType   objtype);
+
+gboolean ostree_object_set_contains (OstreeObjectSet   *set,
+                                     const char        *checksum,
+                                     OstreeObjectType   objtype);
+
+gboolean ostree_object_set_contains_bytes (OstreeObjectSet   *set,
+                                           const guchar      *csum,
+                                           OstreeObjectType   objtype);
+
+void ostree_object_set_iter_init (OstreeObjectSetIter *iter,
+                                  OstreeObjectSet     *set);
+
+gboolean ostree_object_set_iter_next (OstreeObjectSetIter   *iter,
+                                      const guchar         **out_csum,
+                                      OstreeObjectType      *out_objtype);
+
+G_END_DECLS
@@ -109,17 +109,32 @@ write_regular_file_content (OstreeRepoCheckoutMode mode,
                             GError               **error)
 {
   gboolean ret = FALSE;
+  gboolean cloned = FALSE;
   int fd;
   int res;
 
-  if (g_output_stream_splice (output, input, 0,
-                              cancellable, error) < 0)
-    goto out;
+  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
 
-  if (!g_output_stream_flush (output, cancellable, error))
-    goto out;
+  /* When hardlinking isn't possible, e.g. a user mode checkout from
+   * a bare repository owned by root, try a reflink of the object.
+   */
+  if (G_IS_FILE_DESCRIPTOR_BASED (input))
+    {
+      if (!ot_util_clone_file (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input),
+                               fd, g_file_info_get_size (file_info), &cloned,
+                               error))
+        goto out;
+    }
 
-  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
+  if (!cloned)
+    {
+      if (g_output_stream_splice (output, input, 0,
+                                  cancellable, error) < 0)
+        goto out;
+
+      if (!g_output_stream_flush (output, cancellable, error))
+        goto out;
+    }
 
   if (mode != OSTREE_REPO_CHECKOUT_MODE_USER)
     {
@@ -357,10 +372,17 @@ checkout_file_hardlink (OstreeRepo                          *self,
   return ret;
 }
 
+/*
+ * checkout_one_file_at:
+ *
+ * Check out the content object @checksum as @destination_name.  The
+ * file header is only loaded if we can't hardlink the object; bare
+ * repositories store symbolic links as-is, so those can be linked
+ * too.
+ */
 static gboolean
 checkout_one_file_at (OstreeRepo                        *repo,
-                      GFile                             *source,
-                      GFileInfo                         *source_info,
+                      const char                        *checksum,
                       int                                destination_dfd,
                       GFile                             *destination_parent,
                       const char                        *destination_name,
@@ -370,121 +392,120 @@ checkout_one_file_at (OstreeRepo                        *repo,
                       GError                           **error)
 {
   gboolean ret = FALSE;
-  const char *checksum;
-  gboolean is_symlink;
   gboolean did_hardlink = FALSE;
   char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
+  OstreeRepo *current_repo;
   gs_unref_object GInputStream *input = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
   gs_unref_variant GVariant *xattrs = NULL;
 
-  is_symlink = g_file_info_get_file_type (source_info) == G_FILE_TYPE_SYMBOLIC_LINK;
-
-  checksum = ostree_repo_file_get_checksum ((OstreeRepoFile*)source);
-
-  /* Try to do a hardlink first, if it's a regular file.  This also
-   * traverses all parent repos.
+  /* Try to do a hardlink first.  This also traverses all parent
+   * repos.
    */
-  if (!is_symlink)
+  _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
+  for (current_repo = repo; current_repo; current_repo = current_repo->parent_repo)
     {
-      OstreeRepo *current_repo = repo;
-
-      while (current_repo)
+      gboolean is_bare = (current_repo->mode == OSTREE_REPO_MODE_BARE
+                          && mode == OSTREE_REPO_CHECKOUT_MODE_NONE);
+      gboolean is_archive_z2_with_cache = (current_repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+                                           && mode == OSTREE_REPO_CHECKOUT_MODE_USER);
+
+      /* But only under these conditions; for archive-z2 we're looking
+       * in the cache, which is in "bare" form, and only holds regular
+       * files.
+       */
+      if (is_bare || is_archive_z2_with_cache)
         {
-          gboolean is_bare = (current_repo->mode == OSTREE_REPO_MODE_BARE
-                              && mode == OSTREE_REPO_CHECKOUT_MODE_NONE);
-          gboolean is_archive_z2_with_cache = (current_repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
-                                               && mode == OSTREE_REPO_CHECKOUT_MODE_USER);
-
-          /* But only under these conditions */
-          if (is_bare || is_archive_z2_with_cache)
-            {
-              /* Override repo mode; for archive-z2 we're looking in
-                 the cache, which is in "bare" form */
-              _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
-              if (!checkout_file_hardlink (current_repo,
-                                           mode, overwrite_mode, loose_path_buf,
-                                           destination_dfd, destination_name,
-                                           TRUE, &did_hardlink,
-                                           cancellable, error))
-                goto out;
-              if (did_hardlink)
-                break;
-            }
-          current_repo = current_repo->parent_repo;
+          if (!checkout_file_hardlink (current_repo,
+                                       mode, overwrite_mode, loose_path_buf,
+                                       destination_dfd, destination_name,
+                                       TRUE, &did_hardlink,
+                                       cancellable, error))
+            goto out;
+          if (did_hardlink)
+            break;
         }
     }
 
   /* Ok, if we're archive-z2 and we didn't find an object, uncompress
    * it now, stick it in the cache, and then hardlink to that.
    */
-  if (!is_symlink
-      && !did_hardlink
+  if (!did_hardlink
       && repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
       && mode == OSTREE_REPO_CHECKOUT_MODE_USER
       && repo->enable_uncompressed_cache)
     {
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, NULL,
+      if (!ostree_repo_load_file (repo, checksum, &input, &file_info, &xattrs,
                                   cancellable, error))
         goto out;
 
-      /* Overwrite any parent repo from earlier */
-      _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
-
-      if (!checkout_object_for_uncompressed_cache (repo, loose_path_buf,
-                                                   source_info, input,
-                                                   cancellable, error))
+      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
         {
-          g_prefix_error (error, "Unpacking loose object %s: ", checksum);
-          goto out;
-        }
-      
-      g_clear_object (&input);
+          if (!checkout_object_for_uncompressed_cache (repo, loose_path_buf,
+                                                       file_info, input,
+                                                       cancellable, error))
+            {
+              g_prefix_error (error, "Unpacking loose object %s: ", checksum);
+              goto out;
+            }
 
-      /* Store the 2-byte objdir prefix (e.g. e3) in a set.  The basic
-       * idea here is that if we had to unpack an object, it's very
-       * likely we're replacing some other object, so we may need a GC.
-       *
-       * This model ensures that we do work roughly proportional to
-       * the size of the changes.  For example, we don't scan any
-       * directories if we didn't modify anything, meaning you can
-       * checkout the same tree multiple times very quickly.
-       *
-       * This is also scale independent; we don't hardcode e.g. looking
-       * at 1000 objects.
-       *
-       * The downside is that if we're unlucky, we may not free
-       * an object for quite some time.
-       */
-      g_mutex_lock (&repo->cache_lock);
-      {
-        gpointer key = GUINT_TO_POINTER ((g_ascii_xdigit_value (checksum[0]) << 4) + 
-                                         g_ascii_xdigit_value (checksum[1]));
-        if (repo->updated_uncompressed_dirs == NULL)
-          repo->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
-        g_hash_table_insert (repo->updated_uncompressed_dirs, key, key);
-      }
-      g_mutex_unlock (&repo->cache_lock);
-
-      if (!checkout_file_hardlink (repo, mode, overwrite_mode, loose_path_buf,
-                                   destination_dfd, destination_name,
-                                   FALSE, &did_hardlink,
-                                   cancellable, error))
-        {
-          g_prefix_error (error, "Using new cached uncompressed hardlink of %s to %s: ", checksum, destination_name);
-          goto out;
+          g_clear_object (&input);
+
+          _ostree_repo_devino_index_note_added (repo, repo->uncompressed_objects_dir_fd,
+                                                loose_path_buf, checksum);
+
+          /* Store the 2-byte objdir prefix (e.g. e3) in a set.  The basic
+           * idea here is that if we had to unpack an object, it's very
+           * likely we're replacing some other object, so we may need a GC.
+           *
+           * This model ensures that we do work roughly proportional to
+           * the size of the changes.  For example, we don't scan any
+           * directories if we didn't modify anything, meaning you can
+           * checkout the same tree multiple times very quickly.
+           *
+           * This is also scale independent; we don't hardcode e.g. looking
+           * at 1000 objects.
+           *
+           * The downside is that if we're unlucky, we may not free
+           * an object for quite some time.
+           */
+          g_mutex_lock (&repo->cache_lock);
+          {
+            gpointer key = GUINT_TO_POINTER ((g_ascii_xdigit_value (checksum[0]) << 4) + 
+                                             g_ascii_xdigit_value (checksum[1]));
+            if (repo->updated_uncompressed_dirs == NULL)
+              repo->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
+            g_hash_table_insert (repo->updated_uncompressed_dirs, key, key);
+          }
+          g_mutex_unlock (&repo->cache_lock);
+
+          if (!checkout_file_hardlink (repo, mode, overwrite_mode, loose_path_buf,
+                                       destination_dfd, destination_name,
+                                       FALSE, &did_hardlink,
+                                       cancellable, error))
+            {
+              g_prefix_error (error, "Using new cached uncompressed hardlink of %s to %s: ", checksum, destination_name);
+              goto out;
+            }
         }
     }
 
   /* Fall back to copy if we couldn't hardlink */
   if (!did_hardlink)
     {
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, &xattrs,
-                                  cancellable, error))
-        goto out;
+      if (file_info == NULL
+          || (input == NULL && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR))
+        {
+          g_clear_object (&file_info);
+          g_clear_pointer (&xattrs, (GDestroyNotify) g_variant_unref);
+          if (!ostree_repo_load_file (repo, checksum, &input, &file_info, &xattrs,
+                                      cancellable, error))
+            goto out;
+        }
 
       if (overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
         {
-          if (!checkout_file_unioning_from_input_at (mode, source_info, xattrs, input,
+          if (!checkout_file_unioning_from_input_at (mode, file_info, xattrs, input,
                                                      destination_dfd, destination_parent,
                                                      destination_name,
                                                      cancellable, error)) 
@@ -495,7 +516,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
         }
       else
         {
-          if (!checkout_file_from_input_at (mode, source_info, xattrs, input,
+          if (!checkout_file_from_input_at (mode, file_info, xattrs, input,
                                             destination_dfd, destination_parent,
                                             destination_name,
                                             cancellable, error))
@@ -518,42 +539,310 @@ checkout_one_file_at (OstreeRepo                        *repo,
 }
 
 /*
- * checkout_tree_at:
- * @self: Repo
- * @mode: Options controlling all files
- * @overwrite_mode: Whether or not to overwrite files
- * @destination_parent_fd: Place tree here
- * @destination_name: Use this name for tree
- * @source: Source tree
- * @source_info: Source info
- * @cancellable: Cancellable
- * @error: Error
+ * Parallel checkout; see ostree_repo_checkout_tree_parallel().
+ *
+ * The calling thread walks the source tree and creates the directory
+ * skeleton, applying ownership and xattrs as it goes.  Files are then
+ * materialized by a pool of workers.  Each queued file holds a
+ * reference to the fd of its parent directory, and at most
+ * @max_outstanding files are queued at a time, so the number of open
+ * fds stays bounded on very large trees.
  *
- * Like ostree_repo_checkout_tree(), but check out @source into the
- * relative @destination_name, located by @destination_parent_fd.
+ * Directories are created writable by the owner, since their contents
+ * are written afterwards; any other mode is applied once the pool has
+ * drained, deepest directories first.
+ */
+typedef struct {
+  volatile gint refcount;
+  int fd;
+  GFile *path;
+} CheckoutDir;
+
+typedef struct {
+  CheckoutDir *parent;
+  char *name;
+  char checksum[65];
+} CheckoutFileJob;
+
+typedef struct {
+  int fd;
+  guint32 mode;
+} CheckoutDirMode;
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeRepoCheckoutMode mode;
+  OstreeRepoCheckoutOverwriteMode overwrite_mode;
+  GCancellable *cancellable;
+  GThreadPool *threadpool;
+  GPtrArray *dir_modes;
+  mode_t umask;
+
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  guint max_outstanding;
+  GError *error;
+} CheckoutPool;
+
+static CheckoutDir *
+checkout_dir_new (int    fd,
+                  GFile *path)
+{
+  CheckoutDir *dir = g_new0 (CheckoutDir, 1);
+  dir->refcount = 1;
+  dir->fd = fd;
+  dir->path = g_object_ref (path);
+  return dir;
+}
+
+static CheckoutDir *
+checkout_dir_ref (CheckoutDir *dir)
+{
+  g_atomic_int_inc (&dir->refcount);
+  return dir;
+}
+
+static void
+checkout_dir_unref (CheckoutDir *dir)
+{
+  if (!g_atomic_int_dec_and_test (&dir->refcount))
+    return;
+  (void) close (dir->fd);
+  g_object_unref (dir->path);
+  g_free (dir);
+}
+
+static void
+checkout_file_job_free (CheckoutFileJob *job)
+{
+  checkout_dir_unref (job->parent);
+  g_free (job->name);
+  g_free (job);
+}
+
+static void
+checkout_dir_mode_free (gpointer data)
+{
+  CheckoutDirMode *dir_mode = data;
+  (void) close (dir_mode->fd);
+  g_free (dir_mode);
+}
+
+/*
+ * New directories get their dirmeta mode masked by the umask, through
+ * mkdirat().  Where a directory's mode is set explicitly instead, the
+ * same mask must be applied, so the result doesn't depend on how the
+ * directory came to be.  Reading the umask means setting it, so this
+ * must be called before any threads which create files are started.
  */
+static mode_t
+checkout_get_umask (void)
+{
+  mode_t mask = umask (0);
+  (void) umask (mask);
+  return mask;
+}
+
+static void
+checkout_pool_thread (gpointer data,
+                      gpointer user_data)
+{
+  CheckoutFileJob *job = data;
+  CheckoutPool *pool = user_data;
+  GError *local_error = NULL;
+  gboolean skip;
+
+  g_mutex_lock (&pool->lock);
+  skip = pool->error != NULL;
+  g_mutex_unlock (&pool->lock);
+
+  if (!skip)
+    (void) checkout_one_file_at (pool->repo, job->checksum,
+                                 job->parent->fd, job->parent->path, job->name,
+                                 pool->mode, pool->overwrite_mode,
+                                 pool->cancellable, &local_error);
+
+  checkout_file_job_free (job);
+
+  g_mutex_lock (&pool->lock);
+  if (local_error)
+    {
+      if (pool->error == NULL)
+        pool->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  pool->n_outstanding--;
+  g_cond_broadcast (&pool->cond);
+  g_mutex_unlock (&pool->lock);
+}
+
+static CheckoutPool *
+checkout_pool_new (OstreeRepo                       *repo,
+                   OstreeRepoCheckoutMode            mode,
+                   OstreeRepoCheckoutOverwriteMode   overwrite_mode,
+                   guint                             n_jobs,
+                   GCancellable                     *cancellable,
+                   GError                          **error)
+{
+  CheckoutPool *pool = g_new0 (CheckoutPool, 1);
+
+  pool->repo = g_object_ref (repo);
+  pool->mode = mode;
+  pool->overwrite_mode = overwrite_mode;
+  pool->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  pool->dir_modes = g_ptr_array_new_with_free_func (checkout_dir_mode_free);
+  pool->umask = checkout_get_umask ();
+  pool->max_outstanding = n_jobs * 8;
+  g_mutex_init (&pool->lock);
+  g_cond_init (&pool->cond);
+
+  pool->threadpool = g_thread_pool_new (checkout_pool_thread, pool,
+                                        (int)n_jobs, FALSE, error);
+  if (!pool->threadpool)
+    {
+      g_ptr_array_unref (pool->dir_modes);
+      g_clear_object (&pool->cancellable);
+      g_object_unref (pool->repo);
+      g_mutex_clear (&pool->lock);
+      g_cond_clear (&pool->cond);
+      g_free (pool);
+      return NULL;
+    }
+
+  return pool;
+}
+
+static void
+checkout_pool_free (CheckoutPool *pool)
+{
+  /* Waits for any queued jobs; after an error they return immediately */
+  g_thread_pool_free (pool->threadpool, FALSE, TRUE);
+  g_ptr_array_unref (pool->dir_modes);
+  g_clear_object (&pool->cancellable);
+  g_object_unref (pool->repo);
+  g_clear_error (&pool->error);
+  g_mutex_clear (&pool->lock);
+  g_cond_clear (&pool->cond);
+  g_free (pool);
+}
+
 static gboolean
-checkout_tree_at (OstreeRepo                        *self,
-                  OstreeRepoCheckoutMode             mode,
-                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
-                  int                                destination_parent_fd,
-                  const char                        *destination_name,
-                  GFile                             *destination,
-                  OstreeRepoFile                    *source,
-                  GFileInfo                         *source_info,
-                  GCancellable                      *cancellable,
-                  GError                           **error)
+checkout_pool_push (CheckoutPool   *pool,
+                    CheckoutDir    *parent,
+                    const char     *name,
+                    const char     *checksum,
+                    GError        **error)
+{
+  CheckoutFileJob *job;
+
+  g_mutex_lock (&pool->lock);
+  while (pool->n_outstanding >= pool->max_outstanding && pool->error == NULL)
+    g_cond_wait (&pool->cond, &pool->lock);
+  if (pool->error)
+    {
+      g_propagate_error (error, g_error_copy (pool->error));
+      g_mutex_unlock (&pool->lock);
+      return FALSE;
+    }
+  pool->n_outstanding++;
+  g_mutex_unlock (&pool->lock);
+
+  job = g_new0 (CheckoutFileJob, 1);
+  job->parent = checkout_dir_ref (parent);
+  job->name = g_strdup (name);
+  memcpy (job->checksum, checksum, sizeof (job->checksum));
+
+  g_thread_pool_push (pool->threadpool, job, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+checkout_pool_finish (CheckoutPool   *pool,
+                      GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  g_mutex_lock (&pool->lock);
+  while (pool->n_outstanding > 0)
+    g_cond_wait (&pool->cond, &pool->lock);
+  g_mutex_unlock (&pool->lock);
+
+  if (pool->error)
+    {
+      g_propagate_error (error, g_error_copy (pool->error));
+      goto out;
+    }
+
+  /* Directories were recorded parents first */
+  for (i = pool->dir_modes->len; i > 0; i--)
+    {
+      CheckoutDirMode *dir_mode = pool->dir_modes->pdata[i-1];
+      int res;
+
+      do
+        res = fchmod (dir_mode->fd, dir_mode->mode);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * checkout_dir_create_at:
+ *
+ * Create the directory @destination_name relative to
+ * @destination_parent_fd, with the ownership and xattrs of
+ * @dirmeta_checksum, and return an fd for it in @out_dfd.
+ */
+static gboolean
+checkout_dir_create_at (OstreeRepo                        *self,
+                        OstreeRepoCheckoutMode             mode,
+                        OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                        CheckoutPool                      *pool,
+                        int                                destination_parent_fd,
+                        const char                        *destination_name,
+                        GFile                             *destination,
+                        const char                        *dirmeta_checksum,
+                        int                               *out_dfd,
+                        GCancellable                      *cancellable,
+                        GError                           **error)
 {
   gboolean ret = FALSE;
   gboolean did_exist = FALSE;
-  int destination_dfd = -1;
+  int dfd = -1;
   int res;
+  guint32 uid, gid, meta_mode, dir_mode;
+  gs_unref_variant GVariant *dirmeta = NULL;
   gs_unref_variant GVariant *xattrs = NULL;
-  gs_unref_object GFileEnumerator *dir_enum = NULL;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_META, dirmeta_checksum,
+                                 &dirmeta, error))
+    goto out;
+
+  /* PARSE OSTREE_OBJECT_TYPE_DIR_META */
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &meta_mode, &xattrs);
+  uid = GUINT32_FROM_BE (uid);
+  gid = GUINT32_FROM_BE (gid);
+  meta_mode = GUINT32_FROM_BE (meta_mode);
+
+  dir_mode = meta_mode;
+  /* In parallel mode, the final mode is applied after the contents */
+  if (pool)
+    dir_mode |= S_IRWXU;
 
   do
-    res = mkdirat (destination_parent_fd, destination_name,
-                   g_file_info_get_attribute_uint32 (source_info, "unix::mode"));
+    res = mkdirat (destination_parent_fd, destination_name, dir_mode);
   while (G_UNLIKELY (res == -1 && errno == EINTR));
   if (res == -1)
     {
@@ -566,16 +855,20 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
-  if (!gs_file_open_dir_fd (destination, &destination_dfd,
-                            cancellable, error))
-    goto out;
+  do
+    dfd = openat (destination_parent_fd, destination_name,
+                  O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  while (G_UNLIKELY (dfd == -1 && errno == EINTR));
+  if (dfd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
 
   if (!did_exist && mode != OSTREE_REPO_CHECKOUT_MODE_USER)
     {
       do
-        res = fchown (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::uid"),
-                      g_file_info_get_attribute_uint32 (source_info, "unix::gid"));
+        res = fchown (dfd, uid, gid);
       while (G_UNLIKELY (res == -1 && errno == EINTR));
       if (G_UNLIKELY (res == -1))
         {
@@ -583,59 +876,181 @@ checkout_tree_at (OstreeRepo                        *self,
           goto out;
         }
 
-      if (!ostree_repo_file_get_xattrs (source, &xattrs, NULL, error))
-        goto out;
-
-      if (xattrs)
+      if (g_variant_n_children (xattrs) > 0)
         {
-          if (!_ostree_set_xattrs_fd (destination_dfd, xattrs, cancellable, error))
+          if (!_ostree_set_xattrs_fd (dfd, xattrs, cancellable, error))
             goto out;
         }
     }
 
-  dir_enum = g_file_enumerate_children ((GFile*)source,
-                                        OSTREE_GIO_FAST_QUERYINFO, 
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable, 
-                                        error);
-  if (!dir_enum)
+  /* Keep the directory open rather than going back by path, which
+   * could follow symlinks created in the meantime.
+   */
+  if (!did_exist && pool && dir_mode != meta_mode)
+    {
+      CheckoutDirMode *pending;
+      int pending_fd;
+
+      do
+        pending_fd = fcntl (dfd, F_DUPFD_CLOEXEC, 0);
+      while (G_UNLIKELY (pending_fd == -1 && errno == EINTR));
+      if (pending_fd == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      pending = g_new0 (CheckoutDirMode, 1);
+      pending->fd = pending_fd;
+      pending->mode = meta_mode & ~pool->umask;
+      g_ptr_array_add (pool->dir_modes, pending);
+    }
+
+  ret = TRUE;
+  *out_dfd = dfd;
+  dfd = -1;
+ out:
+  if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+/*
+ * checkout_tree_at:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @pool: (allow-none): If set, hand files to this pool
+ * @destination_parent_fd: Place tree here
+ * @destination_name: Use this name for tree
+ * @destination: Path of the tree
+ * @dirtree_checksum: Contents of the tree
+ * @dirmeta_checksum: Metadata of the tree
+ * @recursion_depth: Depth of @destination below the checkout root
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Check out the tree described by @dirtree_checksum and
+ * @dirmeta_checksum into the relative @destination_name, located by
+ * @destination_parent_fd.  This walks the dirtree variants directly,
+ * and for files uses only their name and checksum.
+ */
+static gboolean
+checkout_tree_at (OstreeRepo                        *self,
+                  OstreeRepoCheckoutMode             mode,
+                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                  CheckoutPool                      *pool,
+                  int                                destination_parent_fd,
+                  const char                        *destination_name,
+                  GFile                             *destination,
+                  const char                        *dirtree_checksum,
+                  const char                        *dirmeta_checksum,
+                  guint                              recursion_depth,
+                  GCancellable                      *cancellable,
+                  GError                           **error)
+{
+  gboolean ret = FALSE;
+  int destination_dfd = -1;
+  int dfd;
+  CheckoutDir *destination_dir = NULL;
+  gs_unref_variant GVariant *dirtree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+  int i, n;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Exceeded maximum recursion");
+      goto out;
+    }
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    goto out;
+
+  if (!checkout_dir_create_at (self, mode, overwrite_mode, pool,
+                               destination_parent_fd, destination_name, destination,
+                               dirmeta_checksum, &destination_dfd,
+                               cancellable, error))
     goto out;
+  dfd = destination_dfd;
 
-  while (TRUE)
+  if (pool)
+    {
+      destination_dir = checkout_dir_new (destination_dfd, destination);
+      destination_dfd = -1; /* Transfer ownership */
+    }
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
     {
-      GFileInfo *file_info;
-      GFile *src_child;
       const char *name;
+      gs_unref_variant GVariant *csum_v = NULL;
+      char checksum[65];
 
-      if (!gs_file_enumerator_iterate (dir_enum, &file_info, &src_child,
-                                       cancellable, error))
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
         goto out;
-      if (file_info == NULL)
-        break;
 
-      name = g_file_info_get_name (file_info);
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &csum_v);
+      if (!ot_util_filename_validate (name, error))
+        goto out;
+      if (!ostree_validate_structureof_csum_v (csum_v, error))
+        goto out;
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), checksum);
 
-      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
+      if (pool)
         {
-          gs_unref_object GFile *child_destination = g_file_get_child (destination, name);
-          if (!checkout_tree_at (self, mode, overwrite_mode,
-                                 destination_dfd, name, child_destination,
-                                 (OstreeRepoFile*)src_child, file_info,
-                                 cancellable, error))
+          if (!checkout_pool_push (pool, destination_dir, name, checksum, error))
             goto out;
         }
       else
         {
-          if (!checkout_one_file_at (self, src_child, file_info,
-                                     destination_dfd, destination, name,
+          if (!checkout_one_file_at (self, checksum,
+                                     dfd, destination, name,
                                      mode, overwrite_mode,
                                      cancellable, error))
             goto out;
         }
     }
 
+  dirs_variant = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      gs_unref_variant GVariant *tree_csum_v = NULL;
+      gs_unref_variant GVariant *meta_csum_v = NULL;
+      gs_unref_object GFile *child_destination = NULL;
+      char tree_checksum[65];
+      char meta_checksum[65];
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &tree_csum_v, &meta_csum_v);
+      if (!ot_util_filename_validate (name, error))
+        goto out;
+      if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+        goto out;
+      if (!ostree_validate_structureof_csum_v (meta_csum_v, error))
+        goto out;
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (tree_csum_v), tree_checksum);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (meta_csum_v), meta_checksum);
+
+      child_destination = g_file_get_child (destination, name);
+      if (!checkout_tree_at (self, mode, overwrite_mode, pool,
+                             dfd, name, child_destination,
+                             tree_checksum, meta_checksum,
+                             recursion_depth + 1,
+                             cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
  out:
+  if (destination_dir)
+    checkout_dir_unref (destination_dir);
   if (destination_dfd != -1)
     (void) close (destination_dfd);
   return ret;
@@ -656,6 +1071,9 @@ checkout_tree_at (OstreeRepo                        *self,
  * physical filesystem.  @source may be any subdirectory of a given
  * commit.  The @mode and @overwrite_mode allow control over how the
  * files are checked out.
+ *
+ * This is equivalent to ostree_repo_checkout_tree_parallel() with
+ * one job.
  */
 gboolean
 ostree_repo_checkout_tree (OstreeRepo               *self,
@@ -667,49 +1085,767 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            GCancellable             *cancellable,
                            GError                  **error)
 {
-  return checkout_tree_at (self, mode, overwrite_mode,
-                           AT_FDCWD,
-                           gs_file_get_path_cached (destination),
-                           destination,
-                           source, source_info,
-                           cancellable, error);
+  return ostree_repo_checkout_tree_parallel (self, mode, overwrite_mode,
+                                             destination, source, source_info,
+                                             1, cancellable, error);
 }
 
 /**
- * ostree_repo_checkout_gc:
+ * ostree_repo_checkout_tree_parallel:
  * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @destination: Place tree here
+ * @source: Source tree
+ * @source_info: Source info
+ * @n_jobs: Number of threads writing files, or 0 for one per CPU
  * @cancellable: Cancellable
  * @error: Error
  *
- * Call this after finishing a succession of checkout operations; it
- * will delete any currently-unused uncompressed objects from the
- * cache.
+ * Like ostree_repo_checkout_tree(), but if @n_jobs is not 1, first
+ * create the directories of @source on the calling thread, and
+ * write the files using up to @n_jobs threads.  Directories whose
+ * mode is not writable by their owner are given their final mode
+ * after all their contents have been written.
  */
 gboolean
-ostree_repo_checkout_gc (OstreeRepo        *self,
-                         GCancellable      *cancellable,
-                         GError           **error)
+ostree_repo_checkout_tree_parallel (OstreeRepo               *self,
+                                    OstreeRepoCheckoutMode    mode,
+                                    OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                                    GFile                    *destination,
+                                    OstreeRepoFile           *source,
+                                    GFileInfo                *source_info,
+                                    guint                     n_jobs,
+                                    GCancellable             *cancellable,
+                                    GError                  **error)
 {
   gboolean ret = FALSE;
-  gs_unref_hashtable GHashTable *to_clean_dirs = NULL;
-  GHashTableIter iter;
-  gpointer key, value;
-
-  g_mutex_lock (&self->cache_lock);
-  to_clean_dirs = self->updated_uncompressed_dirs;
-  self->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
-  g_mutex_unlock (&self->cache_lock);
+  CheckoutPool *pool = NULL;
 
-  if (to_clean_dirs)
-    g_hash_table_iter_init (&iter, to_clean_dirs);
-  while (to_clean_dirs && g_hash_table_iter_next (&iter, &key, &value))
+  if (g_file_info_get_file_type (source_info) != G_FILE_TYPE_DIRECTORY)
     {
-      gs_unref_object GFile *objdir = NULL;
-      gs_unref_object GFileEnumerator *enumerator = NULL;
-      gs_free char *objdir_name = NULL;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                   "Checkout source %s is not a directory",
+                   gs_file_get_path_cached ((GFile*)source));
+      goto out;
+    }
 
-      objdir_name = g_strdup_printf ("%02x", GPOINTER_TO_UINT (key));
-      objdir = g_file_get_child (self->uncompressed_objects_dir, objdir_name);
+  if (n_jobs == 0)
+    {
+      long nproc_onln = sysconf (_SC_NPROCESSORS_ONLN);
+      n_jobs = nproc_onln > 0 ? (guint) nproc_onln : 2;
+    }
+
+  if (n_jobs > 1)
+    {
+      pool = checkout_pool_new (self, mode, overwrite_mode, n_jobs,
+                                cancellable, error);
+      if (!pool)
+        goto out;
+    }
+
+  if (!ostree_repo_file_ensure_resolved (source, error))
+    goto out;
+
+  if (!checkout_tree_at (self, mode, overwrite_mode, pool,
+                         AT_FDCWD,
+                         gs_file_get_path_cached (destination),
+                         destination,
+                         ostree_repo_file_tree_get_contents_checksum (source),
+                         ostree_repo_file_tree_get_metadata_checksum (source),
+                         0, cancellable, error))
+    goto out;
+
+  if (pool)
+    {
+      if (!checkout_pool_finish (pool, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (pool)
+    checkout_pool_free (pool);
+  return ret;
+}
+
+/*
+ * Incremental checkout; see ostree_repo_checkout_tree_update() and
+ * ostree_repo_checkout_tree_from_reference().  Both walk the old and
+ * new dirtrees side by side, and never descend into a directory whose
+ * contents and metadata checksums are unchanged.
+ */
+
+/* Map the names of @entries, the file or directory array of a dirtree,
+ * to their index plus one.  Names point into @entries.
+ */
+static GHashTable *
+index_dirtree_entries (GVariant      *entries,
+                       GError       **error)
+{
+  GHashTable *ret = g_hash_table_new (g_str_hash, g_str_equal);
+  int i, n;
+
+  n = g_variant_n_children (entries);
+  for (i = 0; i < n; i++)
+    {
+      gs_unref_variant GVariant *entry = g_variant_get_child_value (entries, i);
+      const char *name;
+
+      g_variant_get_child (entry, 0, "&s", &name);
+      if (!ot_util_filename_validate (name, error))
+        {
+          g_hash_table_unref (ret);
+          return NULL;
+        }
+      g_hash_table_insert (ret, (char*)name, GINT_TO_POINTER (i + 1));
+    }
+
+  return ret;
+}
+
+static gboolean
+get_dirtree_entry (GVariant      *entries,
+                   int            i,
+                   const char   **out_name,
+                   char          *out_checksum,
+                   char          *out_meta_checksum,
+                   GError       **error)
+{
+  gs_unref_variant GVariant *entry = g_variant_get_child_value (entries, i);
+  gs_unref_variant GVariant *csum_v = NULL;
+
+  g_variant_get_child (entry, 0, "&s", out_name);
+  if (!ot_util_filename_validate (*out_name, error))
+    return FALSE;
+
+  csum_v = g_variant_get_child_value (entry, 1);
+  if (!ostree_validate_structureof_csum_v (csum_v, error))
+    return FALSE;
+  ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), out_checksum);
+
+  if (out_meta_checksum)
+    {
+      gs_unref_variant GVariant *meta_csum_v = g_variant_get_child_value (entry, 2);
+      if (!ostree_validate_structureof_csum_v (meta_csum_v, error))
+        return FALSE;
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (meta_csum_v), out_meta_checksum);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+lookup_dirtree_entry (GVariant      *entries,
+                      GHashTable    *index,
+                      const char    *name,
+                      char          *out_checksum,
+                      char          *out_meta_checksum,
+                      gboolean      *out_found,
+                      GError       **error)
+{
+  int i = GPOINTER_TO_INT (g_hash_table_lookup (index, name));
+  const char *found_name;
+
+  *out_found = i > 0;
+  if (i == 0)
+    return TRUE;
+
+  return get_dirtree_entry (entries, i - 1, &found_name,
+                            out_checksum, out_meta_checksum, error);
+}
+
+static gboolean
+update_dir_metadata (OstreeRepo              *self,
+                     OstreeRepoCheckoutMode   mode,
+                     int                      dfd,
+                     const char              *dirmeta_checksum,
+                     GCancellable            *cancellable,
+                     GError                 **error)
+{
+  gboolean ret = FALSE;
+  guint32 uid, gid, meta_mode;
+  int res;
+  gs_unref_variant GVariant *dirmeta = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_META, dirmeta_checksum,
+                                 &dirmeta, error))
+    goto out;
+
+  /* PARSE OSTREE_OBJECT_TYPE_DIR_META */
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &meta_mode, &xattrs);
+
+  if (mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      do
+        res = fchown (dfd, GUINT32_FROM_BE (uid), GUINT32_FROM_BE (gid));
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (g_variant_n_children (xattrs) > 0)
+        {
+          if (!_ostree_set_xattrs_fd (dfd, xattrs, cancellable, error))
+            goto out;
+        }
+    }
+
+  do
+    res = fchmod (dfd, GUINT32_FROM_BE (meta_mode) & ~checkout_get_umask ());
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (G_UNLIKELY (res == -1))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+open_subdir_at (int            dfd,
+                const char    *name,
+                gboolean       allow_noent,
+                int           *out_dfd,
+                GError       **error)
+{
+  int fd;
+
+  do
+    fd = openat (dfd, name, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      if (allow_noent && (errno == ENOENT || errno == ENOTDIR || errno == ELOOP))
+        {
+          *out_dfd = -1;
+          return TRUE;
+        }
+      ot_util_set_error_from_errno (error, errno);
+      g_prefix_error (error, "Opening directory %s: ", name);
+      return FALSE;
+    }
+
+  *out_dfd = fd;
+  return TRUE;
+}
+
+/*
+ * checkout_tree_update_at:
+ *
+ * Transform @destination, located by @dfd and currently a checkout of
+ * the tree @from_tree/@from_meta, into a checkout of
+ * @to_tree/@to_meta.  Entries which went away or changed are removed
+ * first, then new and changed ones are checked out.
+ */
+static gboolean
+checkout_tree_update_at (OstreeRepo                *self,
+                         OstreeRepoCheckoutMode     mode,
+                         int                        dfd,
+                         GFile                     *destination,
+                         const char                *from_tree,
+                         const char                *from_meta,
+                         const char                *to_tree,
+                         const char                *to_meta,
+                         guint                      recursion_depth,
+                         GCancellable              *cancellable,
+                         GError                   **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *from_dirtree = NULL;
+  gs_unref_variant GVariant *to_dirtree = NULL;
+  gs_unref_variant GVariant *from_files = NULL;
+  gs_unref_variant GVariant *from_dirs = NULL;
+  gs_unref_variant GVariant *to_files = NULL;
+  gs_unref_variant GVariant *to_dirs = NULL;
+  gs_unref_hashtable GHashTable *from_files_index = NULL;
+  gs_unref_hashtable GHashTable *from_dirs_index = NULL;
+  gs_unref_hashtable GHashTable *to_files_index = NULL;
+  gs_unref_hashtable GHashTable *to_dirs_index = NULL;
+  int i, n;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Exceeded maximum recursion");
+      goto out;
+    }
+
+  if (strcmp (from_tree, to_tree) != 0)
+    {
+      if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE, from_tree,
+                                     &from_dirtree, error))
+        goto out;
+      if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE, to_tree,
+                                     &to_dirtree, error))
+        goto out;
+
+      /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+      from_files = g_variant_get_child_value (from_dirtree, 0);
+      from_dirs = g_variant_get_child_value (from_dirtree, 1);
+      to_files = g_variant_get_child_value (to_dirtree, 0);
+      to_dirs = g_variant_get_child_value (to_dirtree, 1);
+
+      if (!(from_files_index = index_dirtree_entries (from_files, error)))
+        goto out;
+      if (!(from_dirs_index = index_dirtree_entries (from_dirs, error)))
+        goto out;
+      if (!(to_files_index = index_dirtree_entries (to_files, error)))
+        goto out;
+      if (!(to_dirs_index = index_dirtree_entries (to_dirs, error)))
+        goto out;
+
+      /* Remove files which changed or went away */
+      n = g_variant_n_children (from_files);
+      for (i = 0; i < n; i++)
+        {
+          const char *name;
+          char checksum[65];
+          char to_checksum[65];
+          gboolean found;
+
+          if (!get_dirtree_entry (from_files, i, &name, checksum, NULL, error))
+            goto out;
+          if (!lookup_dirtree_entry (to_files, to_files_index, name,
+                                     to_checksum, NULL, &found, error))
+            goto out;
+          if (found && strcmp (checksum, to_checksum) == 0)
+            continue;
+
+          if (unlinkat (dfd, name, 0) == -1 && errno != ENOENT)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              g_prefix_error (error, "Removing %s: ", name);
+              goto out;
+            }
+        }
+
+      /* Remove directories which went away */
+      n = g_variant_n_children (from_dirs);
+      for (i = 0; i < n; i++)
+        {
+          const char *name;
+          char tree_checksum[65];
+          char meta_checksum[65];
+          gs_unref_object GFile *child = NULL;
+
+          if (!get_dirtree_entry (from_dirs, i, &name, tree_checksum, meta_checksum, error))
+            goto out;
+          if (g_hash_table_contains (to_dirs_index, name))
+            continue;
+
+          child = g_file_get_child (destination, name);
+          if (!gs_shutil_rm_rf (child, cancellable, error))
+            goto out;
+        }
+
+      /* Check out new and changed files */
+      n = g_variant_n_children (to_files);
+      for (i = 0; i < n; i++)
+        {
+          const char *name;
+          char checksum[65];
+          char from_checksum[65];
+          gboolean found;
+
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            goto out;
+
+          if (!get_dirtree_entry (to_files, i, &name, checksum, NULL, error))
+            goto out;
+          if (!lookup_dirtree_entry (from_files, from_files_index, name,
+                                     from_checksum, NULL, &found, error))
+            goto out;
+          if (found && strcmp (checksum, from_checksum) == 0)
+            continue;
+
+          if (!checkout_one_file_at (self, checksum, dfd, destination, name,
+                                     mode, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
+                                     cancellable, error))
+            goto out;
+        }
+
+      /* Recurse into changed directories, check out new ones */
+      n = g_variant_n_children (to_dirs);
+      for (i = 0; i < n; i++)
+        {
+          const char *name;
+          char tree_checksum[65];
+          char meta_checksum[65];
+          char from_tree_checksum[65];
+          char from_meta_checksum[65];
+          gboolean found;
+          gs_unref_object GFile *child = NULL;
+
+          if (!get_dirtree_entry (to_dirs, i, &name, tree_checksum, meta_checksum, error))
+            goto out;
+          if (!lookup_dirtree_entry (from_dirs, from_dirs_index, name,
+                                     from_tree_checksum, from_meta_checksum, &found, error))
+            goto out;
+
+          if (found
+              && strcmp (tree_checksum, from_tree_checksum) == 0
+              && strcmp (meta_checksum, from_meta_checksum) == 0)
+            continue;
+
+          child = g_file_get_child (destination, name);
+          if (found)
+            {
+              int child_dfd;
+              gboolean updated;
+
+              if (!open_subdir_at (dfd, name, FALSE, &child_dfd, error))
+                goto out;
+              updated = checkout_tree_update_at (self, mode, child_dfd, child,
+                                                 from_tree_checksum, from_meta_checksum,
+                                                 tree_checksum, meta_checksum,
+                                                 recursion_depth + 1,
+                                                 cancellable, error);
+              (void) close (child_dfd);
+              if (!updated)
+                goto out;
+            }
+          else
+            {
+              if (!checkout_tree_at (self, mode, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, NULL,
+                                     dfd, name, child, tree_checksum, meta_checksum,
+                                     recursion_depth + 1, cancellable, error))
+                goto out;
+            }
+        }
+    }
+
+  if (strcmp (from_meta, to_meta) != 0)
+    {
+      if (!update_dir_metadata (self, mode, dfd, to_meta, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * checkout_tree_from_reference_at:
+ *
+ * Like checkout_tree_at(), but where a file is unchanged from
+ * @reference_tree, hardlink it from the directory @reference_dfd
+ * instead of the repository.
+ */
+static gboolean
+checkout_tree_from_reference_at (OstreeRepo                *self,
+                                 OstreeRepoCheckoutMode     mode,
+                                 int                        reference_dfd,
+                                 const char                *reference_tree,
+                                 int                        destination_parent_fd,
+                                 const char                *destination_name,
+                                 GFile                     *destination,
+                                 const char                *dirtree_checksum,
+                                 const char                *dirmeta_checksum,
+                                 guint                      recursion_depth,
+                                 GCancellable              *cancellable,
+                                 GError                   **error)
+{
+  gboolean ret = FALSE;
+  int dfd = -1;
+  gs_unref_variant GVariant *reference_dirtree = NULL;
+  gs_unref_variant GVariant *dirtree = NULL;
+  gs_unref_variant GVariant *reference_files = NULL;
+  gs_unref_variant GVariant *reference_dirs = NULL;
+  gs_unref_variant GVariant *files = NULL;
+  gs_unref_variant GVariant *dirs = NULL;
+  gs_unref_hashtable GHashTable *reference_files_index = NULL;
+  gs_unref_hashtable GHashTable *reference_dirs_index = NULL;
+  int i, n;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Exceeded maximum recursion");
+      goto out;
+    }
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE, reference_tree,
+                                 &reference_dirtree, error))
+    goto out;
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    goto out;
+
+  if (!checkout_dir_create_at (self, mode, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, NULL,
+                               destination_parent_fd, destination_name, destination,
+                               dirmeta_checksum, &dfd, cancellable, error))
+    goto out;
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  reference_files = g_variant_get_child_value (reference_dirtree, 0);
+  reference_dirs = g_variant_get_child_value (reference_dirtree, 1);
+  files = g_variant_get_child_value (dirtree, 0);
+  dirs = g_variant_get_child_value (dirtree, 1);
+
+  if (!(reference_files_index = index_dirtree_entries (reference_files, error)))
+    goto out;
+  if (!(reference_dirs_index = index_dirtree_entries (reference_dirs, error)))
+    goto out;
+
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      char checksum[65];
+      char reference_checksum[65];
+      gboolean found;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (!get_dirtree_entry (files, i, &name, checksum, NULL, error))
+        goto out;
+      if (!lookup_dirtree_entry (reference_files, reference_files_index, name,
+                                 reference_checksum, NULL, &found, error))
+        goto out;
+
+      if (found && strcmp (checksum, reference_checksum) == 0)
+        {
+          if (linkat (reference_dfd, name, dfd, name, 0) == 0)
+            continue;
+          else if (!(errno == ENOENT || errno == EMLINK || errno == EXDEV || errno == EPERM))
+            {
+              ot_util_set_error_from_errno (error, errno);
+              g_prefix_error (error, "Hardlinking %s from reference: ", name);
+              goto out;
+            }
+        }
+
+      if (!checkout_one_file_at (self, checksum, dfd, destination, name,
+                                 mode, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
+                                 cancellable, error))
+        goto out;
+    }
+
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      char tree_checksum[65];
+      char meta_checksum[65];
+      char reference_tree_checksum[65];
+      char reference_meta_checksum[65];
+      gboolean found;
+      int reference_child_dfd = -1;
+      gs_unref_object GFile *child = NULL;
+
+      if (!get_dirtree_entry (dirs, i, &name, tree_checksum, meta_checksum, error))
+        goto out;
+      if (!lookup_dirtree_entry (reference_dirs, reference_dirs_index, name,
+                                 reference_tree_checksum, reference_meta_checksum,
+                                 &found, error))
+        goto out;
+
+      if (found)
+        {
+          if (!open_subdir_at (reference_dfd, name, TRUE, &reference_child_dfd, error))
+            goto out;
+        }
+
+      child = g_file_get_child (destination, name);
+      if (reference_child_dfd != -1)
+        {
+          gboolean checked_out;
+
+          checked_out = checkout_tree_from_reference_at (self, mode, reference_child_dfd,
+                                                         reference_tree_checksum,
+                                                         dfd, name, child,
+                                                         tree_checksum, meta_checksum,
+                                                         recursion_depth + 1,
+                                                         cancellable, error);
+          (void) close (reference_child_dfd);
+          if (!checked_out)
+            goto out;
+        }
+      else
+        {
+          if (!checkout_tree_at (self, mode, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, NULL,
+                                 dfd, name, child, tree_checksum, meta_checksum,
+                                 recursion_depth + 1, cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+static gboolean
+resolve_source_tree (OstreeRepoFile  *source,
+                     GError         **error)
+{
+  if (!ostree_repo_file_ensure_resolved (source, error))
+    return FALSE;
+
+  if (ostree_repo_file_tree_get_contents_checksum (source) == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                   "Checkout source %s is not a directory",
+                   gs_file_get_path_cached ((GFile*)source));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * ostree_repo_checkout_tree_update:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @destination: An existing checkout of @from_source
+ * @from_source: Source tree which is checked out at @destination
+ * @to_source: New source tree
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Transform @destination, which must be an unmodified checkout of
+ * @from_source made with the same @mode, into a checkout of
+ * @to_source.  Directories whose contents are unchanged are not
+ * visited, so the work done is proportional to the size of the
+ * difference between the trees.
+ *
+ * If this fails, @destination is left partially updated.
+ */
+gboolean
+ostree_repo_checkout_tree_update (OstreeRepo               *self,
+                                  OstreeRepoCheckoutMode    mode,
+                                  GFile                    *destination,
+                                  OstreeRepoFile           *from_source,
+                                  OstreeRepoFile           *to_source,
+                                  GCancellable             *cancellable,
+                                  GError                  **error)
+{
+  gboolean ret = FALSE;
+  int dfd = -1;
+
+  if (!resolve_source_tree (from_source, error))
+    goto out;
+  if (!resolve_source_tree (to_source, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd (destination, &dfd, cancellable, error))
+    goto out;
+
+  if (!checkout_tree_update_at (self, mode, dfd, destination,
+                                ostree_repo_file_tree_get_contents_checksum (from_source),
+                                ostree_repo_file_tree_get_metadata_checksum (from_source),
+                                ostree_repo_file_tree_get_contents_checksum (to_source),
+                                ostree_repo_file_tree_get_metadata_checksum (to_source),
+                                0, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+/**
+ * ostree_repo_checkout_tree_from_reference:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @destination: Place tree here; must not exist
+ * @source: Source tree
+ * @reference: An existing checkout of @reference_source
+ * @reference_source: Source tree which is checked out at @reference
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Check out @source into @destination, like
+ * ostree_repo_checkout_tree().  Files which are unchanged from
+ * @reference_source are hardlinked from @reference, which must be an
+ * unmodified checkout of it; only the difference between the two
+ * trees is read from the repository.
+ */
+gboolean
+ostree_repo_checkout_tree_from_reference (OstreeRepo               *self,
+                                          OstreeRepoCheckoutMode    mode,
+                                          GFile                    *destination,
+                                          OstreeRepoFile           *source,
+                                          GFile                    *reference,
+                                          OstreeRepoFile           *reference_source,
+                                          GCancellable             *cancellable,
+                                          GError                  **error)
+{
+  gboolean ret = FALSE;
+  int reference_dfd = -1;
+
+  if (!resolve_source_tree (source, error))
+    goto out;
+  if (!resolve_source_tree (reference_source, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd (reference, &reference_dfd, cancellable, error))
+    goto out;
+
+  if (!checkout_tree_from_reference_at (self, mode, reference_dfd,
+                                        ostree_repo_file_tree_get_contents_checksum (reference_source),
+                                        AT_FDCWD, gs_file_get_path_cached (destination),
+                                        destination,
+                                        ostree_repo_file_tree_get_contents_checksum (source),
+                                        ostree_repo_file_tree_get_metadata_checksum (source),
+                                        0, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (reference_dfd != -1)
+    (void) close (reference_dfd);
+  return ret;
+}
+
+/**
+ * ostree_repo_checkout_gc:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Call this after finishing a succession of checkout operations; it
+ * will delete any currently-unused uncompressed objects from the
+ * cache.
+ */
+gboolean
+ostree_repo_checkout_gc (OstreeRepo        *self,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *to_clean_dirs = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_mutex_lock (&self->cache_lock);
+  to_clean_dirs = self->updated_uncompressed_dirs;
+  self->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
+  g_mutex_unlock (&self->cache_lock);
+
+  if (to_clean_dirs)
+    g_hash_table_iter_init (&iter, to_clean_dirs);
+  while (to_clean_dirs && g_hash_table_iter_next (&iter, &key, &value))
+    {
+      gs_unref_object GFile *objdir = NULL;
+      gs_unref_object GFileEnumerator *enumerator = NULL;
+      gs_free char *objdir_name = NULL;
+
+      objdir_name = g_strdup_printf ("%02x", GPOINTER_TO_UINT (key));
+      objdir = g_file_get_child (self->uncompressed_objects_dir, objdir_name);
 
       enumerator = g_file_enumerate_children (objdir, "standard::name,standard::type,unix::inode,unix::nlink", 
                                               G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
@@ -732,14 +1868,27 @@ ostree_repo_checkout_gc (OstreeRepo        *self,
           nlinks = g_file_info_get_attribute_uint32 (file_info, "unix::nlink");
           if (nlinks == 1)
             {
+              const char *name = g_file_info_get_name (file_info);
               gs_unref_object GFile *objpath = NULL;
-              objpath = g_file_get_child (objdir, g_file_info_get_name (file_info));
+              objpath = g_file_get_child (objdir, name);
               if (!gs_file_unlink (objpath, cancellable, error))
                 goto out;
+
+              if (g_str_has_suffix (name, ".file") && strlen (name) == 62 + strlen (".file"))
+                {
+                  char checksum[65];
+                  memcpy (checksum, objdir_name, 2);
+                  memcpy (checksum + 2, name, 62);
+                  checksum[64] = '\0';
+                  _ostree_repo_devino_index_note_removed (self, checksum);
+                }
             }
         }
     }
 
+  if (!_ostree_repo_devino_index_flush (self, cancellable, error))
+    goto out;
+
   ret = TRUE;
  out:
   return ret;
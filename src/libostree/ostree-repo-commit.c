@@ -24,6 +24,7 @@
 
 #include <glib-unix.h>
 #include <gio/gfiledescriptorbased.h>
+#include <gio/gunixoutputstream.h>
 #include "otutil.h"
 #include "libgsystem.h"
 
@@ -57,6 +58,70 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
   return TRUE;
 }
 
+/*
+ * Objects are staged in an anonymous O_TMPFILE in the repository tmp
+ * dir where the kernel supports it, so nothing is left behind if we
+ * crash, and otherwise in a randomly named file.  @out_temp_filename
+ * is %NULL in the first case.
+ */
+static gboolean
+open_temp_object (OstreeRepo       *self,
+                  char            **out_temp_filename,
+                  GOutputStream   **out_temp_out,
+                  GCancellable     *cancellable,
+                  GError          **error)
+{
+#ifdef O_TMPFILE
+  if (self->use_tmpfile)
+    {
+      int fd;
+
+      do
+        fd = openat (self->tmp_dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+      while (G_UNLIKELY (fd == -1 && errno == EINTR));
+      if (fd == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+      *out_temp_filename = NULL;
+      *out_temp_out = g_unix_output_stream_new (fd, TRUE);
+      return TRUE;
+    }
+#endif
+
+  return gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                    out_temp_filename, out_temp_out,
+                                    cancellable, error);
+}
+
+/* Give the O_TMPFILE @fd the name @loose_path in the objects dir.
+ * Linking via /proc works without CAP_DAC_READ_SEARCH, unlike
+ * AT_EMPTY_PATH.
+ */
+static gboolean
+link_temp_object (OstreeRepo   *self,
+                  int           fd,
+                  const char   *loose_path,
+                  GError      **error)
+{
+  char proc_path[64];
+
+  g_snprintf (proc_path, sizeof (proc_path), "/proc/self/fd/%d", fd);
+  if (G_UNLIKELY (linkat (AT_FDCWD, proc_path, self->objects_dir_fd, loose_path,
+                          AT_SYMLINK_FOLLOW) == -1))
+    {
+      /* Someone else stored the object first */
+      if (errno != EEXIST)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          g_prefix_error (error, "Storing object '%s': ", loose_path);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
 static gboolean
 commit_loose_object_trusted (OstreeRepo        *self,
                              OstreeObjectType   objtype,
@@ -136,34 +201,45 @@ commit_loose_object_trusted (OstreeRepo        *self,
             }
         }
 
-      /* Ensure that in case of a power cut, these files have the data we
-       * want.   See http://lwn.net/Articles/322823/
+      /* An anonymous temporary file has to be linked in while it's
+       * still open.
        */
-      if (fsync (fd) == -1)
+      if (temp_filename == NULL)
         {
-          ot_util_set_error_from_errno (error, errno);
-          goto out;
+          if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_path,
+                                                    cancellable, error))
+            goto out;
+
+          if (!link_temp_object (self, fd, loose_path, error))
+            goto out;
         }
-          
+
+      /* Note there's no fsync() here; ostree_repo_commit_transaction()
+       * does one syncfs() for all objects before any ref can point to
+       * them.  See http://lwn.net/Articles/322823/
+       */
       if (!g_output_stream_close (temp_out, cancellable, error))
         goto out;
     }
-  
-  if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_path,
-                                            cancellable, error))
-    goto out;
-  
-  if (G_UNLIKELY (renameat (self->tmp_dir_fd, temp_filename,
-                            self->objects_dir_fd, loose_path) == -1))
+
+  if (temp_filename != NULL)
     {
-      if (errno != EEXIST)
+      if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_path,
+                                                cancellable, error))
+        goto out;
+
+      if (G_UNLIKELY (renameat (self->tmp_dir_fd, temp_filename,
+                                self->objects_dir_fd, loose_path) == -1))
         {
-          ot_util_set_error_from_errno (error, errno);
-          g_prefix_error (error, "Storing file '%s': ", temp_filename);
-          goto out;
+          if (errno != EEXIST)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              g_prefix_error (error, "Storing file '%s': ", temp_filename);
+              goto out;
+            }
+          else
+            (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
         }
-      else
-        (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
     }
 
   ret = TRUE;
@@ -202,6 +278,10 @@ repo_store_size_entry (OstreeRepo       *self,
                        gsize             unpacked,
                        gsize             archived)
 {
+  /* Content may be written from several threads at once; see
+   * ostree_repo_commit_modifier_set_n_jobs().
+   */
+  g_mutex_lock (&self->txn_stats_lock);
   if (G_UNLIKELY (self->object_sizes == NULL))
     self->object_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, content_size_cache_entry_free);
@@ -209,6 +289,7 @@ repo_store_size_entry (OstreeRepo       *self,
   g_hash_table_replace (self->object_sizes,
                         g_strdup (checksum),
                         content_size_cache_entry_new (unpacked, archived));
+  g_mutex_unlock (&self->txn_stats_lock);
 }
 
 static int
@@ -294,12 +375,130 @@ add_size_index_to_metadata (OstreeRepo        *self,
   return ret;
 }
 
+/* Only this much of each file is examined by
+ * content_looks_incompressible(), so the probe is cheap even for huge
+ * files.
+ */
+#define OSTREE_COMPRESSION_PROBE_SIZE (64 * 1024)
+
+/*
+ * content_looks_incompressible:
+ *
+ * Returns %TRUE if a quick deflate pass over @buf, the start of a
+ * file, saves less than 3%.  That is typically the case for already
+ * compressed data like .gz, .xz or .png files, which we store with
+ * level 0 (stored blocks) to avoid burning CPU for nothing.
+ */
+static gboolean
+content_looks_incompressible (const guint8  *buf,
+                              gsize          len)
+{
+  gboolean ret;
+  GConverterResult result;
+  gsize bytes_read, bytes_written;
+  gs_unref_object GConverter *compressor = NULL;
+  gs_free guint8 *outbuf = NULL;
+
+  /* Not worth it for small files */
+  if (len < 4096)
+    return FALSE;
+
+  compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 1);
+  outbuf = g_malloc (len);
+  result = g_converter_convert (compressor, buf, len, outbuf, len,
+                                G_CONVERTER_INPUT_AT_END,
+                                &bytes_read, &bytes_written, NULL);
+  /* Anything but finishing within len bytes means the output would
+   * have been at least as large as the input.
+   */
+  if (result != G_CONVERTER_FINISHED)
+    ret = TRUE;
+  else
+    ret = bytes_written * 100 >= len * 97;
+
+  return ret;
+}
+
+/*
+ * Add the data of the temporary object we just created by cloning to
+ * @checksum.  The clone is what gets stored, so it's what has to be
+ * checksummed; the source file may have changed since.
+ */
+static gboolean
+checksum_cloned_object (OstreeRepo     *self,
+                        const char     *temp_filename,
+                        GOutputStream  *temp_out,
+                        guint64         expected_size,
+                        GChecksum      *checksum,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  int read_fd;
+  guint8 buf[8192];
+  gssize bytes_read;
+  guint64 total = 0;
+
+  if (temp_filename)
+    {
+      do
+        fd = openat (self->tmp_dir_fd, temp_filename, O_RDONLY | O_CLOEXEC);
+      while (G_UNLIKELY (fd == -1 && errno == EINTR));
+      if (fd == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      read_fd = fd;
+    }
+  else
+    {
+      /* An O_TMPFILE, which open_temp_object() opened for reading too */
+      read_fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out);
+    }
+
+  while (TRUE)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      do
+        bytes_read = pread (read_fd, buf, sizeof (buf), total);
+      while (G_UNLIKELY (bytes_read == -1 && errno == EINTR));
+      if (bytes_read == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      if (bytes_read == 0)
+        break;
+
+      g_checksum_update (checksum, buf, bytes_read);
+      total += bytes_read;
+    }
+
+  if (total != expected_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "File changed size while being committed");
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
 static gboolean
 write_object (OstreeRepo         *self,
               OstreeObjectType    objtype,
               const char         *expected_checksum,
               GInputStream       *input,
               guint64             file_object_length,
+              int                 clone_fd,
               guchar            **out_csum,
               GCancellable       *cancellable,
               GError            **error)
@@ -332,11 +531,14 @@ write_object (OstreeRepo         *self,
 
   g_assert (expected_checksum || out_csum);
 
+  /* Objects which are already packed count as stored too, so that
+   * committing or pulling doesn't duplicate them as loose objects.
+   */
   if (expected_checksum)
     {
-      if (!_ostree_repo_has_loose_object (self, expected_checksum, objtype,
-                                          &have_obj, loose_objpath,
-                                          cancellable, error))
+      if (!_ostree_repo_find_object (self, objtype, expected_checksum,
+                                     &have_obj, NULL,
+                                     cancellable, error))
         goto out;
       if (have_obj)
         {
@@ -381,12 +583,36 @@ write_object (OstreeRepo         *self,
        */
       if (repo_mode == OSTREE_REPO_MODE_BARE && temp_file_is_regular)
         {
-          if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
-                                          cancellable, error))
+          gboolean cloned = FALSE;
+
+          if (!open_temp_object (self, &temp_filename, &temp_out,
+                                 cancellable, error))
             goto out;
-          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
-          if (g_output_stream_splice (temp_out, file_input, 0,
-                                      cancellable, error) < 0)
+
+          /* If the caller gave us the source file, try to share its
+           * data extents rather than copying.  The clone still has
+           * to be read for the checksum, but reading is much cheaper
+           * than writing it all out again.
+           */
+          if (clone_fd != -1)
+            {
+              if (!ot_util_clone_file (clone_fd,
+                                       g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out),
+                                       g_file_info_get_size (file_info), &cloned,
+                                       error))
+                goto out;
+            }
+
+          if (cloned)
+            {
+              if (checksum
+                  && !checksum_cloned_object (self, temp_filename, temp_out,
+                                              g_file_info_get_size (file_info), checksum,
+                                              cancellable, error))
+                goto out;
+            }
+          else if (g_output_stream_splice (temp_out, file_input, 0,
+                                           cancellable, error) < 0)
             goto out;
         }
       else if (repo_mode == OSTREE_REPO_MODE_BARE && is_symlink)
@@ -407,11 +633,9 @@ write_object (OstreeRepo         *self,
           if (self->generate_sizes)
             indexable = TRUE;
 
-          if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
-                                          &temp_filename, &temp_out,
-                                          cancellable, error))
+          if (!open_temp_object (self, &temp_filename, &temp_out,
+                                 cancellable, error))
             goto out;
-          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
           temp_file_is_regular = TRUE;
 
           file_meta = _ostree_zlib_file_header_new (file_info, xattrs);
@@ -422,15 +646,52 @@ write_object (OstreeRepo         *self,
 
           if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
             {
-              zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
-              compressed_out_stream = g_converter_output_stream_new (temp_out, zlib_compressor);
-              /* Don't close the base; we'll do that later */
-              g_filter_output_stream_set_close_base_stream ((GFilterOutputStream*)compressed_out_stream, FALSE);
-              
-              unpacked_size = g_output_stream_splice (compressed_out_stream, file_input,
-                                                      0, cancellable, error);
-              if (unpacked_size < 0)
+              int zlib_level = self->zlib_level;
+              long n_threads;
+              gsize probe_len;
+              gs_free guint8 *probe_buf = g_malloc (OSTREE_COMPRESSION_PROBE_SIZE);
+
+              if (!g_input_stream_read_all (file_input, probe_buf, OSTREE_COMPRESSION_PROBE_SIZE,
+                                            &probe_len, cancellable, error))
                 goto out;
+
+              if (zlib_level > 0 && content_looks_incompressible (probe_buf, probe_len))
+                zlib_level = 0;
+
+              n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+              if (self->zlib_parallel_threshold > 0
+                  && g_file_info_get_size (file_info) >= self->zlib_parallel_threshold
+                  && n_threads > 1)
+                {
+                  guint64 bytes_read;
+
+                  if (!_ostree_zlib_compress_parallel (file_input, probe_buf, probe_len,
+                                                       temp_out, zlib_level,
+                                                       (guint) MIN (n_threads, 16),
+                                                       &bytes_read,
+                                                       cancellable, error))
+                    goto out;
+                  unpacked_size = bytes_read;
+                }
+              else
+                {
+                  gssize bytes_spliced;
+
+                  zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, zlib_level);
+                  compressed_out_stream = g_converter_output_stream_new (temp_out, zlib_compressor);
+                  /* Don't close the base; we'll do that later */
+                  g_filter_output_stream_set_close_base_stream ((GFilterOutputStream*)compressed_out_stream, FALSE);
+
+                  if (!g_output_stream_write_all (compressed_out_stream, probe_buf, probe_len,
+                                                  NULL, cancellable, error))
+                    goto out;
+
+                  bytes_spliced = g_output_stream_splice (compressed_out_stream, file_input,
+                                                          0, cancellable, error);
+                  if (bytes_spliced < 0)
+                    goto out;
+                  unpacked_size = probe_len + bytes_spliced;
+                }
             }
         }
       else
@@ -438,10 +699,9 @@ write_object (OstreeRepo         *self,
     }
   else
     {
-      if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
-                                      cancellable, error))
+      if (!open_temp_object (self, &temp_filename, &temp_out,
+                             cancellable, error))
         goto out;
-      temp_file = g_file_get_child (self->tmp_dir, temp_filename);
       if (g_output_stream_splice (temp_out, checksum_input ? (GInputStream*)checksum_input : input,
                                   0,
                                   cancellable, error) < 0)
@@ -472,22 +732,21 @@ write_object (OstreeRepo         *self,
           
   if (indexable)
     {
-      gsize archived_size;
-      gs_unref_object GFileInfo *compressed_info =
-        g_file_query_info (temp_file, G_FILE_ATTRIBUTE_STANDARD_SIZE, 0,
-                           cancellable, error);
-      if (!compressed_info)
+      struct stat stbuf;
+
+      if (!gs_stream_fstat ((GFileDescriptorBased*)temp_out, &stbuf,
+                            cancellable, error))
         goto out;
-      archived_size = g_file_info_get_size (compressed_info);
-      repo_store_size_entry (self, actual_checksum, unpacked_size, archived_size);
+      repo_store_size_entry (self, actual_checksum, unpacked_size, stbuf.st_size);
     }
 
-  if (!_ostree_repo_has_loose_object (self, actual_checksum, objtype,
-                                      &have_obj, loose_objpath,
-                                      cancellable, error))
+  if (!_ostree_repo_find_object (self, objtype, actual_checksum,
+                                 &have_obj, NULL,
+                                 cancellable, error))
     goto out;
           
   do_commit = !have_obj;
+  _ostree_loose_path (loose_objpath, actual_checksum, objtype, repo_mode);
 
   if (do_commit)
     {
@@ -500,6 +759,11 @@ write_object (OstreeRepo         *self,
 
       g_clear_pointer (&temp_filename, g_free);
       g_clear_object (&temp_file);
+
+      _ostree_repo_object_filter_note_added (self, actual_checksum, objtype);
+      if (objtype == OSTREE_OBJECT_TYPE_FILE && repo_mode == OSTREE_REPO_MODE_BARE)
+        _ostree_repo_devino_index_note_added (self, self->objects_dir_fd,
+                                              loose_objpath, actual_checksum);
     }
 
   g_mutex_lock (&self->txn_stats_lock);
@@ -533,133 +797,15 @@ write_object (OstreeRepo         *self,
   return ret;
 }
 
-typedef struct {
-  dev_t dev;
-  ino_t ino;
-} OstreeDevIno;
-
-static guint
-devino_hash (gconstpointer a)
-{
-  OstreeDevIno *a_i = (gpointer)a;
-  return (guint) (a_i->dev + a_i->ino);
-}
-
-static int
-devino_equal (gconstpointer   a,
-              gconstpointer   b)
-{
-  OstreeDevIno *a_i = (gpointer)a;
-  OstreeDevIno *b_i = (gpointer)b;
-  return a_i->dev == b_i->dev
-    && a_i->ino == b_i->ino;
-}
-
 static gboolean
-scan_loose_devino (OstreeRepo                     *self,
-                   GHashTable                     *devino_cache,
-                   GCancellable                   *cancellable,
-                   GError                        **error)
-{
-  gboolean ret = FALSE;
-  guint i;
-  OstreeRepoMode repo_mode;
-  gs_unref_ptrarray GPtrArray *object_dirs = NULL;
-
-  if (self->parent_repo)
-    {
-      if (!scan_loose_devino (self->parent_repo, devino_cache, cancellable, error))
-        goto out;
-    }
-
-  repo_mode = ostree_repo_get_mode (self);
-
-  if (!_ostree_repo_get_loose_object_dirs (self, &object_dirs, cancellable, error))
-    goto out;
-
-  for (i = 0; i < object_dirs->len; i++)
-    {
-      GFile *objdir = object_dirs->pdata[i];
-      gs_unref_object GFileEnumerator *enumerator = NULL;
-      gs_unref_object GFileInfo *file_info = NULL;
-      const char *dirname;
-
-      enumerator = g_file_enumerate_children (objdir, OSTREE_GIO_FAST_QUERYINFO,
-                                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                              cancellable,
-                                              error);
-      if (!enumerator)
-        goto out;
-
-      dirname = gs_file_get_basename_cached (objdir);
-
-      while (TRUE)
-        {
-          const char *name;
-          const char *dot;
-          guint32 type;
-          OstreeDevIno *key;
-          GString *checksum;
-          gboolean skip;
-
-          if (!gs_file_enumerator_iterate (enumerator, &file_info, NULL,
-                                           NULL, error))
-            goto out;
-          if (file_info == NULL)
-            break;
-
-          name = g_file_info_get_attribute_byte_string (file_info, "standard::name");
-          type = g_file_info_get_attribute_uint32 (file_info, "standard::type");
-
-          if (type == G_FILE_TYPE_DIRECTORY)
-            continue;
-
-          switch (repo_mode)
-            {
-            case OSTREE_REPO_MODE_ARCHIVE_Z2:
-            case OSTREE_REPO_MODE_BARE:
-              skip = !g_str_has_suffix (name, ".file");
-              break;
-            default:
-              g_assert_not_reached ();
-            }
-          if (skip)
-            continue;
-
-          dot = strrchr (name, '.');
-          g_assert (dot);
-
-          if ((dot - name) != 62)
-            continue;
-
-          checksum = g_string_new (dirname);
-          g_string_append_len (checksum, name, 62);
-
-          key = g_new (OstreeDevIno, 1);
-          key->dev = g_file_info_get_attribute_uint32 (file_info, "unix::device");
-          key->ino = g_file_info_get_attribute_uint64 (file_info, "unix::inode");
-
-          g_hash_table_replace (devino_cache, key, g_string_free (checksum, FALSE));
-        }
-    }
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
-static const char *
 devino_cache_lookup (OstreeRepo           *self,
-                     GFileInfo            *finfo)
+                     GFileInfo            *finfo,
+                     char                 *out_checksum)
 {
-  OstreeDevIno dev_ino;
-
-  if (!self->loose_object_devino_hash)
-    return NULL;
-
-  dev_ino.dev = g_file_info_get_attribute_uint32 (finfo, "unix::device");
-  dev_ino.ino = g_file_info_get_attribute_uint64 (finfo, "unix::inode");
-  return g_hash_table_lookup (self->loose_object_devino_hash, &dev_ino);
+  return _ostree_repo_devino_index_lookup (self,
+                                           g_file_info_get_attribute_uint32 (finfo, "unix::device"),
+                                           g_file_info_get_attribute_uint64 (finfo, "unix::inode"),
+                                           out_checksum);
 }
 
 /**
@@ -674,10 +820,12 @@ devino_cache_lookup (OstreeRepo           *self,
  * ostree's existing repo, ostree can build a mapping of device numbers and
  * inodes to their checksum.
  *
- * There is an upfront cost to creating this mapping, as this will scan the
- * entire objects directory. If your commit is composed of mostly hardlinks to
- * existing ostree objects, then this will speed up considerably, so call it
- * before you call ostree_write_directory_to_mtree() or similar.
+ * The mapping is stored in the repository and kept up to date as
+ * objects are added and pruned, so only the first call has to scan
+ * the entire objects directory; later calls just map the index. If
+ * your commit is composed of mostly hardlinks to existing ostree
+ * objects, then this will speed up considerably, so call it before
+ * you call ostree_write_directory_to_mtree() or similar.
  */
 gboolean
 ostree_repo_scan_hardlinks (OstreeRepo    *self,
@@ -685,20 +833,48 @@ ostree_repo_scan_hardlinks (OstreeRepo    *self,
                             GError       **error)
 {
   gboolean ret = FALSE;
+  OstreeRepo *repo;
 
   g_return_val_if_fail (self->in_transaction == TRUE, FALSE);
 
-  if (!self->loose_object_devino_hash)
-    self->loose_object_devino_hash = g_hash_table_new_full (devino_hash, devino_equal, g_free, g_free);
-  g_hash_table_remove_all (self->loose_object_devino_hash);
-  if (!scan_loose_devino (self, self->loose_object_devino_hash, cancellable, error))
-    goto out;
+  for (repo = self; repo; repo = repo->parent_repo)
+    {
+      gboolean loaded;
+
+      if (!_ostree_repo_devino_index_load (repo, &loaded, cancellable, error))
+        goto out;
+      if (!loaded)
+        {
+          if (!_ostree_repo_devino_index_rebuild (repo, cancellable, error))
+            goto out;
+        }
+    }
 
   ret = TRUE;
  out:
   return ret;
 }
 
+static gboolean
+tmpfile_supported (OstreeRepo *self)
+{
+#ifdef O_TMPFILE
+  int fd;
+
+  /* See link_temp_object() */
+  if (access ("/proc/self/fd", X_OK) != 0)
+    return FALSE;
+
+  fd = openat (self->tmp_dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return FALSE;
+  (void) close (fd);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
 /**
  * ostree_repo_prepare_transaction:
  * @self: An #OstreeRepo
@@ -737,7 +913,10 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
   memset (&self->txn_stats, 0, sizeof (OstreeRepoTransactionStats));
 
+  self->use_tmpfile = tmpfile_supported (self);
+
   self->in_transaction = TRUE;
+  _ostree_repo_object_filter_enable (self);
   if (ret_transaction_resume)
     {
       if (!ot_gfile_ensure_unlinked (self->transaction_lock_path, cancellable, error))
@@ -900,8 +1079,22 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  if (!_ostree_repo_devino_index_flush (self, cancellable, error))
+    goto out;
+  _ostree_repo_devino_index_unload (self);
+
+  /* Objects are written without individual fsync() calls; instead,
+   * flush the whole repository filesystem once, so that after a power
+   * cut no ref can point to a commit with truncated objects.
+   */
+  if (!self->disable_fsync)
+    {
+      if (!ot_util_syncfs (self->tmp_dir_fd, error))
+        {
+          g_prefix_error (error, "Syncing repository: ");
+          goto out;
+        }
+    }
 
   if (self->txn_refs)
     if (!_ostree_repo_update_refs (self, self->txn_refs, cancellable, error))
@@ -909,6 +1102,7 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
   self->in_transaction = FALSE;
+  _ostree_repo_object_filter_disable (self);
 
   if (!ot_gfile_ensure_unlinked (self->transaction_lock_path, cancellable, error))
     goto out;
@@ -934,12 +1128,15 @@ ostree_repo_abort_transaction (OstreeRepo     *self,
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  /* Objects written before the abort are still in the repository */
+  if (!_ostree_repo_devino_index_flush (self, cancellable, error))
+    goto out;
+  _ostree_repo_devino_index_unload (self);
 
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
   self->in_transaction = FALSE;
+  _ostree_repo_object_filter_disable (self);
 
   ret = TRUE;
  out:
@@ -977,7 +1174,7 @@ ostree_repo_write_metadata (OstreeRepo         *self,
   normalized = g_variant_get_normal_form (object);
   input = ot_variant_read (normalized);
 
-  return write_object (self, objtype, expected_checksum, input, 0, out_csum,
+  return write_object (self, objtype, expected_checksum, input, 0, -1, out_csum,
                        cancellable, error);
 }
 
@@ -1004,7 +1201,7 @@ ostree_repo_write_metadata_stream_trusted (OstreeRepo        *self,
                                            GError           **error)
 {
   /* Ignore provided length for now */
-  return write_object (self, objtype, checksum, object_input, 0, NULL,
+  return write_object (self, objtype, checksum, object_input, 0, -1, NULL,
                        cancellable, error);
 }
 
@@ -1034,7 +1231,7 @@ ostree_repo_write_metadata_trusted (OstreeRepo         *self,
   normalized = g_variant_get_normal_form (variant);
   input = ot_variant_read (normalized);
 
-  return write_object (self, type, checksum, input, 0, NULL,
+  return write_object (self, type, checksum, input, 0, -1, NULL,
                        cancellable, error);
 }
 
@@ -1201,7 +1398,7 @@ ostree_repo_write_content_trusted (OstreeRepo       *self,
                                    GError          **error)
 {
   return write_object (self, OSTREE_OBJECT_TYPE_FILE, checksum,
-                       object_input, length, NULL,
+                       object_input, length, -1, NULL,
                        cancellable, error);
 }
 
@@ -1229,7 +1426,7 @@ ostree_repo_write_content (OstreeRepo       *self,
                            GError          **error)
 {
   return write_object (self, OSTREE_OBJECT_TYPE_FILE, expected_checksum,
-                       object_input, length, out_csum,
+                       object_input, length, -1, out_csum,
                        cancellable, error);
 }
 
@@ -1342,45 +1539,355 @@ ostree_repo_write_content_finish (OstreeRepo        *self,
   return TRUE;
 }
 
-static GVariant *
-create_empty_gvariant_dict (void)
-{
-  GVariantBuilder builder;
-  g_variant_builder_init (&builder, G_VARIANT_TYPE("a{sv}"));
-  return g_variant_builder_end (&builder);
-}
-
-/**
- * ostree_repo_write_commit:
- * @self: Repo
- * @parent: (allow-none): ASCII SHA256 checksum for parent, or %NULL for none
- * @subject: Subject
- * @body: (allow-none): Body
- * @metadata: (allow-none): GVariant of type a{sv}, or %NULL for none
- * @root: The tree to point the commit to
- * @out_commit: (out): Resulting ASCII SHA256 checksum for commit
+/*
+ * _ostree_repo_write_archive_content:
+ * @self: Repo, must be in archive-z2 mode
+ * @expected_checksum: Checksum of the content object
+ * @archived_path: An archive-z2 (.filez) representation of the object
+ * @archived_path_is_temporary: If %TRUE, @archived_path lives in the
+ *   repository tmp directory and may be renamed into place
+ * @out_csum: (out) (array fixed-size=32) (allow-none): Binary checksum
  * @cancellable: Cancellable
  * @error: Error
  *
- * Write a commit metadata object, referencing @root_contents_checksum
- * and @root_metadata_checksum.
+ * Store a content object which is already in archive-z2 form, without
+ * decompressing and recompressing it.  The content is verified
+ * against @expected_checksum by inflating it as it is hashed; the
+ * compressed bytes are then stored as they are.
  */
 gboolean
-ostree_repo_write_commit (OstreeRepo      *self,
-                          const char      *parent,
-                          const char      *subject,
-                          const char      *body,
-                          GVariant        *metadata,
-                          OstreeRepoFile  *root,
-                          char           **out_commit,
-                          GCancellable    *cancellable,
-                          GError         **error)
+_ostree_repo_write_archive_content (OstreeRepo       *self,
+                                    const char       *expected_checksum,
+                                    GFile            *archived_path,
+                                    gboolean          archived_path_is_temporary,
+                                    guchar          **out_csum,
+                                    GCancellable     *cancellable,
+                                    GError          **error)
 {
   gboolean ret = FALSE;
-  gs_free char *ret_commit = NULL;
-  gs_unref_variant GVariant *commit = NULL;
-  gs_unref_variant GVariant *new_metadata = NULL;
-  gs_free guchar *commit_csum = NULL;
+  gboolean have_obj;
+  char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
+  gs_free char *temp_filename = NULL;
+  gs_free char *actual_checksum = NULL;
+  gs_free guchar *ret_csum = NULL;
+  gs_unref_object GFile *temp_file = NULL;
+  guint64 unpacked_size;
+  struct stat stbuf;
+  int fd = -1;
+
+  g_return_val_if_fail (self->in_transaction, FALSE);
+  g_return_val_if_fail (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2, FALSE);
+  g_return_val_if_fail (expected_checksum != NULL, FALSE);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (!_ostree_repo_find_object (self, OSTREE_OBJECT_TYPE_FILE, expected_checksum,
+                                 &have_obj, NULL,
+                                 cancellable, error))
+    goto out;
+  _ostree_loose_path (loose_objpath, expected_checksum, OSTREE_OBJECT_TYPE_FILE,
+                      self->mode);
+  if (have_obj)
+    {
+      ret_csum = ostree_checksum_to_bytes (expected_checksum);
+      ret = TRUE;
+      goto out;
+    }
+
+  if (archived_path_is_temporary)
+    {
+      g_return_val_if_fail (g_file_has_parent (archived_path, self->tmp_dir), FALSE);
+      temp_file = g_object_ref (archived_path);
+    }
+  else
+    {
+      gs_unref_object GInputStream *src_in = NULL;
+      gs_unref_object GOutputStream *temp_out = NULL;
+
+      src_in = (GInputStream*)gs_file_read_noatime (archived_path, cancellable, error);
+      if (!src_in)
+        goto out;
+
+      if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                      &temp_filename, &temp_out,
+                                      cancellable, error))
+        goto out;
+      temp_file = g_file_get_child (self->tmp_dir, temp_filename);
+
+      if (g_output_stream_splice (temp_out, src_in, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, error) < 0)
+        goto out;
+    }
+
+  /* Verify the copy we are about to rename into place, not the source */
+  if (!_ostree_checksum_zlib_file (temp_file, &ret_csum, &unpacked_size,
+                                   cancellable, error))
+    {
+      g_prefix_error (error, "Verifying content object %s: ", expected_checksum);
+      goto out;
+    }
+
+  actual_checksum = ostree_checksum_from_bytes (ret_csum);
+  if (strcmp (actual_checksum, expected_checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted %s object %s (actual checksum is %s)",
+                   ostree_object_type_to_string (OSTREE_OBJECT_TYPE_FILE),
+                   expected_checksum, actual_checksum);
+      goto out;
+    }
+
+  fd = openat (self->tmp_dir_fd, gs_file_get_basename_cached (temp_file), O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || fstat (fd, &stbuf) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (self->generate_sizes)
+    repo_store_size_entry (self, expected_checksum, unpacked_size, stbuf.st_size);
+
+  if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_objpath,
+                                            cancellable, error))
+    goto out;
+
+  if (G_UNLIKELY (renameat (self->tmp_dir_fd, gs_file_get_basename_cached (temp_file),
+                            self->objects_dir_fd, loose_objpath) == -1))
+    {
+      if (errno != EEXIST)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          g_prefix_error (error, "Storing file '%s': ", gs_file_get_path_cached (temp_file));
+          goto out;
+        }
+      else if (temp_filename)
+        (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
+    }
+  g_clear_pointer (&temp_filename, g_free);
+  _ostree_repo_object_filter_note_added (self, expected_checksum, OSTREE_OBJECT_TYPE_FILE);
+
+  g_mutex_lock (&self->txn_stats_lock);
+  self->txn_stats.content_objects_written++;
+  self->txn_stats.content_bytes_written += unpacked_size;
+  self->txn_stats.content_objects_total++;
+  g_mutex_unlock (&self->txn_stats_lock);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_csum, &ret_csum);
+ out:
+  if (fd != -1)
+    (void) close (fd);
+  if (temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  char *expected_checksum;
+  GFile *archived_path;
+  gboolean archived_path_is_temporary;
+  GCancellable *cancellable;
+  GSimpleAsyncResult *result;
+
+  guchar *result_csum;
+} WriteArchiveContentAsyncData;
+
+static void
+write_archive_content_async_data_free (gpointer user_data)
+{
+  WriteArchiveContentAsyncData *data = user_data;
+
+  g_clear_object (&data->repo);
+  g_clear_object (&data->cancellable);
+  g_clear_object (&data->archived_path);
+  g_free (data->result_csum);
+  g_free (data->expected_checksum);
+  g_free (data);
+}
+
+static void
+write_archive_content_thread (GSimpleAsyncResult  *res,
+                              GObject             *object,
+                              GCancellable        *cancellable)
+{
+  GError *error = NULL;
+  WriteArchiveContentAsyncData *data;
+
+  data = g_simple_async_result_get_op_res_gpointer (res);
+  if (!_ostree_repo_write_archive_content (data->repo, data->expected_checksum,
+                                           data->archived_path,
+                                           data->archived_path_is_temporary,
+                                           &data->result_csum,
+                                           cancellable, &error))
+    g_simple_async_result_take_error (res, error);
+}
+
+/*
+ * _ostree_repo_write_archive_content_async:
+ *
+ * Asynchronous version of _ostree_repo_write_archive_content().
+ */
+void
+_ostree_repo_write_archive_content_async (OstreeRepo               *self,
+                                          const char               *expected_checksum,
+                                          GFile                    *archived_path,
+                                          gboolean                  archived_path_is_temporary,
+                                          GCancellable             *cancellable,
+                                          GAsyncReadyCallback       callback,
+                                          gpointer                  user_data)
+{
+  WriteArchiveContentAsyncData *asyncdata;
+
+  asyncdata = g_new0 (WriteArchiveContentAsyncData, 1);
+  asyncdata->repo = g_object_ref (self);
+  asyncdata->expected_checksum = g_strdup (expected_checksum);
+  asyncdata->archived_path = g_object_ref (archived_path);
+  asyncdata->archived_path_is_temporary = archived_path_is_temporary;
+  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+  asyncdata->result = g_simple_async_result_new ((GObject*) self,
+                                                 callback, user_data,
+                                                 _ostree_repo_write_archive_content_async);
+
+  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
+                                             write_archive_content_async_data_free);
+  g_simple_async_result_run_in_thread (asyncdata->result, write_archive_content_thread,
+                                       G_PRIORITY_DEFAULT, cancellable);
+  g_object_unref (asyncdata->result);
+}
+
+gboolean
+_ostree_repo_write_archive_content_finish (OstreeRepo        *self,
+                                           GAsyncResult      *result,
+                                           guchar           **out_csum,
+                                           GError           **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  WriteArchiveContentAsyncData *data;
+
+  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == _ostree_repo_write_archive_content_async);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return FALSE;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+  ot_transfer_out_value (out_csum, &data->result_csum);
+  return TRUE;
+}
+
+/**
+ * ostree_repo_import_object_from:
+ * @self: Destination repo
+ * @source: Source repo
+ * @objtype: Object type
+ * @checksum: checksum
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Copy object named by @objtype and @checksum into @self from the
+ * source repository @source.  If both repositories are of mode
+ * archive-z2, content objects are copied in their compressed form
+ * after being verified, rather than being decompressed and
+ * compressed again.
+ */
+gboolean
+ostree_repo_import_object_from (OstreeRepo           *self,
+                                OstreeRepo           *source,
+                                OstreeObjectType      objtype,
+                                const char           *checksum,
+                                GCancellable         *cancellable,
+                                GError              **error)
+{
+  gboolean ret = FALSE;
+  guint64 length;
+  gs_unref_object GInputStream *object = NULL;
+  gs_unref_object GFile *archived_path = NULL;
+
+  if (objtype == OSTREE_OBJECT_TYPE_FILE
+      && self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+      && source->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      /* May be NULL if the object is packed, or only in a parent of @source */
+      if (!_ostree_repo_find_object (source, objtype, checksum, NULL, &archived_path,
+                                     cancellable, error))
+        goto out;
+    }
+
+  if (archived_path)
+    {
+      if (!_ostree_repo_write_archive_content (self, checksum, archived_path, FALSE,
+                                               NULL, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!ostree_repo_load_object_stream (source, objtype, checksum,
+                                           &object, &length,
+                                           cancellable, error))
+        goto out;
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          if (!ostree_repo_write_content_trusted (self, checksum,
+                                                  object, length,
+                                                  cancellable, error))
+            goto out;
+        }
+      else
+        {
+          if (!ostree_repo_write_metadata_stream_trusted (self, objtype,
+                                                          checksum, object, length,
+                                                          cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static GVariant *
+create_empty_gvariant_dict (void)
+{
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE("a{sv}"));
+  return g_variant_builder_end (&builder);
+}
+
+/**
+ * ostree_repo_write_commit:
+ * @self: Repo
+ * @parent: (allow-none): ASCII SHA256 checksum for parent, or %NULL for none
+ * @subject: Subject
+ * @body: (allow-none): Body
+ * @metadata: (allow-none): GVariant of type a{sv}, or %NULL for none
+ * @root: The tree to point the commit to
+ * @out_commit: (out): Resulting ASCII SHA256 checksum for commit
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write a commit metadata object, referencing @root_contents_checksum
+ * and @root_metadata_checksum.
+ */
+gboolean
+ostree_repo_write_commit (OstreeRepo      *self,
+                          const char      *parent,
+                          const char      *subject,
+                          const char      *body,
+                          GVariant        *metadata,
+                          OstreeRepoFile  *root,
+                          char           **out_commit,
+                          GCancellable    *cancellable,
+                          GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *ret_commit = NULL;
+  gs_unref_variant GVariant *commit = NULL;
+  gs_unref_variant GVariant *new_metadata = NULL;
+  gs_free guchar *commit_csum = NULL;
   GDateTime *now = NULL;
   OstreeRepoFile *repo_root = OSTREE_REPO_FILE (root);
 
@@ -1593,6 +2100,9 @@ struct OstreeRepoCommitModifier {
   OstreeRepoCommitFilter filter;
   gpointer user_data;
   GDestroyNotify destroy_notify;
+
+  guint n_jobs;
+  OstreeRepoStatCache *stat_cache;
 };
 
 OstreeRepoCommitFilterResult
@@ -1656,18 +2166,273 @@ apply_commit_filter (OstreeRepo               *self,
   return result;
 }
 
+static gboolean
+write_content_for_file (OstreeRepo                  *self,
+                        OstreeRepoCommitModifier    *modifier,
+                        GFile                       *file,
+                        GFileInfo                   *file_info,
+                        guchar                     **out_csum,
+                        GCancellable                *cancellable,
+                        GError                     **error)
+{
+  gboolean ret = FALSE;
+  guint64 file_obj_length;
+  int clone_fd = -1;
+  gs_unref_object GInputStream *file_input = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_object GInputStream *file_object_input = NULL;
+
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      file_input = (GInputStream*)g_file_read (file, cancellable, error);
+      if (!file_input)
+        goto out;
+    }
+
+  if (!(modifier && (modifier->flags & OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS) > 0))
+    {
+      if (!ostree_get_xattrs_for_file (file, &xattrs, cancellable, error))
+        goto out;
+    }
+
+  if (!ostree_raw_file_to_content_stream (file_input,
+                                          file_info, xattrs,
+                                          &file_object_input, &file_obj_length,
+                                          cancellable, error))
+    goto out;
+  /* For bare repositories, let write_object() reflink the file */
+  if (file_input && self->mode == OSTREE_REPO_MODE_BARE
+      && G_IS_FILE_DESCRIPTOR_BASED (file_input))
+    clone_fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)file_input);
+
+  if (!write_object (self, OSTREE_OBJECT_TYPE_FILE, NULL,
+                     file_object_input, file_obj_length, clone_fd,
+                     out_csum, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * Parallel content writing; see ostree_repo_commit_modifier_set_n_jobs().
+ *
+ * Directory enumeration and dirmeta writes stay on the calling
+ * thread; reading, checksumming, compressing and storing file
+ * objects is handed to a pool of workers.  At most
+ * @max_outstanding files are queued at a time, so memory use and
+ * open file descriptors stay bounded on very large trees.  Once the
+ * pool drains, results are inserted into the mutable trees in
+ * enumeration order, which makes the outcome identical to a serial
+ * commit.
+ */
+typedef struct {
+  OstreeMutableTree *mtree;
+  char *name;
+  GFile *file;
+  GFileInfo *file_info;
+  GFileInfo *stat_info;
+
+  char *checksum;
+} CommitContentJob;
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeRepoCommitModifier *modifier;
+  GCancellable *cancellable;
+  GThreadPool *threadpool;
+  GPtrArray *jobs;
+
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  guint max_outstanding;
+  GError *error;
+} CommitContentPool;
+
+static void
+commit_content_job_free (gpointer data)
+{
+  CommitContentJob *job = data;
+
+  g_clear_object (&job->mtree);
+  g_clear_object (&job->file);
+  g_clear_object (&job->file_info);
+  g_clear_object (&job->stat_info);
+  g_free (job->name);
+  g_free (job->checksum);
+  g_free (job);
+}
+
+static void
+commit_content_pool_thread (gpointer data,
+                            gpointer user_data)
+{
+  CommitContentJob *job = data;
+  CommitContentPool *pool = user_data;
+  GError *local_error = NULL;
+  gs_free guchar *csum = NULL;
+  gboolean skip;
+
+  g_mutex_lock (&pool->lock);
+  skip = pool->error != NULL;
+  g_mutex_unlock (&pool->lock);
+
+  if (!skip)
+    {
+      if (write_content_for_file (pool->repo, pool->modifier,
+                                  job->file, job->file_info, &csum,
+                                  pool->cancellable, &local_error))
+        job->checksum = ostree_checksum_from_bytes (csum);
+    }
+
+  g_mutex_lock (&pool->lock);
+  if (local_error)
+    {
+      if (pool->error == NULL)
+        pool->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  pool->n_outstanding--;
+  g_cond_broadcast (&pool->cond);
+  g_mutex_unlock (&pool->lock);
+}
+
+static CommitContentPool *
+commit_content_pool_new (OstreeRepo                *repo,
+                         OstreeRepoCommitModifier  *modifier,
+                         GCancellable              *cancellable,
+                         GError                   **error)
+{
+  CommitContentPool *pool = g_new0 (CommitContentPool, 1);
+
+  pool->repo = g_object_ref (repo);
+  pool->modifier = ostree_repo_commit_modifier_ref (modifier);
+  pool->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  pool->jobs = g_ptr_array_new_with_free_func (commit_content_job_free);
+  pool->max_outstanding = modifier->n_jobs * 8;
+  g_mutex_init (&pool->lock);
+  g_cond_init (&pool->cond);
+
+  pool->threadpool = g_thread_pool_new (commit_content_pool_thread, pool,
+                                        (int)modifier->n_jobs, FALSE, error);
+  if (!pool->threadpool)
+    {
+      g_ptr_array_unref (pool->jobs);
+      g_clear_object (&pool->cancellable);
+      ostree_repo_commit_modifier_unref (pool->modifier);
+      g_object_unref (pool->repo);
+      g_mutex_clear (&pool->lock);
+      g_cond_clear (&pool->cond);
+      g_free (pool);
+      return NULL;
+    }
+
+  return pool;
+}
+
+static void
+commit_content_pool_free (CommitContentPool *pool)
+{
+  /* Waits for any queued jobs; after an error they return immediately */
+  g_thread_pool_free (pool->threadpool, FALSE, TRUE);
+  g_ptr_array_unref (pool->jobs);
+  g_clear_object (&pool->cancellable);
+  ostree_repo_commit_modifier_unref (pool->modifier);
+  g_object_unref (pool->repo);
+  g_clear_error (&pool->error);
+  g_mutex_clear (&pool->lock);
+  g_cond_clear (&pool->cond);
+  g_free (pool);
+}
+
+static gboolean
+commit_content_pool_push (CommitContentPool  *pool,
+                          OstreeMutableTree  *mtree,
+                          const char         *name,
+                          GFile              *file,
+                          GFileInfo          *file_info,
+                          GFileInfo          *stat_info,
+                          GError            **error)
+{
+  CommitContentJob *job;
+
+  g_mutex_lock (&pool->lock);
+  while (pool->n_outstanding >= pool->max_outstanding && pool->error == NULL)
+    g_cond_wait (&pool->cond, &pool->lock);
+  if (pool->error)
+    {
+      g_propagate_error (error, g_error_copy (pool->error));
+      g_mutex_unlock (&pool->lock);
+      return FALSE;
+    }
+  pool->n_outstanding++;
+  g_mutex_unlock (&pool->lock);
+
+  job = g_new0 (CommitContentJob, 1);
+  job->mtree = g_object_ref (mtree);
+  job->name = g_strdup (name);
+  job->file = g_object_ref (file);
+  job->file_info = g_object_ref (file_info);
+  job->stat_info = g_object_ref (stat_info);
+
+  g_ptr_array_add (pool->jobs, job);
+  g_thread_pool_push (pool->threadpool, job, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+commit_content_pool_finish (CommitContentPool  *pool,
+                            GError            **error)
+{
+  guint i;
+
+  g_mutex_lock (&pool->lock);
+  while (pool->n_outstanding > 0)
+    g_cond_wait (&pool->cond, &pool->lock);
+  g_mutex_unlock (&pool->lock);
+
+  if (pool->error)
+    {
+      g_propagate_error (error, g_error_copy (pool->error));
+      return FALSE;
+    }
+
+  for (i = 0; i < pool->jobs->len; i++)
+    {
+      CommitContentJob *job = pool->jobs->pdata[i];
+
+      if (!ostree_mutable_tree_replace_file (job->mtree, job->name, job->checksum,
+                                             error))
+        return FALSE;
+
+      if (pool->modifier->stat_cache)
+        _ostree_repo_stat_cache_add (pool->modifier->stat_cache,
+                                     gs_file_get_path_cached (job->file),
+                                     job->stat_info, job->file_info,
+                                     job->checksum);
+    }
+
+  return TRUE;
+}
+
 static gboolean
 write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
                                    OstreeMutableTree           *mtree,
                                    OstreeRepoCommitModifier    *modifier,
                                    GPtrArray                   *path,
+                                   CommitContentPool           *content_pool,
                                    GCancellable                *cancellable,
                                    GError                     **error)
 {
   gboolean ret = FALSE;
   OstreeRepoCommitFilterResult filter_result;
   OstreeRepoFile *repo_dir = NULL;
+  OstreeRepoStatCache *stat_cache = modifier ? modifier->stat_cache : NULL;
   gs_unref_object GFileEnumerator *dir_enum = NULL;
   gs_unref_object GFileInfo *child_info = NULL;
 
@@ -1740,7 +2505,11 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
 
   if (filter_result == OSTREE_REPO_COMMIT_FILTER_ALLOW)
     {
-      dir_enum = g_file_enumerate_children ((GFile*)dir, OSTREE_GIO_FAST_QUERYINFO,
+      /* The stat cache also needs timestamps, which come from the
+       * same lstat() */
+      dir_enum = g_file_enumerate_children ((GFile*)dir,
+                                            stat_cache ? OSTREE_GIO_FAST_QUERYINFO ",time::modified,time::modified-usec,time::changed,time::changed-usec"
+                                            : OSTREE_GIO_FAST_QUERYINFO,
                                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                             cancellable,
                                             error);
@@ -1775,7 +2544,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                     goto out;
 
                   if (!write_directory_to_mtree_internal (self, child, child_mtree,
-                                                          modifier, path,
+                                                          modifier, path, content_pool,
                                                           cancellable, error))
                     goto out;
                 }
@@ -1789,46 +2558,46 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                 }
               else
                 {
-                  guint64 file_obj_length;
-                  const char *loose_checksum;
-                  gs_unref_object GInputStream *file_input = NULL;
-                  gs_unref_variant GVariant *xattrs = NULL;
-                  gs_unref_object GInputStream *file_object_input = NULL;
+                  char loose_checksum[65];
+                  gboolean found = FALSE;
                   gs_free guchar *child_file_csum = NULL;
                   gs_free char *tmp_checksum = NULL;
 
                   g_debug ("Adding: %s", gs_file_get_path_cached (child));
-                  loose_checksum = devino_cache_lookup (self, child_info);
 
-                  if (loose_checksum)
+                  if (devino_cache_lookup (self, child_info, loose_checksum))
+                    found = TRUE;
+                  else if (stat_cache)
+                    {
+                      if (!_ostree_repo_stat_cache_lookup (stat_cache, self,
+                                                           gs_file_get_path_cached (child),
+                                                           child_info, modified_info,
+                                                           loose_checksum, &found,
+                                                           cancellable, error))
+                        goto out;
+                    }
+
+                  if (found)
                     {
                       if (!ostree_mutable_tree_replace_file (mtree, name, loose_checksum,
                                                              error))
                         goto out;
+                      if (stat_cache)
+                        _ostree_repo_stat_cache_add (stat_cache, gs_file_get_path_cached (child),
+                                                     child_info, modified_info, loose_checksum);
                     }
-                  else
+                  else if (content_pool)
                     {
-                     if (g_file_info_get_file_type (modified_info) == G_FILE_TYPE_REGULAR)
-                        {
-                          file_input = (GInputStream*)g_file_read (child, cancellable, error);
-                          if (!file_input)
-                            goto out;
-                        }
-
-                      if (!(modifier && (modifier->flags & OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS) > 0))
-                        {
-                          g_clear_pointer (&xattrs, (GDestroyNotify) g_variant_unref);
-                          if (!ostree_get_xattrs_for_file (child, &xattrs, cancellable, error))
-                            goto out;
-                        }
-
-                      if (!ostree_raw_file_to_content_stream (file_input,
-                                                              modified_info, xattrs,
-                                                              &file_object_input, &file_obj_length,
-                                                              cancellable, error))
+                      if (!commit_content_pool_push (content_pool, mtree, name,
+                                                     child, modified_info, child_info,
+                                                     error))
                         goto out;
-                      if (!ostree_repo_write_content (self, NULL, file_object_input, file_obj_length,
-                                                      &child_file_csum, cancellable, error))
+                    }
+                  else
+                    {
+                      if (!write_content_for_file (self, modifier, child, modified_info,
+                                                   &child_file_csum,
+                                                   cancellable, error))
                         goto out;
 
                       g_free (tmp_checksum);
@@ -1836,6 +2605,9 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                       if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
                                                              error))
                         goto out;
+                      if (stat_cache)
+                        _ostree_repo_stat_cache_add (stat_cache, gs_file_get_path_cached (child),
+                                                     child_info, modified_info, tmp_checksum);
                     }
                 }
 
@@ -1871,14 +2643,31 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
 {
   gboolean ret = FALSE;
   GPtrArray *path = NULL;
+  CommitContentPool *content_pool = NULL;
+
+  if (modifier && modifier->n_jobs > 1)
+    {
+      content_pool = commit_content_pool_new (self, modifier, cancellable, error);
+      if (!content_pool)
+        goto out;
+    }
 
   path = g_ptr_array_new ();
   if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, path,
+                                          content_pool,
                                           cancellable, error))
     goto out;
 
+  if (content_pool)
+    {
+      if (!commit_content_pool_finish (content_pool, error))
+        goto out;
+    }
+
   ret = TRUE;
  out:
+  if (content_pool)
+    commit_content_pool_free (content_pool);
   if (path)
     g_ptr_array_free (path, TRUE);
   return ret;
@@ -1999,6 +2788,92 @@ ostree_repo_commit_modifier_new (OstreeRepoCommitModifierFlags  flags,
   return modifier;
 }
 
+/**
+ * ostree_repo_commit_modifier_set_n_jobs:
+ * @modifier: Commit modifier
+ * @n_jobs: Number of worker threads
+ *
+ * If @n_jobs is greater than 1, ostree_repo_write_directory_to_mtree()
+ * will read, checksum and store file content using up to @n_jobs
+ * threads while the directory hierarchy is being walked.  The
+ * resulting tree is identical to a single-threaded commit.
+ *
+ * Note that a #OstreeRepoCommitFilter set on @modifier will still
+ * only be invoked from the thread calling
+ * ostree_repo_write_directory_to_mtree().
+ */
+void
+ostree_repo_commit_modifier_set_n_jobs (OstreeRepoCommitModifier *modifier,
+                                        guint                     n_jobs)
+{
+  modifier->n_jobs = n_jobs;
+}
+
+/**
+ * ostree_repo_commit_modifier_set_stat_cache:
+ * @modifier: Commit modifier
+ * @path: Path to the cache file
+ * @parent: (allow-none): Parent of the commit being made
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Use the stat cache stored in @path.  Regular files and symbolic
+ * links whose size, timestamps, inode and (filtered) ownership and
+ * mode match the cache are not read or checksummed by
+ * ostree_repo_write_directory_to_mtree(); their recorded checksum is
+ * used instead.  This makes recommitting a large, mostly unchanged
+ * tree much faster.
+ *
+ * The cache is only used if it was saved for @parent, with the same
+ * modifier flags.  After the new commit is written, call
+ * ostree_repo_commit_modifier_save_stat_cache().
+ *
+ * Note the cache cannot see changes made by a #OstreeRepoCommitFilter
+ * other than to ownership and mode, so the filter should not depend
+ * on anything else that changes between commits.
+ */
+gboolean
+ostree_repo_commit_modifier_set_stat_cache (OstreeRepoCommitModifier *modifier,
+                                            GFile                    *path,
+                                            const char               *parent,
+                                            GCancellable             *cancellable,
+                                            GError                  **error)
+{
+  OstreeRepoStatCache *cache;
+
+  cache = _ostree_repo_stat_cache_new (path, parent, modifier->flags,
+                                       cancellable, error);
+  if (!cache)
+    return FALSE;
+
+  _ostree_repo_stat_cache_free (modifier->stat_cache);
+  modifier->stat_cache = cache;
+  return TRUE;
+}
+
+/**
+ * ostree_repo_commit_modifier_save_stat_cache:
+ * @modifier: Commit modifier
+ * @commit: Checksum of the commit made using @modifier
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write out the stat cache set up by
+ * ostree_repo_commit_modifier_set_stat_cache(), recording the files
+ * which were committed as @commit.
+ */
+gboolean
+ostree_repo_commit_modifier_save_stat_cache (OstreeRepoCommitModifier *modifier,
+                                             const char               *commit,
+                                             GCancellable             *cancellable,
+                                             GError                  **error)
+{
+  g_return_val_if_fail (modifier->stat_cache != NULL, FALSE);
+
+  return _ostree_repo_stat_cache_save (modifier->stat_cache, commit,
+                                       cancellable, error);
+}
+
 OstreeRepoCommitModifier *
 ostree_repo_commit_modifier_ref (OstreeRepoCommitModifier *modifier)
 {
@@ -2017,6 +2892,7 @@ ostree_repo_commit_modifier_unref (OstreeRepoCommitModifier *modifier)
   if (modifier->destroy_notify)
     modifier->destroy_notify (modifier->user_data);
 
+  _ostree_repo_stat_cache_free (modifier->stat_cache);
   g_free (modifier);
   return;
 }
@@ -0,0 +1,926 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * The devino index maps the (device, inode) pair of each uncompressed
+ * content object to its checksum.  It lets
+ * ostree_repo_write_directory_to_mtree() skip checksumming files
+ * which are hardlinks into the repository, such as a checkout made
+ * with hardlinks that is being committed again.
+ *
+ * It lives in the file "devino-index" in the repository directory:
+ *
+ *   8 bytes  magic "OSTDVI01"
+ *   guint64  number of sorted entries (little endian)
+ *   entries  OstreeDevinoIndexEntry, sorted by (device, inode)
+ *   records  OstreeDevinoIndexEntry, appended since, in order
+ *
+ * Each transaction appends the objects it added, and tombstones for
+ * the ones it removed, so keeping the index current costs as much as
+ * the change rather than the size of the repository.  A tombstone has
+ * OSTREE_DEVINO_INDEX_REMOVED set in its device field.  Once there
+ * are enough appended records, they are merged into a new sorted
+ * index.  Writers hold an exclusive flock() on the file while
+ * appending or merging, so concurrent transactions don't lose each
+ * other's records.
+ *
+ * The index is a cache, never a source of truth.  A lookup hit is
+ * only accepted after stat()ing the loose object and checking that
+ * its device and inode still match, so stale entries (for example
+ * objects deleted by an older OSTree, or a repository copied to
+ * another filesystem) only cost a failed lookup.  A truncated or
+ * otherwise malformed file is discarded and rebuilt.
+ *
+ * The device number is stored truncated to 32 bits, because that is
+ * what GIO exposes as "unix::device".
+ */
+
+#define OSTREE_DEVINO_INDEX_MAGIC "OSTDVI01"
+#define OSTREE_DEVINO_INDEX_HEADER_SIZE 16
+#define OSTREE_DEVINO_INDEX_REMOVED (G_GUINT64_CONSTANT (1) << 63)
+
+/* Merge appended records once there are more than this, or than a
+ * quarter of the sorted entries, whichever is larger.
+ */
+#define OSTREE_DEVINO_INDEX_MIN_MERGE 1024
+
+typedef struct {
+  guint64 dev;
+  guint64 ino;
+  guint8 csum[32];
+} OstreeDevinoIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeDevinoIndexEntry) == 48);
+
+static int
+compare_devino (guint64 a_dev,
+                guint64 a_ino,
+                guint64 b_dev,
+                guint64 b_ino)
+{
+  if (a_dev < b_dev)
+    return -1;
+  else if (a_dev > b_dev)
+    return 1;
+  else if (a_ino < b_ino)
+    return -1;
+  else if (a_ino > b_ino)
+    return 1;
+  return 0;
+}
+
+static int
+devino_index_entry_compare (gconstpointer a,
+                            gconstpointer b)
+{
+  const OstreeDevinoIndexEntry *entry_a = a;
+  const OstreeDevinoIndexEntry *entry_b = b;
+
+  return compare_devino (GUINT64_FROM_LE (entry_a->dev), GUINT64_FROM_LE (entry_a->ino),
+                         GUINT64_FROM_LE (entry_b->dev), GUINT64_FROM_LE (entry_b->ino));
+}
+
+static void
+devino_index_entry_init (OstreeDevinoIndexEntry *entry,
+                         guint32                 dev,
+                         guint64                 ino,
+                         const char             *checksum)
+{
+  entry->dev = GUINT64_TO_LE ((guint64) dev);
+  entry->ino = GUINT64_TO_LE (ino);
+  ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+}
+
+static const OstreeDevinoIndexEntry *
+devino_index_bsearch (const OstreeDevinoIndexEntry *entries,
+                      gsize                         n_entries,
+                      guint64                       dev,
+                      guint64                       ino)
+{
+  gsize lo = 0;
+  gsize hi = n_entries;
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      const OstreeDevinoIndexEntry *entry = &entries[mid];
+      int c = compare_devino (GUINT64_FROM_LE (entry->dev), GUINT64_FROM_LE (entry->ino),
+                              dev, ino);
+
+      if (c < 0)
+        lo = mid + 1;
+      else if (c > 0)
+        hi = mid;
+      else
+        return entry;
+    }
+
+  return NULL;
+}
+
+/* Uncompressed content objects live in objects/ for bare repositories,
+ * and in the uncompressed object cache for archive-z2.
+ */
+static int
+devino_index_content_dfd (OstreeRepo *self)
+{
+  if (self->mode == OSTREE_REPO_MODE_BARE)
+    return self->objects_dir_fd;
+  return self->uncompressed_objects_dir_fd;
+}
+
+/* Sets @out_sorted to the sorted entries of the on-disk index and
+ * @out_appended to the records appended since, or both to %NULL if
+ * there is no (valid) index.
+ */
+static gboolean
+devino_index_read (OstreeRepo     *self,
+                   GBytes        **out_sorted,
+                   GBytes        **out_appended,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  GMappedFile *mfile = NULL;
+  GError *temp_error = NULL;
+  gs_unref_bytes GBytes *contents = NULL;
+  GBytes *ret_sorted = NULL;
+  GBytes *ret_appended = NULL;
+  const guint8 *data;
+  gsize len;
+  guint64 n_sorted;
+  guint64 n_records;
+
+  mfile = g_mapped_file_new (gs_file_get_path_cached (self->devino_index_path),
+                             FALSE, &temp_error);
+  if (!mfile)
+    {
+      if (g_error_matches (temp_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&temp_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  contents = g_mapped_file_get_bytes (mfile);
+  data = g_bytes_get_data (contents, &len);
+
+  if (len < OSTREE_DEVINO_INDEX_HEADER_SIZE
+      || memcmp (data, OSTREE_DEVINO_INDEX_MAGIC, 8) != 0)
+    {
+      g_debug ("Ignoring invalid devino index");
+      ret = TRUE;
+      goto out;
+    }
+
+  /* A torn append leaves a partial record at the end */
+  memcpy (&n_sorted, data + 8, sizeof (n_sorted));
+  n_sorted = GUINT64_FROM_LE (n_sorted);
+  n_records = (len - OSTREE_DEVINO_INDEX_HEADER_SIZE) / sizeof (OstreeDevinoIndexEntry);
+  if ((len - OSTREE_DEVINO_INDEX_HEADER_SIZE) % sizeof (OstreeDevinoIndexEntry) != 0
+      || n_sorted > n_records)
+    {
+      g_debug ("Ignoring truncated devino index");
+      ret = TRUE;
+      goto out;
+    }
+
+  ret_sorted = g_bytes_new_from_bytes (contents, OSTREE_DEVINO_INDEX_HEADER_SIZE,
+                                       n_sorted * sizeof (OstreeDevinoIndexEntry));
+  ret_appended = g_bytes_new_from_bytes (contents,
+                                         OSTREE_DEVINO_INDEX_HEADER_SIZE
+                                         + n_sorted * sizeof (OstreeDevinoIndexEntry),
+                                         (n_records - n_sorted) * sizeof (OstreeDevinoIndexEntry));
+
+  ret = TRUE;
+  ot_transfer_out_value (out_sorted, &ret_sorted);
+  ot_transfer_out_value (out_appended, &ret_appended);
+ out:
+  if (ret_sorted)
+    g_bytes_unref (ret_sorted);
+  if (ret_appended)
+    g_bytes_unref (ret_appended);
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  return ret;
+}
+
+/* The index is only a cache, so it isn't fsync()ed; a torn write is
+ * caught by the size check in devino_index_read().  Writers must hold
+ * the lock from devino_index_lock(), if there is an index to lock.
+ */
+static gboolean
+devino_index_write (OstreeRepo     *self,
+                    GArray         *entries,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *temp_filename = NULL;
+  gs_unref_object GOutputStream *temp_out = NULL;
+  guint64 n_entries_le = GUINT64_TO_LE ((guint64) entries->len);
+  gsize bytes_written;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                  &temp_filename, &temp_out,
+                                  cancellable, error))
+    goto out;
+
+  if (!g_output_stream_write_all (temp_out, OSTREE_DEVINO_INDEX_MAGIC, 8,
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (temp_out, &n_entries_le, sizeof (n_entries_le),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (entries->len > 0
+      && !g_output_stream_write_all (temp_out, entries->data,
+                                     entries->len * sizeof (OstreeDevinoIndexEntry),
+                                     &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (temp_out, cancellable, error))
+    goto out;
+
+  if (renameat (self->tmp_dir_fd, temp_filename,
+                AT_FDCWD, gs_file_get_path_cached (self->devino_index_path)) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&temp_filename, g_free);
+
+  ret = TRUE;
+ out:
+  if (temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
+  return ret;
+}
+
+/* Open the on-disk index for appending, and take an exclusive lock on
+ * it; @out_fd is set to -1 if there is no index.  Another writer may
+ * replace the file while we wait for the lock, so make sure the one
+ * we locked is still current.
+ */
+static gboolean
+devino_index_lock (OstreeRepo     *self,
+                   int            *out_fd,
+                   GError        **error)
+{
+  const char *path = gs_file_get_path_cached (self->devino_index_path);
+  int fd;
+
+  while (TRUE)
+    {
+      struct stat fd_stbuf;
+      struct stat path_stbuf;
+      int res;
+
+      fd = open (path, O_RDWR | O_APPEND | O_CLOEXEC);
+      if (fd == -1)
+        {
+          if (errno != ENOENT)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              return FALSE;
+            }
+          break;
+        }
+
+      do
+        res = flock (fd, LOCK_EX);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (res == -1 || fstat (fd, &fd_stbuf) == -1)
+        {
+          int errsv = errno;
+          (void) close (fd);
+          ot_util_set_error_from_errno (error, errsv);
+          return FALSE;
+        }
+
+      if (stat (path, &path_stbuf) == 0
+          && path_stbuf.st_dev == fd_stbuf.st_dev
+          && path_stbuf.st_ino == fd_stbuf.st_ino)
+        break;
+
+      (void) close (fd);
+    }
+
+  *out_fd = fd;
+  return TRUE;
+}
+
+typedef struct {
+  OstreeDevinoIndexEntry entry;
+  gsize seq;
+} OstreeDevinoIndexMergeItem;
+
+static int
+devino_index_merge_item_compare (gconstpointer a,
+                                 gconstpointer b)
+{
+  const OstreeDevinoIndexMergeItem *item_a = a;
+  const OstreeDevinoIndexMergeItem *item_b = b;
+  int c = devino_index_entry_compare (&item_a->entry, &item_b->entry);
+
+  if (c != 0)
+    return c;
+  /* Newest first */
+  if (item_a->seq > item_b->seq)
+    return -1;
+  else if (item_a->seq < item_b->seq)
+    return 1;
+  return 0;
+}
+
+/*
+ * Apply the appended @records, in order, to the sorted entries in
+ * @sorted, and return the resulting sorted entries.  A record for a
+ * (device, inode) pair replaces any earlier one, since a new object
+ * may have reused the inode of a deleted one, and a tombstone drops
+ * the earlier entries for its checksum.
+ */
+static GArray *
+devino_index_merge (const OstreeDevinoIndexEntry  *sorted,
+                    gsize                          n_sorted,
+                    const OstreeDevinoIndexEntry  *records,
+                    gsize                          n_records)
+{
+  GArray *items;
+  GArray *merged;
+  GHashTable *removed = NULL; /* Maps checksum to position of its last tombstone + 1 */
+  gsize i;
+
+  for (i = 0; i < n_records; i++)
+    {
+      char checksum[65];
+
+      if (!(GUINT64_FROM_LE (records[i].dev) & OSTREE_DEVINO_INDEX_REMOVED))
+        continue;
+
+      if (!removed)
+        removed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      ostree_checksum_inplace_from_bytes (records[i].csum, checksum);
+      g_hash_table_replace (removed, g_strdup (checksum),
+                            GSIZE_TO_POINTER (n_sorted + i + 1));
+    }
+
+  items = g_array_sized_new (FALSE, FALSE, sizeof (OstreeDevinoIndexMergeItem),
+                             n_sorted + n_records);
+  for (i = 0; i < n_sorted + n_records; i++)
+    {
+      const OstreeDevinoIndexEntry *entry = i < n_sorted ? &sorted[i] : &records[i - n_sorted];
+      OstreeDevinoIndexMergeItem item;
+
+      if (GUINT64_FROM_LE (entry->dev) & OSTREE_DEVINO_INDEX_REMOVED)
+        continue;
+
+      if (removed)
+        {
+          char checksum[65];
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+          if (GPOINTER_TO_SIZE (g_hash_table_lookup (removed, checksum)) > i + 1)
+            continue;
+        }
+
+      item.entry = *entry;
+      item.seq = i;
+      g_array_append_val (items, item);
+    }
+
+  g_array_sort (items, devino_index_merge_item_compare);
+
+  merged = g_array_sized_new (FALSE, FALSE, sizeof (OstreeDevinoIndexEntry), items->len);
+  for (i = 0; i < items->len; i++)
+    {
+      OstreeDevinoIndexMergeItem *item = &g_array_index (items, OstreeDevinoIndexMergeItem, i);
+
+      if (i > 0 && devino_index_entry_compare (&item->entry,
+                                               &g_array_index (items, OstreeDevinoIndexMergeItem, i - 1).entry) == 0)
+        continue;
+      g_array_append_val (merged, item->entry);
+    }
+
+  g_array_unref (items);
+  if (removed)
+    g_hash_table_unref (removed);
+  return merged;
+}
+
+/* Use the index read by devino_index_read() for lookups */
+static void
+devino_index_set (OstreeRepo     *self,
+                  GBytes         *sorted,
+                  GBytes         *appended)
+{
+  g_clear_pointer (&self->devino_index, g_bytes_unref);
+  g_clear_pointer (&self->devino_index_appended, g_bytes_unref);
+
+  if (!sorted)
+    return;
+
+  self->devino_index = g_bytes_ref (sorted);
+  if (appended && g_bytes_get_size (appended) > 0)
+    {
+      gsize len;
+      const OstreeDevinoIndexEntry *records = g_bytes_get_data (appended, &len);
+      GArray *entries = devino_index_merge (NULL, 0, records,
+                                            len / sizeof (OstreeDevinoIndexEntry));
+
+      self->devino_index_appended = g_bytes_new (entries->data,
+                                                 entries->len * sizeof (OstreeDevinoIndexEntry));
+      g_array_unref (entries);
+    }
+}
+
+static gboolean
+scan_content_objects (OstreeRepo     *self,
+                      GArray         *entries,
+                      GCancellable   *cancellable,
+                      GError        **error)
+{
+  gboolean ret = FALSE;
+  int dfd = devino_index_content_dfd (self);
+  guint c;
+
+  for (c = 0; c < 256; c++)
+    {
+      char subdir[3];
+      char checksum[65];
+      int subdir_fd;
+      DIR *d;
+      struct dirent *dent;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      g_snprintf (subdir, sizeof (subdir), "%02x", c);
+      subdir_fd = openat (dfd, subdir, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+      if (subdir_fd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      d = fdopendir (subdir_fd);
+      if (!d)
+        {
+          int errsv = errno;
+          (void) close (subdir_fd);
+          ot_util_set_error_from_errno (error, errsv);
+          goto out;
+        }
+
+      memcpy (checksum, subdir, 2);
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          const char *name = dent->d_name;
+          OstreeDevinoIndexEntry entry;
+          struct stat stbuf;
+
+          if (strlen (name) != 62 + strlen (".file")
+              || strcmp (name + 62, ".file") != 0)
+            continue;
+
+          memcpy (checksum + 2, name, 62);
+          checksum[64] = '\0';
+          if (!ostree_validate_checksum_string (checksum, NULL))
+            continue;
+
+          if (fstatat (dirfd (d), name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+              int errsv = errno;
+              if (errsv == ENOENT)
+                continue;
+              (void) closedir (d);
+              ot_util_set_error_from_errno (error, errsv);
+              goto out;
+            }
+
+          devino_index_entry_init (&entry, (guint32) stbuf.st_dev, stbuf.st_ino, checksum);
+          g_array_append_val (entries, entry);
+        }
+
+      (void) closedir (d);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_devino_index_load:
+ * @self: Repo
+ * @out_loaded: (out): Whether a valid index was found
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Map the on-disk devino index of @self (not its parents), if there
+ * is a valid one.
+ */
+gboolean
+_ostree_repo_devino_index_load (OstreeRepo     *self,
+                                gboolean       *out_loaded,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_bytes GBytes *sorted = NULL;
+  gs_unref_bytes GBytes *appended = NULL;
+
+  if (!devino_index_read (self, &sorted, &appended, error))
+    goto out;
+
+  devino_index_set (self, sorted, appended);
+  if (sorted)
+    self->devino_index_track = TRUE;
+
+  ret = TRUE;
+  *out_loaded = sorted != NULL;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_devino_index_rebuild:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Scan all uncompressed content objects of @self, and write out a
+ * fresh index.  If the index can't be written (for example on a
+ * read-only repository), the scan results are still used in memory.
+ */
+gboolean
+_ostree_repo_devino_index_rebuild (OstreeRepo     *self,
+                                   GCancellable   *cancellable,
+                                   GError        **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  GArray *entries = NULL;
+  gs_unref_bytes GBytes *sorted = NULL;
+  int fd = -1;
+
+  entries = g_array_new (FALSE, FALSE, sizeof (OstreeDevinoIndexEntry));
+
+  if (!scan_content_objects (self, entries, cancellable, error))
+    goto out;
+
+  g_array_sort (entries, devino_index_entry_compare);
+
+  /* Replacing an invalid index; lock it so concurrent appends to it
+   * don't go to the old file.
+   */
+  if (devino_index_lock (self, &fd, &temp_error)
+      && devino_index_write (self, entries, cancellable, &temp_error))
+    self->devino_index_track = TRUE;
+  else
+    {
+      g_debug ("Failed to write devino index: %s", temp_error->message);
+      g_clear_error (&temp_error);
+    }
+
+  sorted = g_bytes_new (entries->data,
+                        entries->len * sizeof (OstreeDevinoIndexEntry));
+  devino_index_set (self, sorted, NULL);
+
+  ret = TRUE;
+ out:
+  if (fd != -1)
+    (void) close (fd);
+  g_array_unref (entries);
+  return ret;
+}
+
+/**
+ * _ostree_repo_devino_index_unload:
+ * @self: Repo
+ *
+ * Drop the mapped index of @self and all of its parents; lookups
+ * will fail until ostree_repo_scan_hardlinks() is called again.
+ */
+void
+_ostree_repo_devino_index_unload (OstreeRepo *self)
+{
+  OstreeRepo *repo;
+
+  for (repo = self; repo; repo = repo->parent_repo)
+    devino_index_set (repo, NULL, NULL);
+}
+
+/* Check that @entry, found for @dev and @ino, still names a content
+ * object of @repo.
+ */
+static gboolean
+devino_index_entry_verify (OstreeRepo                    *repo,
+                           const OstreeDevinoIndexEntry  *entry,
+                           guint32                        dev,
+                           guint64                        ino,
+                           char                          *out_checksum)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  struct stat stbuf;
+  gboolean have_object;
+
+  ostree_checksum_inplace_from_bytes (entry->csum, out_checksum);
+  _ostree_loose_path (loose_path, out_checksum, OSTREE_OBJECT_TYPE_FILE,
+                      OSTREE_REPO_MODE_BARE);
+  if (fstatat (devino_index_content_dfd (repo), loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0
+      || (guint32) stbuf.st_dev != dev
+      || (guint64) stbuf.st_ino != ino)
+    return FALSE;
+
+  /* In archive-z2 mode the file is in the uncompressed object cache,
+   * which isn't cleaned up when the object itself is pruned.
+   */
+  if (repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      if (!_ostree_repo_find_object (repo, OSTREE_OBJECT_TYPE_FILE, out_checksum,
+                                     &have_object, NULL, NULL, NULL))
+        return FALSE;
+      return have_object;
+    }
+
+  return TRUE;
+}
+
+/**
+ * _ostree_repo_devino_index_lookup:
+ * @self: Repo
+ * @dev: Device number, as in "unix::device"
+ * @ino: Inode number
+ * @out_checksum: (out): Buffer of at least 65 bytes for the checksum
+ *
+ * Returns: %TRUE if @dev and @ino are a loose content object of @self
+ * or one of its parents
+ */
+gboolean
+_ostree_repo_devino_index_lookup (OstreeRepo     *self,
+                                  guint32         dev,
+                                  guint64         ino,
+                                  char           *out_checksum)
+{
+  OstreeRepo *repo;
+
+  for (repo = self; repo; repo = repo->parent_repo)
+    {
+      GBytes *indexes[2];
+      guint i;
+
+      /* Appended entries are newer, so try them first */
+      indexes[0] = repo->devino_index_appended;
+      indexes[1] = repo->devino_index;
+
+      for (i = 0; i < G_N_ELEMENTS (indexes); i++)
+        {
+          const OstreeDevinoIndexEntry *entries;
+          const OstreeDevinoIndexEntry *entry;
+          gsize len;
+
+          if (!indexes[i])
+            continue;
+
+          entries = g_bytes_get_data (indexes[i], &len);
+          entry = devino_index_bsearch (entries, len / sizeof (OstreeDevinoIndexEntry),
+                                        dev, ino);
+          if (entry && devino_index_entry_verify (repo, entry, dev, ino, out_checksum))
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/**
+ * _ostree_repo_devino_index_note_added:
+ * @self: Repo
+ * @dfd: Directory fd @loose_path is relative to
+ * @loose_path: Path of a newly stored uncompressed content object
+ * @checksum: Checksum of the object
+ *
+ * Queue an index entry for @checksum; it is written out by
+ * _ostree_repo_devino_index_flush().  This function is thread-safe.
+ */
+void
+_ostree_repo_devino_index_note_added (OstreeRepo     *self,
+                                      int             dfd,
+                                      const char     *loose_path,
+                                      const char     *checksum)
+{
+  OstreeDevinoIndexEntry entry;
+  struct stat stbuf;
+
+  if (!self->devino_index_track)
+    return;
+
+  if (fstatat (dfd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    return;
+
+  devino_index_entry_init (&entry, (guint32) stbuf.st_dev, stbuf.st_ino, checksum);
+
+  g_mutex_lock (&self->cache_lock);
+  if (!self->devino_index_added)
+    self->devino_index_added = g_array_new (FALSE, FALSE, sizeof (OstreeDevinoIndexEntry));
+  g_array_append_val (self->devino_index_added, entry);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+/**
+ * _ostree_repo_devino_index_note_removed:
+ * @self: Repo
+ * @checksum: Checksum of a deleted uncompressed content object
+ *
+ * Queue removal of the index entry for @checksum.  This function
+ * is thread-safe.
+ */
+void
+_ostree_repo_devino_index_note_removed (OstreeRepo     *self,
+                                        const char     *checksum)
+{
+  if (!self->devino_index_track)
+    return;
+
+  g_mutex_lock (&self->cache_lock);
+  if (!self->devino_index_removed)
+    self->devino_index_removed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, NULL);
+  g_hash_table_add (self->devino_index_removed, g_strdup (checksum));
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static gboolean
+devino_index_append (int             fd,
+                     GArray         *records,
+                     GError        **error)
+{
+  const guint8 *buf = (const guint8 *) records->data;
+  gsize remaining = records->len * sizeof (OstreeDevinoIndexEntry);
+
+  while (remaining > 0)
+    {
+      gssize bytes_written = write (fd, buf, remaining);
+      if (bytes_written == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+      buf += bytes_written;
+      remaining -= bytes_written;
+    }
+
+  return TRUE;
+}
+
+/**
+ * _ostree_repo_devino_index_flush:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Append queued additions and removals to the on-disk index, merging
+ * the appended records into the sorted entries once there are enough
+ * of them.  If there is no index on disk, the queue is dropped; a
+ * partial index would make lookups miss objects for no good reason,
+ * so we wait for ostree_repo_scan_hardlinks() to build a complete one.
+ */
+gboolean
+_ostree_repo_devino_index_flush (OstreeRepo     *self,
+                                 GCancellable   *cancellable,
+                                 GError        **error)
+{
+  gboolean ret = FALSE;
+  GArray *added;
+  GHashTable *removed;
+  GArray *records = NULL;
+  GArray *merged = NULL;
+  gs_unref_bytes GBytes *sorted = NULL;
+  gs_unref_bytes GBytes *appended = NULL;
+  gsize n_sorted;
+  gsize n_appended;
+  int fd = -1;
+
+  g_mutex_lock (&self->cache_lock);
+  added = self->devino_index_added;
+  self->devino_index_added = NULL;
+  removed = self->devino_index_removed;
+  self->devino_index_removed = NULL;
+  g_mutex_unlock (&self->cache_lock);
+
+  if (!added && !removed)
+    return TRUE;
+
+  if (!devino_index_lock (self, &fd, error))
+    goto out;
+  if (fd == -1)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!devino_index_read (self, &sorted, &appended, error))
+    goto out;
+  if (!sorted)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  /* Tombstones go first, so an object removed and added again in the
+   * same transaction stays.
+   */
+  records = g_array_new (FALSE, FALSE, sizeof (OstreeDevinoIndexEntry));
+  if (removed)
+    {
+      GHashTableIter hash_iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&hash_iter, removed);
+      while (g_hash_table_iter_next (&hash_iter, &key, NULL))
+        {
+          OstreeDevinoIndexEntry entry;
+
+          devino_index_entry_init (&entry, 0, 0, key);
+          entry.dev = GUINT64_TO_LE (OSTREE_DEVINO_INDEX_REMOVED);
+          g_array_append_val (records, entry);
+        }
+    }
+  if (added)
+    g_array_append_vals (records, added->data, added->len);
+
+  n_sorted = g_bytes_get_size (sorted) / sizeof (OstreeDevinoIndexEntry);
+  n_appended = g_bytes_get_size (appended) / sizeof (OstreeDevinoIndexEntry);
+
+  if (n_appended + records->len > MAX (OSTREE_DEVINO_INDEX_MIN_MERGE, n_sorted / 4))
+    {
+      g_array_prepend_vals (records, g_bytes_get_data (appended, NULL), n_appended);
+      merged = devino_index_merge (g_bytes_get_data (sorted, NULL), n_sorted,
+                                   (OstreeDevinoIndexEntry*) records->data, records->len);
+      if (!devino_index_write (self, merged, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!devino_index_append (fd, records, error))
+        goto out;
+    }
+
+  if (self->devino_index)
+    {
+      g_clear_pointer (&sorted, g_bytes_unref);
+      g_clear_pointer (&appended, g_bytes_unref);
+      if (!devino_index_read (self, &sorted, &appended, error))
+        goto out;
+      devino_index_set (self, sorted, appended);
+    }
+
+  ret = TRUE;
+ out:
+  if (fd != -1)
+    (void) close (fd);
+  if (added)
+    g_array_unref (added);
+  if (removed)
+    g_hash_table_unref (removed);
+  if (records)
+    g_array_unref (records);
+  if (merged)
+    g_array_unref (merged);
+  return ret;
+}
@@ -0,0 +1,396 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * The object filter answers "might this loose object exist?" from
+ * memory, so that looking up objects we don't have, which is most
+ * lookups during a pull into a large repository, doesn't cost an
+ * fstatat() each.
+ *
+ * It only exists during a transaction.  For each of the 256 object
+ * subdirectories, the first lookup reads the directory into a sorted
+ * array of (binary checksum, type) entries; objects written or
+ * deleted by this process afterwards are recorded in a separate
+ * table, which takes precedence.  A "maybe" answer is always
+ * confirmed by the caller with fstatat(), so stale entries only cost
+ * what a lookup used to.  A "no" is trusted, which means objects
+ * written concurrently by another process may be written again;
+ * since object writes are idempotent, that only costs time.
+ */
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+} OstreeObjectFilterEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeObjectFilterEntry) == 33);
+
+enum {
+  OBJECT_FILTER_ADDED = 1,
+  OBJECT_FILTER_REMOVED = 2
+};
+
+struct OstreeRepoObjectFilter {
+  GMutex lock;
+  /* Sorted OstreeObjectFilterEntry, indexed by first checksum byte;
+   * NULL until loaded.
+   */
+  GArray *buckets[256];
+  /* Entry -> OBJECT_FILTER_ADDED or OBJECT_FILTER_REMOVED */
+  GHashTable *changes;
+};
+
+static guint
+object_filter_entry_hash (gconstpointer v)
+{
+  const OstreeObjectFilterEntry *entry = v;
+  guint32 h;
+
+  memcpy (&h, entry->csum, sizeof (h));
+  return h ^ entry->objtype;
+}
+
+static gboolean
+object_filter_entry_equal (gconstpointer a,
+                           gconstpointer b)
+{
+  return memcmp (a, b, sizeof (OstreeObjectFilterEntry)) == 0;
+}
+
+static int
+object_filter_entry_compare (gconstpointer a,
+                             gconstpointer b)
+{
+  return memcmp (a, b, sizeof (OstreeObjectFilterEntry));
+}
+
+static void
+object_filter_entry_init (OstreeObjectFilterEntry *entry,
+                          const char              *checksum,
+                          OstreeObjectType         objtype)
+{
+  ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+  entry->objtype = (guint8) objtype;
+}
+
+static void
+object_filter_free (OstreeRepoObjectFilter *filter)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (filter->buckets); i++)
+    {
+      if (filter->buckets[i])
+        g_array_unref (filter->buckets[i]);
+    }
+  g_hash_table_unref (filter->changes);
+  g_mutex_clear (&filter->lock);
+  g_free (filter);
+}
+
+/* Map the extension of a loose object file name to its type; see
+ * _ostree_loose_path().
+ */
+static gboolean
+loose_extension_to_objtype (const char        *ext,
+                            OstreeRepoMode     mode,
+                            OstreeObjectType  *out_objtype)
+{
+  OstreeObjectType objtype;
+
+  for (objtype = OSTREE_OBJECT_TYPE_FILE; objtype <= OSTREE_OBJECT_TYPE_LAST; objtype++)
+    {
+      const char *name = ostree_object_type_to_string (objtype);
+      gsize len = strlen (name);
+
+      if (strncmp (ext, name, len) != 0)
+        continue;
+      ext += len;
+      if (!OSTREE_OBJECT_TYPE_IS_META (objtype) && mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+        {
+          if (*ext != 'z')
+            return FALSE;
+          ext++;
+        }
+      if (*ext != '\0')
+        return FALSE;
+      *out_objtype = objtype;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+read_bucket (OstreeRepo     *self,
+             guint           bucket,
+             GArray        **out_entries,
+             GCancellable   *cancellable,
+             GError        **error)
+{
+  gboolean ret = FALSE;
+  char subdir[3];
+  char checksum[65];
+  int dfd;
+  DIR *d = NULL;
+  struct dirent *dent;
+  GArray *ret_entries = NULL;
+
+  ret_entries = g_array_new (FALSE, FALSE, sizeof (OstreeObjectFilterEntry));
+
+  g_snprintf (subdir, sizeof (subdir), "%02x", bucket);
+  dfd = openat (self->objects_dir_fd, subdir, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      goto done;
+    }
+
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      int errsv = errno;
+      (void) close (dfd);
+      ot_util_set_error_from_errno (error, errsv);
+      goto out;
+    }
+
+  memcpy (checksum, subdir, 2);
+  checksum[64] = '\0';
+
+  while ((dent = readdir (d)) != NULL)
+    {
+      const char *name = dent->d_name;
+      OstreeObjectType objtype;
+      OstreeObjectFilterEntry entry;
+
+      if (strlen (name) < 64 || name[62] != '.')
+        continue;
+
+      memcpy (checksum + 2, name, 62);
+      if (!ostree_validate_checksum_string (checksum, NULL))
+        continue;
+      if (!loose_extension_to_objtype (name + 63, self->mode, &objtype))
+        continue;
+
+      object_filter_entry_init (&entry, checksum, objtype);
+      g_array_append_val (ret_entries, entry);
+    }
+
+  g_array_sort (ret_entries, object_filter_entry_compare);
+
+ done:
+  ret = TRUE;
+  ot_transfer_out_value (out_entries, &ret_entries);
+ out:
+  if (d)
+    (void) closedir (d);
+  if (ret_entries)
+    g_array_unref (ret_entries);
+  return ret;
+}
+
+/**
+ * _ostree_repo_object_filter_enable:
+ * @self: Repo
+ *
+ * Start answering loose object lookups in @self and its parents from
+ * memory; called when a transaction starts.
+ */
+void
+_ostree_repo_object_filter_enable (OstreeRepo *self)
+{
+  OstreeRepo *repo;
+
+  for (repo = self; repo; repo = repo->parent_repo)
+    {
+      OstreeRepoObjectFilter *filter;
+
+      if (repo->object_filter)
+        continue;
+
+      filter = g_new0 (OstreeRepoObjectFilter, 1);
+      g_mutex_init (&filter->lock);
+      filter->changes = g_hash_table_new_full (object_filter_entry_hash,
+                                               object_filter_entry_equal,
+                                               g_free, NULL);
+      repo->object_filter = filter;
+    }
+}
+
+/**
+ * _ostree_repo_object_filter_disable:
+ * @self: Repo
+ *
+ * Drop the filters of @self and its parents; lookups go to the
+ * filesystem again.
+ */
+void
+_ostree_repo_object_filter_disable (OstreeRepo *self)
+{
+  OstreeRepo *repo;
+
+  for (repo = self; repo; repo = repo->parent_repo)
+    g_clear_pointer (&repo->object_filter, object_filter_free);
+}
+
+/**
+ * _ostree_repo_object_filter_lookup:
+ * @self: Repo
+ * @checksum: ASCII checksum
+ * @objtype: Object type
+ * @out_maybe_stored: (out): %FALSE if @self (not its parents) definitely has no loose object @checksum
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * If there is no filter, @out_maybe_stored is always %TRUE.  This
+ * function is thread-safe.
+ */
+gboolean
+_ostree_repo_object_filter_lookup (OstreeRepo         *self,
+                                   const char         *checksum,
+                                   OstreeObjectType    objtype,
+                                   gboolean           *out_maybe_stored,
+                                   GCancellable       *cancellable,
+                                   GError            **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoObjectFilter *filter = self->object_filter;
+  OstreeObjectFilterEntry entry;
+  GArray *bucket;
+  gpointer change;
+
+  if (!filter)
+    {
+      *out_maybe_stored = TRUE;
+      return TRUE;
+    }
+
+  object_filter_entry_init (&entry, checksum, objtype);
+
+  g_mutex_lock (&filter->lock);
+  bucket = filter->buckets[entry.csum[0]];
+  g_mutex_unlock (&filter->lock);
+
+  /* Read the directory without holding the lock; if another thread
+   * beat us to it, use theirs.  Changes made meanwhile are in the
+   * changes table, so it doesn't matter which listing we keep.
+   */
+  if (!bucket)
+    {
+      GArray *entries = NULL;
+
+      if (!read_bucket (self, entry.csum[0], &entries, cancellable, error))
+        goto out;
+
+      g_mutex_lock (&filter->lock);
+      if (filter->buckets[entry.csum[0]] == NULL)
+        filter->buckets[entry.csum[0]] = entries;
+      else
+        g_array_unref (entries);
+      bucket = filter->buckets[entry.csum[0]];
+      g_mutex_unlock (&filter->lock);
+    }
+
+  g_mutex_lock (&filter->lock);
+  change = g_hash_table_lookup (filter->changes, &entry);
+  g_mutex_unlock (&filter->lock);
+
+  if (change)
+    *out_maybe_stored = GPOINTER_TO_INT (change) == OBJECT_FILTER_ADDED;
+  else
+    *out_maybe_stored = bsearch (&entry, bucket->data, bucket->len,
+                                 sizeof (OstreeObjectFilterEntry),
+                                 object_filter_entry_compare) != NULL;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+object_filter_note_change (OstreeRepo         *self,
+                           const char         *checksum,
+                           OstreeObjectType    objtype,
+                           int                 change)
+{
+  OstreeRepoObjectFilter *filter = self->object_filter;
+  OstreeObjectFilterEntry *entry;
+
+  if (!filter)
+    return;
+
+  entry = g_new (OstreeObjectFilterEntry, 1);
+  object_filter_entry_init (entry, checksum, objtype);
+
+  g_mutex_lock (&filter->lock);
+  g_hash_table_replace (filter->changes, entry, GINT_TO_POINTER (change));
+  g_mutex_unlock (&filter->lock);
+}
+
+/**
+ * _ostree_repo_object_filter_note_added:
+ * @self: Repo
+ * @checksum: ASCII checksum
+ * @objtype: Object type
+ *
+ * Record that a loose object was stored in @self.  This function is
+ * thread-safe.
+ */
+void
+_ostree_repo_object_filter_note_added (OstreeRepo         *self,
+                                       const char         *checksum,
+                                       OstreeObjectType    objtype)
+{
+  object_filter_note_change (self, checksum, objtype, OBJECT_FILTER_ADDED);
+}
+
+/**
+ * _ostree_repo_object_filter_note_removed:
+ * @self: Repo
+ * @checksum: ASCII checksum
+ * @objtype: Object type
+ *
+ * Record that a loose object was deleted from @self.  This function
+ * is thread-safe.
+ */
+void
+_ostree_repo_object_filter_note_removed (OstreeRepo         *self,
+                                         const char         *checksum,
+                                         OstreeObjectType    objtype)
+{
+  object_filter_note_change (self, checksum, objtype, OBJECT_FILTER_REMOVED);
+}
@@ -0,0 +1,1304 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <gio/gfiledescriptorbased.h>
+
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * Pack files store many objects in one file, to avoid the inode and
+ * open() cost of thousands of small loose objects.  They live in
+ * objects/pack/, as a pair:
+ *
+ *   ost{meta,data}pack-CHECKSUM.data  - Object data, concatenated
+ *   ost{meta,data}pack-CHECKSUM.index - Sorted index into the data
+ *
+ * where CHECKSUM is the SHA256 of the .data file.  Each object in the
+ * data file starts on an 8 byte boundary, so metadata variants can be
+ * used straight from the mapping.  Metadata objects are stored as
+ * their serialized variant; content objects as their archive-z2
+ * representation.
+ *
+ * The index is:
+ *
+ *   8 bytes  magic "OSTPKI01"
+ *   guint64  number of entries (little endian)
+ *   entries  OstreePackIndexEntry, sorted by (checksum, objtype)
+ *
+ * Both files are mapped; lookups are a binary search.  The .data file
+ * is always renamed into place before its .index, so an index is
+ * only visible once its data is complete.
+ *
+ * Packs are immutable.  Deleting packed objects (from prune) writes a
+ * new pack without them and removes the old one.  Readers which have
+ * the old pack mapped keep working; readers which miss an object
+ * rescan objects/pack/ if it changed.
+ *
+ * Since a directory can't be listed over HTTP, objects/pack/packs
+ * names the current packs, one "ost{meta,data}pack-CHECKSUM" per
+ * line.  It is updated before loose objects are removed by a repack,
+ * and before an old pack is removed by prune, so that ostree_repo_pull()
+ * can always find an object either loose or in a listed pack; it
+ * fetches the indexes, and then packed objects with range requests
+ * on the .data files.
+ */
+
+#define OSTREE_PACK_INDEX_MAGIC "OSTPKI01"
+#define OSTREE_PACK_INDEX_HEADER_SIZE 16
+#define OSTREE_PACK_ALIGNMENT 8
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+  guint8 padding[7];
+  guint64 offset;
+  guint64 size;
+} OstreePackIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreePackIndexEntry) == 56);
+
+struct OstreeRepoPack {
+  volatile gint refcount;
+  char *name;
+  gboolean is_meta;
+  GBytes *index;
+  GBytes *data;
+  const OstreePackIndexEntry *entries;
+  gsize n_entries;
+};
+
+static OstreeRepoPack *
+pack_ref (OstreeRepoPack *pack)
+{
+  g_atomic_int_inc (&pack->refcount);
+  return pack;
+}
+
+static void
+pack_unref (OstreeRepoPack *pack)
+{
+  if (!g_atomic_int_dec_and_test (&pack->refcount))
+    return;
+  g_free (pack->name);
+  g_bytes_unref (pack->index);
+  g_bytes_unref (pack->data);
+  g_free (pack);
+}
+
+static const char *
+pack_prefix (gboolean is_meta)
+{
+  return is_meta ? "ostmetapack-" : "ostdatapack-";
+}
+
+static char *
+pack_filename (gboolean     is_meta,
+               const char  *name,
+               const char  *suffix)
+{
+  return g_strconcat (pack_prefix (is_meta), name, suffix, NULL);
+}
+
+/*
+ * Parse a pack file name, "ost{meta,data}pack-CHECKSUM" followed by
+ * @suffix.  @out_name must have room for 65 bytes.
+ */
+static gboolean
+pack_parse_filename (const char  *filename,
+                     const char  *suffix,
+                     gboolean    *out_is_meta,
+                     char        *out_name)
+{
+  gboolean is_meta;
+
+  if (g_str_has_prefix (filename, pack_prefix (TRUE)))
+    is_meta = TRUE;
+  else if (g_str_has_prefix (filename, pack_prefix (FALSE)))
+    is_meta = FALSE;
+  else
+    return FALSE;
+
+  filename += strlen (pack_prefix (is_meta));
+  if (strlen (filename) != 64 + strlen (suffix)
+      || strcmp (filename + 64, suffix) != 0)
+    return FALSE;
+
+  memcpy (out_name, filename, 64);
+  out_name[64] = '\0';
+  if (!ostree_validate_checksum_string (out_name, NULL))
+    return FALSE;
+
+  *out_is_meta = is_meta;
+  return TRUE;
+}
+
+static int
+pack_entry_compare (const guint8      *a_csum,
+                    guint8             a_objtype,
+                    const guint8      *b_csum,
+                    guint8             b_objtype)
+{
+  int c = memcmp (a_csum, b_csum, 32);
+  if (c != 0)
+    return c;
+  return (int)a_objtype - (int)b_objtype;
+}
+
+static int
+pack_index_entry_compare (gconstpointer a,
+                          gconstpointer b)
+{
+  const OstreePackIndexEntry *entry_a = a;
+  const OstreePackIndexEntry *entry_b = b;
+
+  return pack_entry_compare (entry_a->csum, entry_a->objtype,
+                             entry_b->csum, entry_b->objtype);
+}
+
+static const OstreePackIndexEntry *
+pack_bsearch (OstreeRepoPack   *pack,
+              const guint8     *csum,
+              OstreeObjectType  objtype)
+{
+  gsize lo = 0;
+  gsize hi = pack->n_entries;
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      const OstreePackIndexEntry *entry = &pack->entries[mid];
+      int c = pack_entry_compare (entry->csum, entry->objtype, csum, (guint8) objtype);
+
+      if (c < 0)
+        lo = mid + 1;
+      else if (c > 0)
+        hi = mid;
+      else
+        return entry;
+    }
+
+  return NULL;
+}
+
+static GBytes *
+map_file_at (int            dfd,
+             const char    *name,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  GBytes *ret = NULL;
+  GMappedFile *mfile = NULL;
+  int fd = -1;
+
+  if (!gs_file_openat_noatime (dfd, name, &fd, cancellable, error))
+    goto out;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+
+  ret = g_mapped_file_get_bytes (mfile);
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+/* Validate the header and size of @pack's index, and point its entries into it */
+static gboolean
+pack_parse_index (OstreeRepoPack  *pack,
+                  const char      *index_name,
+                  GError         **error)
+{
+  const guint8 *index_data;
+  gsize index_len;
+  guint64 n_entries;
+
+  index_data = g_bytes_get_data (pack->index, &index_len);
+  if (index_len < OSTREE_PACK_INDEX_HEADER_SIZE
+      || memcmp (index_data, OSTREE_PACK_INDEX_MAGIC, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted pack index %s; invalid header", index_name);
+      return FALSE;
+    }
+
+  memcpy (&n_entries, index_data + 8, sizeof (n_entries));
+  n_entries = GUINT64_FROM_LE (n_entries);
+  if (n_entries > (index_len - OSTREE_PACK_INDEX_HEADER_SIZE) / sizeof (OstreePackIndexEntry)
+      || index_len != OSTREE_PACK_INDEX_HEADER_SIZE + n_entries * sizeof (OstreePackIndexEntry))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted pack index %s; invalid size %" G_GSIZE_FORMAT,
+                   index_name, index_len);
+      return FALSE;
+    }
+
+  pack->entries = (const OstreePackIndexEntry*) (index_data + OSTREE_PACK_INDEX_HEADER_SIZE);
+  pack->n_entries = n_entries;
+  return TRUE;
+}
+
+static gboolean
+pack_open_at (int               pack_dfd,
+              gboolean          is_meta,
+              const char       *name,
+              OstreeRepoPack  **out_pack,
+              GCancellable     *cancellable,
+              GError          **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoPack *ret_pack = NULL;
+  gs_free char *index_name = pack_filename (is_meta, name, ".index");
+  gs_free char *data_name = pack_filename (is_meta, name, ".data");
+
+  ret_pack = g_new0 (OstreeRepoPack, 1);
+  ret_pack->refcount = 1;
+  ret_pack->name = g_strdup (name);
+  ret_pack->is_meta = is_meta;
+
+  ret_pack->index = map_file_at (pack_dfd, index_name, cancellable, error);
+  if (!ret_pack->index)
+    goto out;
+  ret_pack->data = map_file_at (pack_dfd, data_name, cancellable, error);
+  if (!ret_pack->data)
+    goto out;
+
+  if (!pack_parse_index (ret_pack, index_name, error))
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_pack, &ret_pack);
+ out:
+  if (ret_pack)
+    pack_unref (ret_pack);
+  return ret;
+}
+
+static gint64
+pack_dir_mtime (OstreeRepo *self)
+{
+  struct stat stbuf;
+
+  if (fstatat (self->objects_dir_fd, "pack", &stbuf, 0) == -1)
+    return 0;
+  return (gint64) stbuf.st_mtim.tv_sec * G_USEC_PER_SEC + stbuf.st_mtim.tv_nsec / 1000;
+}
+
+/* Must be called with cache_lock held */
+static gboolean
+load_packs_unlocked (OstreeRepo     *self,
+                     GCancellable   *cancellable,
+                     GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *meta_packs = NULL;
+  gs_unref_ptrarray GPtrArray *content_packs = NULL;
+  DIR *d = NULL;
+  int dfd = -1;
+  struct dirent *dent;
+  gint64 mtime;
+
+  meta_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) pack_unref);
+  content_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) pack_unref);
+
+  mtime = pack_dir_mtime (self);
+
+  dfd = openat (self->objects_dir_fd, "pack", O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+  else
+    {
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          gboolean is_meta;
+          char pack_name[65];
+          OstreeRepoPack *pack = NULL;
+          GError *temp_error = NULL;
+
+          if (!pack_parse_filename (dent->d_name, ".index", &is_meta, pack_name))
+            continue;
+
+          if (!pack_open_at (dirfd (d), is_meta, pack_name, &pack,
+                             cancellable, &temp_error))
+            {
+              /* Deleted by a concurrent prune or repack since we
+               * listed it; its objects are in another pack now.
+               */
+              if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                {
+                  g_clear_error (&temp_error);
+                  continue;
+                }
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
+
+          g_ptr_array_add (is_meta ? meta_packs : content_packs, pack);
+        }
+    }
+
+  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  self->cached_meta_indexes = meta_packs;
+  meta_packs = NULL;
+  self->cached_content_indexes = content_packs;
+  content_packs = NULL;
+  self->packs_mtime = mtime;
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  else if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+/* Must be called with cache_lock held */
+static gboolean
+ensure_packs_loaded_unlocked (OstreeRepo     *self,
+                              gboolean        refresh,
+                              GCancellable   *cancellable,
+                              GError        **error)
+{
+  if (self->cached_meta_indexes == NULL
+      || (refresh && pack_dir_mtime (self) != self->packs_mtime))
+    return load_packs_unlocked (self, cancellable, error);
+  return TRUE;
+}
+
+/*
+ * Take a reference to each currently loaded pack, so callers can
+ * iterate over them without holding cache_lock.
+ */
+static gboolean
+snapshot_packs (OstreeRepo     *self,
+                gboolean        refresh,
+                GPtrArray     **out_packs,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *ret_packs = NULL;
+  guint i;
+
+  ret_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) pack_unref);
+
+  g_mutex_lock (&self->cache_lock);
+  if (!ensure_packs_loaded_unlocked (self, refresh, cancellable, error))
+    {
+      g_mutex_unlock (&self->cache_lock);
+      goto out;
+    }
+  for (i = 0; i < self->cached_meta_indexes->len; i++)
+    g_ptr_array_add (ret_packs, pack_ref (self->cached_meta_indexes->pdata[i]));
+  for (i = 0; i < self->cached_content_indexes->len; i++)
+    g_ptr_array_add (ret_packs, pack_ref (self->cached_content_indexes->pdata[i]));
+  g_mutex_unlock (&self->cache_lock);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_packs, &ret_packs);
+ out:
+  return ret;
+}
+
+static gboolean
+pack_entry_get_data (OstreeRepoPack              *pack,
+                     const OstreePackIndexEntry  *entry,
+                     GBytes                     **out_data,
+                     GError                     **error)
+{
+  guint64 offset = GUINT64_FROM_LE (entry->offset);
+  guint64 size = GUINT64_FROM_LE (entry->size);
+  guint64 data_len = g_bytes_get_size (pack->data);
+
+  if (offset > data_len || size > data_len - offset)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted pack %s; object extends past end of data",
+                   pack->name);
+      return FALSE;
+    }
+
+  *out_data = g_bytes_new_from_bytes (pack->data, offset, size);
+  return TRUE;
+}
+
+/**
+ * _ostree_repo_find_packed_object:
+ * @self: Repo
+ * @objtype: Object type
+ * @checksum: ASCII checksum
+ * @refresh: If %TRUE, rescan the pack directory first if it changed
+ * @out_data: (out) (allow-none): Object data, or %NULL if not packed
+ * @out_pack_name: (out) (allow-none): Name of pack containing the object
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Look up @checksum in the pack files of @self (not its parents).
+ * Normally, callers first try with @refresh set to %FALSE, then look
+ * for a loose object, and only if that fails too retry with @refresh
+ * set to %TRUE, in case another process repacked in the meantime.
+ */
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 gboolean              refresh,
+                                 GBytes              **out_data,
+                                 char                **out_pack_name,
+                                 GCancellable         *cancellable,
+                                 GError              **error)
+{
+  gboolean ret = FALSE;
+  guint8 csum[32];
+  GPtrArray *packs;
+  guint i;
+  GBytes *ret_data = NULL;
+  char *ret_pack_name = NULL;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (!ensure_packs_loaded_unlocked (self, refresh, cancellable, error))
+    goto out;
+
+  packs = OSTREE_OBJECT_TYPE_IS_META (objtype) ? self->cached_meta_indexes : self->cached_content_indexes;
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+      const OstreePackIndexEntry *entry = pack_bsearch (pack, csum, objtype);
+
+      if (!entry)
+        continue;
+
+      if (!pack_entry_get_data (pack, entry, &ret_data, error))
+        goto out;
+      ret_pack_name = g_strdup (pack->name);
+      break;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_data, &ret_data);
+  ot_transfer_out_value (out_pack_name, &ret_pack_name);
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  if (ret_data)
+    g_bytes_unref (ret_data);
+  g_free (ret_pack_name);
+  return ret;
+}
+
+/**
+ * _ostree_repo_list_packed_objects:
+ * @self: Repo
+ * @inout_objects: Table in the format of ostree_repo_list_objects()
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Add all packed objects of @self to @inout_objects, appending
+ * the pack name to existing entries.
+ */
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo           *self,
+                                  GHashTable           *inout_objects,
+                                  GCancellable         *cancellable,
+                                  GError              **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *packs = NULL;
+  guint i;
+  gsize j;
+
+  if (!snapshot_packs (self, TRUE, &packs, cancellable, error))
+    goto out;
+
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+
+      for (j = 0; j < pack->n_entries; j++)
+        {
+          const OstreePackIndexEntry *entry = &pack->entries[j];
+          char checksum[65];
+          GVariant *key;
+          GVariant *value;
+          GVariant *orig;
+          gboolean is_loose = FALSE;
+          GVariantBuilder pack_names;
+
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+          key = g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype));
+
+          g_variant_builder_init (&pack_names, G_VARIANT_TYPE ("as"));
+          orig = g_hash_table_lookup (inout_objects, key);
+          if (orig)
+            {
+              GVariantIter *iter;
+              const char *name;
+
+              g_variant_get (orig, "(bas)", &is_loose, &iter);
+              while (g_variant_iter_loop (iter, "&s", &name))
+                g_variant_builder_add (&pack_names, "s", name);
+              g_variant_iter_free (iter);
+            }
+          g_variant_builder_add (&pack_names, "s", pack->name);
+
+          value = g_variant_new ("(b@as)", is_loose, g_variant_builder_end (&pack_names));
+          /* transfer ownership */
+          g_hash_table_replace (inout_objects, key, g_variant_ref_sink (value));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_invalidate_packs:
+ * @self: Repo
+ *
+ * Drop the cached pack list; it is reloaded on the next lookup.
+ */
+void
+_ostree_repo_invalidate_packs (OstreeRepo *self)
+{
+  g_mutex_lock (&self->cache_lock);
+  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+/**
+ * _ostree_repo_pack_validate_name:
+ * @pack_file: Pack name
+ * @error: Error
+ *
+ * Check that @pack_file is of the form "ost{meta,data}pack-CHECKSUM".
+ */
+gboolean
+_ostree_repo_pack_validate_name (const char  *pack_file,
+                                 GError     **error)
+{
+  gboolean is_meta;
+  char pack_name[65];
+
+  if (!pack_parse_filename (pack_file, "", &is_meta, pack_name))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack name '%s'", pack_file);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/**
+ * _ostree_repo_pack_new_from_index:
+ * @pack_file: Pack name, "ost{meta,data}pack-CHECKSUM"
+ * @index: Contents of its .index file
+ * @out_pack: (out): Pack with an index, but no data
+ * @error: Error
+ *
+ * Parse the index of a pack which isn't in a local repository, such
+ * as one fetched from a remote by ostree_repo_pull().  Use
+ * _ostree_repo_pack_lookup() to find an object in its .data file.
+ */
+gboolean
+_ostree_repo_pack_new_from_index (const char       *pack_file,
+                                  GBytes           *index,
+                                  OstreeRepoPack  **out_pack,
+                                  GError          **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoPack *ret_pack = NULL;
+  gboolean is_meta;
+  char pack_name[65];
+
+  if (!_ostree_repo_pack_validate_name (pack_file, error))
+    goto out;
+  (void) pack_parse_filename (pack_file, "", &is_meta, pack_name);
+
+  ret_pack = g_new0 (OstreeRepoPack, 1);
+  ret_pack->refcount = 1;
+  ret_pack->name = g_strdup (pack_name);
+  ret_pack->is_meta = is_meta;
+  ret_pack->index = g_bytes_ref (index);
+
+  if (!pack_parse_index (ret_pack, pack_file, error))
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_pack, &ret_pack);
+ out:
+  if (ret_pack)
+    pack_unref (ret_pack);
+  return ret;
+}
+
+/**
+ * _ostree_repo_pack_lookup:
+ * @pack: Pack
+ * @objtype: Object type
+ * @checksum: Object checksum
+ * @out_offset: (out): Offset of the object in the .data file
+ * @out_size: (out): Size of the object
+ *
+ * Returns: %TRUE if @pack has the object
+ */
+gboolean
+_ostree_repo_pack_lookup (OstreeRepoPack   *pack,
+                          OstreeObjectType  objtype,
+                          const char       *checksum,
+                          guint64          *out_offset,
+                          guint64          *out_size)
+{
+  const OstreePackIndexEntry *entry;
+  guint8 csum[32];
+  guint64 offset;
+  guint64 size;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  entry = pack_bsearch (pack, csum, objtype);
+  if (!entry)
+    return FALSE;
+
+  offset = GUINT64_FROM_LE (entry->offset);
+  size = GUINT64_FROM_LE (entry->size);
+  /* Don't trust a corrupted index to describe a valid range */
+  if (size == 0 || offset > G_MAXUINT64 - size)
+    return FALSE;
+
+  *out_offset = offset;
+  *out_size = size;
+  return TRUE;
+}
+
+void
+_ostree_repo_pack_unref (OstreeRepoPack *pack)
+{
+  pack_unref (pack);
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  gboolean is_meta;
+  char *data_tmpname;
+  GOutputStream *data_out;
+  GChecksum *checksum;
+  guint64 offset;
+  GArray *entries;
+} OstreePackWriter;
+
+static gboolean
+pack_writer_init (OstreePackWriter  *writer,
+                  OstreeRepo        *repo,
+                  gboolean           is_meta,
+                  GCancellable      *cancellable,
+                  GError           **error)
+{
+  memset (writer, 0, sizeof (*writer));
+  writer->repo = repo;
+  writer->is_meta = is_meta;
+  writer->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  writer->entries = g_array_new (FALSE, FALSE, sizeof (OstreePackIndexEntry));
+
+  return gs_file_open_in_tmpdir_at (repo->tmp_dir_fd, 0644,
+                                    &writer->data_tmpname, &writer->data_out,
+                                    cancellable, error);
+}
+
+static void
+pack_writer_clear (OstreePackWriter *writer)
+{
+  if (writer->data_tmpname)
+    (void) unlinkat (writer->repo->tmp_dir_fd, writer->data_tmpname, 0);
+  g_free (writer->data_tmpname);
+  g_clear_object (&writer->data_out);
+  g_clear_pointer (&writer->checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&writer->entries, g_array_unref);
+}
+
+static gboolean
+pack_writer_add (OstreePackWriter  *writer,
+                 const guint8      *csum,
+                 OstreeObjectType   objtype,
+                 GBytes            *data,
+                 GCancellable      *cancellable,
+                 GError           **error)
+{
+  gboolean ret = FALSE;
+  static const guint8 padding_nuls[OSTREE_PACK_ALIGNMENT] = { 0, };
+  OstreePackIndexEntry entry;
+  gsize len;
+  gconstpointer buf = g_bytes_get_data (data, &len);
+  gsize bytes_written;
+  guint padding;
+
+  if (!ot_gio_write_update_checksum (writer->data_out, buf, len, &bytes_written,
+                                     writer->checksum, cancellable, error))
+    goto out;
+
+  memset (&entry, 0, sizeof (entry));
+  memcpy (entry.csum, csum, 32);
+  entry.objtype = (guint8) objtype;
+  entry.offset = GUINT64_TO_LE (writer->offset);
+  entry.size = GUINT64_TO_LE ((guint64) len);
+  g_array_append_val (writer->entries, entry);
+
+  writer->offset += len;
+
+  padding = (OSTREE_PACK_ALIGNMENT - (writer->offset % OSTREE_PACK_ALIGNMENT)) % OSTREE_PACK_ALIGNMENT;
+  if (padding > 0)
+    {
+      if (!ot_gio_write_update_checksum (writer->data_out, padding_nuls, padding,
+                                         &bytes_written, writer->checksum,
+                                         cancellable, error))
+        goto out;
+      writer->offset += padding;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+fsync_and_close (GOutputStream  *out,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  if (!g_output_stream_flush (out, cancellable, error))
+    return FALSE;
+  if (fsync (g_file_descriptor_based_get_fd ((GFileDescriptorBased*) out)) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  return g_output_stream_close (out, cancellable, error);
+}
+
+/*
+ * Write out the index, and move both files into objects/pack.  If
+ * the writer is empty, no pack is created and @out_name is %NULL.
+ */
+static gboolean
+pack_writer_finish (OstreePackWriter  *writer,
+                    char             **out_name,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepo *repo = writer->repo;
+  gs_free char *ret_name = NULL;
+  gs_free char *index_tmpname = NULL;
+  gs_free char *index_name = NULL;
+  gs_free char *data_name = NULL;
+  gs_unref_object GOutputStream *index_out = NULL;
+  guint64 n_entries_le;
+  gsize bytes_written;
+  int pack_dfd = -1;
+
+  if (writer->entries->len == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!fsync_and_close (writer->data_out, cancellable, error))
+    goto out;
+
+  ret_name = g_strdup (g_checksum_get_string (writer->checksum));
+  index_name = pack_filename (writer->is_meta, ret_name, ".index");
+  data_name = pack_filename (writer->is_meta, ret_name, ".data");
+
+  g_array_sort (writer->entries, pack_index_entry_compare);
+
+  if (!gs_file_open_in_tmpdir_at (repo->tmp_dir_fd, 0644,
+                                  &index_tmpname, &index_out,
+                                  cancellable, error))
+    goto out;
+
+  n_entries_le = GUINT64_TO_LE ((guint64) writer->entries->len);
+  if (!g_output_stream_write_all (index_out, OSTREE_PACK_INDEX_MAGIC, 8,
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (index_out, &n_entries_le, sizeof (n_entries_le),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (index_out, writer->entries->data,
+                                  writer->entries->len * sizeof (OstreePackIndexEntry),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!fsync_and_close (index_out, cancellable, error))
+    goto out;
+
+  if (mkdirat (repo->objects_dir_fd, "pack", 0777) == -1 && errno != EEXIST)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  pack_dfd = openat (repo->objects_dir_fd, "pack", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (pack_dfd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  /* Data first, so that an index is never visible without its data */
+  if (renameat (repo->tmp_dir_fd, writer->data_tmpname, pack_dfd, data_name) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&writer->data_tmpname, g_free);
+
+  if (renameat (repo->tmp_dir_fd, index_tmpname, pack_dfd, index_name) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&index_tmpname, g_free);
+
+  if (fsync (pack_dfd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_name, &ret_name);
+ out:
+  if (index_tmpname)
+    (void) unlinkat (repo->tmp_dir_fd, index_tmpname, 0);
+  if (pack_dfd != -1)
+    (void) close (pack_dfd);
+  return ret;
+}
+
+static gboolean
+delete_pack (OstreeRepo     *self,
+             gboolean        is_meta,
+             const char     *name,
+             GError        **error)
+{
+  gs_free char *index_path = NULL;
+  gs_free char *data_path = NULL;
+
+  index_path = g_strconcat ("pack/", pack_prefix (is_meta), name, ".index", NULL);
+  data_path = g_strconcat ("pack/", pack_prefix (is_meta), name, ".data", NULL);
+
+  /* Index first; the reverse of pack_writer_finish() */
+  if (unlinkat (self->objects_dir_fd, index_path, 0) == -1 && errno != ENOENT)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  if (unlinkat (self->objects_dir_fd, data_path, 0) == -1 && errno != ENOENT)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/*
+ * Publish the list of packs in objects/pack; see the comment at the
+ * top of this file.  Packs in @obsolete are left out, so that the
+ * list can be updated before they are deleted.
+ */
+static gboolean
+write_pack_list (OstreeRepo     *self,
+                 GPtrArray      *obsolete,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *tmpname = NULL;
+  gs_unref_object GOutputStream *out = NULL;
+  DIR *d = NULL;
+  int dfd = -1;
+  struct dirent *dent;
+  gsize bytes_written;
+  guint i;
+
+  dfd = openat (self->objects_dir_fd, "pack", O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      if (errno == ENOENT)
+        ret = TRUE;
+      else
+        ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                  &tmpname, &out,
+                                  cancellable, error))
+    goto out;
+
+  while ((dent = readdir (d)) != NULL)
+    {
+      gboolean is_meta;
+      char pack_name[65];
+      gboolean is_obsolete = FALSE;
+      gs_free char *line = NULL;
+
+      if (!pack_parse_filename (dent->d_name, ".index", &is_meta, pack_name))
+        continue;
+
+      for (i = 0; obsolete && i < obsolete->len; i++)
+        {
+          OstreeRepoPack *pack = obsolete->pdata[i];
+          if (pack->is_meta == is_meta && strcmp (pack->name, pack_name) == 0)
+            is_obsolete = TRUE;
+        }
+      if (is_obsolete)
+        continue;
+
+      line = pack_filename (is_meta, pack_name, "\n");
+      if (!g_output_stream_write_all (out, line, strlen (line),
+                                      &bytes_written, cancellable, error))
+        goto out;
+    }
+
+  if (!fsync_and_close (out, cancellable, error))
+    goto out;
+
+  if (renameat (self->tmp_dir_fd, tmpname, dirfd (d), "packs") == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&tmpname, g_free);
+
+  ret = TRUE;
+ out:
+  if (tmpname)
+    (void) unlinkat (self->tmp_dir_fd, tmpname, 0);
+  if (d)
+    (void) closedir (d);
+  else if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+/**
+ * _ostree_repo_delete_packed_objects:
+ * @self: Repo
+ * @objects: Set of serialized object names to delete
+ * @out_freed_bytes: (out) (allow-none): Number of bytes freed
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Rewrite every pack of @self which contains any of @objects,
+ * leaving those objects out.  Packs which would become empty are
+ * deleted.
+ */
+gboolean
+_ostree_repo_delete_packed_objects (OstreeRepo           *self,
+                                    GHashTable           *objects,
+                                    guint64              *out_freed_bytes,
+                                    GCancellable         *cancellable,
+                                    GError              **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *packs = NULL;
+  gs_unref_ptrarray GPtrArray *obsolete = NULL;
+  guint64 freed_bytes = 0;
+  guint i;
+  gsize j;
+  OstreePackWriter writer = { 0, };
+
+  if (g_hash_table_size (objects) == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!snapshot_packs (self, TRUE, &packs, cancellable, error))
+    goto out;
+
+  obsolete = g_ptr_array_new ();
+
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+      gs_free char *new_name = NULL;
+      gs_unref_ptrarray GPtrArray *keep = NULL;
+      guint n_deleted = 0;
+
+      keep = g_ptr_array_new ();
+
+      for (j = 0; j < pack->n_entries; j++)
+        {
+          const OstreePackIndexEntry *entry = &pack->entries[j];
+          char checksum[65];
+          gs_unref_variant GVariant *key = NULL;
+
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+          key = g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype));
+          if (g_hash_table_contains (objects, key))
+            n_deleted++;
+          else
+            g_ptr_array_add (keep, (gpointer) entry);
+        }
+
+      if (n_deleted == 0)
+        continue;
+
+      if (!pack_writer_init (&writer, self, pack->is_meta, cancellable, error))
+        goto out;
+
+      for (j = 0; j < keep->len; j++)
+        {
+          const OstreePackIndexEntry *entry = keep->pdata[j];
+          gs_unref_bytes GBytes *data = NULL;
+
+          if (!pack_entry_get_data (pack, entry, &data, error))
+            goto out;
+          if (!pack_writer_add (&writer, entry->csum, entry->objtype, data,
+                                cancellable, error))
+            goto out;
+        }
+
+      freed_bytes += g_bytes_get_size (pack->data) - writer.offset;
+
+      if (!pack_writer_finish (&writer, &new_name, cancellable, error))
+        goto out;
+      pack_writer_clear (&writer);
+
+      /* Could only happen if the rewritten pack is identical */
+      if (new_name && strcmp (new_name, pack->name) == 0)
+        continue;
+
+      g_ptr_array_add (obsolete, pack);
+    }
+
+  if (obsolete->len > 0)
+    {
+      /* Stop pointing pulls at the old packs before removing them */
+      if (!write_pack_list (self, obsolete, cancellable, error))
+        goto out;
+
+      for (i = 0; i < obsolete->len; i++)
+        {
+          OstreeRepoPack *pack = obsolete->pdata[i];
+          if (!delete_pack (self, pack->is_meta, pack->name, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+  if (out_freed_bytes)
+    *out_freed_bytes = freed_bytes;
+ out:
+  if (writer.entries)
+    pack_writer_clear (&writer);
+  _ostree_repo_invalidate_packs (self);
+  return ret;
+}
+
+static gboolean
+repack_loose_objects (OstreeRepo     *self,
+                      gboolean        is_meta,
+                      guint64         max_object_size,
+                      guint          *out_n_packed,
+                      GCancellable   *cancellable,
+                      GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *objects = NULL;
+  gs_unref_ptrarray GPtrArray *packed = NULL;
+  GHashTableIter hash_iter;
+  gpointer key, value;
+  OstreePackWriter writer = { 0, };
+  guint i;
+
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_LOOSE, &objects,
+                                 cancellable, error))
+    goto out;
+
+  if (!pack_writer_init (&writer, self, is_meta, cancellable, error))
+    goto out;
+
+  packed = g_ptr_array_new_with_free_func (g_free);
+
+  g_hash_table_iter_init (&hash_iter, objects);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      gs_unref_bytes GBytes *data = NULL;
+      gs_free guchar *csum = NULL;
+      GError *temp_error = NULL;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype) != is_meta)
+        continue;
+
+      /* list_objects() also returns objects from the parent repo */
+      _ostree_loose_path (loose_path, checksum, objtype, self->mode);
+      data = map_file_at (self->objects_dir_fd, loose_path, cancellable, &temp_error);
+      if (!data)
+        {
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_clear_error (&temp_error);
+              continue;
+            }
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+
+      if (max_object_size > 0 && g_bytes_get_size (data) > max_object_size)
+        continue;
+
+      csum = ostree_checksum_to_bytes (checksum);
+      if (!pack_writer_add (&writer, csum, objtype, data, cancellable, error))
+        goto out;
+
+      g_ptr_array_add (packed, g_strdup (loose_path));
+    }
+
+  if (!pack_writer_finish (&writer, NULL, cancellable, error))
+    goto out;
+
+  _ostree_repo_invalidate_packs (self);
+
+  /* Publish the new pack before its objects stop being loose */
+  if (!write_pack_list (self, NULL, cancellable, error))
+    goto out;
+
+  /* The objects are now safely on disk in the pack */
+  for (i = 0; i < packed->len; i++)
+    {
+      const char *loose_path = packed->pdata[i];
+      if (unlinkat (self->objects_dir_fd, loose_path, 0) == -1 && errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  if (out_n_packed)
+    *out_n_packed = packed->len;
+ out:
+  if (writer.entries)
+    pack_writer_clear (&writer);
+  return ret;
+}
+
+/**
+ * ostree_repo_repack_metadata:
+ * @self: Repo
+ * @out_n_packed: (out) (allow-none): Number of objects packed
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move all loose metadata objects (commits, directory trees and
+ * directory metadata) of @self into a new pack file, which can be
+ * loaded with a single mapping instead of one open() per object.
+ *
+ * This should not be run concurrently with ostree_repo_prune().
+ */
+gboolean
+ostree_repo_repack_metadata (OstreeRepo     *self,
+                             guint          *out_n_packed,
+                             GCancellable   *cancellable,
+                             GError        **error)
+{
+  return repack_loose_objects (self, TRUE, 0, out_n_packed,
+                               cancellable, error);
+}
+
+/**
+ * ostree_repo_repack_content:
+ * @self: Repo
+ * @max_object_size: Leave objects larger than this loose; 0 for no limit
+ * @out_n_packed: (out) (allow-none): Number of objects packed
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move loose content objects of @self whose compressed size is at
+ * most @max_object_size into a new pack file.  This is only supported
+ * for %OSTREE_REPO_MODE_ARCHIVE_Z2 repositories; bare repositories
+ * store file metadata in the filesystem itself.
+ *
+ * The pack is listed in objects/pack/packs before the loose objects
+ * are removed, so @self can still be served over HTTP: ostree_repo_pull()
+ * fetches packed objects with range requests, which the server must
+ * support.  Clients running versions which only fetch loose objects
+ * can't pull content from a repacked repository.
+ *
+ * This should not be run concurrently with ostree_repo_prune().
+ */
+gboolean
+ostree_repo_repack_content (OstreeRepo     *self,
+                            guint64         max_object_size,
+                            guint          *out_n_packed,
+                            GCancellable   *cancellable,
+                            GError        **error)
+{
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Content packs are only supported in archive-z2 repositories");
+      return FALSE;
+    }
+
+  return repack_loose_objects (self, FALSE, max_object_size, out_n_packed,
+                               cancellable, error);
+}
@@ -26,6 +26,9 @@ G_BEGIN_DECLS
 
 #define _OSTREE_OBJECT_SIZES_ENTRY_SIGNATURE "ay"
 
+typedef struct OstreeRepoPack OstreeRepoPack;
+typedef struct OstreeRepoObjectFilter OstreeRepoObjectFilter;
+
 /**
  * OstreeRepo:
  *
@@ -54,17 +57,28 @@ struct OstreeRepo {
   GMutex cache_lock;
   GPtrArray *cached_meta_indexes;
   GPtrArray *cached_content_indexes;
+  gint64 packs_mtime;
 
   gboolean inited;
   gboolean in_transaction;
-  GHashTable *loose_object_devino_hash;
+  GFile *devino_index_path;
+  gboolean devino_index_track;
+  GBytes *devino_index;
+  GBytes *devino_index_appended;
+  GArray *devino_index_added;
+  GHashTable *devino_index_removed;
   GHashTable *updated_uncompressed_dirs;
   GHashTable *object_sizes;
+  OstreeRepoObjectFilter *object_filter;
 
   GKeyFile *config;
   OstreeRepoMode mode;
   gboolean enable_uncompressed_cache;
   gboolean generate_sizes;
+  gboolean disable_fsync;
+  int zlib_level;
+  guint64 zlib_parallel_threshold;
+  gboolean use_tmpfile;
 
   OstreeRepo *parent_repo;
 };
@@ -79,6 +93,7 @@ gboolean
 _ostree_repo_find_object (OstreeRepo           *self,
                           OstreeObjectType      objtype,
                           const char           *checksum,
+                          gboolean             *out_have_object,
                           GFile               **out_stored_path,
                           GCancellable         *cancellable,
                           GError             **error);
@@ -120,6 +135,30 @@ _ostree_repo_update_refs (OstreeRepo        *self,
                           GCancellable      *cancellable,
                           GError           **error);
 
+gboolean
+_ostree_repo_write_archive_content (OstreeRepo       *self,
+                                    const char       *expected_checksum,
+                                    GFile            *archived_path,
+                                    gboolean          archived_path_is_temporary,
+                                    guchar          **out_csum,
+                                    GCancellable     *cancellable,
+                                    GError          **error);
+
+void
+_ostree_repo_write_archive_content_async (OstreeRepo               *self,
+                                          const char               *expected_checksum,
+                                          GFile                    *archived_path,
+                                          gboolean                  archived_path_is_temporary,
+                                          GCancellable             *cancellable,
+                                          GAsyncReadyCallback       callback,
+                                          gpointer                  user_data);
+
+gboolean
+_ostree_repo_write_archive_content_finish (OstreeRepo        *self,
+                                           GAsyncResult      *result,
+                                           guchar           **out_csum,
+                                           GError           **error);
+
 OstreeRepoFile *
 _ostree_repo_file_new_for_commit (OstreeRepo  *repo,
                                   const char  *commit,
@@ -137,5 +176,175 @@ _ostree_repo_commit_modifier_apply (OstreeRepo               *self,
                                     GFileInfo                *file_info,
                                     GFileInfo               **out_modified_info);
 
+gboolean
+_ostree_repo_devino_index_load (OstreeRepo     *self,
+                                gboolean       *out_loaded,
+                                GCancellable   *cancellable,
+                                GError        **error);
+
+gboolean
+_ostree_repo_devino_index_rebuild (OstreeRepo     *self,
+                                   GCancellable   *cancellable,
+                                   GError        **error);
+
+void
+_ostree_repo_devino_index_unload (OstreeRepo *self);
+
+gboolean
+_ostree_repo_devino_index_lookup (OstreeRepo     *self,
+                                  guint32         dev,
+                                  guint64         ino,
+                                  char           *out_checksum);
+
+void
+_ostree_repo_devino_index_note_added (OstreeRepo     *self,
+                                      int             dfd,
+                                      const char     *loose_path,
+                                      const char     *checksum);
+
+void
+_ostree_repo_devino_index_note_removed (OstreeRepo     *self,
+                                        const char     *checksum);
+
+gboolean
+_ostree_repo_devino_index_flush (OstreeRepo     *self,
+                                 GCancellable   *cancellable,
+                                 GError        **error);
+
+void
+_ostree_repo_object_filter_enable (OstreeRepo *self);
+
+void
+_ostree_repo_object_filter_disable (OstreeRepo *self);
+
+gboolean
+_ostree_repo_object_filter_lookup (OstreeRepo         *self,
+                                   const char         *checksum,
+                                   OstreeObjectType    objtype,
+                                   gboolean           *out_maybe_stored,
+                                   GCancellable       *cancellable,
+                                   GError            **error);
+
+void
+_ostree_repo_object_filter_note_added (OstreeRepo         *self,
+                                       const char         *checksum,
+                                       OstreeObjectType    objtype);
+
+void
+_ostree_repo_object_filter_note_removed (OstreeRepo         *self,
+                                         const char         *checksum,
+                                         OstreeObjectType    objtype);
+
+gboolean
+_ostree_repo_reachable_index_load (OstreeRepo       *self,
+                                   const char       *commit_checksum,
+                                   OstreeObjectSet  *inout_objects,
+                                   gboolean         *out_loaded,
+                                   GCancellable     *cancellable,
+                                   GError          **error);
+
+gboolean
+_ostree_repo_reachable_index_write (OstreeRepo       *self,
+                                    const char       *commit_checksum,
+                                    OstreeObjectSet  *objects,
+                                    GCancellable     *cancellable,
+                                    GError          **error);
+
+gboolean
+_ostree_repo_reachable_index_delete (OstreeRepo     *self,
+                                     const char     *commit_checksum,
+                                     GCancellable   *cancellable,
+                                     GError        **error);
+
+gboolean
+_ostree_repo_traverse_commits_indexed (OstreeRepo         *repo,
+                                       const char * const *commits,
+                                       int                 maxdepth,
+                                       OstreeObjectSet    *inout_reachable,
+                                       GCancellable       *cancellable,
+                                       GError            **error);
+
+typedef struct OstreeRepoStatCache OstreeRepoStatCache;
+
+OstreeRepoStatCache *
+_ostree_repo_stat_cache_new (GFile          *path,
+                             const char     *parent,
+                             guint32         flags,
+                             GCancellable   *cancellable,
+                             GError        **error);
+
+void
+_ostree_repo_stat_cache_free (OstreeRepoStatCache *cache);
+
+gboolean
+_ostree_repo_stat_cache_lookup (OstreeRepoStatCache  *cache,
+                                OstreeRepo           *repo,
+                                const char           *path,
+                                GFileInfo            *stat_info,
+                                GFileInfo            *file_info,
+                                char                 *out_checksum,
+                                gboolean             *out_found,
+                                GCancellable         *cancellable,
+                                GError              **error);
+
+void
+_ostree_repo_stat_cache_add (OstreeRepoStatCache  *cache,
+                             const char           *path,
+                             GFileInfo            *stat_info,
+                             GFileInfo            *file_info,
+                             const char           *checksum);
+
+gboolean
+_ostree_repo_stat_cache_save (OstreeRepoStatCache  *cache,
+                              const char           *commit,
+                              GCancellable         *cancellable,
+                              GError              **error);
+
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 gboolean              refresh,
+                                 GBytes              **out_data,
+                                 char                **out_pack_name,
+                                 GCancellable         *cancellable,
+                                 GError              **error);
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo           *self,
+                                  GHashTable           *inout_objects,
+                                  GCancellable         *cancellable,
+                                  GError              **error);
+
+gboolean
+_ostree_repo_delete_packed_objects (OstreeRepo           *self,
+                                    GHashTable           *objects,
+                                    guint64              *out_freed_bytes,
+                                    GCancellable         *cancellable,
+                                    GError              **error);
+
+void
+_ostree_repo_invalidate_packs (OstreeRepo *self);
+
+gboolean
+_ostree_repo_pack_validate_name (const char  *pack_file,
+                                 GError     **error);
+
+gboolean
+_ostree_repo_pack_new_from_index (const char       *pack_file,
+                                  GBytes           *index,
+                                  OstreeRepoPack  **out_pack,
+                                  GError          **error);
+
+gboolean
+_ostree_repo_pack_lookup (OstreeRepoPack   *pack,
+                          OstreeObjectType  objtype,
+                          const char       *checksum,
+                          guint64          *out_offset,
+                          guint64          *out_size);
+
+void
+_ostree_repo_pack_unref (OstreeRepoPack *pack);
+
 G_END_DECLS
 
@@ -27,36 +27,35 @@
 
 typedef struct {
   OstreeRepo *repo;
-  GHashTable *reachable;
+  OstreeObjectSet *reachable;
   guint n_reachable_meta;
   guint n_reachable_content;
   guint n_unreachable_meta;
   guint n_unreachable_content;
   guint64 freed_bytes;
+  GHashTable *unreachable_packed;
 } OtPruneData;
 
 static gboolean
-maybe_prune_loose_object (OtPruneData        *data,
-                          OstreeRepoPruneFlags    flags,
-                          const char         *checksum,
-                          OstreeObjectType    objtype,
-                          GCancellable       *cancellable,
-                          GError            **error)
+maybe_prune_object (OtPruneData        *data,
+                    OstreeRepoPruneFlags    flags,
+                    const char         *checksum,
+                    OstreeObjectType    objtype,
+                    gboolean            is_loose,
+                    gboolean            is_packed,
+                    GCancellable       *cancellable,
+                    GError            **error)
 {
   gboolean ret = FALSE;
-  gs_unref_variant GVariant *key = NULL;
-  gs_unref_object GFile *objf = NULL;
 
-  key = ostree_object_name_serialize (checksum, objtype);
-
-  objf = _ostree_repo_get_object_path (data->repo, checksum, objtype);
-
-  if (!g_hash_table_lookup_extended (data->reachable, key, NULL, NULL))
+  if (!ostree_object_set_contains (data->reachable, checksum, objtype))
     {
-      if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+      if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) && is_loose)
         {
+          gs_unref_object GFile *objf = NULL;
           gs_unref_object GFileInfo *info = NULL;
 
+          objf = _ostree_repo_get_object_path (data->repo, checksum, objtype);
           if (!ot_gfile_query_info_allow_noent (objf, OSTREE_GIO_FAST_QUERYINFO,
                                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                                 &info, cancellable, error))
@@ -70,12 +69,35 @@ maybe_prune_loose_object (OtPruneData        *data,
                     _ostree_repo_get_commit_metadata_loose_path (data->repo, checksum);
                   if (!ot_gfile_ensure_unlinked (detached_metadata, cancellable, error))
                     goto out;
+                  if (!_ostree_repo_reachable_index_delete (data->repo, checksum,
+                                                            cancellable, error))
+                    goto out;
                 }
               if (!gs_file_unlink (objf, cancellable, error))
                 goto out;
+              _ostree_repo_object_filter_note_removed (data->repo, checksum, objtype);
+              if (objtype == OSTREE_OBJECT_TYPE_FILE
+                  && ostree_repo_get_mode (data->repo) == OSTREE_REPO_MODE_BARE)
+                _ostree_repo_devino_index_note_removed (data->repo, checksum);
               data->freed_bytes += g_file_info_get_size (info);
             }
         }
+      if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) && is_packed)
+        {
+          /* Packs are rewritten in one go at the end */
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            {
+              gs_unref_object GFile *detached_metadata =
+                _ostree_repo_get_commit_metadata_loose_path (data->repo, checksum);
+              if (!ot_gfile_ensure_unlinked (detached_metadata, cancellable, error))
+                goto out;
+              if (!_ostree_repo_reachable_index_delete (data->repo, checksum,
+                                                        cancellable, error))
+                goto out;
+            }
+          g_hash_table_add (data->unreachable_packed,
+                            g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype)));
+        }
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
         data->n_unreachable_meta++;
       else
@@ -118,6 +140,10 @@ maybe_prune_loose_object (OtPruneData        *data,
  * Use the %OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE to just determine
  * statistics on objects that would be deleted, without actually
  * deleting them.
+ *
+ * The objects reachable from each commit are stored in an index next
+ * to it the first time it is traversed, so later calls don't need to
+ * load the directories of the same commits again.
  */
 gboolean
 ostree_repo_prune (OstreeRepo        *self,
@@ -134,35 +160,31 @@ ostree_repo_prune (OstreeRepo        *self,
   gpointer key, value;
   gs_unref_hashtable GHashTable *objects = NULL;
   gs_unref_hashtable GHashTable *all_refs = NULL;
+  gs_unref_ptrarray GPtrArray *commits = NULL;
   OtPruneData data = { 0, };
   gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
 
   data.repo = self;
-  data.reachable = ostree_repo_traverse_new_reachable ();
+  data.reachable = ostree_object_set_new ();
+  data.unreachable_packed = ostree_repo_traverse_new_reachable ();
 
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
+                                 cancellable, error))
+    goto out;
+
+  /* Gather the starting points, so they're all traversed in parallel */
+  commits = g_ptr_array_new ();
   if (refs_only)
     {
       if (!ostree_repo_list_refs (self, NULL, &all_refs,
                                   cancellable, error))
         goto out;
-      
+
       g_hash_table_iter_init (&hash_iter, all_refs);
-      
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
-        {
-          const char *checksum = value;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                            cancellable, error))
-            goto out;
-        }
+        g_ptr_array_add (commits, value);
     }
-
-  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
-                                 cancellable, error))
-    goto out;
-
-  if (!refs_only)
+  else
     {
       g_hash_table_iter_init (&hash_iter, objects);
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -175,12 +197,16 @@ ostree_repo_prune (OstreeRepo        *self,
 
           if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
             continue;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                                  cancellable, error))
-            goto out;
+
+          g_ptr_array_add (commits, (char*)checksum);
         }
     }
+  g_ptr_array_add (commits, NULL);
+
+  if (!_ostree_repo_traverse_commits_indexed (self, (const char * const *)commits->pdata,
+                                              depth, data.reachable,
+                                              cancellable, error))
+    goto out;
 
   g_hash_table_iter_init (&hash_iter, objects);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -190,17 +216,31 @@ ostree_repo_prune (OstreeRepo        *self,
       const char *checksum;
       OstreeObjectType objtype;
       gboolean is_loose;
+      gs_unref_variant GVariant *packs = NULL;
       
       ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-      g_variant_get_child (objdata, 0, "b", &is_loose);
+      g_variant_get (objdata, "(b@as)", &is_loose, &packs);
 
-      if (!is_loose)
-        continue;
+      if (!maybe_prune_object (&data, flags, checksum, objtype,
+                               is_loose, g_variant_n_children (packs) > 0,
+                               cancellable, error))
+        goto out;
+    }
 
-      if (!maybe_prune_loose_object (&data, flags, checksum, objtype,
-                                     cancellable, error))
+  if (g_hash_table_size (data.unreachable_packed) > 0)
+    {
+      guint64 packed_freed_bytes;
+
+      if (!_ostree_repo_delete_packed_objects (self, data.unreachable_packed,
+                                               &packed_freed_bytes,
+                                               cancellable, error))
         goto out;
+      data.freed_bytes += packed_freed_bytes;
     }
+
+  if (!_ostree_repo_devino_index_flush (self, cancellable, error))
+    goto out;
+
   ret = TRUE;
   *out_objects_total = (data.n_reachable_meta + data.n_unreachable_meta +
                         data.n_reachable_content + data.n_unreachable_content);
@@ -208,6 +248,8 @@ ostree_repo_prune (OstreeRepo        *self,
   *out_pruned_object_size_total = data.freed_bytes;
  out:
   if (data.reachable)
-    g_hash_table_unref (data.reachable);
+    ostree_object_set_unref (data.reachable);
+  if (data.unreachable_packed)
+    g_hash_table_unref (data.unreachable_packed);
   return ret;
 }
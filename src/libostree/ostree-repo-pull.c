@@ -27,30 +27,26 @@
  * First, we synchronously fetch all requested refs, and resolve them
  * to SHA256 commit checksums.
  *
- * Now, there are two threads involved here.  First, there's the
- * calling thread; we create a temporary #GMainContext, and iterate
- * it.  This thread performs all HTTP requests.
+ * Now, there are two kinds of threads involved here.  First, there's
+ * the calling thread; we create a temporary #GMainContext, and
+ * iterate it.  This thread performs all HTTP requests.
  *
- * The calling thread communicates with the "metadata scanning"
- * thread.  The purpose of the metadata thread is to avoid blocking
- * the main thread while reading from the repository.  If a
- * transaction is interrupted for example, the next run will need to
- * lstat() each loose object, which could easily be 60000 or more.
+ * The calling thread hands metadata objects to a pool of "metadata
+ * scanning" threads.  Their purpose is to avoid blocking the main
+ * thread while reading from the repository.  If a transaction is
+ * interrupted for example, the next run will need to lstat() each
+ * loose object, which could easily be 60000 or more; spreading that
+ * over several threads keeps the disk busy.  The scanners share the
+ * sets of scanned and requested objects, under a lock.
  *
- * The two threads pass messages back and forth over queues.  The deep
- * complexity in this code is determining when a pull process is
- * complete.  When the main thread completes fetching a metadata
- * object, it passes it over to the metadata thread, which may in turn
- * queue more work for the main thread.  That in turn may generate
- * more work for the metadata thread, etc.
- *
- * Work completion is presently done via sending special _IDLE message
- * down the queue; if both threads are idle, the main thread tells the
- * metadata thread to shut down, and then proceeds to stop iterating
- * the main context.
- *  
- * There is still a race condition here.  See
- * https://bugzilla.gnome.org/show_bug.cgi?id=706456
+ * When the main thread completes fetching a metadata object, it
+ * queues it for scanning, which may in turn queue fetch requests back
+ * to the main thread, and so on.  The deep complexity in this code is
+ * determining when a pull process is complete.  We count scan jobs
+ * which are queued or running; a worker sends its fetch requests
+ * before its job is counted as done, so once the count drops to zero
+ * and the main thread has drained its queue, and no fetches or writes
+ * are outstanding, we're finished.
  */
 
 #include "config.h"
@@ -58,24 +54,32 @@
 #include "ostree.h"
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-static-delta-private.h"
 #include "ostree-fetcher.h"
+#include "ostree-varint.h"
 #include "otutil.h"
 
 typedef struct {
   enum {
     PULL_MSG_SCAN_IDLE,
-    PULL_MSG_MAIN_IDLE,
     PULL_MSG_FETCH,
-    PULL_MSG_FETCH_DETACHED_METADATA,
-    PULL_MSG_SCAN,
-    PULL_MSG_QUIT
+    PULL_MSG_FETCH_DETACHED_METADATA
   } t;
   union {
-    guint     idle_serial;
     GVariant *item;
   } d;
 } PullWorkerMessage;
 
+typedef struct {
+  GVariant *object;
+  guint     recursion_depth;
+} PullScanJob;
+
+typedef struct {
+  OstreeRepoPack *pack;
+  SoupURI        *data_uri;
+} OtRemotePack;
+
 typedef struct {
   OstreeRepo   *repo;
   OstreeRepoPullFlags flags;
@@ -95,16 +99,18 @@ typedef struct {
   
   gboolean          gpg_verify;
 
-  GThread          *metadata_thread;
-  GMainContext     *metadata_thread_context;
-  GMainLoop        *metadata_thread_loop;
-  OtWaitableQueue  *metadata_objects_to_scan;
+  GThreadPool      *metadata_scan_pool;
   OtWaitableQueue  *metadata_objects_to_fetch;
+  GMutex            scan_lock; /* Protects the three tables below */
   GHashTable       *scanned_metadata; /* Maps object name to itself */
   GHashTable       *requested_metadata; /* Maps object name to itself */
   GHashTable       *requested_content; /* Maps object name to itself */
-  guint             metadata_scan_idle : 1; /* TRUE if we passed through an idle message */
-  guint             idle_serial; /* Incremented when we get a SCAN_IDLE message */
+  GMutex            expected_sizes_lock;
+  GHashTable       *expected_content_sizes; /* Maps checksum to archived size */
+  GPtrArray        *remote_packs; /* OtRemotePack, see load_remote_packs() */
+  volatile gint     n_outstanding_metadata_scans; /* Queued or running scan jobs */
+  volatile gint     metadata_scan_aborted;
+  guint             metadata_scan_idle : 1; /* TRUE if all scans have completed and their fetches are queued */
   guint             n_outstanding_metadata_fetches;
   guint             n_outstanding_metadata_write_requests;
   guint             n_outstanding_content_fetches;
@@ -126,9 +132,28 @@ typedef struct {
   OtPullData  *pull_data;
   GVariant    *object;
   GFile       *temp_path;
+  GBytes      *membuf;
   gboolean     is_detached_meta;
 } FetchObjectData;
 
+/* Content objects smaller than this are downloaded into memory when
+ * they need to be uncompressed anyway, rather than into a temporary
+ * file which would be written and then read back.  Larger ones, and
+ * ones whose size we don't know, go to disk: that bounds memory use,
+ * an interrupted download can be resumed by the next pull, and the
+ * object is parsed with blocking reads, which on a stream straight
+ * from the fetcher would stall the main loop.  The temporary file
+ * holds the compressed object, so it costs less than the uncompressed
+ * write into a bare repository.
+ */
+#define OSTREE_PULL_MEMBUF_CONTENT_MAX (1024 * 1024)
+
+/* Scanning is mostly waiting on lstat() and reading small objects, so
+ * a few threads help even on small machines; beyond this the disk is
+ * the limit.
+ */
+#define OSTREE_PULL_MAX_SCAN_THREADS 8
+
 static SoupURI *
 suburi_new (SoupURI   *base,
             const char *first,
@@ -140,10 +165,9 @@ static gboolean scan_one_metadata_object (OtPullData         *pull_data,
                                           guint               recursion_depth,
                                           GCancellable       *cancellable,
                                           GError            **error);
-static gboolean scan_one_metadata_object_v_name (OtPullData         *pull_data,
-                                                 GVariant           *object,
-                                                 GCancellable       *cancellable,
-                                                 GError            **error);
+static void queue_scan_one_metadata_object (OtPullData         *pull_data,
+                                            GVariant           *object,
+                                            guint               recursion_depth);
 
 
 static SoupURI *
@@ -179,6 +203,33 @@ suburi_new (SoupURI   *base,
   return ret;
 }
 
+static void
+remote_pack_free (OtRemotePack *remote_pack)
+{
+  _ostree_repo_pack_unref (remote_pack->pack);
+  soup_uri_free (remote_pack->data_uri);
+  g_free (remote_pack);
+}
+
+static OtRemotePack *
+lookup_remote_pack (OtPullData        *pull_data,
+                    const char        *checksum,
+                    OstreeObjectType   objtype,
+                    guint64           *out_offset,
+                    guint64           *out_size)
+{
+  guint i;
+
+  for (i = 0; pull_data->remote_packs && i < pull_data->remote_packs->len; i++)
+    {
+      OtRemotePack *remote_pack = pull_data->remote_packs->pdata[i];
+      if (_ostree_repo_pack_lookup (remote_pack->pack, objtype, checksum,
+                                    out_offset, out_size))
+        return remote_pack;
+    }
+  return NULL;
+}
+
 static gboolean
 update_progress (gpointer user_data)
 {
@@ -221,16 +272,11 @@ pull_worker_message_new (int msgtype, gpointer data)
   switch (msgtype)
     {
     case PULL_MSG_SCAN_IDLE:
-    case PULL_MSG_MAIN_IDLE:
-      msg->d.idle_serial = GPOINTER_TO_UINT (data);
       break;
-    case PULL_MSG_SCAN:
     case PULL_MSG_FETCH:
     case PULL_MSG_FETCH_DETACHED_METADATA:
       msg->d.item = data;
       break;
-    case PULL_MSG_QUIT:
-      break;
     }
   return msg;
 }
@@ -269,7 +315,7 @@ check_outstanding_requests_handle_error (OtPullData          *pull_data,
   throw_async_error (pull_data, error);
 
   /* This is true in the phase when we're fetching refs */
-  if (pull_data->metadata_objects_to_scan == NULL)
+  if (pull_data->metadata_scan_pool == NULL)
     {
       if (!pull_data->fetching_sync_uri)
         g_main_loop_quit (pull_data->loop);
@@ -316,6 +362,8 @@ run_mainloop_monitor_fetcher (OtPullData   *pull_data)
 typedef struct {
   OtPullData     *pull_data;
   GInputStream   *result_stream;
+  GBytes         *result_bytes;
+  GError        **error;
 } OstreeFetchUriSyncData;
 
 static void
@@ -326,36 +374,78 @@ fetch_uri_sync_on_complete (GObject        *object,
   OstreeFetchUriSyncData *data = user_data;
 
   data->result_stream = ostree_fetcher_stream_uri_finish ((OstreeFetcher*)object,
-                                                          result, data->pull_data->async_error);
+                                                          result, data->error);
+  data->pull_data->fetching_sync_uri = NULL;
+  g_main_loop_quit (data->pull_data->loop);
+}
+
+static void
+fetch_uri_cached_sync_on_complete (GObject        *object,
+                                   GAsyncResult   *result,
+                                   gpointer        user_data)
+{
+  OstreeFetchUriSyncData *data = user_data;
+
+  data->result_bytes = ostree_fetcher_request_uri_cached_finish ((OstreeFetcher*)object,
+                                                                 result, data->error);
   data->pull_data->fetching_sync_uri = NULL;
   g_main_loop_quit (data->pull_data->loop);
 }
 
+/*
+ * Synchronously fetch @uri into memory.  If @allow_noent is %TRUE
+ * and the server returns "not found", @out_contents is set to %NULL
+ * and %TRUE is returned.  If @use_cache is %TRUE, the request is
+ * conditional on the copy in the remote's cache directory; use it for
+ * small files which are fetched on every pull.
+ */
 static gboolean
-fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
-                              SoupURI     *uri,
-                              char       **out_contents,
-                              GCancellable  *cancellable,
-                              GError     **error)
+fetch_uri_contents_membuf_sync (OtPullData    *pull_data,
+                                SoupURI       *uri,
+                                gboolean       add_nul,
+                                gboolean       allow_noent,
+                                gboolean       use_cache,
+                                GBytes       **out_contents,
+                                GCancellable  *cancellable,
+                                GError       **error)
 {
   gboolean ret = FALSE;
   const guint8 nulchar = 0;
-  gs_free char *ret_contents = NULL;
+  gs_unref_bytes GBytes *ret_contents = NULL;
   gs_unref_object GMemoryOutputStream *buf = NULL;
   OstreeFetchUriSyncData fetch_data = { 0, };
+  GError *local_error = NULL;
 
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
   fetch_data.pull_data = pull_data;
+  fetch_data.error = &local_error;
 
   pull_data->fetching_sync_uri = uri;
-  ostree_fetcher_stream_uri_async (pull_data->fetcher, uri, cancellable,
-                                   fetch_uri_sync_on_complete, &fetch_data);
+  if (use_cache)
+    ostree_fetcher_request_uri_cached_async (pull_data->fetcher, uri, cancellable,
+                                             fetch_uri_cached_sync_on_complete, &fetch_data);
+  else
+    ostree_fetcher_stream_uri_async (pull_data->fetcher, uri, cancellable,
+                                     fetch_uri_sync_on_complete, &fetch_data);
 
   run_mainloop_monitor_fetcher (pull_data);
+  if (fetch_data.result_bytes)
+    fetch_data.result_stream = g_memory_input_stream_new_from_bytes (fetch_data.result_bytes);
   if (!fetch_data.result_stream)
-    goto out;
+    {
+      if (allow_noent && g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&local_error);
+          ret = TRUE;
+          if (out_contents)
+            *out_contents = NULL;
+        }
+      else
+        g_propagate_error (error, local_error);
+      goto out;
+    }
 
   buf = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
   if (g_output_stream_splice ((GOutputStream*)buf, fetch_data.result_stream,
@@ -363,14 +453,43 @@ fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
                               cancellable, error) < 0)
     goto out;
 
-  /* Add trailing NUL */
-  if (!g_output_stream_write ((GOutputStream*)buf, &nulchar, 1, cancellable, error))
-    goto out;
+  if (add_nul)
+    {
+      if (!g_output_stream_write ((GOutputStream*)buf, &nulchar, 1, cancellable, error))
+        goto out;
+    }
 
   if (!g_output_stream_close ((GOutputStream*)buf, cancellable, error))
     goto out;
 
-  ret_contents = g_memory_output_stream_steal_data (buf);
+  ret_contents = g_memory_output_stream_steal_as_bytes (buf);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_contents, &ret_contents);
+ out:
+  g_clear_object (&(fetch_data.result_stream));
+  g_clear_pointer (&(fetch_data.result_bytes), g_bytes_unref);
+  return ret;
+}
+
+static gboolean
+fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
+                              SoupURI     *uri,
+                              char       **out_contents,
+                              GCancellable  *cancellable,
+                              GError     **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_free char *ret_contents = NULL;
+  gsize len;
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, uri, TRUE, FALSE, TRUE,
+                                       &bytes, cancellable, error))
+    goto out;
+
+  ret_contents = g_bytes_unref_to_data (bytes, &len);
+  bytes = NULL;
 
   if (!g_utf8_validate (ret_contents, -1, NULL))
     {
@@ -382,7 +501,6 @@ fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
   ret = TRUE;
   ot_transfer_out_value (out_contents, &ret_contents);
  out:
-  g_clear_object (&(fetch_data.result_stream));
   return ret;
 }
 
@@ -433,14 +551,25 @@ scan_dirtree_object (OtPullData   *pull_data,
                                    &file_is_stored, cancellable, error))
         goto out;
       
-      if (!file_is_stored && !g_hash_table_lookup (pull_data->requested_content, file_checksum))
+      if (!file_is_stored)
         {
-          g_hash_table_insert (pull_data->requested_content, file_checksum, file_checksum);
-      
-          ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
-                                  pull_worker_message_new (PULL_MSG_FETCH,
-                                                           ostree_object_name_serialize (file_checksum, OSTREE_OBJECT_TYPE_FILE)));
-          file_checksum = NULL; /* Transfer ownership to hash */
+          gboolean need_fetch = FALSE;
+
+          g_mutex_lock (&pull_data->scan_lock);
+          if (!g_hash_table_lookup (pull_data->requested_content, file_checksum))
+            {
+              g_hash_table_insert (pull_data->requested_content, file_checksum, file_checksum);
+              need_fetch = TRUE;
+            }
+          g_mutex_unlock (&pull_data->scan_lock);
+
+          if (need_fetch)
+            {
+              ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
+                                      pull_worker_message_new (PULL_MSG_FETCH,
+                                                               ostree_object_name_serialize (file_checksum, OSTREE_OBJECT_TYPE_FILE)));
+              file_checksum = NULL; /* Transfer ownership to hash */
+            }
         }
     }
       
@@ -450,6 +579,7 @@ scan_dirtree_object (OtPullData   *pull_data,
       const char *dirname;
       gs_unref_variant GVariant *tree_csum = NULL;
       gs_unref_variant GVariant *meta_csum = NULL;
+      gs_free char *tree_checksum = NULL;
 
       g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
                            &dirname, &tree_csum, &meta_csum);
@@ -457,10 +587,11 @@ scan_dirtree_object (OtPullData   *pull_data,
       if (!ot_util_filename_validate (dirname, error))
         goto out;
 
-      if (!scan_one_metadata_object (pull_data, ostree_checksum_bytes_peek (tree_csum),
-                                     OSTREE_OBJECT_TYPE_DIR_TREE, recursion_depth + 1,
-                                     cancellable, error))
-        goto out;
+      /* Subdirectories are scanned by the next free worker */
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum);
+      queue_scan_one_metadata_object (pull_data,
+                                      ostree_object_name_serialize (tree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE),
+                                      recursion_depth + 1);
       
       if (!scan_one_metadata_object (pull_data, ostree_checksum_bytes_peek (meta_csum),
                                      OSTREE_OBJECT_TYPE_DIR_META, recursion_depth + 1,
@@ -516,8 +647,14 @@ content_fetch_on_write_complete (GObject        *object,
   gs_free guchar *csum = NULL;
   gs_free char *checksum = NULL;
 
-  if (!ostree_repo_write_content_finish ((OstreeRepo*)object, result, 
-                                         &csum, error))
+  if (pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      if (!_ostree_repo_write_archive_content_finish ((OstreeRepo*)object, result,
+                                                      &csum, error))
+        goto out;
+    }
+  else if (!ostree_repo_write_content_finish ((OstreeRepo*)object, result, 
+                                              &csum, error))
     goto out;
 
   checksum = ostree_checksum_from_bytes (csum);
@@ -539,8 +676,12 @@ content_fetch_on_write_complete (GObject        *object,
  out:
   pull_data->n_outstanding_content_write_requests--;
   check_outstanding_requests_handle_error (pull_data, local_error);
-  (void) gs_file_unlink (fetch_data->temp_path, NULL, NULL);
-  g_object_unref (fetch_data->temp_path);
+  if (fetch_data->temp_path)
+    {
+      (void) gs_file_unlink (fetch_data->temp_path, NULL, NULL);
+      g_object_unref (fetch_data->temp_path);
+    }
+  g_clear_pointer (&fetch_data->membuf, g_bytes_unref);
   g_variant_unref (fetch_data->object);
   g_free (fetch_data);
 }
@@ -563,15 +704,85 @@ content_fetch_on_complete (GObject        *object,
   const char *checksum;
   OstreeObjectType objtype;
 
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+  g_assert (objtype == OSTREE_OBJECT_TYPE_FILE);
+
+  if (g_async_result_is_tagged (result, ostree_fetcher_request_uri_to_membuf_async))
+    {
+      gs_unref_object GInputStream *membuf_in = NULL;
+
+      fetch_data->membuf = ostree_fetcher_request_uri_to_membuf_finish ((OstreeFetcher*)object, result, error);
+      if (!fetch_data->membuf)
+        goto out;
+
+      g_debug ("fetch of %s complete", ostree_object_to_string (checksum, objtype));
+
+      /* Fetched from a pack; store it as is, like below */
+      if (pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+        {
+          gs_free char *temp_name = NULL;
+          gs_unref_object GOutputStream *temp_out = NULL;
+          gsize bytes_written;
+
+          if (!gs_file_open_in_tmpdir_at (pull_data->repo->tmp_dir_fd, 0644,
+                                          &temp_name, &temp_out,
+                                          cancellable, error))
+            goto out;
+          fetch_data->temp_path = g_file_get_child (pull_data->repo->tmp_dir, temp_name);
+
+          if (!g_output_stream_write_all (temp_out, g_bytes_get_data (fetch_data->membuf, NULL),
+                                          g_bytes_get_size (fetch_data->membuf),
+                                          &bytes_written, cancellable, error))
+            goto out;
+          if (!g_output_stream_close (temp_out, cancellable, error))
+            goto out;
+
+          pull_data->n_outstanding_content_write_requests++;
+          _ostree_repo_write_archive_content_async (pull_data->repo, checksum,
+                                                    fetch_data->temp_path, TRUE,
+                                                    cancellable,
+                                                    content_fetch_on_write_complete, fetch_data);
+          goto out;
+        }
+
+      membuf_in = g_memory_input_stream_new_from_bytes (fetch_data->membuf);
+      if (!ostree_content_stream_parse (TRUE, membuf_in, g_bytes_get_size (fetch_data->membuf),
+                                        FALSE, &file_in, &file_info, &xattrs,
+                                        cancellable, error))
+        goto out;
+
+      if (!ostree_raw_file_to_content_stream (file_in, file_info, xattrs,
+                                              &object_input, &length,
+                                              cancellable, error))
+        goto out;
+
+      pull_data->n_outstanding_content_write_requests++;
+      ostree_repo_write_content_async (pull_data->repo, checksum,
+                                       object_input, length,
+                                       cancellable,
+                                       content_fetch_on_write_complete, fetch_data);
+      goto out;
+    }
+
   fetch_data->temp_path = ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
   if (!fetch_data->temp_path)
     goto out;
 
-  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
-  g_assert (objtype == OSTREE_OBJECT_TYPE_FILE);
-
   g_debug ("fetch of %s complete", ostree_object_to_string (checksum, objtype));
 
+  /* The remote is always archive-z2; if we are too, store the fetched
+   * object as is rather than inflating and deflating it again.
+   */
+  if (pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      pull_data->n_outstanding_content_write_requests++;
+      _ostree_repo_write_archive_content_async (pull_data->repo, checksum,
+                                                fetch_data->temp_path, TRUE,
+                                                cancellable,
+                                                content_fetch_on_write_complete, fetch_data);
+      goto out;
+    }
+
   if (!ostree_content_file_parse (TRUE, fetch_data->temp_path, FALSE,
                                   &file_in, &file_info, &xattrs,
                                   cancellable, error))
@@ -627,13 +838,10 @@ on_metadata_writed (GObject           *object,
     }
 
   pull_data->metadata_scan_idle = FALSE;
-  ot_waitable_queue_push (pull_data->metadata_objects_to_scan,
-                          pull_worker_message_new (PULL_MSG_SCAN,
-                                                  g_variant_ref (fetch_data->object)));
+  queue_scan_one_metadata_object (pull_data, g_variant_ref (fetch_data->object), 0);
  out:
   pull_data->n_outstanding_metadata_write_requests--;
-  (void) gs_file_unlink (fetch_data->temp_path, NULL, NULL);
-  g_object_unref (fetch_data->temp_path);
+  g_bytes_unref (fetch_data->membuf);
   g_variant_unref (fetch_data->object);
   g_free (fetch_data);
 
@@ -655,14 +863,15 @@ meta_fetch_on_complete (GObject           *object,
   gs_unref_variant GVariant *metadata = NULL;
   const char *checksum;
   OstreeObjectType objtype;
+  gboolean free_fetch_data = TRUE;
   GError *local_error = NULL;
   GError **error = &local_error;
 
   ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
   g_debug ("fetch of %s complete", ostree_object_to_string (checksum, objtype));
 
-  fetch_data->temp_path = ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
-  if (!fetch_data->temp_path)
+  fetch_data->membuf = ostree_fetcher_request_uri_to_membuf_finish ((OstreeFetcher*)object, result, error);
+  if (!fetch_data->membuf)
     {
       if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         goto out;
@@ -678,9 +887,8 @@ meta_fetch_on_complete (GObject           *object,
 
   if (fetch_data->is_detached_meta)
     {
-      if (!ot_util_variant_map (fetch_data->temp_path, G_VARIANT_TYPE ("a{sv}"),
-                                FALSE, &metadata, error))
-        goto out;
+      metadata = g_variant_new_from_bytes (G_VARIANT_TYPE ("a{sv}"), fetch_data->membuf, FALSE);
+      g_variant_ref_sink (metadata);
       if (!ostree_repo_write_commit_detached_metadata (pull_data->repo, checksum, metadata,
                                                        pull_data->cancellable, error))
         goto out;
@@ -689,27 +897,78 @@ meta_fetch_on_complete (GObject           *object,
     }
   else
     {
-      if (!ot_util_variant_map (fetch_data->temp_path, ostree_metadata_variant_type (objtype),
-                                FALSE, &metadata, error))
-        goto out;
-      
+      metadata = g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                           fetch_data->membuf, FALSE);
+      g_variant_ref_sink (metadata);
+
       ostree_repo_write_metadata_async (pull_data->repo, objtype, checksum, metadata,
                                         pull_data->cancellable,
                                         on_metadata_writed, fetch_data);
       pull_data->n_outstanding_metadata_write_requests++;
+      free_fetch_data = FALSE;
     }
 
  out:
   pull_data->n_outstanding_metadata_fetches--;
   pull_data->n_fetched_metadata++;
   throw_async_error (pull_data, local_error);
-  if (local_error)
+  if (free_fetch_data)
     {
+      g_clear_pointer (&fetch_data->membuf, g_bytes_unref);
       g_variant_unref (fetch_data->object);
       g_free (fetch_data);
     }
 }
 
+/* If the commit has an ostree.sizes index, remember the download
+ * size of each content object so the fetcher can prioritize them.
+ */
+static gboolean
+add_expected_content_sizes (OtPullData   *pull_data,
+                            GVariant     *commit,
+                            GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *metadata = NULL;
+  gs_unref_variant GVariant *sizes = NULL;
+  guint i, n;
+
+  metadata = g_variant_get_child_value (commit, 0);
+  sizes = g_variant_lookup_value (metadata, "ostree.sizes",
+                                  G_VARIANT_TYPE ("a" _OSTREE_OBJECT_SIZES_ENTRY_SIGNATURE));
+  if (!sizes)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_mutex_lock (&pull_data->expected_sizes_lock);
+  n = g_variant_n_children (sizes);
+  for (i = 0; i < n; i++)
+    {
+      gs_unref_variant GVariant *entry = g_variant_get_child_value (sizes, i);
+      const guint8 *data;
+      gsize len, bytes_read;
+      guint64 archived;
+
+      data = g_variant_get_fixed_array (entry, &len, 1);
+      if (len <= 32)
+        continue;
+      archived = _ostree_read_varuint64 (data + 32, len - 32, &bytes_read);
+      if (bytes_read == 0)
+        continue;
+
+      g_hash_table_replace (pull_data->expected_content_sizes,
+                            ostree_checksum_from_bytes (data),
+                            GUINT_TO_POINTER ((guint) MIN (archived, G_MAXUINT)));
+    }
+  g_mutex_unlock (&pull_data->expected_sizes_lock);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 scan_commit_object (OtPullData         *pull_data,
                     const char         *checksum,
@@ -721,6 +980,7 @@ scan_commit_object (OtPullData         *pull_data,
   gs_unref_variant GVariant *commit = NULL;
   gs_unref_variant GVariant *tree_contents_csum = NULL;
   gs_unref_variant GVariant *tree_meta_csum = NULL;
+  gs_free char *tree_contents_checksum = NULL;
   GVariantIter *iter = NULL;
 
   if (recursion_depth > OSTREE_MAX_RECURSION)
@@ -747,14 +1007,17 @@ scan_commit_object (OtPullData         *pull_data,
                                  &commit, error))
     goto out;
 
+  if (!add_expected_content_sizes (pull_data, commit, error))
+    goto out;
+
   /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
   g_variant_get_child (commit, 6, "@ay", &tree_contents_csum);
   g_variant_get_child (commit, 7, "@ay", &tree_meta_csum);
 
-  if (!scan_one_metadata_object (pull_data, ostree_checksum_bytes_peek (tree_contents_csum),
-                                 OSTREE_OBJECT_TYPE_DIR_TREE, recursion_depth + 1,
-                                 cancellable, error))
-    goto out;
+  tree_contents_checksum = ostree_checksum_from_bytes_v (tree_contents_csum);
+  queue_scan_one_metadata_object (pull_data,
+                                  ostree_object_name_serialize (tree_contents_checksum, OSTREE_OBJECT_TYPE_DIR_TREE),
+                                  recursion_depth + 1);
 
   if (!scan_one_metadata_object (pull_data, ostree_checksum_bytes_peek (tree_meta_csum),
                                  OSTREE_OBJECT_TYPE_DIR_META, recursion_depth + 1,
@@ -780,24 +1043,48 @@ scan_one_metadata_object (OtPullData         *pull_data,
   gs_unref_variant GVariant *object = NULL;
   gs_free char *tmp_checksum = NULL;
   gboolean is_requested;
+  gboolean is_scanned;
   gboolean is_stored;
+  gboolean need_fetch = FALSE;
+  gboolean need_scan = FALSE;
 
   tmp_checksum = ostree_checksum_from_bytes (csum);
   object = ostree_object_name_serialize (tmp_checksum, objtype);
 
-  if (g_hash_table_lookup (pull_data->scanned_metadata, object))
+  g_mutex_lock (&pull_data->scan_lock);
+  is_scanned = g_hash_table_lookup (pull_data->scanned_metadata, object) != NULL;
+  g_mutex_unlock (&pull_data->scan_lock);
+  if (is_scanned)
     return TRUE;
 
-  is_requested = g_hash_table_lookup (pull_data->requested_metadata, tmp_checksum) != NULL;
+  /* Not under the lock; this is the part we want to run in parallel */
   if (!ostree_repo_has_object (pull_data->repo, objtype, tmp_checksum, &is_stored,
                                cancellable, error))
     goto out;
 
-  if (!is_stored && !is_requested)
+  /* Another worker may have requested or scanned the object in the
+   * meantime, so check again and record what we're doing atomically.
+   * An object is always marked as requested before its fetch starts,
+   * so if it's stored now we can't miss that we requested it.
+   */
+  g_mutex_lock (&pull_data->scan_lock);
+  is_scanned = g_hash_table_lookup (pull_data->scanned_metadata, object) != NULL;
+  is_requested = g_hash_table_lookup (pull_data->requested_metadata, tmp_checksum) != NULL;
+  if (!is_scanned && !is_stored && !is_requested)
     {
       char *duped_checksum = g_strdup (tmp_checksum);
       g_hash_table_insert (pull_data->requested_metadata, duped_checksum, duped_checksum);
-      
+      need_fetch = TRUE;
+    }
+  else if (!is_scanned && is_stored)
+    {
+      g_hash_table_insert (pull_data->scanned_metadata, g_variant_ref (object), object);
+      need_scan = TRUE;
+    }
+  g_mutex_unlock (&pull_data->scan_lock);
+
+  if (need_fetch)
+    {
       if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
         ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
                                 pull_worker_message_new (PULL_MSG_FETCH_DETACHED_METADATA,
@@ -807,8 +1094,10 @@ scan_one_metadata_object (OtPullData         *pull_data,
                                 pull_worker_message_new (PULL_MSG_FETCH,
                                                          g_variant_ref (object)));
     }
-  else if (is_stored)
+  else if (need_scan)
     {
+      g_atomic_int_inc (&pull_data->n_scanned_metadata);
+
       if (pull_data->transaction_resuming || is_requested)
         {
           switch (objtype)
@@ -830,8 +1119,6 @@ scan_one_metadata_object (OtPullData         *pull_data,
               break;
             }
         }
-      g_hash_table_insert (pull_data->scanned_metadata, g_variant_ref (object), object);
-      g_atomic_int_inc (&pull_data->n_scanned_metadata);
     }
 
   ret = TRUE;
@@ -839,23 +1126,6 @@ scan_one_metadata_object (OtPullData         *pull_data,
   return ret;
 }
 
-static gboolean
-scan_one_metadata_object_v_name (OtPullData         *pull_data,
-                                 GVariant           *object,
-                                 GCancellable       *cancellable,
-                                 GError            **error)
-{
-  OstreeObjectType objtype;
-  const char *checksum = NULL;
-  gs_free guchar *csum = NULL;
-
-  ostree_object_name_deserialize (object, &checksum, &objtype);
-  csum = ostree_checksum_to_bytes (checksum);
-
-  return scan_one_metadata_object (pull_data, csum, objtype, 0,
-                                   cancellable, error);
-}
-
 typedef struct {
   OtPullData *pull_data;
   GError *error;
@@ -872,84 +1142,82 @@ idle_throw_error (gpointer user_data)
   return FALSE;
 }
 
-static gboolean
-on_metadata_objects_to_scan_ready (gint         fd,
-                                   GIOCondition condition,
-                                   gpointer     user_data)
+/**
+ * metadata_scan_thread:
+ *
+ * Run by each metadata scan worker.  We scan one object, queueing a
+ * request to the main thread to fetch anything that's missing; when it
+ * has been fetched, the main thread queues it back to us for scanning.
+ * Subdirectories are queued as separate jobs, so large trees are
+ * walked by all workers at once.
+ */
+static void
+metadata_scan_thread (gpointer data,
+                      gpointer user_data)
 {
+  PullScanJob *job = data;
   OtPullData *pull_data = user_data;
-  PullWorkerMessage *msg;
-  PullWorkerMessage *last_idle_msg = NULL;
+  OstreeObjectType objtype;
+  const char *checksum = NULL;
+  gs_free guchar *csum = NULL;
   GError *local_error = NULL;
-  GError **error = &local_error;
 
-  while (ot_waitable_queue_pop (pull_data->metadata_objects_to_scan, (gpointer*)&msg))
-    {
-      if (msg->t == PULL_MSG_SCAN)
-        {
-          if (!scan_one_metadata_object_v_name (pull_data, msg->d.item,
-                                                pull_data->cancellable, error))
-            goto out;
-          g_variant_unref (msg->d.item);
-          g_free (msg);
-        }
-      else if (msg->t == PULL_MSG_MAIN_IDLE)
-        {
-          g_free (last_idle_msg);
-          last_idle_msg = msg;
-        }
-      else if (msg->t == PULL_MSG_QUIT)
-        {
-          g_free (msg);
-          g_main_loop_quit (pull_data->metadata_thread_loop);
-        }
-      else
-        g_assert_not_reached ();
-      }
-    
-  if (last_idle_msg)
-    ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
-                            last_idle_msg);
-  
-  /* When we have no queue to process, notify the main thread */
-  ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
-                          pull_worker_message_new (PULL_MSG_SCAN_IDLE, GUINT_TO_POINTER (0)));
+  if (g_atomic_int_get (&pull_data->metadata_scan_aborted))
+    goto out;
 
- out:
-  if (local_error)
+  ostree_object_name_deserialize (job->object, &checksum, &objtype);
+  csum = ostree_checksum_to_bytes (checksum);
+
+  if (!scan_one_metadata_object (pull_data, csum, objtype, job->recursion_depth,
+                                 pull_data->cancellable, &local_error))
     {
       IdleThrowErrorData *throwdata = g_new0 (IdleThrowErrorData, 1);
+
+      g_atomic_int_set (&pull_data->metadata_scan_aborted, 1);
       throwdata->pull_data = pull_data;
       throwdata->error = local_error;
       g_main_context_invoke (NULL, idle_throw_error, throwdata);
     }
-  return TRUE;
+
+ out:
+  g_variant_unref (job->object);
+  g_free (job);
+
+  /* Any fetches and child jobs this one queued were queued before
+   * this point; if we were the last, wake up the main thread so it
+   * can notice the scan is complete.
+   */
+  if (g_atomic_int_dec_and_test (&pull_data->n_outstanding_metadata_scans))
+    ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
+                            pull_worker_message_new (PULL_MSG_SCAN_IDLE, NULL));
 }
 
-/**
- * metadata_thread_main:
- *
- * Called from the metadatascan worker thread. If we're missing an
- * object from one of them, we queue a request to the main thread to
- * fetch it.  When it's fetched, we get passed the object back and
- * scan it.
- */
-static gpointer
-metadata_thread_main (gpointer user_data)
+/* Takes ownership of @object; may be called from any thread */
+static void
+queue_scan_one_metadata_object (OtPullData         *pull_data,
+                                GVariant           *object,
+                                guint               recursion_depth)
 {
-  OtPullData *pull_data = user_data;
-  GSource *src;
+  PullScanJob *job;
 
-  pull_data->metadata_thread_context = g_main_context_new ();
-  pull_data->metadata_thread_loop = g_main_loop_new (pull_data->metadata_thread_context, TRUE);
+  /* Checked under the lock so we can't race with the pool being
+   * freed on error.
+   */
+  g_mutex_lock (&pull_data->scan_lock);
+  if (pull_data->metadata_scan_aborted)
+    {
+      g_mutex_unlock (&pull_data->scan_lock);
+      g_variant_unref (object);
+      return;
+    }
 
-  src = ot_waitable_queue_create_source (pull_data->metadata_objects_to_scan);
-  g_source_set_callback (src, (GSourceFunc)on_metadata_objects_to_scan_ready, pull_data, NULL);
-  g_source_attach (src, pull_data->metadata_thread_context);
-  g_source_unref (src);
+  job = g_new0 (PullScanJob, 1);
+  job->object = object;
+  job->recursion_depth = recursion_depth;
 
-  g_main_loop_run (pull_data->metadata_thread_loop);
-  return NULL;
+  g_atomic_int_inc (&pull_data->n_outstanding_metadata_scans);
+  g_thread_pool_push (pull_data->metadata_scan_pool, job, NULL);
+  g_mutex_unlock (&pull_data->scan_lock);
 }
 
 static void
@@ -962,7 +1230,11 @@ enqueue_one_object_request (OtPullData        *pull_data,
   SoupURI *obj_uri = NULL;
   gboolean is_meta;
   FetchObjectData *fetch_data;
+  guint64 expected_size = 0;
   gs_free char *objpath = NULL;
+  OtRemotePack *remote_pack = NULL;
+  guint64 pack_offset = 0;
+  guint64 pack_size = 0;
 
   ostree_object_name_deserialize (object_name, &checksum, &objtype);
 
@@ -975,8 +1247,13 @@ enqueue_one_object_request (OtPullData        *pull_data,
     }
   else
     {
-      objpath = _ostree_get_relative_object_path (checksum, objtype, TRUE);
-      obj_uri = suburi_new (pull_data->base_uri, objpath, NULL);
+      remote_pack = lookup_remote_pack (pull_data, checksum, objtype,
+                                        &pack_offset, &pack_size);
+      if (!remote_pack)
+        {
+          objpath = _ostree_get_relative_object_path (checksum, objtype, TRUE);
+          obj_uri = suburi_new (pull_data->base_uri, objpath, NULL);
+        }
     }
 
   is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
@@ -989,14 +1266,40 @@ enqueue_one_object_request (OtPullData        *pull_data,
     {
       pull_data->n_outstanding_content_fetches++;
       pull_data->n_requested_content++;
+
+      g_mutex_lock (&pull_data->expected_sizes_lock);
+      expected_size = GPOINTER_TO_UINT (g_hash_table_lookup (pull_data->expected_content_sizes, checksum));
+      g_mutex_unlock (&pull_data->expected_sizes_lock);
     }
   fetch_data = g_new0 (FetchObjectData, 1);
   fetch_data->pull_data = pull_data;
   fetch_data->object = g_variant_ref (object_name);
   fetch_data->is_detached_meta = is_detached_meta;
-  ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri, pull_data->cancellable,
-                                                 is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
-  soup_uri_free (obj_uri);
+  if (remote_pack)
+    ostree_fetcher_request_uri_range_to_membuf_async (pull_data->fetcher, remote_pack->data_uri,
+                                                      pack_offset, pack_size,
+                                                      is_meta, pack_size,
+                                                      pull_data->cancellable,
+                                                      is_meta ? meta_fetch_on_complete : content_fetch_on_complete,
+                                                      fetch_data);
+  else if (is_meta)
+    ostree_fetcher_request_uri_to_membuf_async (pull_data->fetcher, obj_uri,
+                                                TRUE, expected_size,
+                                                pull_data->cancellable,
+                                                meta_fetch_on_complete, fetch_data);
+  else if (pull_data->repo->mode != OSTREE_REPO_MODE_ARCHIVE_Z2
+           && expected_size > 0 && expected_size < OSTREE_PULL_MEMBUF_CONTENT_MAX)
+    ostree_fetcher_request_uri_to_membuf_async (pull_data->fetcher, obj_uri,
+                                                FALSE, expected_size,
+                                                pull_data->cancellable,
+                                                content_fetch_on_complete, fetch_data);
+  else
+    ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri,
+                                                   FALSE, expected_size,
+                                                   pull_data->cancellable,
+                                                   content_fetch_on_complete, fetch_data);
+  if (obj_uri)
+    soup_uri_free (obj_uri);
 }
 
 static gboolean
@@ -1006,46 +1309,52 @@ on_metadata_objects_to_fetch_ready (gint         fd,
 {
   OtPullData *pull_data = user_data;
   PullWorkerMessage *msg;
+  gboolean scans_complete;
+  gboolean woken_by_idle;
 
-  if (!ot_waitable_queue_pop (pull_data->metadata_objects_to_fetch, (gpointer*)&msg))
-    goto out;
-
-  if (msg->t == PULL_MSG_MAIN_IDLE)
-    {
-      if (msg->d.idle_serial == pull_data->idle_serial)
-        {
-          g_assert (!pull_data->metadata_scan_idle);
-          pull_data->metadata_scan_idle = TRUE;
-          g_debug ("pull: metadata scan is idle");
-        }
-    }
-  else if (msg->t == PULL_MSG_SCAN_IDLE)
+  do
     {
-      if (!pull_data->metadata_scan_idle)
+      /* Workers queue their fetch requests before finishing, and only
+       * the main thread starts new top-level scans.  So if no scans
+       * are outstanding now, everything they will ever ask us to
+       * fetch is already in the queue, and draining it leaves nothing
+       * behind.
+       */
+      scans_complete = g_atomic_int_get (&pull_data->n_outstanding_metadata_scans) == 0;
+      woken_by_idle = FALSE;
+
+      while (ot_waitable_queue_pop (pull_data->metadata_objects_to_fetch, (gpointer*)&msg))
         {
-          g_debug ("pull: queue MAIN_IDLE");
-          pull_data->idle_serial++;
-          ot_waitable_queue_push (pull_data->metadata_objects_to_scan,
-                                  pull_worker_message_new (PULL_MSG_MAIN_IDLE, GUINT_TO_POINTER (pull_data->idle_serial)));
-        }
-    }
-  else if (msg->t == PULL_MSG_FETCH || msg->t == PULL_MSG_FETCH_DETACHED_METADATA)
-    {
-      gboolean is_detached_meta;
+          if (msg->t == PULL_MSG_FETCH || msg->t == PULL_MSG_FETCH_DETACHED_METADATA)
+            {
+              gboolean is_detached_meta;
 
-      is_detached_meta = msg->t == PULL_MSG_FETCH_DETACHED_METADATA;
-      
-      enqueue_one_object_request (pull_data, msg->d.item, is_detached_meta);
+              is_detached_meta = msg->t == PULL_MSG_FETCH_DETACHED_METADATA;
+
+              enqueue_one_object_request (pull_data, msg->d.item, is_detached_meta);
+
+              g_variant_unref (msg->d.item);
+            }
+          else
+            {
+              g_assert (msg->t == PULL_MSG_SCAN_IDLE);
+              woken_by_idle = TRUE;
+            }
+          g_free (msg);
+        }
 
-      g_variant_unref (msg->d.item);
+      /* If the last scan finished while we were draining, we consumed
+       * its wakeup; go around again rather than waiting for another.
+       */
     }
-  else
+  while (!scans_complete && woken_by_idle);
+
+  if (scans_complete && !pull_data->metadata_scan_idle)
     {
-      g_assert_not_reached ();
+      g_debug ("pull: metadata scan is idle");
+      pull_data->metadata_scan_idle = TRUE;
     }
-  g_free (msg);
 
- out:
   check_outstanding_requests_handle_error (pull_data, NULL);
   
   return TRUE;
@@ -1105,6 +1414,42 @@ parse_ref_summary (const char    *contents,
   return ret;
 }
 
+static gboolean
+keyfile_get_uint_with_default (GKeyFile      *keyfile,
+                               const char    *section,
+                               const char    *key,
+                               guint          default_value,
+                               guint         *out_value,
+                               GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *value = NULL;
+  guint64 parsed;
+  char *endp;
+
+  if (!ot_keyfile_get_value_with_default (keyfile, section, key, NULL,
+                                          &value, error))
+    goto out;
+
+  if (value == NULL)
+    parsed = default_value;
+  else
+    {
+      parsed = g_ascii_strtoull (value, &endp, 10);
+      if (*value == '\0' || *endp != '\0' || parsed > G_MAXUINT)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid value '%s' for %s in [%s]", value, key, section);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  *out_value = (guint) parsed;
+ out:
+  return ret;
+}
+
 static gboolean
 repo_get_string_key_inherit (OstreeRepo          *repo,
                              const char          *section,
@@ -1174,6 +1519,302 @@ load_remote_repo_config (OtPullData    *pull_data,
   return ret;
 }
 
+/*
+ * Load the remote's list of packs, and their indexes.  Packed objects
+ * may not exist loose, so they are fetched from the pack's data file
+ * with a range request instead.  Packs are immutable, so once we have
+ * an index, fetching it again through the cache costs only a "304
+ * Not Modified".
+ */
+static gboolean
+load_remote_packs (OtPullData    *pull_data,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_bytes GBytes *list_bytes = NULL;
+  char **lines = NULL;
+  char **iter;
+  SoupURI *list_uri = NULL;
+
+  pull_data->remote_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) remote_pack_free);
+
+  list_uri = suburi_new (pull_data->base_uri, "objects", "pack", "packs", NULL);
+  if (!fetch_uri_contents_membuf_sync (pull_data, list_uri, TRUE, TRUE, TRUE,
+                                       &list_bytes, cancellable, error))
+    goto out;
+
+  /* Nothing is packed */
+  if (!list_bytes)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  lines = g_strsplit (g_bytes_get_data (list_bytes, NULL), "\n", -1);
+  for (iter = lines; *iter; iter++)
+    {
+      const char *pack_file = *iter;
+      gs_free char *index_name = NULL;
+      gs_free char *data_name = NULL;
+      gs_unref_bytes GBytes *index = NULL;
+      OstreeRepoPack *pack = NULL;
+      OtRemotePack *remote_pack;
+      SoupURI *index_uri;
+      gboolean fetched;
+
+      if (!*pack_file)
+        continue;
+
+      if (!_ostree_repo_pack_validate_name (pack_file, error))
+        goto out;
+
+      index_name = g_strconcat (pack_file, ".index", NULL);
+      index_uri = suburi_new (pull_data->base_uri, "objects", "pack", index_name, NULL);
+      fetched = fetch_uri_contents_membuf_sync (pull_data, index_uri, FALSE, TRUE, TRUE,
+                                                &index, cancellable, error);
+      soup_uri_free (index_uri);
+      if (!fetched)
+        goto out;
+
+      /* Deleted by a concurrent prune; its objects are in another pack */
+      if (!index)
+        continue;
+
+      if (!_ostree_repo_pack_new_from_index (pack_file, index, &pack, error))
+        goto out;
+
+      data_name = g_strconcat (pack_file, ".data", NULL);
+      remote_pack = g_new0 (OtRemotePack, 1);
+      remote_pack->pack = pack;
+      remote_pack->data_uri = suburi_new (pull_data->base_uri, "objects", "pack", data_name, NULL);
+      g_ptr_array_add (pull_data->remote_packs, remote_pack);
+    }
+
+  ret = TRUE;
+ out:
+  g_strfreev (lines);
+  if (list_uri)
+    soup_uri_free (list_uri);
+  return ret;
+}
+
+static gboolean
+request_static_delta_superblock_sync (OtPullData    *pull_data,
+                                      const char    *from_revision,
+                                      const char    *to_revision,
+                                      GVariant     **out_delta_superblock,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *ret_delta_superblock = NULL;
+  gs_free char *delta_name = _ostree_get_relative_static_delta_path (from_revision, to_revision);
+  gs_unref_bytes GBytes *delta_superblock_data = NULL;
+  SoupURI *target_uri = NULL;
+
+  target_uri = suburi_new (pull_data->base_uri, delta_name, "superblock", NULL);
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE, FALSE,
+                                       &delta_superblock_data,
+                                       cancellable, error))
+    goto out;
+
+  if (delta_superblock_data)
+    {
+      gs_unref_variant GVariant *to_csum_v = NULL;
+      gs_free char *to_checksum = NULL;
+
+      ret_delta_superblock = g_variant_new_from_data (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT),
+                                                      g_bytes_get_data (delta_superblock_data, NULL),
+                                                      g_bytes_get_size (delta_superblock_data),
+                                                      FALSE,
+                                                      (GDestroyNotify) g_bytes_unref,
+                                                      g_bytes_ref (delta_superblock_data));
+      g_variant_ref_sink (ret_delta_superblock);
+
+      to_csum_v = g_variant_get_child_value (ret_delta_superblock, 3);
+      if (!ostree_validate_structureof_csum_v (to_csum_v, error))
+        goto out;
+      to_checksum = ostree_checksum_from_bytes_v (to_csum_v);
+      if (strcmp (to_checksum, to_revision) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Static delta %s targets commit %s, expected %s",
+                       delta_name, to_checksum, to_revision);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_delta_superblock, &ret_delta_superblock);
+ out:
+  g_clear_pointer (&target_uri, (GDestroyNotify) soup_uri_free);
+  return ret;
+}
+
+static gboolean
+process_one_static_delta (OtPullData    *pull_data,
+                          const char    *from_revision,
+                          const char    *to_revision,
+                          GVariant      *delta_superblock,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *headers = NULL;
+  gs_free char *delta_name = _ostree_get_relative_static_delta_path (from_revision, to_revision);
+  guint i, n;
+
+  headers = g_variant_get_child_value (delta_superblock, 6);
+  n = g_variant_n_children (headers);
+  for (i = 0; i < n; i++)
+    {
+      gs_unref_variant GVariant *header = NULL;
+      gs_unref_bytes GBytes *part_data = NULL;
+      gs_free char *part_name = NULL;
+      SoupURI *target_uri = NULL;
+      gboolean is_fetched;
+      gboolean fetched_part;
+
+      header = g_variant_get_child_value (headers, i);
+
+      if (!_ostree_static_delta_part_is_fetched (pull_data->repo, header, &is_fetched,
+                                                 cancellable, error))
+        goto out;
+      if (is_fetched)
+        continue;
+
+      part_name = g_strdup_printf ("%u", i);
+      target_uri = suburi_new (pull_data->base_uri, delta_name, part_name, NULL);
+      fetched_part = fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, FALSE, FALSE,
+                                                     &part_data, cancellable, error);
+      soup_uri_free (target_uri);
+      if (!fetched_part)
+        goto out;
+
+      if (!_ostree_static_delta_part_execute (pull_data->repo, header, part_data,
+                                              cancellable, error))
+        {
+          g_prefix_error (error, "Executing delta part %u: ", i);
+          goto out;
+        }
+    }
+
+  if (!_ostree_static_delta_write_commit (pull_data->repo, delta_superblock,
+                                          cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * If the server has a static delta from our current revision of
+ * @ref to @to_revision, apply it.  Otherwise, objects are fetched
+ * individually as usual.
+ */
+static gboolean
+pull_one_static_delta (OtPullData    *pull_data,
+                       const char    *ref,
+                       const char    *to_revision,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *delta_superblock = NULL;
+  gs_free char *remote_ref = NULL;
+  gs_free char *from_revision = NULL;
+  gboolean have_to_commit;
+  char *duped_checksum;
+
+  remote_ref = g_strdup_printf ("%s/%s", pull_data->remote_name, ref);
+  if (!ostree_repo_resolve_rev (pull_data->repo, remote_ref, TRUE, &from_revision, error))
+    goto out;
+
+  if (from_revision == NULL || strcmp (from_revision, to_revision) == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_COMMIT, to_revision,
+                               &have_to_commit, cancellable, error))
+    goto out;
+  if (have_to_commit)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!request_static_delta_superblock_sync (pull_data, from_revision, to_revision,
+                                             &delta_superblock, cancellable, error))
+    goto out;
+
+  if (!delta_superblock)
+    {
+      g_debug ("no static delta from %s to %s", from_revision, to_revision);
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!process_one_static_delta (pull_data, from_revision, to_revision,
+                                 delta_superblock, cancellable, error))
+    goto out;
+
+  /* The commit is stored now; mark it as requested so the scanner
+   * still walks (and if configured, GPG verifies) it.
+   */
+  duped_checksum = g_strdup (to_revision);
+  g_hash_table_insert (pull_data->requested_metadata, duped_checksum, duped_checksum);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * Set @out_unchanged to %TRUE if every ref in @refs (name -> commit)
+ * already points to that commit locally, and the commit is stored.
+ */
+static gboolean
+refs_are_unchanged (OtPullData    *pull_data,
+                    GHashTable    *refs,
+                    gboolean      *out_unchanged,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  gboolean ret_unchanged = TRUE;
+  GHashTableIter hash_iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&hash_iter, refs);
+  while (ret_unchanged && g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *checksum = value;
+      gs_free char *remote_ref = NULL;
+      gs_free char *original_rev = NULL;
+
+      remote_ref = g_strdup_printf ("%s/%s", pull_data->remote_name, ref);
+      if (!ostree_repo_resolve_rev (pull_data->repo, remote_ref, TRUE, &original_rev, error))
+        goto out;
+
+      if (!original_rev || strcmp (checksum, original_rev) != 0)
+        ret_unchanged = FALSE;
+      else if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                        &ret_unchanged, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  *out_unchanged = ret_unchanged;
+ out:
+  return ret;
+}
+
 gboolean
 ostree_repo_pull (OstreeRepo               *self,
                   const char               *remote_name,
@@ -1187,6 +1828,8 @@ ostree_repo_pull (OstreeRepo               *self,
   GHashTableIter hash_iter;
   gpointer key, value;
   gboolean tls_permissive = FALSE;
+  gboolean prioritize_small = TRUE;
+  guint min_fetches, max_fetches;
   OstreeFetcherConfigFlags fetcher_flags = 0;
   gs_free char *remote_key = NULL;
   gs_free char *path = NULL;
@@ -1196,6 +1839,7 @@ ostree_repo_pull (OstreeRepo               *self,
   gs_unref_hashtable GHashTable *updated_refs = NULL;
   gs_unref_hashtable GHashTable *commits_to_fetch = NULL;
   gs_free char *remote_mode_str = NULL;
+  gs_unref_object GFile *remote_cache_dir = NULL;
   GSource *queue_src = NULL;
   OtPullData pull_data_real = { 0, };
   OtPullData *pull_data = &pull_data_real;
@@ -1221,6 +1865,10 @@ ostree_repo_pull (OstreeRepo               *self,
                                                         (GDestroyNotify)g_free, NULL);
   pull_data->requested_metadata = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                          (GDestroyNotify)g_free, NULL);
+  g_mutex_init (&pull_data->scan_lock);
+  pull_data->expected_content_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                             (GDestroyNotify)g_free, NULL);
+  g_mutex_init (&pull_data->expected_sizes_lock);
 
   start_time = g_get_monotonic_time ();
 
@@ -1249,6 +1897,34 @@ ostree_repo_pull (OstreeRepo               *self,
   pull_data->fetcher = ostree_fetcher_new (pull_data->repo->tmp_dir,
                                            fetcher_flags);
 
+  if (!keyfile_get_uint_with_default (config, remote_key, "min-concurrent-fetches",
+                                      2, &min_fetches, error))
+    goto out;
+  if (!keyfile_get_uint_with_default (config, remote_key, "max-concurrent-fetches",
+                                      24, &max_fetches, error))
+    goto out;
+  if (min_fetches == 0 || min_fetches > max_fetches)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid concurrent fetch limits %u-%u for remote '%s'",
+                   min_fetches, max_fetches, pull_data->remote_name);
+      goto out;
+    }
+  ostree_fetcher_set_concurrency (pull_data->fetcher, min_fetches, max_fetches);
+
+  if (!ot_keyfile_get_boolean_with_default (config, remote_key, "prioritize-small-objects",
+                                            TRUE, &prioritize_small, error))
+    goto out;
+  ostree_fetcher_set_prioritize_small (pull_data->fetcher, prioritize_small);
+
+  /* Remember the remote's config and refs, so polling an unchanged
+   * remote costs only a few "304 Not Modified" responses.
+   */
+  remote_cache_dir = g_file_get_child (self->remote_cache_dir, pull_data->remote_name);
+  if (!gs_file_ensure_directory (remote_cache_dir, TRUE, cancellable, error))
+    goto out;
+  ostree_fetcher_set_cache_dir (pull_data->fetcher, remote_cache_dir);
+
   if (!pull_data->base_uri)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -1355,22 +2031,66 @@ ostree_repo_pull (OstreeRepo               *self,
         }
     }
 
+  /* A ref is only updated once everything it points to has been
+   * fetched, so if no ref moved there is nothing to do, and no need
+   * for a transaction.
+   */
+  if (g_hash_table_size (commits_to_fetch) == 0)
+    {
+      gboolean unchanged;
+
+      if (!refs_are_unchanged (pull_data, requested_refs_to_fetch, &unchanged,
+                               cancellable, error))
+        goto out;
+
+      if (unchanged)
+        {
+          g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
+          while (g_hash_table_iter_next (&hash_iter, &key, &value))
+            g_print ("remote %s/%s is unchanged from %s\n", pull_data->remote_name,
+                     (const char*)key, (const char*)value);
+          ret = TRUE;
+          goto out;
+        }
+    }
+
   if (!ostree_repo_prepare_transaction (pull_data->repo, &pull_data->transaction_resuming,
                                         cancellable, error))
     goto out;
 
+  if (!load_remote_packs (pull_data, cancellable, error))
+    goto out;
+
+  g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *sha256 = value;
+
+      if (!pull_one_static_delta (pull_data, ref, sha256, cancellable, error))
+        goto out;
+    }
+
   pull_data->metadata_objects_to_fetch = ot_waitable_queue_new ();
-  pull_data->metadata_objects_to_scan = ot_waitable_queue_new ();
-  pull_data->metadata_thread = g_thread_new ("metadatascan", metadata_thread_main, pull_data);
+
+  {
+    long nproc_onln = sysconf (_SC_NPROCESSORS_ONLN);
+    guint n_scan_threads = CLAMP (nproc_onln, 2, OSTREE_PULL_MAX_SCAN_THREADS);
+
+    pull_data->metadata_scan_pool = g_thread_pool_new (metadata_scan_thread, pull_data,
+                                                       (int)n_scan_threads, FALSE, error);
+    if (!pull_data->metadata_scan_pool)
+      goto out;
+  }
 
   g_hash_table_iter_init (&hash_iter, commits_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
       const char *commit = value;
 
-      ot_waitable_queue_push (pull_data->metadata_objects_to_scan,
-                              pull_worker_message_new (PULL_MSG_SCAN,
-                                                       ostree_object_name_serialize (commit, OSTREE_OBJECT_TYPE_COMMIT)));
+      queue_scan_one_metadata_object (pull_data,
+                                      ostree_object_name_serialize (commit, OSTREE_OBJECT_TYPE_COMMIT),
+                                      0);
     }
 
   g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
@@ -1379,9 +2099,9 @@ ostree_repo_pull (OstreeRepo               *self,
       const char *ref = key;
       const char *sha256 = value;
 
-      ot_waitable_queue_push (pull_data->metadata_objects_to_scan,
-                              pull_worker_message_new (PULL_MSG_SCAN,
-                                                       ostree_object_name_serialize (sha256, OSTREE_OBJECT_TYPE_COMMIT)));
+      queue_scan_one_metadata_object (pull_data,
+                                      ostree_object_name_serialize (sha256, OSTREE_OBJECT_TYPE_COMMIT),
+                                      0);
       g_hash_table_insert (updated_refs, g_strdup (ref), g_strdup (sha256));
     }
   
@@ -1392,10 +2112,9 @@ ostree_repo_pull (OstreeRepo               *self,
     g_source_unref (queue_src);
   }
 
-  /* Prime the message queue */
-  pull_data->idle_serial++;
-  ot_waitable_queue_push (pull_data->metadata_objects_to_scan,
-                          pull_worker_message_new (PULL_MSG_MAIN_IDLE, GUINT_TO_POINTER (pull_data->idle_serial)));
+  /* Prime the message queue, in case there was nothing to scan */
+  ot_waitable_queue_push (pull_data->metadata_objects_to_fetch,
+                          pull_worker_message_new (PULL_MSG_SCAN_IDLE, NULL));
   
   /* Now await work completion */
   if (!run_mainloop_monitor_fetcher (pull_data))
@@ -1460,17 +2179,22 @@ ostree_repo_pull (OstreeRepo               *self,
     soup_uri_free (pull_data->base_uri);
   if (queue_src)
     g_source_destroy (queue_src);
-  if (pull_data->metadata_thread)
+  if (pull_data->metadata_scan_pool)
     {
-      ot_waitable_queue_push (pull_data->metadata_objects_to_scan,
-                              pull_worker_message_new (PULL_MSG_QUIT, NULL));
-      g_thread_join (pull_data->metadata_thread);
+      /* On error, let any remaining jobs finish without doing work */
+      g_mutex_lock (&pull_data->scan_lock);
+      g_atomic_int_set (&pull_data->metadata_scan_aborted, 1);
+      g_mutex_unlock (&pull_data->scan_lock);
+      g_thread_pool_free (pull_data->metadata_scan_pool, FALSE, TRUE);
     }
-  g_clear_pointer (&pull_data->metadata_objects_to_scan, (GDestroyNotify) ot_waitable_queue_unref);
   g_clear_pointer (&pull_data->metadata_objects_to_fetch, (GDestroyNotify) ot_waitable_queue_unref);
   g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_content, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_metadata, (GDestroyNotify) g_hash_table_unref);
+  g_mutex_clear (&pull_data->scan_lock);
+  g_clear_pointer (&pull_data->expected_content_sizes, (GDestroyNotify) g_hash_table_unref);
+  g_mutex_clear (&pull_data->expected_sizes_lock);
+  g_clear_pointer (&pull_data->remote_packs, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&remote_config, (GDestroyNotify) g_key_file_unref);
   if (summary_uri)
     soup_uri_free (summary_uri);
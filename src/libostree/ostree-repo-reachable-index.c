@@ -0,0 +1,292 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <fcntl.h>
+
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * The reachable index of a commit lists every object reachable from
+ * its root dirtree: all dirtree, dirmeta and file objects below it,
+ * but not the commit itself, its root dirmeta or its parents.  Since
+ * the contents of a commit never change, the index is computed once,
+ * on the first traversal by prune, and from then on prune just merges
+ * indexes instead of loading every directory of every commit again.
+ *
+ * It lives next to the commit object, like detached metadata, as
+ * objects/XX/YYY.commitreachable:
+ *
+ *   8 bytes  magic "OSTRCH01"
+ *   guint64  number of entries (little endian)
+ *   entries  OstreeReachableIndexEntry, sorted by (checksum, type)
+ *
+ * An index is only written for a commit whose tree is complete in
+ * the repository, so it never depends on what else is stored.  A
+ * truncated or otherwise malformed file is ignored, and rewritten by
+ * the next traversal.
+ */
+
+#define OSTREE_REACHABLE_INDEX_MAGIC "OSTRCH01"
+#define OSTREE_REACHABLE_INDEX_HEADER_SIZE 16
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+} OstreeReachableIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeReachableIndexEntry) == 33);
+
+static int
+reachable_index_entry_compare (gconstpointer a,
+                               gconstpointer b)
+{
+  return memcmp (a, b, sizeof (OstreeReachableIndexEntry));
+}
+
+static void
+reachable_index_loose_path (OstreeRepo  *self,
+                            const char  *commit_checksum,
+                            char        *buf)
+{
+  _ostree_loose_path_with_suffix (buf, commit_checksum, OSTREE_OBJECT_TYPE_COMMIT,
+                                  self->mode, "reachable");
+}
+
+/**
+ * _ostree_repo_reachable_index_load:
+ * @self: Repo
+ * @commit_checksum: ASCII SHA256 checksum of a commit
+ * @inout_objects: Set of objects
+ * @out_loaded: (out): Whether a valid index was found
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Add the objects in the reachable index of @commit_checksum in @self
+ * (not its parents) to @inout_objects.
+ */
+gboolean
+_ostree_repo_reachable_index_load (OstreeRepo       *self,
+                                   const char       *commit_checksum,
+                                   OstreeObjectSet  *inout_objects,
+                                   gboolean         *out_loaded,
+                                   GCancellable     *cancellable,
+                                   GError          **error)
+{
+  gboolean ret = FALSE;
+  gboolean loaded = FALSE;
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  int fd = -1;
+  GMappedFile *mfile = NULL;
+  const guint8 *data;
+  const OstreeReachableIndexEntry *entries;
+  gsize len;
+  guint64 n_entries;
+  guint64 i;
+
+  reachable_index_loose_path (self, commit_checksum, loose_path);
+  fd = openat (self->objects_dir_fd, loose_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      goto done;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+
+  data = (const guint8 *) g_mapped_file_get_contents (mfile);
+  len = g_mapped_file_get_length (mfile);
+
+  if (len < OSTREE_REACHABLE_INDEX_HEADER_SIZE
+      || memcmp (data, OSTREE_REACHABLE_INDEX_MAGIC, 8) != 0)
+    {
+      g_debug ("Ignoring invalid reachable index for %s", commit_checksum);
+      goto done;
+    }
+
+  memcpy (&n_entries, data + 8, sizeof (n_entries));
+  n_entries = GUINT64_FROM_LE (n_entries);
+  if (n_entries > (len - OSTREE_REACHABLE_INDEX_HEADER_SIZE) / sizeof (OstreeReachableIndexEntry)
+      || len != OSTREE_REACHABLE_INDEX_HEADER_SIZE + n_entries * sizeof (OstreeReachableIndexEntry))
+    {
+      g_debug ("Ignoring truncated reachable index for %s", commit_checksum);
+      goto done;
+    }
+
+  /* Validate everything first, so a corrupted index adds nothing */
+  entries = (const OstreeReachableIndexEntry *) (data + OSTREE_REACHABLE_INDEX_HEADER_SIZE);
+  for (i = 0; i < n_entries; i++)
+    {
+      if (entries[i].objtype < OSTREE_OBJECT_TYPE_FILE
+          || entries[i].objtype > OSTREE_OBJECT_TYPE_LAST)
+        {
+          g_debug ("Ignoring corrupted reachable index for %s", commit_checksum);
+          goto done;
+        }
+    }
+
+  for (i = 0; i < n_entries; i++)
+    (void) ostree_object_set_add_bytes (inout_objects, entries[i].csum, entries[i].objtype);
+  loaded = TRUE;
+
+ done:
+  ret = TRUE;
+  *out_loaded = loaded;
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+/**
+ * _ostree_repo_reachable_index_write:
+ * @self: Repo
+ * @commit_checksum: ASCII SHA256 checksum of a commit
+ * @objects: All objects reachable from the root dirtree of @commit_checksum
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Store @objects as the reachable index of @commit_checksum.  Does
+ * nothing if the commit isn't stored in @self itself.  Like the
+ * devino index, this is only a cache, so it isn't fsync()ed.
+ */
+gboolean
+_ostree_repo_reachable_index_write (OstreeRepo       *self,
+                                    const char       *commit_checksum,
+                                    OstreeObjectSet  *objects,
+                                    GCancellable     *cancellable,
+                                    GError          **error)
+{
+  gboolean ret = FALSE;
+  gboolean have_commit;
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  gs_free char *temp_filename = NULL;
+  gs_unref_object GOutputStream *temp_out = NULL;
+  GArray *entries = NULL;
+  OstreeObjectSetIter iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  guint64 n_entries_le;
+  gsize bytes_written;
+
+  if (!_ostree_repo_find_object (self, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum,
+                                 &have_commit, NULL, cancellable, error))
+    goto out;
+  if (!have_commit)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  entries = g_array_sized_new (FALSE, FALSE, sizeof (OstreeReachableIndexEntry),
+                               ostree_object_set_size (objects));
+  ostree_object_set_iter_init (&iter, objects);
+  while (ostree_object_set_iter_next (&iter, &csum, &objtype))
+    {
+      OstreeReachableIndexEntry entry;
+
+      memcpy (entry.csum, csum, 32);
+      entry.objtype = (guint8) objtype;
+      g_array_append_val (entries, entry);
+    }
+  g_array_sort (entries, reachable_index_entry_compare);
+
+  if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, commit_checksum,
+                                            cancellable, error))
+    goto out;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                  &temp_filename, &temp_out,
+                                  cancellable, error))
+    goto out;
+
+  n_entries_le = GUINT64_TO_LE ((guint64) entries->len);
+  if (!g_output_stream_write_all (temp_out, OSTREE_REACHABLE_INDEX_MAGIC, 8,
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (temp_out, &n_entries_le, sizeof (n_entries_le),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (entries->len > 0
+      && !g_output_stream_write_all (temp_out, entries->data,
+                                     entries->len * sizeof (OstreeReachableIndexEntry),
+                                     &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (temp_out, cancellable, error))
+    goto out;
+
+  reachable_index_loose_path (self, commit_checksum, loose_path);
+  if (renameat (self->tmp_dir_fd, temp_filename,
+                self->objects_dir_fd, loose_path) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&temp_filename, g_free);
+
+  ret = TRUE;
+ out:
+  if (temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
+  if (entries)
+    g_array_unref (entries);
+  return ret;
+}
+
+/**
+ * _ostree_repo_reachable_index_delete:
+ * @self: Repo
+ * @commit_checksum: ASCII SHA256 checksum of a commit
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Delete the reachable index of @commit_checksum, if any; called
+ * when the commit is pruned.
+ */
+gboolean
+_ostree_repo_reachable_index_delete (OstreeRepo     *self,
+                                     const char     *commit_checksum,
+                                     GCancellable   *cancellable,
+                                     GError        **error)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+  reachable_index_loose_path (self, commit_checksum, loose_path);
+  if (unlinkat (self->objects_dir_fd, loose_path, 0) == -1 && errno != ENOENT)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  return TRUE;
+}
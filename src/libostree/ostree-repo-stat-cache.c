@@ -0,0 +1,329 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * The stat cache lets ostree_repo_write_directory_to_mtree() skip
+ * reading and checksumming files which have not changed since the
+ * previous commit of the same directory, much like the git index.
+ *
+ * It is a file, chosen by the caller, holding a GVariant of type
+ * OSTREE_STAT_CACHE_FORMAT:
+ *
+ *   s - The commit which was made from the recorded files
+ *   u - OstreeRepoCommitModifierFlags used for that commit
+ *   a(sttttuuuuay) - For each file: absolute path, size, mtime and
+ *     ctime in microseconds, inode, device, then the uid, gid and mode
+ *     after the commit filter, and the content checksum
+ *
+ * The cache is only used when the commit it was saved for is the
+ * parent of the new commit, and a hit is only accepted if the content
+ * object is still in the repository.  Files modified within a second
+ * of the start of a commit are not recorded, since a later write in
+ * the same timestamp tick would be invisible to us.
+ */
+
+#define OSTREE_STAT_CACHE_FORMAT "(sua(sttttuuuuay))"
+
+struct OstreeRepoStatCache {
+  GFile *path;
+  guint32 flags;
+  guint64 start_time;
+
+  /* path (pointing into the entry) -> entry variant */
+  GHashTable *old_entries;
+  /* owned path -> entry variant */
+  GHashTable *new_entries;
+};
+
+static guint64
+file_info_get_time_usec (GFileInfo   *file_info,
+                         const char  *secs_attr,
+                         const char  *usecs_attr)
+{
+  return g_file_info_get_attribute_uint64 (file_info, secs_attr) * G_USEC_PER_SEC
+    + g_file_info_get_attribute_uint32 (file_info, usecs_attr);
+}
+
+static gboolean
+file_info_has_times (GFileInfo  *file_info)
+{
+  return g_file_info_has_attribute (file_info, "time::modified")
+    && g_file_info_has_attribute (file_info, "time::changed");
+}
+
+/**
+ * _ostree_repo_stat_cache_new:
+ * @path: Cache file
+ * @parent: (allow-none): Parent of the commit being made
+ * @flags: Commit modifier flags
+ *
+ * Load the stat cache in @path.  If it is missing, malformed, or was
+ * not saved for @parent with @flags, start from an empty cache.
+ */
+OstreeRepoStatCache *
+_ostree_repo_stat_cache_new (GFile          *path,
+                             const char     *parent,
+                             guint32         flags,
+                             GCancellable   *cancellable,
+                             GError        **error)
+{
+  OstreeRepoStatCache *ret = NULL;
+  OstreeRepoStatCache *cache = NULL;
+  GMappedFile *mfile = NULL;
+  GError *temp_error = NULL;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_variant GVariant *data = NULL;
+  gs_unref_variant GVariant *entries = NULL;
+  const char *cached_commit;
+  guint32 cached_flags;
+  guint i, n;
+
+  cache = g_new0 (OstreeRepoStatCache, 1);
+  cache->path = g_object_ref (path);
+  cache->flags = flags;
+  cache->start_time = g_get_real_time ();
+  cache->old_entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                              (GDestroyNotify) g_variant_unref);
+  cache->new_entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify) g_variant_unref);
+
+  if (parent == NULL)
+    goto done;
+
+  mfile = gs_file_map_noatime (path, cancellable, &temp_error);
+  if (!mfile)
+    {
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&temp_error);
+          goto done;
+        }
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  data = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STAT_CACHE_FORMAT), bytes, FALSE);
+  g_variant_ref_sink (data);
+
+  g_variant_get (data, "(&su@a(sttttuuuuay))", &cached_commit, &cached_flags, &entries);
+  if (strcmp (cached_commit, parent) != 0 || cached_flags != flags)
+    goto done;
+
+  n = g_variant_n_children (entries);
+  for (i = 0; i < n; i++)
+    {
+      GVariant *entry = g_variant_get_child_value (entries, i);
+      const char *entry_path;
+
+      g_variant_get_child (entry, 0, "&s", &entry_path);
+      g_hash_table_replace (cache->old_entries, (char*)entry_path, entry);
+    }
+
+ done:
+  ret = cache;
+  cache = NULL;
+ out:
+  if (cache)
+    _ostree_repo_stat_cache_free (cache);
+  return ret;
+}
+
+void
+_ostree_repo_stat_cache_free (OstreeRepoStatCache *cache)
+{
+  if (!cache)
+    return;
+
+  g_clear_object (&cache->path);
+  g_hash_table_unref (cache->old_entries);
+  g_hash_table_unref (cache->new_entries);
+  g_free (cache);
+}
+
+/**
+ * _ostree_repo_stat_cache_lookup:
+ * @cache: Stat cache
+ * @repo: Repo
+ * @path: Absolute path of the file
+ * @stat_info: Information for @path, including time attributes
+ * @file_info: @stat_info after the commit filter
+ * @out_checksum: (out): Content checksum, if found
+ * @out_found: (out): Whether @path is unchanged
+ *
+ * Look up @path; it is only found if all recorded attributes match
+ * and the content object is in @repo.
+ */
+gboolean
+_ostree_repo_stat_cache_lookup (OstreeRepoStatCache  *cache,
+                                OstreeRepo           *repo,
+                                const char           *path,
+                                GFileInfo            *stat_info,
+                                GFileInfo            *file_info,
+                                char                 *out_checksum,
+                                gboolean             *out_found,
+                                GCancellable         *cancellable,
+                                GError              **error)
+{
+  gboolean ret = FALSE;
+  GVariant *entry;
+  guint64 size, mtime, ctime, inode;
+  guint32 dev, uid, gid, mode;
+  gboolean have_object;
+  gs_unref_variant GVariant *csum_v = NULL;
+
+  *out_found = FALSE;
+
+  entry = g_hash_table_lookup (cache->old_entries, path);
+  if (!entry || !file_info_has_times (stat_info))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_variant_get (entry, "(&sttttuuuu@ay)", NULL, &size, &mtime, &ctime, &inode,
+                 &dev, &uid, &gid, &mode, &csum_v);
+
+  if (size != (guint64) g_file_info_get_size (stat_info)
+      || mtime != file_info_get_time_usec (stat_info, "time::modified", "time::modified-usec")
+      || ctime != file_info_get_time_usec (stat_info, "time::changed", "time::changed-usec")
+      || inode != g_file_info_get_attribute_uint64 (stat_info, "unix::inode")
+      || dev != g_file_info_get_attribute_uint32 (stat_info, "unix::device")
+      || uid != g_file_info_get_attribute_uint32 (file_info, "unix::uid")
+      || gid != g_file_info_get_attribute_uint32 (file_info, "unix::gid")
+      || mode != g_file_info_get_attribute_uint32 (file_info, "unix::mode"))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!ostree_validate_structureof_csum_v (csum_v, error))
+    goto out;
+  ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), out_checksum);
+
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, out_checksum,
+                               &have_object, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  *out_found = have_object;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_stat_cache_add:
+ * @cache: Stat cache
+ * @path: Absolute path of the file
+ * @stat_info: Information for @path, including time attributes
+ * @file_info: @stat_info after the commit filter
+ * @checksum: Content checksum of @path
+ *
+ * Record that @path has content @checksum, for the next
+ * _ostree_repo_stat_cache_save().
+ */
+void
+_ostree_repo_stat_cache_add (OstreeRepoStatCache  *cache,
+                             const char           *path,
+                             GFileInfo            *stat_info,
+                             GFileInfo            *file_info,
+                             const char           *checksum)
+{
+  guint64 mtime, ctime;
+  guchar csum[32];
+  GVariant *entry;
+
+  if (!file_info_has_times (stat_info))
+    return;
+
+  mtime = file_info_get_time_usec (stat_info, "time::modified", "time::modified-usec");
+  ctime = file_info_get_time_usec (stat_info, "time::changed", "time::changed-usec");
+
+  /* Racily clean; see above */
+  if (MAX (mtime, ctime) + G_USEC_PER_SEC >= cache->start_time)
+    return;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  entry = g_variant_new ("(sttttuuuu@ay)", path,
+                         (guint64) g_file_info_get_size (stat_info),
+                         mtime, ctime,
+                         g_file_info_get_attribute_uint64 (stat_info, "unix::inode"),
+                         g_file_info_get_attribute_uint32 (stat_info, "unix::device"),
+                         g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+                         g_file_info_get_attribute_uint32 (file_info, "unix::gid"),
+                         g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                         ostree_checksum_to_bytes_v (checksum));
+  g_hash_table_replace (cache->new_entries, g_strdup (path), g_variant_ref_sink (entry));
+}
+
+/**
+ * _ostree_repo_stat_cache_save:
+ * @cache: Stat cache
+ * @commit: Commit made from the recorded files
+ *
+ * Replace the cache file with the files recorded by
+ * _ostree_repo_stat_cache_add().
+ */
+gboolean
+_ostree_repo_stat_cache_save (OstreeRepoStatCache  *cache,
+                              const char           *commit,
+                              GCancellable         *cancellable,
+                              GError              **error)
+{
+  gboolean ret = FALSE;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  GVariantBuilder builder;
+  gs_unref_variant GVariant *data = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttttuuuuay)"));
+  g_hash_table_iter_init (&hashiter, cache->new_entries);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    g_variant_builder_add_value (&builder, (GVariant*)value);
+
+  data = g_variant_new ("(su@a(sttttuuuuay))", commit, cache->flags,
+                        g_variant_builder_end (&builder));
+  g_variant_ref_sink (data);
+
+  if (!g_file_replace_contents (cache->path,
+                                g_variant_get_data (data),
+                                g_variant_get_size (data),
+                                NULL, FALSE, 0, NULL,
+                                cancellable, error))
+    {
+      g_prefix_error (error, "Writing stat cache: ");
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
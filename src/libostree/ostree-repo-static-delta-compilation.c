@@ -0,0 +1,681 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-repo-private.h"
+#include "ostree-repo-static-delta-private.h"
+#include "ostree-varint.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+/* Block size for matching data of a new file against its previous
+ * version, in the style of rsync.
+ */
+#define ROLLSUM_BLOCK_SIZE 2048
+
+typedef struct {
+  guint64 uncompressed_size;
+  GPtrArray *objects;         /* Floating-free GVariant (yayay) */
+  GString *objects_list;      /* (type byte, 32 byte checksum)* */
+  GPtrArray *sources;         /* char * checksums */
+  GHashTable *source_indexes; /* checksum -> index + 1 */
+} OstreeStaticDeltaPartBuilder;
+
+typedef struct {
+  OstreeRepo *repo;
+  GFile *delta_dir;
+  guint n_parts;
+  GVariantBuilder part_headers;
+  OstreeStaticDeltaPartBuilder *current_part;
+} OstreeStaticDeltaBuilder;
+
+static OstreeStaticDeltaPartBuilder *
+part_builder_new (void)
+{
+  OstreeStaticDeltaPartBuilder *part = g_new0 (OstreeStaticDeltaPartBuilder, 1);
+  part->objects = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  part->objects_list = g_string_new ("");
+  part->sources = g_ptr_array_new_with_free_func (g_free);
+  part->source_indexes = g_hash_table_new (g_str_hash, g_str_equal);
+  return part;
+}
+
+static void
+part_builder_free (OstreeStaticDeltaPartBuilder *part)
+{
+  g_ptr_array_unref (part->objects);
+  g_string_free (part->objects_list, TRUE);
+  g_hash_table_unref (part->source_indexes);
+  g_ptr_array_unref (part->sources);
+  g_free (part);
+}
+
+static guint
+part_builder_get_source_index (OstreeStaticDeltaPartBuilder *part,
+                               const char                   *checksum)
+{
+  gpointer idx = g_hash_table_lookup (part->source_indexes, checksum);
+  char *dup_checksum;
+
+  if (idx)
+    return GPOINTER_TO_UINT (idx) - 1;
+
+  dup_checksum = g_strdup (checksum);
+  g_ptr_array_add (part->sources, dup_checksum);
+  g_hash_table_insert (part->source_indexes, dup_checksum,
+                       GUINT_TO_POINTER (part->sources->len));
+  part->uncompressed_size += 32;
+  return part->sources->len - 1;
+}
+
+static void
+append_op_write (GString       *ops,
+                 const guint8  *data,
+                 gsize          len)
+{
+  if (len == 0)
+    return;
+  g_string_append_c (ops, OSTREE_STATIC_DELTA_OP_WRITE);
+  _ostree_write_varuint64 (ops, len);
+  g_string_append_len (ops, (const char*)data, len);
+}
+
+static void
+append_op_copy (GString       *ops,
+                guint          source_index,
+                guint64        offset,
+                guint64        len)
+{
+  g_string_append_c (ops, OSTREE_STATIC_DELTA_OP_COPY);
+  _ostree_write_varuint64 (ops, source_index);
+  _ostree_write_varuint64 (ops, offset);
+  _ostree_write_varuint64 (ops, len);
+}
+
+static void
+rollsum_init (const guint8  *buf,
+              guint32       *out_a,
+              guint32       *out_b)
+{
+  guint32 a = 0, b = 0;
+  guint i;
+
+  for (i = 0; i < ROLLSUM_BLOCK_SIZE; i++)
+    {
+      a += buf[i];
+      b += (ROLLSUM_BLOCK_SIZE - i) * buf[i];
+    }
+  *out_a = a & 0xFFFF;
+  *out_b = b & 0xFFFF;
+}
+
+/*
+ * Compute operations producing @new_data, copying runs of bytes from
+ * @old_data where they match.  Only blocks at aligned offsets of
+ * @old_data are indexed, but the scan of @new_data moves a byte at a
+ * time, so inserted or removed bytes don't defeat the matching.
+ */
+static gboolean
+compute_rollsum_ops (const guint8  *old_data,
+                     gsize          old_len,
+                     const guint8  *new_data,
+                     gsize          new_len,
+                     guint          source_index,
+                     GString       *ops)
+{
+  gs_unref_hashtable GHashTable *blocks = NULL;
+  gsize offset;
+  gsize pos = 0;
+  gsize literal_start = 0;
+  guint32 a, b;
+  gboolean matched = FALSE;
+
+  if (old_len < ROLLSUM_BLOCK_SIZE || new_len < ROLLSUM_BLOCK_SIZE)
+    return FALSE;
+
+  blocks = g_hash_table_new (NULL, NULL);
+  for (offset = 0; offset + ROLLSUM_BLOCK_SIZE <= old_len; offset += ROLLSUM_BLOCK_SIZE)
+    {
+      guint32 block_a, block_b;
+      gpointer key;
+
+      rollsum_init (old_data + offset, &block_a, &block_b);
+      key = GUINT_TO_POINTER (block_a | (block_b << 16));
+      if (!g_hash_table_contains (blocks, key))
+        g_hash_table_insert (blocks, key, GSIZE_TO_POINTER (offset));
+    }
+
+  rollsum_init (new_data, &a, &b);
+  while (pos + ROLLSUM_BLOCK_SIZE <= new_len)
+    {
+      gpointer match;
+
+      if (g_hash_table_lookup_extended (blocks, GUINT_TO_POINTER (a | (b << 16)), NULL, &match))
+        {
+          gsize old_offset = GPOINTER_TO_SIZE (match);
+
+          if (memcmp (old_data + old_offset, new_data + pos, ROLLSUM_BLOCK_SIZE) == 0)
+            {
+              gsize match_len = ROLLSUM_BLOCK_SIZE;
+
+              while (old_offset + match_len < old_len
+                     && pos + match_len < new_len
+                     && old_data[old_offset + match_len] == new_data[pos + match_len])
+                match_len++;
+
+              append_op_write (ops, new_data + literal_start, pos - literal_start);
+              append_op_copy (ops, source_index, old_offset, match_len);
+              matched = TRUE;
+
+              pos += match_len;
+              literal_start = pos;
+              if (pos + ROLLSUM_BLOCK_SIZE <= new_len)
+                rollsum_init (new_data + pos, &a, &b);
+              continue;
+            }
+        }
+
+      if (pos + ROLLSUM_BLOCK_SIZE < new_len)
+        {
+          guint8 out_byte = new_data[pos];
+          guint8 in_byte = new_data[pos + ROLLSUM_BLOCK_SIZE];
+
+          a = (a - out_byte + in_byte) & 0xFFFF;
+          b = (b - ROLLSUM_BLOCK_SIZE * out_byte + a) & 0xFFFF;
+        }
+      pos++;
+    }
+
+  append_op_write (ops, new_data + literal_start, new_len - literal_start);
+  return matched;
+}
+
+static gboolean
+write_part (OstreeStaticDeltaBuilder      *builder,
+            OstreeStaticDeltaPartBuilder  *part,
+            GCancellable                  *cancellable,
+            GError                       **error)
+{
+  gboolean ret = FALSE;
+  GVariantBuilder sources_builder;
+  GVariantBuilder objects_builder;
+  gs_unref_variant GVariant *payload = NULL;
+  gs_unref_object GOutputStream *part_out = NULL;
+  gs_unref_object GOutputStream *compressed_out = NULL;
+  gs_unref_object GConverter *compressor = NULL;
+  gs_unref_bytes GBytes *part_data = NULL;
+  gs_unref_object GFile *part_path = NULL;
+  gs_free char *part_name = NULL;
+  gsize bytes_written;
+  GChecksum *checksum = NULL;
+  guint8 digest[32];
+  gsize digest_len = sizeof (digest);
+  const guint8 compression_type = OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP;
+  guint i;
+
+  g_variant_builder_init (&sources_builder, G_VARIANT_TYPE ("aay"));
+  for (i = 0; i < part->sources->len; i++)
+    {
+      guchar csum[32];
+      ostree_checksum_inplace_to_bytes (part->sources->pdata[i], csum);
+      g_variant_builder_add_value (&sources_builder, ot_gvariant_new_bytearray (csum, 32));
+    }
+
+  g_variant_builder_init (&objects_builder, G_VARIANT_TYPE ("a(yayay)"));
+  for (i = 0; i < part->objects->len; i++)
+    g_variant_builder_add_value (&objects_builder, part->objects->pdata[i]);
+
+  payload = g_variant_new ("(@aay@a(yayay))",
+                           g_variant_builder_end (&sources_builder),
+                           g_variant_builder_end (&objects_builder));
+  g_variant_ref_sink (payload);
+
+  part_out = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  if (!g_output_stream_write_all (part_out, &compression_type, 1, &bytes_written,
+                                  cancellable, error))
+    goto out;
+
+  compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
+  compressed_out = g_converter_output_stream_new (part_out, compressor);
+  if (!g_output_stream_write_all (compressed_out,
+                                  g_variant_get_data (payload),
+                                  g_variant_get_size (payload),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (compressed_out, cancellable, error))
+    goto out;
+
+  part_data = g_memory_output_stream_steal_as_bytes ((GMemoryOutputStream*)part_out);
+
+  part_name = g_strdup_printf ("%u", builder->n_parts);
+  part_path = g_file_get_child (builder->delta_dir, part_name);
+  if (!g_file_replace_contents (part_path,
+                                g_bytes_get_data (part_data, NULL),
+                                g_bytes_get_size (part_data),
+                                NULL, FALSE, 0, NULL,
+                                cancellable, error))
+    goto out;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, g_bytes_get_data (part_data, NULL),
+                     g_bytes_get_size (part_data));
+  g_checksum_get_digest (checksum, digest, &digest_len);
+
+  g_variant_builder_add (&builder->part_headers, "(@aytt@ay)",
+                         ot_gvariant_new_bytearray (digest, 32),
+                         GUINT64_TO_BE ((guint64) g_bytes_get_size (part_data)),
+                         GUINT64_TO_BE ((guint64) g_variant_get_size (payload)),
+                         ot_gvariant_new_bytearray ((guchar*)part->objects_list->str,
+                                                    part->objects_list->len));
+  builder->n_parts++;
+
+  ret = TRUE;
+ out:
+  if (checksum)
+    g_checksum_free (checksum);
+  return ret;
+}
+
+static gboolean
+flush_part (OstreeStaticDeltaBuilder  *builder,
+            GCancellable              *cancellable,
+            GError                   **error)
+{
+  gboolean ret = FALSE;
+
+  if (builder->current_part->objects->len == 0)
+    return TRUE;
+
+  if (!write_part (builder, builder->current_part, cancellable, error))
+    goto out;
+
+  part_builder_free (builder->current_part);
+  builder->current_part = part_builder_new ();
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+add_object (OstreeStaticDeltaBuilder  *builder,
+            OstreeObjectType           objtype,
+            const char                *checksum,
+            const char                *old_checksum,
+            GCancellable              *cancellable,
+            GError                   **error)
+{
+  gboolean ret = FALSE;
+  OstreeStaticDeltaPartBuilder *part;
+  gs_unref_bytes GBytes *new_data = NULL;
+  gs_unref_bytes GBytes *old_data = NULL;
+  GString *ops = NULL;
+  guchar csum[32];
+  gsize new_len;
+  const guint8 *new_buf;
+  guint source_index;
+
+  new_data = _ostree_static_delta_load_object_bytes (builder->repo, objtype, checksum,
+                                                     cancellable, error);
+  if (!new_data)
+    goto out;
+  new_buf = g_bytes_get_data (new_data, &new_len);
+
+  part = builder->current_part;
+  if (part->objects->len > 0
+      && part->uncompressed_size + new_len > OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES)
+    {
+      if (!flush_part (builder, cancellable, error))
+        goto out;
+      part = builder->current_part;
+    }
+
+  ops = g_string_new ("");
+
+  if (old_checksum)
+    {
+      gsize old_len;
+      const guint8 *old_buf;
+
+      old_data = _ostree_static_delta_load_object_bytes (builder->repo, OSTREE_OBJECT_TYPE_FILE,
+                                                         old_checksum, cancellable, error);
+      if (!old_data)
+        goto out;
+      old_buf = g_bytes_get_data (old_data, &old_len);
+
+      /* Only reference the source if something actually matched */
+      source_index = GPOINTER_TO_UINT (g_hash_table_lookup (part->source_indexes, old_checksum));
+      source_index = source_index > 0 ? source_index - 1 : part->sources->len;
+      if (compute_rollsum_ops (old_buf, old_len, new_buf, new_len,
+                               source_index, ops))
+        (void) part_builder_get_source_index (part, old_checksum);
+      else
+        g_string_truncate (ops, 0);
+    }
+
+  if (ops->len == 0)
+    append_op_write (ops, new_buf, new_len);
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  g_ptr_array_add (part->objects,
+                   g_variant_ref_sink (g_variant_new ("(y@ay@ay)", (guint8) objtype,
+                                                      ot_gvariant_new_bytearray (csum, 32),
+                                                      ot_gvariant_new_bytearray ((guchar*)ops->str, ops->len))));
+  g_string_append_c (part->objects_list, (char) objtype);
+  g_string_append_len (part->objects_list, (char*)csum, 32);
+  part->uncompressed_size += ops->len + 33;
+
+  ret = TRUE;
+ out:
+  if (ops)
+    g_string_free (ops, TRUE);
+  return ret;
+}
+
+/*
+ * Record the content checksum at each path of the tree @dirtree_checksum
+ * in @paths, mapping path to checksum.
+ */
+static gboolean
+collect_content_paths (OstreeRepo    *repo,
+                       const char    *path,
+                       const char    *dirtree_checksum,
+                       int            recursion_depth,
+                       GHashTable    *paths,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *tree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+  int i, n;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Exceeded maximum recursion");
+      goto out;
+    }
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &tree, error))
+    goto out;
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      if (!ostree_validate_structureof_csum_v (csum_v, error))
+        goto out;
+
+      g_hash_table_insert (paths, g_build_filename (path, filename, NULL),
+                           ostree_checksum_from_bytes_v (csum_v));
+    }
+
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      gs_unref_variant GVariant *tree_csum_v = NULL;
+      gs_free char *subpath = NULL;
+      gs_free char *tree_checksum = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &tree_csum_v, NULL);
+      if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+        goto out;
+
+      subpath = g_build_filename (path, dirname, NULL);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      if (!collect_content_paths (repo, subpath, tree_checksum, recursion_depth + 1,
+                                  paths, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+collect_commit_content_paths (OstreeRepo    *repo,
+                              GVariant      *commit,
+                              GHashTable   **out_paths,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *ret_paths = NULL;
+  gs_unref_variant GVariant *tree_csum_v = NULL;
+  gs_free char *tree_checksum = NULL;
+
+  ret_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+  g_variant_get_child (commit, 6, "@ay", &tree_csum_v);
+  if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+    goto out;
+  tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+  if (!collect_content_paths (repo, "/", tree_checksum, 0, ret_paths,
+                              cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_paths, &ret_paths);
+ out:
+  return ret;
+}
+
+static int
+compare_object_names (gconstpointer a,
+                      gconstpointer b)
+{
+  GVariant *name_a = *((GVariant**)a);
+  GVariant *name_b = *((GVariant**)b);
+  const char *checksum_a, *checksum_b;
+  OstreeObjectType objtype_a, objtype_b;
+
+  ostree_object_name_deserialize (name_a, &checksum_a, &objtype_a);
+  ostree_object_name_deserialize (name_b, &checksum_b, &objtype_b);
+
+  /* Metadata first, commit type down to dirmeta, then content */
+  if (objtype_a != objtype_b)
+    return (int)objtype_b - (int)objtype_a;
+  return strcmp (checksum_a, checksum_b);
+}
+
+/**
+ * ostree_repo_static_delta_generate:
+ * @self: Repo
+ * @from: (allow-none): ASCII SHA256 checksum of origin, or %NULL
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata, of type a{sv}
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Generate a static delta from commit @from to commit @to, stored in
+ * the deltas/ directory of @self.  If @from is %NULL, the delta
+ * contains all objects of @to.
+ *
+ * A client which has @from can then fetch @to with a few large
+ * requests instead of one per object; see ostree_repo_pull() and
+ * ostree_repo_static_delta_execute_offline().  New versions of files
+ * which existed at the same path in @from are encoded as copies of
+ * the unchanged parts of the old version.
+ */
+gboolean
+ostree_repo_static_delta_generate (OstreeRepo       *self,
+                                   const char       *from,
+                                   const char       *to,
+                                   GVariant         *metadata,
+                                   GCancellable     *cancellable,
+                                   GError          **error)
+{
+  gboolean ret = FALSE;
+  OstreeStaticDeltaBuilder builder = { 0, };
+  gs_unref_hashtable GHashTable *to_reachable = NULL;
+  gs_unref_hashtable GHashTable *from_reachable = NULL;
+  gs_unref_hashtable GHashTable *to_paths = NULL;
+  gs_unref_hashtable GHashTable *from_paths = NULL;
+  gs_unref_hashtable GHashTable *new_content_paths = NULL;
+  gs_unref_ptrarray GPtrArray *new_objects = NULL;
+  gs_unref_variant GVariant *to_commit = NULL;
+  gs_unref_variant GVariant *from_commit = NULL;
+  gs_unref_variant GVariant *detached_metadata = NULL;
+  gs_unref_variant GVariant *superblock = NULL;
+  gs_unref_object GFile *superblock_path = NULL;
+  gs_free char *delta_relpath = NULL;
+  guchar to_csum[32];
+  guchar from_csum[32];
+  GHashTableIter hash_iter;
+  gpointer key, value;
+  guint i;
+
+  if (!ostree_validate_checksum_string (to, error))
+    goto out;
+  if (from && !ostree_validate_checksum_string (from, error))
+    goto out;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, to,
+                                 &to_commit, error))
+    goto out;
+  if (!ostree_repo_read_commit_detached_metadata (self, to, &detached_metadata,
+                                                  cancellable, error))
+    goto out;
+
+  if (!ostree_repo_traverse_commit (self, to, 0, &to_reachable, cancellable, error))
+    goto out;
+  if (!collect_commit_content_paths (self, to_commit, &to_paths, cancellable, error))
+    goto out;
+
+  if (from)
+    {
+      if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, from,
+                                     &from_commit, error))
+        goto out;
+      if (!ostree_repo_traverse_commit (self, from, 0, &from_reachable, cancellable, error))
+        goto out;
+      if (!collect_commit_content_paths (self, from_commit, &from_paths, cancellable, error))
+        goto out;
+    }
+
+  /* For each new content object, the first path it was seen at */
+  new_content_paths = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_iter_init (&hash_iter, to_paths);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      if (!g_hash_table_contains (new_content_paths, value))
+        g_hash_table_insert (new_content_paths, value, key);
+    }
+
+  new_objects = g_ptr_array_new ();
+  g_hash_table_iter_init (&hash_iter, to_reachable);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      GVariant *object_name = key;
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      if (from_reachable && g_hash_table_contains (from_reachable, object_name))
+        continue;
+
+      ostree_object_name_deserialize (object_name, &checksum, &objtype);
+      /* The commit itself is carried in the superblock */
+      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+        continue;
+
+      g_ptr_array_add (new_objects, object_name);
+    }
+  g_ptr_array_sort (new_objects, compare_object_names);
+
+  delta_relpath = _ostree_get_relative_static_delta_path (from, to);
+  builder.repo = self;
+  builder.delta_dir = g_file_resolve_relative_path (self->repodir, delta_relpath);
+  builder.current_part = part_builder_new ();
+  g_variant_builder_init (&builder.part_headers, G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
+
+  if (!gs_shutil_rm_rf (builder.delta_dir, cancellable, error))
+    goto out;
+  if (!gs_file_ensure_directory (builder.delta_dir, TRUE, cancellable, error))
+    goto out;
+
+  for (i = 0; i < new_objects->len; i++)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      const char *old_checksum = NULL;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      ostree_object_name_deserialize (new_objects->pdata[i], &checksum, &objtype);
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE && from_paths)
+        {
+          const char *path = g_hash_table_lookup (new_content_paths, checksum);
+          if (path)
+            old_checksum = g_hash_table_lookup (from_paths, path);
+        }
+
+      if (!add_object (&builder, objtype, checksum, old_checksum,
+                       cancellable, error))
+        goto out;
+    }
+
+  if (!flush_part (&builder, cancellable, error))
+    goto out;
+
+  ostree_checksum_inplace_to_bytes (to, to_csum);
+  if (from)
+    ostree_checksum_inplace_to_bytes (from, from_csum);
+
+  superblock = g_variant_new ("(@a{sv}t@ay@ay@" "(a{sv}aya(say)sstayay)" "@a{sv}@a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT ")",
+                              metadata ? metadata : g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                              GUINT64_TO_BE (g_get_real_time () / G_USEC_PER_SEC),
+                              ot_gvariant_new_bytearray (from_csum, from ? 32 : 0),
+                              ot_gvariant_new_bytearray (to_csum, 32),
+                              to_commit,
+                              detached_metadata ? detached_metadata : g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                              g_variant_builder_end (&builder.part_headers));
+  g_variant_ref_sink (superblock);
+
+  /* Written last; clients treat a delta without a superblock as absent */
+  superblock_path = g_file_get_child (builder.delta_dir, "superblock");
+  if (!ot_util_variant_save (superblock_path, superblock, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (builder.current_part)
+    part_builder_free (builder.current_part);
+  g_clear_object (&builder.delta_dir);
+  return ret;
+}
@@ -0,0 +1,136 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-repo.h"
+
+G_BEGIN_DECLS
+
+/* This file contains the on-disk and on-the-wire format of static
+ * deltas.  A delta from commit FROM to commit TO is a directory
+ *
+ *   deltas/FROM-TO/     (or deltas/TO/ for a delta from scratch)
+ *     superblock
+ *     0
+ *     1
+ *     ...
+ *
+ * which can be served as plain files next to objects/.  The
+ * superblock describes the delta; the numbered files are "parts",
+ * each a compressed stream of new objects.
+ */
+
+/* Parts are split at roughly this uncompressed size, to bound memory
+ * use when applying, and so that an interrupted download only needs
+ * to refetch one part.
+ */
+#define OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES (16*1024*1024)
+
+/**
+ * OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT:
+ *
+ * aay - Checksums of content objects already in the repository,
+ *       referenced by copy operations
+ * a(yayay) - New objects: object type, checksum, and the
+ *            operations which produce the object's data
+ *
+ * For metadata objects, the data is the serialized variant; for
+ * content objects, it is the content stream as returned by
+ * ostree_repo_load_object_stream().
+ *
+ * Each operation is an opcode byte followed by arguments encoded as
+ * varints:
+ *
+ *  'w' LENGTH, followed by LENGTH bytes of literal data
+ *  'c' SOURCE OFFSET LENGTH: Copy LENGTH bytes at OFFSET of source
+ *      object SOURCE
+ */
+#define OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT "(aaya(yayay))"
+
+/**
+ * OSTREE_STATIC_DELTA_META_ENTRY_FORMAT:
+ *
+ * ay - SHA256 checksum of the part file
+ * t - Size of the part file (big endian)
+ * t - Size of the uncompressed payload (big endian)
+ * ay - Objects in the part, as a concatenation of (type byte, 32 byte checksum)
+ */
+#define OSTREE_STATIC_DELTA_META_ENTRY_FORMAT "(ayttay)"
+
+/**
+ * OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT:
+ *
+ * a{sv} - Metadata
+ * t - Timestamp (big endian)
+ * ay - FROM checksum, empty for a delta from scratch
+ * ay - TO checksum
+ * (a{sv}aya(say)sstayay) - The commit object TO
+ * a{sv} - Detached metadata of TO
+ * a(ayttay) - Parts, see %OSTREE_STATIC_DELTA_META_ENTRY_FORMAT
+ *
+ * The commit object is written last, so an interrupted delta never
+ * leaves a commit whose objects are missing.
+ */
+#define OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT "(a{sv}tayay(a{sv}aya(say)sstayay)a{sv}a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT ")"
+
+/* The first byte of each part file */
+typedef enum {
+  OSTREE_STATIC_DELTA_COMPRESSION_TYPE_NONE = '0',
+  OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP = 'g'
+} OstreeStaticDeltaCompressionType;
+
+typedef enum {
+  OSTREE_STATIC_DELTA_OP_WRITE = 'w',
+  OSTREE_STATIC_DELTA_OP_COPY = 'c'
+} OstreeStaticDeltaOpCode;
+
+char *
+_ostree_get_relative_static_delta_path (const char *from,
+                                        const char *to);
+
+GBytes *
+_ostree_static_delta_load_object_bytes (OstreeRepo        *repo,
+                                        OstreeObjectType   objtype,
+                                        const char        *checksum,
+                                        GCancellable      *cancellable,
+                                        GError           **error);
+
+gboolean
+_ostree_static_delta_part_is_fetched (OstreeRepo    *repo,
+                                      GVariant      *part_header,
+                                      gboolean      *out_is_fetched,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
+gboolean
+_ostree_static_delta_part_execute (OstreeRepo      *repo,
+                                   GVariant        *part_header,
+                                   GBytes          *part_data,
+                                   GCancellable    *cancellable,
+                                   GError         **error);
+
+gboolean
+_ostree_static_delta_write_commit (OstreeRepo      *repo,
+                                   GVariant        *superblock,
+                                   GCancellable    *cancellable,
+                                   GError         **error);
+
+G_END_DECLS
@@ -0,0 +1,614 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-repo-private.h"
+#include "ostree-repo-static-delta-private.h"
+#include "ostree-varint.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+char *
+_ostree_get_relative_static_delta_path (const char *from,
+                                        const char *to)
+{
+  if (from)
+    return g_strdup_printf ("deltas/%s-%s", from, to);
+  else
+    return g_strdup_printf ("deltas/%s", to);
+}
+
+/**
+ * _ostree_static_delta_load_object_bytes:
+ *
+ * Read the whole of an object into memory, in the form used by
+ * delta parts: the serialized variant for metadata, the content
+ * stream for files.
+ */
+GBytes *
+_ostree_static_delta_load_object_bytes (OstreeRepo        *repo,
+                                        OstreeObjectType   objtype,
+                                        const char        *checksum,
+                                        GCancellable      *cancellable,
+                                        GError           **error)
+{
+  GBytes *ret = NULL;
+  guint64 size;
+  gs_unref_object GInputStream *input = NULL;
+  gs_unref_object GOutputStream *buf = NULL;
+
+  if (!ostree_repo_load_object_stream (repo, objtype, checksum, &input, &size,
+                                       cancellable, error))
+    goto out;
+
+  buf = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  if (g_output_stream_splice (buf, input, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable, error) < 0)
+    goto out;
+
+  ret = g_memory_output_stream_steal_as_bytes ((GMemoryOutputStream*)buf);
+  if (g_bytes_get_size (ret) != size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Object %s.%s: expected size %" G_GUINT64_FORMAT ", got %" G_GSIZE_FORMAT,
+                   checksum, ostree_object_type_to_string (objtype),
+                   size, g_bytes_get_size (ret));
+      g_clear_pointer (&ret, g_bytes_unref);
+      goto out;
+    }
+ out:
+  return ret;
+}
+
+static gboolean
+read_varuint64 (const guint8  **inout_buf,
+                const guint8   *end,
+                guint64        *out_value,
+                GError        **error)
+{
+  gsize bytes_read;
+
+  *out_value = _ostree_read_varuint64 (*inout_buf, end - *inout_buf, &bytes_read);
+  if (bytes_read == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted static delta part; invalid varint");
+      return FALSE;
+    }
+  *inout_buf += bytes_read;
+  return TRUE;
+}
+
+/**
+ * _ostree_static_delta_part_is_fetched:
+ *
+ * Set @out_is_fetched to %TRUE if @repo already has every object
+ * listed in @part_header, in which case the part need not be
+ * downloaded.
+ */
+gboolean
+_ostree_static_delta_part_is_fetched (OstreeRepo    *repo,
+                                      GVariant      *part_header,
+                                      gboolean      *out_is_fetched,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *objects = NULL;
+  const guint8 *objects_data;
+  gsize n_bytes;
+  gsize i;
+  gboolean is_fetched = TRUE;
+
+  g_variant_get_child (part_header, 3, "@ay", &objects);
+  objects_data = g_variant_get_fixed_array (objects, &n_bytes, 1);
+
+  if (n_bytes % 33 != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted static delta superblock; invalid object list");
+      goto out;
+    }
+
+  for (i = 0; i < n_bytes && is_fetched; i += 33)
+    {
+      OstreeObjectType objtype = (OstreeObjectType) objects_data[i];
+      char checksum[65];
+
+      if (!ostree_validate_structureof_objtype (objects_data[i], error))
+        goto out;
+      ostree_checksum_inplace_from_bytes (objects_data + i + 1, checksum);
+      if (!ostree_repo_has_object (repo, objtype, checksum, &is_fetched,
+                                   cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  *out_is_fetched = is_fetched;
+ out:
+  return ret;
+}
+
+static GBytes *
+decompress_part (GBytes         *part_data,
+                 guint64         expected_size,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  GBytes *ret = NULL;
+  const guint8 *data;
+  gsize len;
+  gs_unref_bytes GBytes *payload = NULL;
+  gs_unref_object GInputStream *mem_in = NULL;
+  gs_unref_object GInputStream *convin = NULL;
+  gs_unref_object GConverter *decompressor = NULL;
+  gs_unref_object GOutputStream *buf = NULL;
+
+  data = g_bytes_get_data (part_data, &len);
+  if (len == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted static delta part; empty");
+      goto out;
+    }
+
+  payload = g_bytes_new_from_bytes (part_data, 1, len - 1);
+
+  switch (data[0])
+    {
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_NONE:
+      ret = g_bytes_ref (payload);
+      break;
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP:
+      mem_in = g_memory_input_stream_new_from_bytes (payload);
+      decompressor = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+      convin = g_converter_input_stream_new (mem_in, decompressor);
+      buf = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+      if (g_output_stream_splice (buf, convin, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, error) < 0)
+        goto out;
+      ret = g_memory_output_stream_steal_as_bytes ((GMemoryOutputStream*)buf);
+      break;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unknown static delta part compression type '%c'", data[0]);
+      goto out;
+    }
+
+  if (g_bytes_get_size (ret) != expected_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted static delta part; expected uncompressed size %" G_GUINT64_FORMAT ", got %" G_GSIZE_FORMAT,
+                   expected_size, g_bytes_get_size (ret));
+      g_clear_pointer (&ret, g_bytes_unref);
+      goto out;
+    }
+
+ out:
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  GVariant *sources;
+  GHashTable *source_data; /* index -> GBytes */
+} StaticDeltaExecutionState;
+
+static GBytes *
+get_source_data (StaticDeltaExecutionState  *state,
+                 guint64                     source_index,
+                 GCancellable               *cancellable,
+                 GError                    **error)
+{
+  GBytes *ret;
+  gs_unref_variant GVariant *csum_v = NULL;
+  gs_free char *checksum = NULL;
+
+  if (source_index >= g_variant_n_children (state->sources))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted static delta part; invalid source %" G_GUINT64_FORMAT,
+                   source_index);
+      return NULL;
+    }
+
+  ret = g_hash_table_lookup (state->source_data, GUINT_TO_POINTER ((guint) source_index));
+  if (ret)
+    return ret;
+
+  csum_v = g_variant_get_child_value (state->sources, source_index);
+  if (!ostree_validate_structureof_csum_v (csum_v, error))
+    return NULL;
+  checksum = ostree_checksum_from_bytes_v (csum_v);
+
+  ret = _ostree_static_delta_load_object_bytes (state->repo, OSTREE_OBJECT_TYPE_FILE,
+                                                checksum, cancellable, error);
+  if (!ret)
+    {
+      g_prefix_error (error, "Loading static delta source: ");
+      return NULL;
+    }
+
+  g_hash_table_insert (state->source_data, GUINT_TO_POINTER ((guint) source_index), ret);
+  return ret;
+}
+
+static GBytes *
+execute_ops (StaticDeltaExecutionState  *state,
+             GVariant                   *ops,
+             GCancellable               *cancellable,
+             GError                    **error)
+{
+  GByteArray *result;
+  gsize ops_len;
+  const guint8 *opdata = g_variant_get_fixed_array (ops, &ops_len, 1);
+  const guint8 *end = opdata + ops_len;
+
+  result = g_byte_array_new ();
+
+  while (opdata < end)
+    {
+      guint8 opcode = *opdata++;
+
+      switch (opcode)
+        {
+        case OSTREE_STATIC_DELTA_OP_WRITE:
+          {
+            guint64 len;
+
+            if (!read_varuint64 (&opdata, end, &len, error))
+              goto err;
+            if (len > (guint64)(end - opdata))
+              {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Corrupted static delta part; write past end of operations");
+                goto err;
+              }
+            g_byte_array_append (result, opdata, len);
+            opdata += len;
+          }
+          break;
+        case OSTREE_STATIC_DELTA_OP_COPY:
+          {
+            guint64 source_index, offset, len;
+            GBytes *source;
+            const guint8 *source_data;
+            gsize source_len;
+
+            if (!read_varuint64 (&opdata, end, &source_index, error)
+                || !read_varuint64 (&opdata, end, &offset, error)
+                || !read_varuint64 (&opdata, end, &len, error))
+              goto err;
+
+            source = get_source_data (state, source_index, cancellable, error);
+            if (!source)
+              goto err;
+
+            source_data = g_bytes_get_data (source, &source_len);
+            if (offset > source_len || len > source_len - offset)
+              {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Corrupted static delta part; copy past end of source");
+                goto err;
+              }
+            g_byte_array_append (result, source_data + offset, len);
+          }
+          break;
+        default:
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Unknown static delta operation '%c'", opcode);
+          goto err;
+        }
+    }
+
+  return g_byte_array_free_to_bytes (result);
+ err:
+  g_byte_array_unref (result);
+  return NULL;
+}
+
+/**
+ * _ostree_static_delta_part_execute:
+ * @repo: Repo, which must be in a transaction
+ * @part_header: Entry for this part from the superblock
+ * @part_data: Contents of the part file
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Verify @part_data against @part_header, and write the objects it
+ * contains into @repo.  Every object is checksummed as it is
+ * written, so a corrupted part can't introduce bad objects.
+ */
+gboolean
+_ostree_static_delta_part_execute (OstreeRepo      *repo,
+                                   GVariant        *part_header,
+                                   GBytes          *part_data,
+                                   GCancellable    *cancellable,
+                                   GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *csum_v = NULL;
+  gs_unref_variant GVariant *payload = NULL;
+  gs_unref_variant GVariant *objects = NULL;
+  gs_unref_bytes GBytes *payload_data = NULL;
+  gs_free char *expected_checksum = NULL;
+  gs_free char *actual_checksum = NULL;
+  guint64 compressed_size, uncompressed_size;
+  StaticDeltaExecutionState state = { 0, };
+  gsize i, n;
+
+  g_variant_get (part_header, "(@aytt@ay)", &csum_v, &compressed_size,
+                 &uncompressed_size, NULL);
+  compressed_size = GUINT64_FROM_BE (compressed_size);
+  uncompressed_size = GUINT64_FROM_BE (uncompressed_size);
+
+  if (!ostree_validate_structureof_csum_v (csum_v, error))
+    goto out;
+  expected_checksum = ostree_checksum_from_bytes_v (csum_v);
+
+  if (g_bytes_get_size (part_data) != compressed_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Static delta part %s has size %" G_GSIZE_FORMAT ", expected %" G_GUINT64_FORMAT,
+                   expected_checksum, g_bytes_get_size (part_data), compressed_size);
+      goto out;
+    }
+
+  actual_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                 g_bytes_get_data (part_data, NULL),
+                                                 g_bytes_get_size (part_data));
+  if (strcmp (actual_checksum, expected_checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted static delta part; checksum expected='%s' actual='%s'",
+                   expected_checksum, actual_checksum);
+      goto out;
+    }
+
+  payload_data = decompress_part (part_data, uncompressed_size, cancellable, error);
+  if (!payload_data)
+    goto out;
+
+  payload = g_variant_new_from_data (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
+                                     g_bytes_get_data (payload_data, NULL),
+                                     g_bytes_get_size (payload_data),
+                                     FALSE,
+                                     (GDestroyNotify) g_bytes_unref,
+                                     g_bytes_ref (payload_data));
+  g_variant_ref_sink (payload);
+
+  state.repo = repo;
+  state.sources = g_variant_get_child_value (payload, 0);
+  state.source_data = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_bytes_unref);
+  objects = g_variant_get_child_value (payload, 1);
+
+  n = g_variant_n_children (objects);
+  for (i = 0; i < n; i++)
+    {
+      guint8 objtype_u8;
+      OstreeObjectType objtype;
+      gs_unref_variant GVariant *obj_csum_v = NULL;
+      gs_unref_variant GVariant *ops = NULL;
+      gs_unref_bytes GBytes *object_data = NULL;
+      gs_free char *checksum = NULL;
+      gboolean have_object;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      g_variant_get_child (objects, i, "(y@ay@ay)", &objtype_u8, &obj_csum_v, &ops);
+      if (!ostree_validate_structureof_objtype (objtype_u8, error))
+        goto out;
+      objtype = (OstreeObjectType) objtype_u8;
+      if (!ostree_validate_structureof_csum_v (obj_csum_v, error))
+        goto out;
+      checksum = ostree_checksum_from_bytes_v (obj_csum_v);
+
+      if (!ostree_repo_has_object (repo, objtype, checksum, &have_object,
+                                   cancellable, error))
+        goto out;
+      if (have_object)
+        continue;
+
+      object_data = execute_ops (&state, ops, cancellable, error);
+      if (!object_data)
+        goto out;
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        {
+          gs_unref_variant GVariant *metadata = NULL;
+
+          metadata = g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                              g_bytes_get_data (object_data, NULL),
+                                              g_bytes_get_size (object_data),
+                                              FALSE,
+                                              (GDestroyNotify) g_bytes_unref,
+                                              g_bytes_ref (object_data));
+          g_variant_ref_sink (metadata);
+
+          if (!ostree_repo_write_metadata (repo, objtype, checksum, metadata, NULL,
+                                           cancellable, error))
+            goto out;
+        }
+      else
+        {
+          gs_unref_object GInputStream *object_input = NULL;
+
+          object_input = g_memory_input_stream_new_from_bytes (object_data);
+          if (!ostree_repo_write_content (repo, checksum, object_input,
+                                          g_bytes_get_size (object_data), NULL,
+                                          cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (state.sources)
+    g_variant_unref (state.sources);
+  if (state.source_data)
+    g_hash_table_unref (state.source_data);
+  return ret;
+}
+
+/**
+ * _ostree_static_delta_write_commit:
+ *
+ * Write the target commit of @superblock, and its detached metadata,
+ * into @repo.  Call this after all parts have been executed.
+ */
+gboolean
+_ostree_static_delta_write_commit (OstreeRepo      *repo,
+                                   GVariant        *superblock,
+                                   GCancellable    *cancellable,
+                                   GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *to_csum_v = NULL;
+  gs_unref_variant GVariant *commit = NULL;
+  gs_unref_variant GVariant *detached_metadata = NULL;
+  gs_free char *to_checksum = NULL;
+
+  to_csum_v = g_variant_get_child_value (superblock, 3);
+  if (!ostree_validate_structureof_csum_v (to_csum_v, error))
+    goto out;
+  to_checksum = ostree_checksum_from_bytes_v (to_csum_v);
+
+  commit = g_variant_get_child_value (superblock, 4);
+  detached_metadata = g_variant_get_child_value (superblock, 5);
+
+  if (g_variant_n_children (detached_metadata) > 0)
+    {
+      if (!ostree_repo_write_commit_detached_metadata (repo, to_checksum, detached_metadata,
+                                                       cancellable, error))
+        goto out;
+    }
+
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_COMMIT, to_checksum,
+                                   commit, NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_static_delta_execute_offline:
+ * @self: Repo
+ * @dir: Path to a directory containing a static delta
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Given @dir, a directory generated by
+ * ostree_repo_static_delta_generate(), write the objects and the
+ * commit it contains into @self.  The source commit of the delta
+ * must already be present.  This must be called inside a
+ * transaction.
+ */
+gboolean
+ostree_repo_static_delta_execute_offline (OstreeRepo      *self,
+                                          GFile           *dir,
+                                          GCancellable    *cancellable,
+                                          GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *superblock_path = NULL;
+  gs_unref_variant GVariant *superblock = NULL;
+  gs_unref_variant GVariant *from_csum_v = NULL;
+  gs_unref_variant GVariant *parts = NULL;
+  gsize i, n;
+
+  g_return_val_if_fail (self->in_transaction, FALSE);
+
+  superblock_path = g_file_get_child (dir, "superblock");
+  if (!ot_util_variant_map (superblock_path, G_VARIANT_TYPE (OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT),
+                            FALSE, &superblock, error))
+    goto out;
+
+  from_csum_v = g_variant_get_child_value (superblock, 2);
+  if (g_variant_n_children (from_csum_v) > 0)
+    {
+      gs_free char *from_checksum = NULL;
+      gboolean have_from;
+
+      if (!ostree_validate_structureof_csum_v (from_csum_v, error))
+        goto out;
+      from_checksum = ostree_checksum_from_bytes_v (from_csum_v);
+
+      if (!ostree_repo_has_object (self, OSTREE_OBJECT_TYPE_COMMIT, from_checksum,
+                                   &have_from, cancellable, error))
+        goto out;
+      if (!have_from)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Commit %s, which is the delta source, is not in repository",
+                       from_checksum);
+          goto out;
+        }
+    }
+
+  parts = g_variant_get_child_value (superblock, 6);
+  n = g_variant_n_children (parts);
+  for (i = 0; i < n; i++)
+    {
+      gs_unref_variant GVariant *part_header = NULL;
+      gs_unref_object GFile *part_path = NULL;
+      gs_free char *part_name = NULL;
+      GMappedFile *mfile = NULL;
+      gs_unref_bytes GBytes *part_data = NULL;
+      gboolean is_fetched;
+
+      part_header = g_variant_get_child_value (parts, i);
+
+      if (!_ostree_static_delta_part_is_fetched (self, part_header, &is_fetched,
+                                                 cancellable, error))
+        goto out;
+      if (is_fetched)
+        continue;
+
+      part_name = g_strdup_printf ("%u", (guint) i);
+      part_path = g_file_get_child (dir, part_name);
+      mfile = gs_file_map_noatime (part_path, cancellable, error);
+      if (!mfile)
+        goto out;
+      part_data = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
+
+      if (!_ostree_static_delta_part_execute (self, part_header, part_data,
+                                              cancellable, error))
+        {
+          g_prefix_error (error, "Executing delta part %u: ", (guint) i);
+          goto out;
+        }
+    }
+
+  if (!_ostree_static_delta_write_commit (self, superblock, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
@@ -22,7 +22,11 @@
 
 #include "config.h"
 
+#include <string.h>
+#include <unistd.h>
+
 #include "ostree.h"
+#include "ostree-repo-private.h"
 #include "otutil.h"
 #include "libgsystem.h"
 
@@ -41,109 +45,402 @@ ostree_repo_traverse_new_reachable (void)
                                 NULL, (GDestroyNotify)g_variant_unref);
 }
 
+/*
+ * Loading dirtrees is mostly waiting for I/O when the cache is cold,
+ * so traversals load them on a pool of threads.  Each job loads one
+ * dirtree, records its entries, and queues the subdirectories which
+ * weren't seen before; the calling thread walks the commits, queues
+ * their root dirtrees, and waits for the queue to drain.
+ *
+ * Objects are recorded in an #OstreeObjectSet, or for the older
+ * #GHashTable based API, in the caller's table.  A dirtree is only
+ * recorded once it is found to exist, so queued dirtrees are tracked
+ * separately in @queued.
+ *
+ * Prune instead uses the reachable index of each commit (see
+ * ostree-repo-reachable-index.c).  A commit without one has its tree
+ * traversed on its own, rather than skipping directories seen in
+ * other commits, and the result is stored as its index.
+ */
+
+#define OSTREE_TRAVERSE_MAX_THREADS 16
+
+typedef struct {
+  OstreeRepo      *repo;
+  GCancellable    *cancellable;
+  GThreadPool     *pool;
+  gboolean         use_index;
+
+  GMutex           lock;
+  GCond            cond;
+  /* The fields below are protected by @lock */
+  OstreeObjectSet *reachable;
+  GHashTable      *compat_reachable;
+  OstreeObjectSet *queued;
+  guint            n_outstanding;
+  /* Set if a dirtree wasn't found */
+  gboolean         incomplete;
+  gboolean         aborted;
+  GError          *error;
+} OstreeTraverseData;
+
+typedef struct {
+  guchar csum[32];
+  int recursion_depth;
+} OstreeTraverseJob;
+
+static gboolean
+traverse_contains (OstreeTraverseData  *data,
+                   const guchar        *csum,
+                   OstreeObjectType     objtype)
+{
+  if (data->compat_reachable)
+    {
+      char checksum[65];
+      gs_unref_variant GVariant *key = NULL;
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+      return g_hash_table_contains (data->compat_reachable, key);
+    }
+
+  return ostree_object_set_contains_bytes (data->reachable, csum, objtype);
+}
+
+static void
+traverse_add (OstreeTraverseData  *data,
+              const guchar        *csum,
+              OstreeObjectType     objtype)
+{
+  if (data->compat_reachable)
+    {
+      char checksum[65];
+      GVariant *key;
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+      g_hash_table_replace (data->compat_reachable, key, key);
+      return;
+    }
+
+  (void) ostree_object_set_add_bytes (data->reachable, csum, objtype);
+}
+
+/* Called with the lock held */
+static void
+traverse_queue_dirtree (OstreeTraverseData  *data,
+                        const guchar        *csum,
+                        int                  recursion_depth)
+{
+  OstreeTraverseJob *job;
+
+  if (data->aborted)
+    return;
+  if (traverse_contains (data, csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+    return;
+  if (!ostree_object_set_add_bytes (data->queued, csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+    return;
+
+  job = g_new (OstreeTraverseJob, 1);
+  memcpy (job->csum, csum, 32);
+  job->recursion_depth = recursion_depth;
+  data->n_outstanding++;
+  g_thread_pool_push (data->pool, job, NULL);
+}
+
+/* Called with the lock held */
 static gboolean
-traverse_dirtree_internal (OstreeRepo      *repo,
-                           const char      *dirtree_checksum,
-                           int              recursion_depth,
-                           GHashTable      *inout_reachable,
-                           GCancellable    *cancellable,
-                           GError         **error)
+traverse_record_dirtree (OstreeTraverseData  *data,
+                         OstreeTraverseJob   *job,
+                         GVariant            *tree,
+                         GError             **error)
 {
   gboolean ret = FALSE;
   int n, i;
-  gs_unref_variant GVariant *key = NULL;
-  gs_unref_variant GVariant *tree = NULL;
   gs_unref_variant GVariant *files_variant = NULL;
   gs_unref_variant GVariant *dirs_variant = NULL;
-  gs_unref_variant GVariant *csum_v = NULL;
-  gs_unref_variant GVariant *content_csum_v = NULL;
-  gs_unref_variant GVariant *metadata_csum_v = NULL;
-  gs_free char *tmp_checksum = NULL;
 
-  if (recursion_depth > OSTREE_MAX_RECURSION)
+  traverse_add (data, job->csum, OSTREE_OBJECT_TYPE_DIR_TREE);
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      if (!ostree_validate_structureof_csum_v (csum_v, error))
+        goto out;
+      traverse_add (data, ostree_checksum_bytes_peek (csum_v), OSTREE_OBJECT_TYPE_FILE);
+    }
+
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      gs_unref_variant GVariant *content_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &content_csum_v, &metadata_csum_v);
+      if (!ostree_validate_structureof_csum_v (content_csum_v, error))
+        goto out;
+      if (!ostree_validate_structureof_csum_v (metadata_csum_v, error))
+        goto out;
+
+      traverse_queue_dirtree (data, ostree_checksum_bytes_peek (content_csum_v),
+                              job->recursion_depth + 1);
+      traverse_add (data, ostree_checksum_bytes_peek (metadata_csum_v), OSTREE_OBJECT_TYPE_DIR_META);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+traverse_dirtree (OstreeTraverseData  *data,
+                  OstreeTraverseJob   *job,
+                  GError             **error)
+{
+  gboolean ret = FALSE;
+  gboolean recorded;
+  char checksum[65];
+  gs_unref_variant GVariant *tree = NULL;
+
+  if (job->recursion_depth > OSTREE_MAX_RECURSION)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "Maximum recursion limit reached during traversal");
       goto out;
     }
 
-  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum, &tree, error))
+  if (g_cancellable_set_error_if_cancelled (data->cancellable, error))
+    goto out;
+
+  ostree_checksum_inplace_from_bytes (job->csum, checksum);
+  if (!ostree_repo_load_variant_if_exists (data->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                           checksum, &tree, error))
     goto out;
 
   if (!tree)
-    return TRUE;
-
-  key = ostree_object_name_serialize (dirtree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE);
-  if (!g_hash_table_lookup (inout_reachable, key))
-    { 
-      g_hash_table_insert (inout_reachable, key, key);
-      key = NULL;
-
-      /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
-      files_variant = g_variant_get_child_value (tree, 0);
-      n = g_variant_n_children (files_variant);
-      for (i = 0; i < n; i++)
-        {
-          const char *filename;
-      
-          g_clear_pointer (&csum_v, (GDestroyNotify) g_variant_unref);
-          g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes_v (csum_v);
-          key = ostree_object_name_serialize (tmp_checksum, OSTREE_OBJECT_TYPE_FILE);
-          g_hash_table_replace (inout_reachable, key, key);
-          key = NULL;
-        }
+    {
+      g_mutex_lock (&data->lock);
+      data->incomplete = TRUE;
+      g_mutex_unlock (&data->lock);
+      ret = TRUE;
+      goto out;
+    }
 
-      dirs_variant = g_variant_get_child_value (tree, 1);
-      n = g_variant_n_children (dirs_variant);
-      for (i = 0; i < n; i++)
-        {
-          const char *dirname;
-      
-          g_clear_pointer (&content_csum_v, (GDestroyNotify) g_variant_unref);
-          g_clear_pointer (&metadata_csum_v, (GDestroyNotify) g_variant_unref);
-          g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
-                               &dirname, &content_csum_v, &metadata_csum_v);
-      
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes_v (content_csum_v);
-          if (!traverse_dirtree_internal (repo, tmp_checksum, recursion_depth + 1,
-                                          inout_reachable, cancellable, error))
-            goto out;
+  g_mutex_lock (&data->lock);
+  recorded = traverse_record_dirtree (data, job, tree, error);
+  g_mutex_unlock (&data->lock);
+  if (!recorded)
+    goto out;
 
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes_v (metadata_csum_v);
-          key = ostree_object_name_serialize (tmp_checksum, OSTREE_OBJECT_TYPE_DIR_META);
-          g_hash_table_replace (inout_reachable, key, key);
-          key = NULL;
-        }
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+traverse_thread (gpointer   datap,
+                 gpointer   user_data)
+{
+  OstreeTraverseJob *job = datap;
+  OstreeTraverseData *data = user_data;
+  GError *local_error = NULL;
+  gboolean skip;
+
+  g_mutex_lock (&data->lock);
+  skip = data->aborted || data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!skip)
+    (void) traverse_dirtree (data, job, &local_error);
+
+  g_mutex_lock (&data->lock);
+  if (local_error)
+    {
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
     }
+  data->n_outstanding--;
+  if (data->n_outstanding == 0)
+    g_cond_broadcast (&data->cond);
+  g_mutex_unlock (&data->lock);
+
+  g_free (job);
+}
+
+static gboolean
+traverse_data_init (OstreeTraverseData  *data,
+                    OstreeRepo          *repo,
+                    OstreeObjectSet     *reachable,
+                    GHashTable          *compat_reachable,
+                    GCancellable        *cancellable,
+                    GError             **error)
+{
+  long nproc_onln = sysconf (_SC_NPROCESSORS_ONLN);
+
+  memset (data, 0, sizeof (*data));
+  data->repo = repo;
+  data->cancellable = cancellable;
+  data->reachable = reachable;
+  data->compat_reachable = compat_reachable;
+  data->queued = ostree_object_set_new ();
+  g_mutex_init (&data->lock);
+  g_cond_init (&data->cond);
+
+  /* More threads than CPUs, since they mostly wait for I/O */
+  data->pool = g_thread_pool_new (traverse_thread, data,
+                                  (int)CLAMP (nproc_onln * 2, 4, OSTREE_TRAVERSE_MAX_THREADS),
+                                  FALSE, error);
+  return data->pool != NULL;
+}
+
+/* Wait for all queued dirtrees to be traversed */
+static gboolean
+traverse_data_wait (OstreeTraverseData  *data,
+                    GError             **error)
+{
+  g_mutex_lock (&data->lock);
+  while (data->n_outstanding > 0)
+    g_cond_wait (&data->cond, &data->lock);
+  g_mutex_unlock (&data->lock);
+
+  if (data->error)
+    {
+      g_propagate_error (error, data->error);
+      data->error = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+traverse_data_clear (OstreeTraverseData *data)
+{
+  if (data->pool)
+    {
+      /* On error, let any remaining jobs finish without doing work */
+      g_mutex_lock (&data->lock);
+      data->aborted = TRUE;
+      g_mutex_unlock (&data->lock);
+      g_thread_pool_free (data->pool, FALSE, TRUE);
+    }
+  g_clear_error (&data->error);
+  ostree_object_set_unref (data->queued);
+  g_mutex_clear (&data->lock);
+  g_cond_clear (&data->cond);
+}
+
+/* Collect all objects reachable from the root dirtree @content_csum,
+ * for a reachable index.  @out_complete is %FALSE if some dirtree
+ * isn't stored.
+ */
+static gboolean
+traverse_root_dirtree (OstreeRepo        *repo,
+                       const guchar      *content_csum,
+                       OstreeObjectSet  **out_objects,
+                       gboolean          *out_complete,
+                       GCancellable      *cancellable,
+                       GError           **error)
+{
+  gboolean ret = FALSE;
+  OstreeTraverseData data;
+  OstreeObjectSet *ret_objects = ostree_object_set_new ();
+
+  if (!traverse_data_init (&data, repo, ret_objects, NULL, cancellable, error))
+    goto out;
+
+  g_mutex_lock (&data.lock);
+  traverse_queue_dirtree (&data, content_csum, 0);
+  g_mutex_unlock (&data.lock);
+
+  if (!traverse_data_wait (&data, error))
+    goto out;
 
   ret = TRUE;
+  *out_complete = !data.incomplete;
+  ot_transfer_out_value (out_objects, &ret_objects);
  out:
+  traverse_data_clear (&data);
+  if (ret_objects)
+    ostree_object_set_unref (ret_objects);
   return ret;
 }
 
-/**
- * ostree_repo_traverse_commit_union: (skip)
- * @repo: Repo
- * @commit_checksum: ASCII SHA256 checksum
- * @maxdepth: Traverse this many parent commits, -1 for unlimited
- * @inout_reachable: Set of reachable objects
- * @cancellable: Cancellable
- * @error: Error
- *
- * Update the set @inout_reachable containing all objects reachable
- * from @commit_checksum, traversing @maxdepth parent commits.
+/* Add the tree of @commit_checksum to the reachable set from its
+ * reachable index, traversing it and storing the index first if there
+ * isn't one yet.
  */
-gboolean
-ostree_repo_traverse_commit_union (OstreeRepo      *repo,
-                                   const char      *commit_checksum,
-                                   int              maxdepth,
-                                   GHashTable      *inout_reachable,
-                                   GCancellable    *cancellable,
-                                   GError         **error)
+static gboolean
+traverse_commit_tree_indexed (OstreeTraverseData  *data,
+                              const char          *commit_checksum,
+                              const guchar        *content_csum,
+                              GError             **error)
+{
+  gboolean ret = FALSE;
+  gboolean success;
+  gboolean loaded;
+  gboolean complete;
+  GError *temp_error = NULL;
+  OstreeObjectSet *tree_objects = NULL;
+  OstreeObjectSetIter iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+
+  g_mutex_lock (&data->lock);
+  success = _ostree_repo_reachable_index_load (data->repo, commit_checksum, data->reachable,
+                                               &loaded, data->cancellable, error);
+  g_mutex_unlock (&data->lock);
+  if (!success)
+    goto out;
+  if (loaded)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!traverse_root_dirtree (data->repo, content_csum, &tree_objects, &complete,
+                              data->cancellable, error))
+    goto out;
+
+  /* The missing parts of a partial tree may be pulled later */
+  if (complete
+      && !_ostree_repo_reachable_index_write (data->repo, commit_checksum, tree_objects,
+                                              data->cancellable, &temp_error))
+    {
+      g_debug ("Failed to write reachable index for %s: %s",
+               commit_checksum, temp_error->message);
+      g_clear_error (&temp_error);
+    }
+
+  g_mutex_lock (&data->lock);
+  ostree_object_set_iter_init (&iter, tree_objects);
+  while (ostree_object_set_iter_next (&iter, &csum, &objtype))
+    traverse_add (data, csum, objtype);
+  g_mutex_unlock (&data->lock);
+
+  ret = TRUE;
+ out:
+  if (tree_objects)
+    ostree_object_set_unref (tree_objects);
+  return ret;
+}
+
+static gboolean
+traverse_commit (OstreeTraverseData  *data,
+                 const char          *commit_checksum,
+                 int                  maxdepth,
+                 GError             **error)
 {
   gboolean ret = FALSE;
   gs_free char *tmp_checksum = NULL;
@@ -151,18 +448,25 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
   while (TRUE)
     {
       gboolean recurse = FALSE;
+      gboolean seen;
+      guchar commit_csum[32];
       gs_unref_variant GVariant *meta_csum_bytes = NULL;
       gs_unref_variant GVariant *content_csum_bytes = NULL;
-      gs_unref_variant GVariant *key = NULL;
       gs_unref_variant GVariant *commit = NULL;
 
-      key = ostree_object_name_serialize (commit_checksum, OSTREE_OBJECT_TYPE_COMMIT);
+      if (g_cancellable_set_error_if_cancelled (data->cancellable, error))
+        goto out;
 
-      if (g_hash_table_contains (inout_reachable, key))
+      ostree_checksum_inplace_to_bytes (commit_checksum, commit_csum);
+      g_mutex_lock (&data->lock);
+      seen = traverse_contains (data, commit_csum, OSTREE_OBJECT_TYPE_COMMIT);
+      g_mutex_unlock (&data->lock);
+      if (seen)
         break;
 
       /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
-      if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, &commit, error))
+      if (!ostree_repo_load_variant_if_exists (data->repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                               commit_checksum, &commit, error))
         goto out;
 
       /* Just return if the parent isn't found; we do expect most
@@ -170,13 +474,9 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
        */
       if (!commit)
         break;
-  
-      g_hash_table_add (inout_reachable, key);
-      key = NULL;
 
       g_variant_get_child (commit, 7, "@ay", &meta_csum_bytes);
-      g_free (tmp_checksum);
-      if (G_UNLIKELY (g_variant_n_children (meta_csum_bytes) == 0))
+      if (G_UNLIKELY (g_variant_n_children (meta_csum_bytes) != 32))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Corrupted commit '%s'; invalid tree metadata",
@@ -184,14 +484,8 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
           goto out;
         }
 
-      tmp_checksum = ostree_checksum_from_bytes_v (meta_csum_bytes);
-      key = ostree_object_name_serialize (tmp_checksum, OSTREE_OBJECT_TYPE_DIR_META);
-      g_hash_table_replace (inout_reachable, key, key);
-      key = NULL;
-
       g_variant_get_child (commit, 6, "@ay", &content_csum_bytes);
-      g_free (tmp_checksum);
-      if (G_UNLIKELY (g_variant_n_children (content_csum_bytes) == 0))
+      if (G_UNLIKELY (g_variant_n_children (content_csum_bytes) != 32))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Corrupted commit '%s'; invalid tree content",
@@ -199,8 +493,17 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
           goto out;
         }
 
-      tmp_checksum = ostree_checksum_from_bytes_v (content_csum_bytes);
-      if (!traverse_dirtree_internal (repo, tmp_checksum, 0, inout_reachable, cancellable, error))
+      g_mutex_lock (&data->lock);
+      traverse_add (data, commit_csum, OSTREE_OBJECT_TYPE_COMMIT);
+      traverse_add (data, ostree_checksum_bytes_peek (meta_csum_bytes), OSTREE_OBJECT_TYPE_DIR_META);
+      if (!data->use_index)
+        traverse_queue_dirtree (data, ostree_checksum_bytes_peek (content_csum_bytes), 0);
+      g_mutex_unlock (&data->lock);
+
+      if (data->use_index
+          && !traverse_commit_tree_indexed (data, commit_checksum,
+                                            ostree_checksum_bytes_peek (content_csum_bytes),
+                                            error))
         goto out;
 
       if (maxdepth == -1 || maxdepth > 0)
@@ -224,6 +527,154 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
   return ret;
 }
 
+static gboolean
+traverse_commits (OstreeRepo          *repo,
+                  const char * const  *commits,
+                  int                  maxdepth,
+                  OstreeObjectSet     *reachable,
+                  GHashTable          *compat_reachable,
+                  gboolean             use_index,
+                  GCancellable        *cancellable,
+                  GError             **error)
+{
+  gboolean ret = FALSE;
+  OstreeTraverseData data;
+  const char * const *iter;
+
+  if (!traverse_data_init (&data, repo, reachable, compat_reachable,
+                           cancellable, error))
+    goto out;
+  data.use_index = use_index;
+
+  for (iter = commits; *iter; iter++)
+    {
+      if (!traverse_commit (&data, *iter, maxdepth, error))
+        goto out;
+    }
+
+  if (!traverse_data_wait (&data, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  traverse_data_clear (&data);
+  return ret;
+}
+
+/**
+ * _ostree_repo_traverse_commits_indexed:
+ * @repo: Repo
+ * @commits: (array zero-terminated=1): ASCII SHA256 checksums
+ * @maxdepth: Traverse this many parent commits of each, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_traverse_commits_into_set(), but use the reachable
+ * index of each commit, creating any that are missing.  Objects
+ * referenced by an indexed commit are included whether or not they
+ * are stored.
+ */
+gboolean
+_ostree_repo_traverse_commits_indexed (OstreeRepo         *repo,
+                                       const char * const *commits,
+                                       int                 maxdepth,
+                                       OstreeObjectSet    *inout_reachable,
+                                       GCancellable       *cancellable,
+                                       GError            **error)
+{
+  return traverse_commits (repo, commits, maxdepth, inout_reachable, NULL, TRUE,
+                           cancellable, error);
+}
+
+/**
+ * ostree_repo_traverse_commits_into_set:
+ * @repo: Repo
+ * @commits: (array zero-terminated=1): ASCII SHA256 checksums
+ * @maxdepth: Traverse this many parent commits of each, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Add all objects reachable from @commits to @inout_reachable,
+ * traversing @maxdepth parent commits of each.  Commits and
+ * directories already in @inout_reachable are not traversed again.
+ *
+ * Directories are loaded in parallel, so this is much faster than
+ * traversing the commits one at a time when the objects are not
+ * cached.
+ */
+gboolean
+ostree_repo_traverse_commits_into_set (OstreeRepo         *repo,
+                                       const char * const *commits,
+                                       int                 maxdepth,
+                                       OstreeObjectSet    *inout_reachable,
+                                       GCancellable       *cancellable,
+                                       GError            **error)
+{
+  return traverse_commits (repo, commits, maxdepth, inout_reachable, NULL, FALSE,
+                           cancellable, error);
+}
+
+/**
+ * ostree_repo_traverse_commit_into_set:
+ * @repo: Repo
+ * @commit_checksum: ASCII SHA256 checksum
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Add all objects reachable from @commit_checksum to
+ * @inout_reachable, traversing @maxdepth parent commits.  Commits and
+ * directories already in @inout_reachable are not traversed again, so
+ * calling this for many commits costs about as much as the number of
+ * distinct objects among them; but see
+ * ostree_repo_traverse_commits_into_set().
+ */
+gboolean
+ostree_repo_traverse_commit_into_set (OstreeRepo      *repo,
+                                      const char      *commit_checksum,
+                                      int              maxdepth,
+                                      OstreeObjectSet *inout_reachable,
+                                      GCancellable    *cancellable,
+                                      GError         **error)
+{
+  const char *commits[] = { commit_checksum, NULL };
+
+  return traverse_commits (repo, commits, maxdepth, inout_reachable, NULL, FALSE,
+                           cancellable, error);
+}
+
+/**
+ * ostree_repo_traverse_commit_union: (skip)
+ * @repo: Repo
+ * @commit_checksum: ASCII SHA256 checksum
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Update the set @inout_reachable containing all objects reachable
+ * from @commit_checksum, traversing @maxdepth parent commits.
+ *
+ * For large repositories, prefer ostree_repo_traverse_commit_into_set(),
+ * which uses much less memory.
+ */
+gboolean
+ostree_repo_traverse_commit_union (OstreeRepo      *repo,
+                                   const char      *commit_checksum,
+                                   int              maxdepth,
+                                   GHashTable      *inout_reachable,
+                                   GCancellable    *cancellable,
+                                   GError         **error)
+{
+  const char *commits[] = { commit_checksum, NULL };
+
+  return traverse_commits (repo, commits, maxdepth, NULL, inout_reachable, FALSE,
+                           cancellable, error);
+}
+
 /**
  * ostree_repo_traverse_commit:
  * @repo: Repo
@@ -88,6 +88,7 @@ ostree_repo_finalize (GObject *object)
 {
   OstreeRepo *self = OSTREE_REPO (object);
 
+  _ostree_repo_object_filter_disable (self);
   g_clear_object (&self->parent_repo);
 
   g_clear_object (&self->repodir);
@@ -107,8 +108,11 @@ ostree_repo_finalize (GObject *object)
 
   g_clear_object (&self->transaction_lock_path);
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_destroy (self->loose_object_devino_hash);
+  g_clear_object (&self->devino_index_path);
+  g_clear_pointer (&self->devino_index, g_bytes_unref);
+  g_clear_pointer (&self->devino_index_appended, g_bytes_unref);
+  g_clear_pointer (&self->devino_index_added, g_array_unref);
+  g_clear_pointer (&self->devino_index_removed, g_hash_table_unref);
   if (self->updated_uncompressed_dirs)
     g_hash_table_destroy (self->updated_uncompressed_dirs);
   if (self->config)
@@ -177,6 +181,7 @@ ostree_repo_constructed (GObject *object)
   self->uncompressed_objects_dir = g_file_resolve_relative_path (self->repodir, "uncompressed-objects-cache/objects");
   self->remote_cache_dir = g_file_get_child (self->repodir, "remote-cache");
   self->config_file = g_file_get_child (self->repodir, "config");
+  self->devino_index_path = g_file_get_child (self->repodir, "devino-index");
 
   G_OBJECT_CLASS (ostree_repo_parent_class)->constructed (object);
 }
@@ -456,6 +461,11 @@ ostree_repo_open (OstreeRepo    *self,
 {
   gboolean ret = FALSE;
   gboolean is_archive;
+  gboolean do_fsync;
+  guint64 zlib_level_value;
+  char *endp;
+  gs_free char *zlib_level = NULL;
+  gs_free char *zlib_parallel_threshold = NULL;
   gs_free char *version = NULL;
   gs_free char *mode = NULL;
   gs_free char *parent_repo_path = NULL;
@@ -529,6 +539,43 @@ ostree_repo_open (OstreeRepo    *self,
                                             TRUE, &self->enable_uncompressed_cache, error))
     goto out;
 
+  /* Setting this to false trades crash safety for speed, e.g. for
+   * repositories which are just an intermediate build artifact.
+   */
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "fsync",
+                                            TRUE, &do_fsync, error))
+    goto out;
+  self->disable_fsync = !do_fsync;
+
+  /* Compression level for content objects in archive-z2 mode; 9 is
+   * much slower than the default for very little gain.
+   */
+  if (!ot_keyfile_get_value_with_default (self->config, "core", "zlib-level",
+                                          "6", &zlib_level, error))
+    goto out;
+  zlib_level_value = g_ascii_strtoull (zlib_level, &endp, 10);
+  if (*zlib_level == '\0' || *endp != '\0' || zlib_level_value > 9)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid core.zlib-level '%s', must be 0 to 9", zlib_level);
+      goto out;
+    }
+  self->zlib_level = (int) zlib_level_value;
+
+  /* Larger content objects are compressed using multiple threads;
+   * 0 disables this.
+   */
+  if (!ot_keyfile_get_value_with_default (self->config, "core", "zlib-parallel-threshold",
+                                          "16777216", &zlib_parallel_threshold, error))
+    goto out;
+  self->zlib_parallel_threshold = g_ascii_strtoull (zlib_parallel_threshold, &endp, 10);
+  if (*zlib_parallel_threshold == '\0' || *endp != '\0')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid core.zlib-parallel-threshold '%s'", zlib_parallel_threshold);
+      goto out;
+    }
+
   if (!gs_file_open_dir_fd (self->objects_dir, &self->objects_dir_fd, cancellable, error))
     goto out;
 
@@ -545,6 +592,11 @@ ostree_repo_open (OstreeRepo    *self,
         goto out;
     }
 
+  /* Only maintain the devino index incrementally once something has
+   * asked for it via ostree_repo_scan_hardlinks().
+   */
+  self->devino_index_track = g_file_query_exists (self->devino_index_path, NULL);
+
   self->inited = TRUE;
 
   ret = TRUE;
@@ -818,18 +870,57 @@ load_metadata_internal (OstreeRepo       *self,
   gboolean ret = FALSE;
   char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
   int fd = -1;
+  GBytes *packed_data = NULL;
   gs_unref_object GInputStream *ret_stream = NULL;
   gs_unref_variant GVariant *ret_variant = NULL;
 
   g_return_val_if_fail (OSTREE_OBJECT_TYPE_IS_META (objtype), FALSE);
 
-  _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
-
-  if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                           cancellable, error))
+  /* Packs are checked first, since they're already mapped; only if
+   * the object isn't loose either do we rescan for new packs.
+   */
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, FALSE,
+                                        &packed_data, NULL,
+                                        cancellable, error))
     goto out;
 
-  if (fd != -1)
+  if (!packed_data)
+    {
+      _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
+
+      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                               cancellable, error))
+        goto out;
+
+      if (fd == -1)
+        {
+          if (!_ostree_repo_find_packed_object (self, objtype, sha256, TRUE,
+                                                &packed_data, NULL,
+                                                cancellable, error))
+            goto out;
+        }
+    }
+
+  if (packed_data)
+    {
+      if (out_size)
+        *out_size = g_bytes_get_size (packed_data);
+
+      if (out_variant)
+        {
+          ret_variant = g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                                 g_bytes_get_data (packed_data, NULL),
+                                                 g_bytes_get_size (packed_data),
+                                                 TRUE,
+                                                 (GDestroyNotify) g_bytes_unref,
+                                                 packed_data);
+          packed_data = NULL; /* Transfer ownership */
+          g_variant_ref_sink (ret_variant);
+        }
+      else if (out_stream)
+        ret_stream = g_memory_input_stream_new_from_bytes (packed_data);
+    }
+  else if (fd != -1)
     {
       if (out_variant)
         {
@@ -886,6 +977,8 @@ load_metadata_internal (OstreeRepo       *self,
  out:
   if (fd != -1)
     (void) close (fd);
+  if (packed_data)
+    g_bytes_unref (packed_data);
   return ret;
 }
 
@@ -996,14 +1089,43 @@ ostree_repo_load_file (OstreeRepo         *self,
       int fd = -1;
       struct stat stbuf;
       gs_unref_object GInputStream *tmp_stream = NULL;
+      gs_unref_bytes GBytes *packed_data = NULL;
 
-      _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
-
-      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                               cancellable, error))
+      if (!_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, checksum, FALSE,
+                                            &packed_data, NULL,
+                                            cancellable, error))
         goto out;
 
-      if (fd != -1)
+      if (!packed_data)
+        {
+          _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+
+          if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                                   cancellable, error))
+            goto out;
+
+          if (fd == -1)
+            {
+              if (!_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, checksum, TRUE,
+                                                    &packed_data, NULL,
+                                                    cancellable, error))
+                goto out;
+            }
+        }
+
+      if (packed_data)
+        {
+          tmp_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+          if (!ostree_content_stream_parse (TRUE, tmp_stream, g_bytes_get_size (packed_data), TRUE,
+                                            out_input ? &ret_input : NULL,
+                                            &ret_file_info, &ret_xattrs,
+                                            cancellable, error))
+            goto out;
+
+          found = TRUE;
+        }
+      else if (fd != -1)
         {
           tmp_stream = g_unix_input_stream_new (fd, TRUE);
           fd = -1; /* Transfer ownership */
@@ -1146,6 +1268,8 @@ ostree_repo_load_object_stream (OstreeRepo         *self,
  *
  * Locate object in repository; if it exists, @out_is_stored will be
  * set to TRUE.  @loose_path_buf is always set to the loose path.
+ * During a transaction, objects known to be missing are answered
+ * without touching the filesystem.
  */
 gboolean
 _ostree_repo_has_loose_object (OstreeRepo           *self,
@@ -1157,11 +1281,22 @@ _ostree_repo_has_loose_object (OstreeRepo           *self,
                                GError             **error)
 {
   gboolean ret = FALSE;
+  gboolean maybe_stored;
   struct stat stbuf;
   int res;
 
   _ostree_loose_path (loose_path_buf, checksum, objtype, self->mode);
 
+  if (!_ostree_repo_object_filter_lookup (self, checksum, objtype, &maybe_stored,
+                                          cancellable, error))
+    goto out;
+  if (!maybe_stored)
+    {
+      ret = TRUE;
+      *out_is_stored = FALSE;
+      goto out;
+    }
+
   do
     res = fstatat (self->objects_dir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
   while (G_UNLIKELY (res == -1 && errno == EINTR));
@@ -1177,10 +1312,16 @@ _ostree_repo_has_loose_object (OstreeRepo           *self,
   return ret;
 }
 
+/*
+ * Check whether @self (but not its parents) contains the object,
+ * either loose or in a pack.  @out_stored_path is only set for
+ * loose objects.
+ */
 gboolean
 _ostree_repo_find_object (OstreeRepo           *self,
                           OstreeObjectType      objtype,
                           const char           *checksum,
+                          gboolean             *out_have_object,
                           GFile               **out_stored_path,
                           GCancellable         *cancellable,
                           GError             **error)
@@ -1188,16 +1329,33 @@ _ostree_repo_find_object (OstreeRepo           *self,
   gboolean ret = FALSE;
   gboolean has_object;
   char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  gs_unref_object GFile *ret_stored_path = NULL;
 
   if (!_ostree_repo_has_loose_object (self, checksum, objtype, &has_object, loose_path, 
                                       cancellable, error))
     goto out;
 
-  ret = TRUE;
   if (has_object)
-    *out_stored_path = g_file_resolve_relative_path (self->objects_dir, loose_path);
+    ret_stored_path = g_file_resolve_relative_path (self->objects_dir, loose_path);
   else
-    *out_stored_path = NULL;
+    {
+      gs_unref_bytes GBytes *packed_data = NULL;
+
+      /* With an object filter, we're in a transaction and trust our
+       * view of the repository; don't stat the pack directory either.
+       */
+      if (!_ostree_repo_find_packed_object (self, objtype, checksum,
+                                            self->object_filter == NULL,
+                                            &packed_data, NULL,
+                                            cancellable, error))
+        goto out;
+      has_object = (packed_data != NULL);
+    }
+
+  ret = TRUE;
+  if (out_have_object)
+    *out_have_object = has_object;
+  ot_transfer_out_value (out_stored_path, &ret_stored_path);
 out:
   return ret;
 }
@@ -1226,14 +1384,11 @@ ostree_repo_has_object (OstreeRepo           *self,
 {
   gboolean ret = FALSE;
   gboolean ret_have_object;
-  gs_unref_object GFile *loose_path = NULL;
 
-  if (!_ostree_repo_find_object (self, objtype, checksum, &loose_path,
+  if (!_ostree_repo_find_object (self, objtype, checksum, &ret_have_object, NULL,
                                  cancellable, error))
     goto out;
 
-  ret_have_object = (loose_path != NULL);
-
   if (!ret_have_object && self->parent_repo)
     {
       if (!ostree_repo_has_object (self->parent_repo, objtype, checksum,
@@ -1267,8 +1422,48 @@ ostree_repo_delete_object (OstreeRepo           *self,
                            GCancellable         *cancellable,
                            GError              **error)
 {
-  gs_unref_object GFile *objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  return gs_file_unlink (objpath, cancellable, error);
+  gboolean ret = FALSE;
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  gs_unref_bytes GBytes *packed_data = NULL;
+  gs_unref_hashtable GHashTable *to_delete = NULL;
+
+  _ostree_loose_path (loose_path, sha256, objtype, self->mode);
+
+  if (unlinkat (self->objects_dir_fd, loose_path, 0) == 0)
+    {
+      _ostree_repo_object_filter_note_removed (self, sha256, objtype);
+      ret = TRUE;
+      goto out;
+    }
+  else if (errno != ENOENT)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, TRUE,
+                                        &packed_data, NULL,
+                                        cancellable, error))
+    goto out;
+
+  if (!packed_data)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No such object %s.%s",
+                   sha256, ostree_object_type_to_string (objtype));
+      goto out;
+    }
+
+  to_delete = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                                     (GDestroyNotify) g_variant_unref, NULL);
+  g_hash_table_add (to_delete, g_variant_ref_sink (ostree_object_name_serialize (sha256, objtype)));
+  if (!_ostree_repo_delete_packed_objects (self, to_delete, NULL,
+                                           cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
 }
 
 /**
@@ -1292,14 +1487,38 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
                                        GError              **error)
 {
   gboolean ret = FALSE;
-  gs_unref_object GFile *objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  gs_unref_object GFileInfo *finfo = g_file_query_info (objpath, OSTREE_GIO_FAST_QUERYINFO,
-                                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                        cancellable, error);
-  if (!finfo)
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  struct stat stbuf;
+  gs_unref_bytes GBytes *packed_data = NULL;
+
+  _ostree_loose_path (loose_path, sha256, objtype, self->mode);
+
+  if (fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+      *out_size = stbuf.st_size;
+      ret = TRUE;
+      goto out;
+    }
+  else if (errno != ENOENT)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, TRUE,
+                                        &packed_data, NULL,
+                                        cancellable, error))
     goto out;
 
-  *out_size = g_file_info_get_size (finfo);
+  if (!packed_data)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No such object %s.%s",
+                   sha256, ostree_object_type_to_string (objtype));
+      goto out;
+    }
+
+  *out_size = g_bytes_get_size (packed_data);
   ret = TRUE;
  out:
   return ret;
@@ -1398,7 +1617,13 @@ ostree_repo_list_objects (OstreeRepo                  *self,
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
     {
-      /* Nothing for now... */
+      if (!_ostree_repo_list_packed_objects (self, ret_objects, cancellable, error))
+        goto out;
+      if (self->parent_repo)
+        {
+          if (!_ostree_repo_list_packed_objects (self->parent_repo, ret_objects, cancellable, error))
+            goto out;
+        }
     }
 
   ret = TRUE;
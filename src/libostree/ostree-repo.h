@@ -25,6 +25,7 @@
 #include "ostree-core.h"
 #include "ostree-types.h"
 #include "ostree-async-progress.h"
+#include "ostree-object-set.h"
 
 G_BEGIN_DECLS
 
@@ -198,6 +199,13 @@ gboolean      ostree_repo_write_content_finish (OstreeRepo        *self,
                                                 guchar           **out_csum,
                                                 GError           **error);
 
+gboolean      ostree_repo_import_object_from (OstreeRepo           *self,
+                                              OstreeRepo           *source,
+                                              OstreeObjectType      objtype,
+                                              const char           *checksum,
+                                              GCancellable         *cancellable,
+                                              GError              **error);
+
 gboolean      ostree_repo_resolve_rev (OstreeRepo  *self,
                                        const char  *refspec,
                                        gboolean     allow_noent,
@@ -300,6 +308,20 @@ OstreeRepoCommitModifier *ostree_repo_commit_modifier_new (OstreeRepoCommitModif
 
 GType ostree_repo_commit_modifier_get_type (void);
 
+void ostree_repo_commit_modifier_set_n_jobs (OstreeRepoCommitModifier *modifier,
+                                             guint                     n_jobs);
+
+gboolean ostree_repo_commit_modifier_set_stat_cache (OstreeRepoCommitModifier *modifier,
+                                                     GFile                    *path,
+                                                     const char               *parent,
+                                                     GCancellable             *cancellable,
+                                                     GError                  **error);
+
+gboolean ostree_repo_commit_modifier_save_stat_cache (OstreeRepoCommitModifier *modifier,
+                                                      const char               *commit,
+                                                      GCancellable             *cancellable,
+                                                      GError                  **error);
+
 OstreeRepoCommitModifier *ostree_repo_commit_modifier_ref (OstreeRepoCommitModifier *modifier);
 void ostree_repo_commit_modifier_unref (OstreeRepoCommitModifier *modifier);
 
@@ -376,6 +398,36 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            GCancellable             *cancellable,
                            GError                  **error);
 
+gboolean
+ostree_repo_checkout_tree_parallel (OstreeRepo               *self,
+                                    OstreeRepoCheckoutMode    mode,
+                                    OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                                    GFile                    *destination,
+                                    OstreeRepoFile           *source,
+                                    GFileInfo                *source_info,
+                                    guint                     n_jobs,
+                                    GCancellable             *cancellable,
+                                    GError                  **error);
+
+gboolean
+ostree_repo_checkout_tree_update (OstreeRepo               *self,
+                                  OstreeRepoCheckoutMode    mode,
+                                  GFile                    *destination,
+                                  OstreeRepoFile           *from_source,
+                                  OstreeRepoFile           *to_source,
+                                  GCancellable             *cancellable,
+                                  GError                  **error);
+
+gboolean
+ostree_repo_checkout_tree_from_reference (OstreeRepo               *self,
+                                          OstreeRepoCheckoutMode    mode,
+                                          GFile                    *destination,
+                                          OstreeRepoFile           *source,
+                                          GFile                    *reference,
+                                          OstreeRepoFile           *reference_source,
+                                          GCancellable             *cancellable,
+                                          GError                  **error);
+
 gboolean       ostree_repo_checkout_gc (OstreeRepo        *self,
                                         GCancellable      *cancellable,
                                         GError           **error);
@@ -429,6 +481,20 @@ gboolean ostree_repo_traverse_commit_union (OstreeRepo         *repo,
                                             GCancellable       *cancellable,
                                             GError            **error);
 
+gboolean ostree_repo_traverse_commit_into_set (OstreeRepo         *repo,
+                                               const char         *commit_checksum,
+                                               int                 maxdepth,
+                                               OstreeObjectSet    *inout_reachable,
+                                               GCancellable       *cancellable,
+                                               GError            **error);
+
+gboolean ostree_repo_traverse_commits_into_set (OstreeRepo         *repo,
+                                                const char * const *commits,
+                                                int                 maxdepth,
+                                                OstreeObjectSet    *inout_reachable,
+                                                GCancellable       *cancellable,
+                                                GError            **error);
+
 /**
  * OstreeRepoPruneFlags:
  * @OSTREE_REPO_PRUNE_FLAGS_NONE: No special options for pruning
@@ -450,6 +516,29 @@ gboolean ostree_repo_prune (OstreeRepo        *self,
                             GCancellable      *cancellable,
                             GError           **error);
 
+gboolean ostree_repo_repack_metadata (OstreeRepo     *self,
+                                      guint          *out_n_packed,
+                                      GCancellable   *cancellable,
+                                      GError        **error);
+
+gboolean ostree_repo_repack_content (OstreeRepo     *self,
+                                     guint64         max_object_size,
+                                     guint          *out_n_packed,
+                                     GCancellable   *cancellable,
+                                     GError        **error);
+
+gboolean ostree_repo_static_delta_generate (OstreeRepo     *self,
+                                            const char     *from,
+                                            const char     *to,
+                                            GVariant       *metadata,
+                                            GCancellable   *cancellable,
+                                            GError        **error);
+
+gboolean ostree_repo_static_delta_execute_offline (OstreeRepo     *self,
+                                                   GFile          *dir,
+                                                   GCancellable   *cancellable,
+                                                   GError        **error);
+
 /**
  * OstreeRepoPullFlags:
  * @OSTREE_REPO_PULL_FLAGS_NONE: No special options for pull
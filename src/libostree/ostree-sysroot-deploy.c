@@ -187,21 +187,87 @@ merge_etc_changes (GFile          *orig_etc,
   return ret;
 }
 
+/*
+ * checkout_from_reference_deployment:
+ *
+ * Check out @root to @deploy_target_path, hardlinking files which are
+ * unchanged from the tree of @reference_deployment out of its
+ * deployment directory.  Sets @out_done to %FALSE if
+ * @reference_deployment cannot be used.
+ */
+static gboolean
+checkout_from_reference_deployment (OstreeSysroot     *sysroot,
+                                    OstreeRepo        *repo,
+                                    OstreeDeployment  *reference_deployment,
+                                    GFile             *root,
+                                    GFile             *deploy_target_path,
+                                    gboolean          *out_done,
+                                    GCancellable      *cancellable,
+                                    GError           **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *reference_root = NULL;
+  gs_unref_object GFile *reference_etc = NULL;
+  gs_unref_object GFile *reference_path = NULL;
+
+  *out_done = FALSE;
+
+  if (!ostree_repo_read_commit (repo, ostree_deployment_get_csum (reference_deployment),
+                                &reference_root, NULL, cancellable, error))
+    goto out;
+
+  /* A tree with a toplevel /etc had it moved to /usr/etc by the
+   * compatibility hack in merge_configuration(), so its deployment
+   * directory no longer matches the commit.
+   */
+  reference_etc = g_file_get_child (reference_root, "etc");
+  if (g_file_query_exists (reference_etc, NULL))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  reference_path = ostree_sysroot_get_deployment_directory (sysroot, reference_deployment);
+  if (!g_file_query_exists (reference_path, NULL))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_print ("ostadmin: Reusing files from %s\n",
+           gs_file_get_path_cached (reference_path));
+
+  if (!ostree_repo_checkout_tree_from_reference (repo, 0, deploy_target_path,
+                                                 OSTREE_REPO_FILE (root),
+                                                 reference_path,
+                                                 OSTREE_REPO_FILE (reference_root),
+                                                 cancellable, error))
+    goto out;
+
+  *out_done = TRUE;
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 /**
  * checkout_deployment_tree:
  *
  * Look up @revision in the repository, and check it out in
- * /ostree/deploy/OS/deploy/${treecsum}.${deployserial}.
+ * /ostree/deploy/OS/deploy/${treecsum}.${deployserial}.  If
+ * @reference_deployment is given, unchanged files are shared with it.
  */
 static gboolean
 checkout_deployment_tree (OstreeSysroot     *sysroot,
                           OstreeRepo        *repo,
                           OstreeDeployment      *deployment,
+                          OstreeDeployment      *reference_deployment,
                           GFile            **out_deployment_path,
                           GCancellable      *cancellable,
                           GError           **error)
 {
   gboolean ret = FALSE;
+  gboolean done = FALSE;
   const char *csum = ostree_deployment_get_csum (deployment);
   gs_unref_object GFile *root = NULL;
   gs_unref_object GFileInfo *file_info = NULL;
@@ -232,9 +298,20 @@ checkout_deployment_tree (OstreeSysroot     *sysroot,
   g_print ("ostadmin: Creating deployment %s\n",
            gs_file_get_path_cached (deploy_target_path));
 
-  if (!ostree_repo_checkout_tree (repo, 0, 0, deploy_target_path, OSTREE_REPO_FILE (root),
-                                  file_info, cancellable, error))
-    goto out;
+  if (reference_deployment != NULL)
+    {
+      if (!checkout_from_reference_deployment (sysroot, repo, reference_deployment,
+                                               root, deploy_target_path, &done,
+                                               cancellable, error))
+        goto out;
+    }
+
+  if (!done)
+    {
+      if (!ostree_repo_checkout_tree_parallel (repo, 0, 0, deploy_target_path, OSTREE_REPO_FILE (root),
+                                               file_info, 0, cancellable, error))
+        goto out;
+    }
 
   ret = TRUE;
   ot_transfer_out_value (out_deployment_path, &deploy_target_path);
@@ -459,16 +536,39 @@ checksum_from_kernel_src (GFile        *src,
   return TRUE;
 }
 
-/* FIXME: We should really do individual fdatasync() on files/dirs,
- * since this causes us to block on unrelated I/O.  However, it's just
- * safer for now.
+/* Flush the filesystems holding the deployments and /boot (which may
+ * be a separate mount), without blocking on I/O to unrelated
+ * filesystems as sync() would.
  */
 static gboolean
-full_system_sync (GCancellable      *cancellable,
+full_system_sync (OstreeSysroot     *self,
+                  GCancellable      *cancellable,
                   GError           **error)
 {
-  sync ();
-  return TRUE;
+  gboolean ret = FALSE;
+  int sysroot_dfd = -1;
+  int boot_dfd = -1;
+  gs_unref_object GFile *boot_dir = g_file_get_child (self->path, "boot");
+
+  if (!gs_file_open_dir_fd (self->path, &sysroot_dfd, cancellable, error))
+    goto out;
+
+  if (!ot_util_syncfs (sysroot_dfd, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd (boot_dir, &boot_dfd, cancellable, error))
+    goto out;
+
+  if (!ot_util_syncfs (boot_dfd, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (sysroot_dfd != -1)
+    (void) close (sysroot_dfd);
+  if (boot_dfd != -1)
+    (void) close (boot_dfd);
+  return ret;
 }
 
 static gboolean
@@ -892,7 +992,7 @@ ostree_sysroot_write_deployments (OstreeSysroot     *self,
 
   if (!requires_new_bootversion)
     {
-      if (!full_system_sync (cancellable, error))
+      if (!full_system_sync (self, cancellable, error))
         {
           g_prefix_error (error, "Full sync: ");
           goto out;
@@ -949,7 +1049,7 @@ ostree_sysroot_write_deployments (OstreeSysroot     *self,
           goto out;
         }
 
-      if (!full_system_sync (cancellable, error))
+      if (!full_system_sync (self, cancellable, error))
         {
           g_prefix_error (error, "Full sync: ");
           goto out;
@@ -1052,6 +1152,44 @@ ostree_sysroot_deploy_one_tree (OstreeSysroot     *self,
                                 OstreeDeployment **out_new_deployment,
                                 GCancellable      *cancellable,
                                 GError           **error)
+{
+  return ostree_sysroot_deploy_one_tree_with_flags (self, osname, revision, origin,
+                                                    add_kernel_argv, provided_merge_deployment,
+                                                    OSTREE_SYSROOT_DEPLOY_FLAGS_NONE,
+                                                    out_new_deployment,
+                                                    cancellable, error);
+}
+
+/**
+ * ostree_sysroot_deploy_one_tree_with_flags:
+ * @self: Sysroot
+ * @osname: (allow-none): osname to use for merge deployment
+ * @revision: Checksum to add
+ * @origin: (allow-none): Origin to use for upgrades
+ * @add_kernel_argv: (allow-none): Append these arguments to kernel configuration
+ * @provided_merge_deployment: (allow-none): Use this deployment for merge path
+ * @flags: Flags controlling the checkout
+ * @out_new_deployment: (out): The new deployment path
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_sysroot_deploy_one_tree().  If @flags contains
+ * %OSTREE_SYSROOT_DEPLOY_FLAGS_INCREMENTAL, files unchanged from
+ * @provided_merge_deployment are hardlinked from its deployment
+ * directory rather than checked out of the repository, so the cost
+ * of deploying is proportional to the size of the update.
+ */
+gboolean
+ostree_sysroot_deploy_one_tree_with_flags (OstreeSysroot          *self,
+                                           const char             *osname,
+                                           const char             *revision,
+                                           GKeyFile               *origin,
+                                           char                  **add_kernel_argv,
+                                           OstreeDeployment       *provided_merge_deployment,
+                                           OstreeSysrootDeployFlags flags,
+                                           OstreeDeployment      **out_new_deployment,
+                                           GCancellable           *cancellable,
+                                           GError                **error)
 {
   gboolean ret = FALSE;
   gint new_deployserial;
@@ -1103,7 +1241,9 @@ ostree_sysroot_deploy_one_tree (OstreeSysroot     *self,
   ostree_deployment_set_origin (new_deployment, origin);
 
   /* Check out the userspace tree onto the filesystem */
-  if (!checkout_deployment_tree (self, repo, new_deployment, &new_deployment_path,
+  if (!checkout_deployment_tree (self, repo, new_deployment,
+                                 (flags & OSTREE_SYSROOT_DEPLOY_FLAGS_INCREMENTAL) ? merge_deployment : NULL,
+                                 &new_deployment_path,
                                  cancellable, error))
     {
       g_prefix_error (error, "Checking out tree: ");
@@ -71,6 +71,16 @@ gboolean ostree_sysroot_write_deployments (OstreeSysroot     *self,
                                            GCancellable      *cancellable,
                                            GError           **error);
 
+/**
+ * OstreeSysrootDeployFlags:
+ * @OSTREE_SYSROOT_DEPLOY_FLAGS_NONE: No flags
+ * @OSTREE_SYSROOT_DEPLOY_FLAGS_INCREMENTAL: Share unchanged files with the merge deployment
+ */
+typedef enum {
+  OSTREE_SYSROOT_DEPLOY_FLAGS_NONE = 0,
+  OSTREE_SYSROOT_DEPLOY_FLAGS_INCREMENTAL = (1 << 0)
+} OstreeSysrootDeployFlags;
+
 gboolean ostree_sysroot_deploy_one_tree (OstreeSysroot     *self,
                                          const char        *osname,
                                          const char        *revision,
@@ -81,6 +91,17 @@ gboolean ostree_sysroot_deploy_one_tree (OstreeSysroot     *self,
                                          GCancellable      *cancellable,
                                          GError           **error);
 
+gboolean ostree_sysroot_deploy_one_tree_with_flags (OstreeSysroot          *self,
+                                                    const char             *osname,
+                                                    const char             *revision,
+                                                    GKeyFile               *origin,
+                                                    char                  **add_kernel_argv,
+                                                    OstreeDeployment       *provided_merge_deployment,
+                                                    OstreeSysrootDeployFlags flags,
+                                                    OstreeDeployment      **out_new_deployment,
+                                                    GCancellable           *cancellable,
+                                                    GError                **error);
+
 OstreeDeployment *ostree_sysroot_get_merge_deployment (OstreeSysroot     *self,
                                                        const char        *osname);
 
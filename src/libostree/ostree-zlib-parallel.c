@@ -0,0 +1,305 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+
+/*
+ * Block-parallel raw deflate, in the style of pigz.  The input is cut
+ * into blocks which are compressed independently on a thread pool.
+ * Every block but the last ends with a sync flush, which pads the
+ * output to a byte boundary without marking the deflate stream as
+ * finished; the last block is finished normally.  Concatenated in
+ * order, the blocks form a single valid raw deflate stream, so
+ * readers don't need to know how it was produced.
+ *
+ * Unlike pigz, blocks are not primed with the end of the previous
+ * block as a dictionary; with large blocks the loss in compression
+ * ratio is negligible.
+ */
+
+#define OSTREE_ZLIB_PARALLEL_BLOCK_SIZE (1024 * 1024)
+
+typedef struct {
+  guint8 *data;
+  gsize len;
+  gboolean last;
+
+  GByteArray *compressed;
+} ParallelDeflateBlock;
+
+typedef struct {
+  int level;
+
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  GError *error;
+} ParallelDeflate;
+
+static void
+parallel_deflate_block_free (ParallelDeflateBlock *block)
+{
+  g_free (block->data);
+  if (block->compressed)
+    g_byte_array_unref (block->compressed);
+  g_free (block);
+}
+
+static gboolean
+deflate_block (ParallelDeflateBlock  *block,
+               int                    level,
+               GError               **error)
+{
+  gboolean ret = FALSE;
+  gsize consumed = 0;
+  gsize written = 0;
+  GConverterFlags flags = block->last ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_FLUSH;
+  gs_unref_object GConverter *compressor = NULL;
+
+  compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, level);
+  /* Deflate output is at most slightly larger than its input */
+  block->compressed = g_byte_array_new ();
+  g_byte_array_set_size (block->compressed, block->len + block->len / 64 + 1024);
+
+  while (TRUE)
+    {
+      GConverterResult result;
+      gsize bytes_read, bytes_written;
+      GError *temp_error = NULL;
+
+      if (block->compressed->len - written < 1024)
+        g_byte_array_set_size (block->compressed, block->compressed->len * 2);
+
+      result = g_converter_convert (compressor,
+                                    block->data + consumed, block->len - consumed,
+                                    block->compressed->data + written,
+                                    block->compressed->len - written,
+                                    flags, &bytes_read, &bytes_written, &temp_error);
+      if (result == G_CONVERTER_ERROR)
+        {
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+            {
+              g_clear_error (&temp_error);
+              g_byte_array_set_size (block->compressed, block->compressed->len * 2);
+              continue;
+            }
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+
+      consumed += bytes_read;
+      written += bytes_written;
+
+      if (result == G_CONVERTER_FINISHED
+          || (result == G_CONVERTER_FLUSHED && consumed == block->len))
+        break;
+    }
+
+  g_byte_array_set_size (block->compressed, written);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+parallel_deflate_thread (gpointer data,
+                         gpointer user_data)
+{
+  ParallelDeflateBlock *block = data;
+  ParallelDeflate *pd = user_data;
+  GError *local_error = NULL;
+  gboolean skip;
+
+  g_mutex_lock (&pd->lock);
+  skip = pd->error != NULL;
+  g_mutex_unlock (&pd->lock);
+
+  if (!skip)
+    (void) deflate_block (block, pd->level, &local_error);
+
+  g_mutex_lock (&pd->lock);
+  if (local_error)
+    {
+      if (pd->error == NULL)
+        pd->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  pd->n_outstanding--;
+  g_cond_broadcast (&pd->cond);
+  g_mutex_unlock (&pd->lock);
+}
+
+/* Fill a block from @prefix, then @input.  A short read means EOF. */
+static gboolean
+read_block (GInputStream   *input,
+            const guint8  **inout_prefix,
+            gsize          *inout_prefix_len,
+            guint8         *buf,
+            gsize           buf_len,
+            gsize          *out_len,
+            GCancellable   *cancellable,
+            GError        **error)
+{
+  gsize len = MIN (*inout_prefix_len, buf_len);
+  gsize bytes_read;
+
+  memcpy (buf, *inout_prefix, len);
+  *inout_prefix += len;
+  *inout_prefix_len -= len;
+
+  if (len < buf_len)
+    {
+      if (!g_input_stream_read_all (input, buf + len, buf_len - len, &bytes_read,
+                                    cancellable, error))
+        return FALSE;
+      len += bytes_read;
+    }
+
+  *out_len = len;
+  return TRUE;
+}
+
+/**
+ * _ostree_zlib_compress_parallel:
+ * @input: Data to compress
+ * @prefix: Data already read from @input
+ * @prefix_len: Length of @prefix
+ * @output: Raw deflate data is written here
+ * @level: zlib compression level
+ * @n_threads: Number of threads to use
+ * @out_bytes_read: (out): Total uncompressed size, including @prefix
+ *
+ * Compress @prefix followed by the rest of @input into a single raw
+ * deflate stream on @output, using @n_threads threads.
+ */
+gboolean
+_ostree_zlib_compress_parallel (GInputStream   *input,
+                                const guint8   *prefix,
+                                gsize           prefix_len,
+                                GOutputStream  *output,
+                                int             level,
+                                guint           n_threads,
+                                guint64        *out_bytes_read,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  gboolean eof = FALSE;
+  guint64 total = 0;
+  guint max_blocks = n_threads * 2;
+  GThreadPool *threadpool = NULL;
+  ParallelDeflate pd = { 0, };
+  GPtrArray *blocks = NULL;
+  guint i;
+
+  pd.level = level;
+  g_mutex_init (&pd.lock);
+  g_cond_init (&pd.cond);
+
+  threadpool = g_thread_pool_new (parallel_deflate_thread, &pd,
+                                  (int)n_threads, FALSE, error);
+  if (!threadpool)
+    goto out;
+
+  blocks = g_ptr_array_new_with_free_func ((GDestroyNotify) parallel_deflate_block_free);
+
+  /* Read a round of up to max_blocks blocks, compress them in
+   * parallel, then write them out in order.  This bounds memory use
+   * to roughly 2 * max_blocks blocks.
+   */
+  while (!eof)
+    {
+      g_ptr_array_set_size (blocks, 0);
+
+      for (i = 0; i < max_blocks && !eof; i++)
+        {
+          ParallelDeflateBlock *block = g_new0 (ParallelDeflateBlock, 1);
+
+          block->data = g_malloc (OSTREE_ZLIB_PARALLEL_BLOCK_SIZE);
+          g_ptr_array_add (blocks, block);
+
+          if (!read_block (input, &prefix, &prefix_len,
+                           block->data, OSTREE_ZLIB_PARALLEL_BLOCK_SIZE, &block->len,
+                           cancellable, error))
+            goto out;
+
+          total += block->len;
+          /* If the input is an exact multiple of the block size, this
+           * is an empty block which just finishes the stream.
+           */
+          if (block->len < OSTREE_ZLIB_PARALLEL_BLOCK_SIZE)
+            {
+              block->last = TRUE;
+              eof = TRUE;
+            }
+        }
+
+      g_mutex_lock (&pd.lock);
+      pd.n_outstanding += blocks->len;
+      g_mutex_unlock (&pd.lock);
+
+      for (i = 0; i < blocks->len; i++)
+        g_thread_pool_push (threadpool, blocks->pdata[i], NULL);
+
+      g_mutex_lock (&pd.lock);
+      while (pd.n_outstanding > 0)
+        g_cond_wait (&pd.cond, &pd.lock);
+      g_mutex_unlock (&pd.lock);
+
+      if (pd.error)
+        {
+          g_propagate_error (error, pd.error);
+          pd.error = NULL;
+          goto out;
+        }
+
+      for (i = 0; i < blocks->len; i++)
+        {
+          ParallelDeflateBlock *block = blocks->pdata[i];
+
+          if (!g_output_stream_write_all (output, block->compressed->data,
+                                          block->compressed->len, NULL,
+                                          cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+  if (out_bytes_read)
+    *out_bytes_read = total;
+ out:
+  if (threadpool)
+    g_thread_pool_free (threadpool, FALSE, TRUE);
+  if (blocks)
+    g_ptr_array_unref (blocks);
+  g_clear_error (&pd.error);
+  g_mutex_clear (&pd.lock);
+  g_cond_clear (&pd.cond);
+  return ret;
+}
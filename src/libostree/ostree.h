@@ -22,6 +22,7 @@
 
 #include <ostree-async-progress.h>
 #include <ostree-core.h>
+#include <ostree-object-set.h>
 #include <ostree-repo.h>
 #include <ostree-mutable-tree.h>
 #include <ostree-repo-file.h>
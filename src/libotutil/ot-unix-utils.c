@@ -35,6 +35,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 gboolean
 ot_util_filename_validate (const char *name,
@@ -134,6 +136,111 @@ ot_util_set_error_from_errno (GError **error,
   errno = saved_errno;
 }
 
+/**
+ * ot_util_syncfs:
+ * @dfd: A file descriptor on the filesystem to sync
+ * @error: Error
+ *
+ * Flush all data and metadata of the filesystem containing @dfd to
+ * disk.  Unlike sync(), this does not wait on I/O to unrelated
+ * filesystems.  Falls back to sync() where syncfs() is unavailable.
+ */
+gboolean
+ot_util_syncfs (int        dfd,
+                GError   **error)
+{
+#ifdef HAVE_SYNCFS
+  if (syncfs (dfd) == 0)
+    return TRUE;
+  if (errno != ENOSYS)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+#endif
+  sync ();
+  return TRUE;
+}
+
+static gboolean
+clone_errno_is_unsupported (int errsv)
+{
+  return errsv == EXDEV || errsv == EOPNOTSUPP || errsv == ENOTTY
+    || errsv == EINVAL || errsv == ENOSYS;
+}
+
+/**
+ * ot_util_clone_file:
+ * @src_fd: Regular file to copy from
+ * @dest_fd: Empty regular file to copy to
+ * @len: Number of bytes to copy
+ * @out_cloned: (out): Whether the data was copied
+ * @error: Error
+ *
+ * Copy the first @len bytes of @src_fd into @dest_fd without passing
+ * them through userspace.  A reflink (FICLONE) is tried first, which
+ * on btrfs and XFS shares the data extents, then copy_file_range().
+ *
+ * If neither is supported for these files, @out_cloned is set to
+ * %FALSE, nothing has been written, and the caller should copy the
+ * data itself.
+ */
+gboolean
+ot_util_clone_file (int        src_fd,
+                    int        dest_fd,
+                    guint64    len,
+                    gboolean  *out_cloned,
+                    GError   **error)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t off_in = 0;
+  loff_t off_out = 0;
+#endif
+
+  *out_cloned = FALSE;
+
+#ifdef FICLONE
+  if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+    {
+      *out_cloned = TRUE;
+      return TRUE;
+    }
+  if (!clone_errno_is_unsupported (errno))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  while ((guint64) off_in < len)
+    {
+      ssize_t bytes_copied;
+
+      bytes_copied = copy_file_range (src_fd, &off_in, dest_fd, &off_out,
+                                      len - off_in, 0);
+      if (bytes_copied == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          if (off_in == 0 && clone_errno_is_unsupported (errno))
+            return TRUE;
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+      else if (bytes_copied == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "File truncated while copying");
+          return FALSE;
+        }
+    }
+  *out_cloned = TRUE;
+#endif
+
+  return TRUE;
+}
+
 void
 ot_util_fatal_literal (const char *msg)
 {
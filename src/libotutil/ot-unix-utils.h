@@ -46,5 +46,10 @@ gboolean ot_util_path_split_validate (const char *path, GPtrArray **out_componen
 
 void ot_util_set_error_from_errno (GError **error, gint saved_errno);
 
+gboolean ot_util_syncfs (int dfd, GError **error);
+
+gboolean ot_util_clone_file (int src_fd, int dest_fd, guint64 len,
+                             gboolean *out_cloned, GError **error);
+
 G_END_DECLS
 
@@ -34,6 +34,7 @@ static gboolean opt_retain;
 static char **opt_kernel_argv;
 static char *opt_osname;
 static char *opt_origin_path;
+static gboolean opt_incremental;
 
 static GOptionEntry options[] = {
   { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname, "Specify operating system root to use", NULL },
@@ -41,6 +42,7 @@ static GOptionEntry options[] = {
   { "no-bootloader", 0, 0, G_OPTION_ARG_NONE, &opt_no_bootloader, "Don't update bootloader", NULL },
   { "retain", 0, 0, G_OPTION_ARG_NONE, &opt_retain, "Do not delete previous deployment", NULL },
   { "karg", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_kernel_argv, "Set kernel argument, like --karg=root=/dev/sda1", NULL },
+  { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental, "Hardlink unchanged files from the merge deployment", NULL },
   { NULL }
 };
 
@@ -118,11 +120,12 @@ ot_admin_builtin_deploy (int argc, char **argv, OstreeSysroot *sysroot, GCancell
       goto out;
     }
 
-  if (!ostree_sysroot_deploy_one_tree (sysroot,
-                                       opt_osname, revision, origin,
-                                       opt_kernel_argv, merge_deployment,
-                                       &new_deployment,
-                                       cancellable, error))
+  if (!ostree_sysroot_deploy_one_tree_with_flags (sysroot,
+                                                  opt_osname, revision, origin,
+                                                  opt_kernel_argv, merge_deployment,
+                                                  opt_incremental ? OSTREE_SYSROOT_DEPLOY_FLAGS_INCREMENTAL : 0,
+                                                  &new_deployment,
+                                                  cancellable, error))
     goto out;
 
   if (!ot_admin_complete_deploy_one (sysroot, opt_osname,
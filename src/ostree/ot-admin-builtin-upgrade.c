@@ -35,10 +35,12 @@
 
 static gboolean opt_reboot;
 static char *opt_osname;
+static gboolean opt_incremental;
 
 static GOptionEntry options[] = {
   { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname, "Specify operating system root to use", NULL },
   { "reboot", 'r', 0, G_OPTION_ARG_NONE, &opt_reboot, "Reboot after a successful upgrade", NULL },
+  { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental, "Hardlink unchanged files from the merge deployment", NULL },
   { NULL }
 };
 
@@ -146,12 +148,13 @@ ot_admin_builtin_upgrade (int argc, char **argv, OstreeSysroot *sysroot, GCancel
           goto out;
         }
 
-      if (!ostree_sysroot_deploy_one_tree (sysroot,
-                                           opt_osname, new_revision, origin,
-                                           NULL,
-                                           merge_deployment,
-                                           &new_deployment,
-                                           cancellable, error))
+      if (!ostree_sysroot_deploy_one_tree_with_flags (sysroot,
+                                                      opt_osname, new_revision, origin,
+                                                      NULL,
+                                                      merge_deployment,
+                                                      opt_incremental ? OSTREE_SYSROOT_DEPLOY_FLAGS_INCREMENTAL : 0,
+                                                      &new_deployment,
+                                                      cancellable, error))
         goto out;
 
       if (!ot_admin_complete_deploy_one (sysroot, opt_osname,
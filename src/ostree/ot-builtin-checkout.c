@@ -35,6 +35,8 @@ static char *opt_subpath;
 static gboolean opt_union;
 static gboolean opt_from_stdin;
 static char *opt_from_file;
+static gint opt_jobs = 1;
+static char *opt_update_from;
 
 static GOptionEntry options[] = {
   { "user-mode", 'U', 0, G_OPTION_ARG_NONE, &opt_user_mode, "Do not change file ownership or initialize extended attributes", NULL },
@@ -43,6 +45,8 @@ static GOptionEntry options[] = {
   { "allow-noent", 0, 0, G_OPTION_ARG_NONE, &opt_allow_noent, "Do nothing if specified path does not exist", NULL },
   { "from-stdin", 0, 0, G_OPTION_ARG_NONE, &opt_from_stdin, "Process many checkouts from standard input", NULL },
   { "from-file", 0, 0, G_OPTION_ARG_STRING, &opt_from_file, "Process many checkouts from input file", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Write files using N threads (0 for one per CPU)", "N" },
+  { "update-from", 0, 0, G_OPTION_ARG_STRING, &opt_update_from, "Update DESTINATION, an unmodified checkout of REV, in place", "REV" },
   { NULL }
 };
 
@@ -86,9 +90,10 @@ process_one_checkout (OstreeRepo           *repo,
       goto out;
     }
 
-  if (!ostree_repo_checkout_tree (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
-                                  opt_union ? OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES : 0,
-                                  target, OSTREE_REPO_FILE (subtree), file_info, cancellable, error))
+  if (!ostree_repo_checkout_tree_parallel (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
+                                           opt_union ? OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES : 0,
+                                           target, OSTREE_REPO_FILE (subtree), file_info,
+                                           opt_jobs, cancellable, error))
     goto out;
                       
   ret = TRUE;
@@ -96,6 +101,49 @@ process_one_checkout (OstreeRepo           *repo,
   return ret;
 }
 
+static gboolean
+process_one_update (OstreeRepo           *repo,
+                    const char           *from_commit,
+                    const char           *to_commit,
+                    const char           *subpath,
+                    GFile                *target,
+                    GCancellable         *cancellable,
+                    GError              **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *from_root = NULL;
+  gs_unref_object GFile *to_root = NULL;
+  gs_unref_object GFile *from_subtree = NULL;
+  gs_unref_object GFile *to_subtree = NULL;
+
+  if (!ostree_repo_read_commit (repo, from_commit, &from_root, NULL, cancellable, error))
+    goto out;
+  if (!ostree_repo_read_commit (repo, to_commit, &to_root, NULL, cancellable, error))
+    goto out;
+
+  if (subpath)
+    {
+      from_subtree = g_file_resolve_relative_path (from_root, subpath);
+      to_subtree = g_file_resolve_relative_path (to_root, subpath);
+    }
+  else
+    {
+      from_subtree = g_object_ref (from_root);
+      to_subtree = g_object_ref (to_root);
+    }
+
+  if (!ostree_repo_checkout_tree_update (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
+                                         target,
+                                         OSTREE_REPO_FILE (from_subtree),
+                                         OSTREE_REPO_FILE (to_subtree),
+                                         cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 process_many_checkouts (OstreeRepo         *repo,
                         GFile              *target,
@@ -177,6 +225,7 @@ ostree_builtin_checkout (int argc, char **argv, OstreeRepo *repo, GCancellable *
   const char *commit;
   const char *destination;
   gs_free char *resolved_commit = NULL;
+  gs_free char *resolved_from_commit = NULL;
   gs_unref_object GFile *checkout_target = NULL;
   gs_unref_object GFile *checkout_target_tmp = NULL;
 
@@ -186,6 +235,20 @@ ostree_builtin_checkout (int argc, char **argv, OstreeRepo *repo, GCancellable *
   if (!g_option_context_parse (context, &argc, &argv, error))
     goto out;
 
+  if (opt_jobs < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid --jobs %d", opt_jobs);
+      goto out;
+    }
+
+  if (opt_update_from && (opt_union || opt_from_stdin || opt_from_file))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "--update-from cannot be combined with --union, --from-stdin or --from-file");
+      goto out;
+    }
+
   if (argc < 2)
     {
       gchar *help = g_option_context_get_help (context, TRUE, NULL);
@@ -217,10 +280,22 @@ ostree_builtin_checkout (int argc, char **argv, OstreeRepo *repo, GCancellable *
 
       checkout_target = g_file_new_for_path (destination);
 
-      if (!process_one_checkout (repo, resolved_commit, opt_subpath,
-                                 checkout_target_tmp ? checkout_target_tmp : checkout_target,
-                                 cancellable, error))
-        goto out;
+      if (opt_update_from)
+        {
+          if (!ostree_repo_resolve_rev (repo, opt_update_from, FALSE, &resolved_from_commit, error))
+            goto out;
+
+          if (!process_one_update (repo, resolved_from_commit, resolved_commit, opt_subpath,
+                                   checkout_target, cancellable, error))
+            goto out;
+        }
+      else
+        {
+          if (!process_one_checkout (repo, resolved_commit, opt_subpath,
+                                     checkout_target_tmp ? checkout_target_tmp : checkout_target,
+                                     cancellable, error))
+            goto out;
+        }
     }
 
   ret = TRUE;
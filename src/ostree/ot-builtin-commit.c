@@ -46,6 +46,8 @@ static char **opt_key_ids;
 static char *opt_gpg_homedir;
 #endif
 static gboolean opt_generate_sizes;
+static gint opt_jobs = 1;
+static char *opt_stat_cache;
 
 static GOptionEntry options[] = {
   { "subject", 's', 0, G_OPTION_ARG_STRING, &opt_subject, "One line subject", "subject" },
@@ -67,6 +69,8 @@ static GOptionEntry options[] = {
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, "GPG Homedir to use when looking for keyrings", "homedir"},
 #endif
   { "generate-sizes", 0, 0, G_OPTION_ARG_NONE, &opt_generate_sizes, "Generate size information along with commit metadata", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Checksum and write file content using N threads", "N" },
+  { "stat-cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_stat_cache, "Skip checksumming files unchanged since the commit recorded in PATH", "PATH" },
   { NULL }
 };
 
@@ -331,14 +335,26 @@ ostree_builtin_commit (int argc, char **argv, OstreeRepo *repo, GCancellable *ca
       || opt_owner_uid >= 0
       || opt_owner_gid >= 0
       || opt_statoverride_file != NULL
-      || opt_no_xattrs)
+      || opt_no_xattrs
+      || opt_jobs > 1
+      || opt_stat_cache != NULL)
     {
       modifier = ostree_repo_commit_modifier_new (flags, commit_filter, mode_adds, NULL);
+      ostree_repo_commit_modifier_set_n_jobs (modifier, opt_jobs > 1 ? opt_jobs : 1);
     }
 
   if (!ostree_repo_resolve_rev (repo, opt_branch, TRUE, &parent, error))
     goto out;
 
+  if (opt_stat_cache)
+    {
+      gs_unref_object GFile *stat_cache_path = g_file_new_for_path (opt_stat_cache);
+
+      if (!ostree_repo_commit_modifier_set_stat_cache (modifier, stat_cache_path, parent,
+                                                       cancellable, error))
+        goto out;
+    }
+
   if (!opt_subject && !opt_body)
     {
       if (!commit_editor (repo, opt_branch, &opt_subject, &opt_body, cancellable, error))
@@ -508,6 +524,13 @@ ostree_builtin_commit (int argc, char **argv, OstreeRepo *repo, GCancellable *ca
       commit_checksum = g_strdup (parent);
     }
 
+  if (opt_stat_cache)
+    {
+      if (!ostree_repo_commit_modifier_save_stat_cache (modifier, commit_checksum,
+                                                        cancellable, error))
+        goto out;
+    }
+
   if (opt_table_output)
     {
       g_print ("Commit: %s\n", commit_checksum);
@@ -22,19 +22,239 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "ot-builtins.h"
 #include "ostree.h"
 #include "otutil.h"
 
 static gboolean opt_quiet;
 static gboolean opt_delete;
+static gint opt_jobs;
+static gboolean opt_metadata_only;
+static gint opt_sample = 100;
+static gboolean opt_resume;
+static gint opt_max_age;
 
 static GOptionEntry options[] = {
   { "quiet", 'q', 0, G_OPTION_ARG_NONE, &opt_quiet, "Only print error messages", NULL },
   { "delete", 0, 0, G_OPTION_ARG_NONE, &opt_delete, "Remove corrupted objects", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Verify objects using N threads (0 for one per CPU)", "N" },
+  { "metadata-only", 0, 0, G_OPTION_ARG_NONE, &opt_metadata_only, "Only verify metadata objects", NULL },
+  { "sample", 0, 0, G_OPTION_ARG_INT, &opt_sample, "Verify a random PERCENT of objects", "PERCENT" },
+  { "resume", 0, 0, G_OPTION_ARG_NONE, &opt_resume, "Skip objects verified by earlier runs", NULL },
+  { "max-age", 0, 0, G_OPTION_ARG_INT, &opt_max_age, "With --resume, verify again objects last verified more than DAYS days ago", "DAYS" },
   { NULL }
 };
 
+/*
+ * Every object verified successfully is recorded in the journal, the
+ * file "fsck-journal" in the repository, so that an interrupted run
+ * can be resumed with --resume, and periodic runs can verify only
+ * objects which haven't been verified recently with --max-age.
+ *
+ *   8 bytes  magic "OSTFSJ01"
+ *   entries  FsckJournalEntry, appended as objects are verified
+ *
+ * At the start of each run, the journal is rewritten with the latest
+ * entry for each object which is still reachable; this also drops a
+ * partial entry left by an interrupted run.
+ */
+
+#define FSCK_JOURNAL_MAGIC "OSTFSJ01"
+#define FSCK_JOURNAL_HEADER_SIZE 8
+/* Bounds memory used for queued objects */
+#define FSCK_MAX_QUEUED_PER_THREAD 64
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+  /* Seconds since the epoch, guint64 little endian */
+  guint8 timestamp[8];
+} FsckJournalEntry;
+
+G_STATIC_ASSERT (sizeof (FsckJournalEntry) == 41);
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+} FsckObject;
+
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+
+  GMutex lock;
+  GCond cond;
+  /* The fields below are protected by @lock */
+  GOutputStream *journal;
+  guint n_outstanding;
+  guint n_verified;
+  guint n_total;
+  gboolean found_corruption;
+  GError *error;
+} OtFsckData;
+
+static guint64
+fsck_journal_entry_get_timestamp (const FsckJournalEntry *entry)
+{
+  guint64 timestamp;
+
+  memcpy (&timestamp, entry->timestamp, sizeof (timestamp));
+  return GUINT64_FROM_LE (timestamp);
+}
+
+/* Sort by object, then oldest first */
+static int
+fsck_journal_entry_compare (gconstpointer a,
+                            gconstpointer b)
+{
+  const FsckJournalEntry *entry_a = a;
+  const FsckJournalEntry *entry_b = b;
+  guint64 timestamp_a, timestamp_b;
+  int c;
+
+  c = memcmp (entry_a, entry_b, sizeof (FsckObject));
+  if (c != 0)
+    return c;
+
+  timestamp_a = fsck_journal_entry_get_timestamp (entry_a);
+  timestamp_b = fsck_journal_entry_get_timestamp (entry_b);
+  if (timestamp_a < timestamp_b)
+    return -1;
+  else if (timestamp_a > timestamp_b)
+    return 1;
+  return 0;
+}
+
+static int
+fsck_journal_entry_compare_object (gconstpointer a,
+                                   gconstpointer b)
+{
+  return memcmp (a, b, sizeof (FsckObject));
+}
+
+/* Returns the entries of the journal at @path still in @reachable,
+ * one per object, sorted.
+ */
+static gboolean
+fsck_journal_load (GFile            *path,
+                   OstreeObjectSet  *reachable,
+                   GArray          **out_entries,
+                   GCancellable     *cancellable,
+                   GError          **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *contents = NULL;
+  gsize len;
+  GError *temp_error = NULL;
+  GArray *ret_entries = NULL;
+  const FsckJournalEntry *entries;
+  gsize n_entries;
+  gsize i;
+
+  ret_entries = g_array_new (FALSE, FALSE, sizeof (FsckJournalEntry));
+
+  if (!g_file_load_contents (path, cancellable, &contents, &len, NULL, &temp_error))
+    {
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&temp_error);
+          goto done;
+        }
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (len < FSCK_JOURNAL_HEADER_SIZE
+      || memcmp (contents, FSCK_JOURNAL_MAGIC, FSCK_JOURNAL_HEADER_SIZE) != 0)
+    {
+      g_printerr ("Ignoring invalid fsck journal\n");
+      goto done;
+    }
+
+  entries = (const FsckJournalEntry *) (contents + FSCK_JOURNAL_HEADER_SIZE);
+  n_entries = (len - FSCK_JOURNAL_HEADER_SIZE) / sizeof (FsckJournalEntry);
+  for (i = 0; i < n_entries; i++)
+    {
+      const FsckJournalEntry *entry = &entries[i];
+
+      if (entry->objtype < OSTREE_OBJECT_TYPE_FILE
+          || entry->objtype > OSTREE_OBJECT_TYPE_LAST)
+        continue;
+      if (!ostree_object_set_contains_bytes (reachable, entry->csum, entry->objtype))
+        continue;
+      g_array_append_vals (ret_entries, entry, 1);
+    }
+
+  g_array_sort (ret_entries, fsck_journal_entry_compare);
+
+  /* Keep only the last, which is the latest, entry for each object */
+  n_entries = 0;
+  for (i = 0; i < ret_entries->len; i++)
+    {
+      if (i + 1 < ret_entries->len
+          && fsck_journal_entry_compare_object (&g_array_index (ret_entries, FsckJournalEntry, i),
+                                                &g_array_index (ret_entries, FsckJournalEntry, i + 1)) == 0)
+        continue;
+      g_array_index (ret_entries, FsckJournalEntry, n_entries++) =
+        g_array_index (ret_entries, FsckJournalEntry, i);
+    }
+  g_array_set_size (ret_entries, n_entries);
+
+ done:
+  ret = TRUE;
+  ot_transfer_out_value (out_entries, &ret_entries);
+ out:
+  if (ret_entries)
+    g_array_unref (ret_entries);
+  return ret;
+}
+
+/* Atomically replace the journal at @path with @entries, and open it
+ * for appending.
+ */
+static gboolean
+fsck_journal_rewrite (GFile            *path,
+                      GArray           *entries,
+                      GOutputStream   **out_journal,
+                      GCancellable     *cancellable,
+                      GError          **error)
+{
+  gboolean ret = FALSE;
+  gsize bytes_written;
+  gs_unref_object GOutputStream *file_out = NULL;
+  gs_unref_object GOutputStream *ret_journal = NULL;
+
+  file_out = (GOutputStream*)g_file_replace (path, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                             cancellable, error);
+  if (!file_out)
+    goto out;
+
+  if (!g_output_stream_write_all (file_out, FSCK_JOURNAL_MAGIC, FSCK_JOURNAL_HEADER_SIZE,
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (entries->len > 0
+      && !g_output_stream_write_all (file_out, entries->data,
+                                     entries->len * sizeof (FsckJournalEntry),
+                                     &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (file_out, cancellable, error))
+    goto out;
+
+  g_clear_object (&file_out);
+  file_out = (GOutputStream*)g_file_append_to (path, 0, cancellable, error);
+  if (!file_out)
+    goto out;
+
+  ret_journal = g_buffered_output_stream_new (file_out);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_journal, &ret_journal);
+ out:
+  return ret;
+}
+
 static gboolean
 load_and_fsck_one_object (OstreeRepo            *repo,
                           const char            *checksum,
@@ -172,6 +392,68 @@ load_and_fsck_one_object (OstreeRepo            *repo,
   return ret;
 }
 
+static gboolean
+fsck_journal_append (OtFsckData         *data,
+                     const FsckObject   *object,
+                     GError            **error)
+{
+  FsckJournalEntry entry;
+  guint64 timestamp = GUINT64_TO_LE ((guint64) (g_get_real_time () / G_USEC_PER_SEC));
+  gsize bytes_written;
+
+  memcpy (&entry, object, sizeof (FsckObject));
+  memcpy (entry.timestamp, &timestamp, sizeof (timestamp));
+
+  return g_output_stream_write_all (data->journal, &entry, sizeof (entry),
+                                    &bytes_written, data->cancellable, error);
+}
+
+static void
+fsck_one_object_thread (gpointer   object,
+                        gpointer   user_data)
+{
+  OtFsckData *data = user_data;
+  FsckObject *fsck_object = object;
+  char checksum[65];
+  gboolean skip;
+  gboolean found_corruption = FALSE;
+  GError *local_error = NULL;
+
+  g_mutex_lock (&data->lock);
+  skip = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  ostree_checksum_inplace_from_bytes (fsck_object->csum, checksum);
+
+  if (!skip)
+    (void) load_and_fsck_one_object (data->repo, checksum, fsck_object->objtype,
+                                     &found_corruption, data->cancellable, &local_error);
+
+  g_mutex_lock (&data->lock);
+  if (!skip && !local_error && !found_corruption && data->journal)
+    (void) fsck_journal_append (data, fsck_object, &local_error);
+  if (local_error)
+    {
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  if (found_corruption)
+    data->found_corruption = TRUE;
+  if (!skip)
+    {
+      guint mod = data->n_total / 10;
+
+      if (mod == 0 || (data->n_verified % mod == 0))
+        g_print ("%u/%u objects\n", data->n_verified, data->n_total);
+      data->n_verified++;
+    }
+  data->n_outstanding--;
+  g_cond_broadcast (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
 static gboolean
 fsck_reachable_objects_from_commits (OstreeRepo            *repo,
                                      GHashTable            *commits,
@@ -182,52 +464,171 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  gs_unref_hashtable GHashTable *reachable_objects = NULL;
+  gs_unref_ptrarray GPtrArray *commit_checksums = NULL;
+  gs_unref_object GFile *journal_path = NULL;
+  OstreeObjectSet *reachable_objects = NULL;
+  OstreeObjectSetIter set_iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  GArray *journal_entries = NULL;
+  GArray *to_verify = NULL;
+  GThreadPool *threadpool = NULL;
+  OtFsckData data = { 0, };
+  GError *temp_error = NULL;
+  guint64 verified_since = 0;
+  guint n_threads;
+  guint n_skipped = 0;
   guint i;
-  guint mod;
-  guint count;
 
-  reachable_objects = ostree_repo_traverse_new_reachable ();
+  data.repo = repo;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  reachable_objects = ostree_object_set_new ();
+  commit_checksums = g_ptr_array_new ();
 
   g_hash_table_iter_init (&hash_iter, commits);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
       GVariant *serialized_key = key;
       const char *checksum;
-      OstreeObjectType objtype;
 
       ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
 
       g_assert (objtype == OSTREE_OBJECT_TYPE_COMMIT);
 
-      if (!ostree_repo_traverse_commit_union (repo, checksum, 0, reachable_objects,
-                                              cancellable, error))
-        goto out;
+      g_ptr_array_add (commit_checksums, (char*)checksum);
     }
+  g_ptr_array_add (commit_checksums, NULL);
 
-  count = g_hash_table_size (reachable_objects);
-  mod = count / 10;
-  i = 0;
-  g_hash_table_iter_init (&hash_iter, reachable_objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  if (!ostree_repo_traverse_commits_into_set (repo, (const char * const *)commit_checksums->pdata,
+                                              0, reachable_objects, cancellable, error))
+    goto out;
+
+  journal_path = g_file_get_child (ostree_repo_get_path (repo), "fsck-journal");
+  if (!fsck_journal_load (journal_path, reachable_objects, &journal_entries,
+                          cancellable, error))
+    goto out;
+
+  if (opt_max_age > 0)
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      guint64 now = g_get_real_time () / G_USEC_PER_SEC;
+      guint64 max_age_secs = (guint64) opt_max_age * 24 * 60 * 60;
+
+      /* Otherwise the age reaches back before the epoch, so nothing
+       * was verified that long ago; keep verified_since at 0.
+       */
+      if (max_age_secs < now)
+        verified_since = now - max_age_secs;
+    }
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+  to_verify = g_array_new (FALSE, FALSE, sizeof (FsckObject));
+  ostree_object_set_iter_init (&set_iter, reachable_objects);
+  while (ostree_object_set_iter_next (&set_iter, &csum, &objtype))
+    {
+      FsckObject fsck_object;
 
-      if (!load_and_fsck_one_object (repo, checksum, objtype, out_found_corruption,
-                                     cancellable, error))
-        goto out;
+      if (opt_metadata_only && !OSTREE_OBJECT_TYPE_IS_META (objtype))
+        continue;
+
+      memcpy (fsck_object.csum, csum, 32);
+      fsck_object.objtype = objtype;
+
+      if (opt_resume)
+        {
+          const FsckJournalEntry *entry =
+            bsearch (&fsck_object, journal_entries->data, journal_entries->len,
+                     sizeof (FsckJournalEntry), fsck_journal_entry_compare_object);
+
+          if (entry && fsck_journal_entry_get_timestamp (entry) >= verified_since)
+            {
+              n_skipped++;
+              continue;
+            }
+        }
 
-      if (mod == 0 || (i % mod == 0))
-        g_print ("%u/%u objects\n", i, count);
-      i++;
+      if (opt_sample < 100 && g_random_int_range (0, 100) >= opt_sample)
+        continue;
+
+      g_array_append_val (to_verify, fsck_object);
+    }
+
+  if (n_skipped > 0 && !opt_quiet)
+    g_print ("Skipping %u objects verified earlier\n", n_skipped);
+
+  /* The journal is only a record of our progress, so a read-only
+   * repository can still be checked.
+   */
+  if (!fsck_journal_rewrite (journal_path, journal_entries, &data.journal,
+                             cancellable, &temp_error))
+    {
+      if (opt_resume)
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_debug ("Not writing fsck journal: %s", temp_error->message);
+      g_clear_error (&temp_error);
+    }
+
+  n_threads = opt_jobs > 0 ? (guint) opt_jobs : (guint) MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+  threadpool = g_thread_pool_new (fsck_one_object_thread, &data, (int) n_threads,
+                                  FALSE, error);
+  if (!threadpool)
+    goto out;
+
+  data.n_total = to_verify->len;
+  for (i = 0; i < to_verify->len; i++)
+    {
+      gboolean failed;
+
+      g_mutex_lock (&data.lock);
+      while (data.n_outstanding >= n_threads * FSCK_MAX_QUEUED_PER_THREAD)
+        g_cond_wait (&data.cond, &data.lock);
+      failed = data.error != NULL;
+      if (!failed)
+        data.n_outstanding++;
+      g_mutex_unlock (&data.lock);
+
+      if (failed)
+        break;
+
+      g_thread_pool_push (threadpool, &g_array_index (to_verify, FsckObject, i), NULL);
     }
 
+  g_mutex_lock (&data.lock);
+  while (data.n_outstanding > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  if (data.journal && !data.error)
+    (void) g_output_stream_close (data.journal, cancellable, &data.error);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      data.error = NULL;
+      goto out;
+    }
+
+  if (data.found_corruption)
+    *out_found_corruption = TRUE;
+
   ret = TRUE;
  out:
+  if (threadpool)
+    g_thread_pool_free (threadpool, FALSE, TRUE);
+  g_clear_object (&data.journal);
+  g_clear_error (&data.error);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+  if (to_verify)
+    g_array_unref (to_verify);
+  if (journal_entries)
+    g_array_unref (journal_entries);
+  if (reachable_objects)
+    ostree_object_set_unref (reachable_objects);
   return ret;
 }
 
@@ -248,6 +649,27 @@ ostree_builtin_fsck (int argc, char **argv, OstreeRepo *repo, GCancellable *canc
   if (!g_option_context_parse (context, &argc, &argv, error))
     goto out;
 
+  if (opt_jobs < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid --jobs %d", opt_jobs);
+      goto out;
+    }
+
+  if (opt_sample < 1 || opt_sample > 100)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid --sample %d, must be between 1 and 100", opt_sample);
+      goto out;
+    }
+
+  if (opt_max_age < 0 || (opt_max_age > 0 && !opt_resume))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "--max-age requires --resume and a positive number of days");
+      goto out;
+    }
+
   if (!opt_quiet)
     g_print ("Enumerating objects...\n");
 
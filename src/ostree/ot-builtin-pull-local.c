@@ -61,46 +61,30 @@ import_one_object (OtLocalCloneData *data,
                    GError        **error)
 {
   gboolean ret = FALSE;
-  guint64 length;
-  gs_unref_object GInputStream *object = NULL;
-  
-  if (!ostree_repo_load_object_stream (data->src_repo, objtype, checksum,
-                                       &object, &length,
-                                       cancellable, error))
-    goto out;
 
-  if (objtype == OSTREE_OBJECT_TYPE_FILE)
+  if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
     {
-      if (!ostree_repo_write_content_trusted (data->dest_repo, checksum,
-                                              object, length,
-                                              cancellable, error))
+      gs_unref_variant GVariant *detached_meta = NULL;
+
+      if (!ostree_repo_read_commit_detached_metadata (data->src_repo,
+                                                      checksum, &detached_meta,
+                                                      cancellable, error))
         goto out;
-    }
-  else
-    {
-      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+
+      if (detached_meta)
         {
-          gs_unref_variant GVariant *detached_meta = NULL;
-          
-          if (!ostree_repo_read_commit_detached_metadata (data->src_repo,
-                                                          checksum, &detached_meta,
-                                                          cancellable, error))
+          if (!ostree_repo_write_commit_detached_metadata (data->src_repo,
+                                                           checksum, detached_meta,
+                                                           cancellable, error))
             goto out;
-
-          if (detached_meta)
-            {
-              if (!ostree_repo_write_commit_detached_metadata (data->src_repo,
-                                                               checksum, detached_meta,
-                                                               cancellable, error))
-                goto out;
-            }
         }
-      if (!ostree_repo_write_metadata_stream_trusted (data->dest_repo, objtype,
-                                                      checksum, object, length,
-                                                      cancellable, error))
-        goto out;
     }
 
+  if (!ostree_repo_import_object_from (data->dest_repo, data->src_repo,
+                                       objtype, checksum,
+                                       cancellable, error))
+    goto out;
+
   g_atomic_int_inc (&data->n_objects_copied);
 
   ret = TRUE;
@@ -177,7 +161,10 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
   gs_unref_object GFile *dest_repo_dir = NULL;
   gs_unref_hashtable GHashTable *refs_to_clone = NULL;
   gs_unref_hashtable GHashTable *commits_to_clone = NULL;
-  gs_unref_hashtable GHashTable *source_objects = NULL;
+  OstreeObjectSet *source_objects = NULL;
+  OstreeObjectSetIter set_iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
   OtLocalCloneData datav = { 0, };
   OtLocalCloneData *data = &datav;
 
@@ -247,7 +234,7 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
 
   g_print ("Enumerating objects...\n");
 
-  source_objects = ostree_repo_traverse_new_reachable ();
+  source_objects = ostree_object_set_new ();
 
   if (refs_to_clone)
     {
@@ -256,8 +243,8 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
         {
           const char *checksum = value;
           
-          if (!ostree_repo_traverse_commit_union (data->src_repo, checksum, 0, source_objects,
-                                                  cancellable, error))
+          if (!ostree_repo_traverse_commit_into_set (data->src_repo, checksum, 0, source_objects,
+                                                     cancellable, error))
             goto out;
         }
     }
@@ -270,18 +257,22 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
           const char *checksum = key;
           gs_unref_hashtable GHashTable *tmp_source_objects = NULL;
 
-          if (!ostree_repo_traverse_commit_union (data->src_repo, checksum, 0, source_objects,
-                                                  cancellable, error))
+          if (!ostree_repo_traverse_commit_into_set (data->src_repo, checksum, 0, source_objects,
+                                                     cancellable, error))
             goto out;
         }
     }
 
-  data->n_objects_to_check = g_hash_table_size (source_objects);
-  g_hash_table_iter_init (&hash_iter, source_objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  data->n_objects_to_check = ostree_object_set_size (source_objects);
+  ostree_object_set_iter_init (&set_iter, source_objects);
+  while (ostree_object_set_iter_next (&set_iter, &csum, &objtype))
     {
-      GVariant *serialized_key = key;
-      g_thread_pool_push (data->threadpool, g_variant_ref (serialized_key), NULL);
+      char checksum[65];
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      g_thread_pool_push (data->threadpool,
+                          g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype)),
+                          NULL);
     }
 
   if (data->n_objects_to_check > 0)
@@ -319,6 +310,8 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
   ret = TRUE;
  out:
   g_clear_pointer (&data->threadpool, (GDestroyNotify) g_thread_pool_free);
+  if (source_objects)
+    ostree_object_set_unref (source_objects);
   if (data->src_repo)
     g_object_unref (data->src_repo);
   if (data->dest_repo)
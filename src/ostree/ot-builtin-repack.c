@@ -0,0 +1,81 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Colin Walters <walters@verbum.org>
+ */
+
+#include "config.h"
+
+#include "ot-builtins.h"
+#include "ostree.h"
+#include "libgsystem.h"
+
+static gboolean opt_content;
+static gint64 opt_max_content_size = 64 * 1024;
+
+static GOptionEntry options[] = {
+  { "content", 0, 0, G_OPTION_ARG_NONE, &opt_content, "Also pack content objects (archive-z2 only; pulling them over HTTP needs range request support)", NULL },
+  { "max-content-size", 0, 0, G_OPTION_ARG_INT64, &opt_max_content_size, "Leave content objects larger than SIZE bytes loose (default: 65536, 0=unlimited)", "SIZE" },
+  { NULL }
+};
+
+gboolean
+ostree_builtin_repack (int argc, char **argv, OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  guint n_meta_packed;
+  guint n_content_packed = 0;
+
+  context = g_option_context_new ("- Move loose objects into pack files");
+  g_option_context_add_main_entries (context, options, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, error))
+    goto out;
+
+  if (opt_max_content_size < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid --max-content-size %" G_GINT64_FORMAT, opt_max_content_size);
+      goto out;
+    }
+
+  if (!ostree_repo_repack_metadata (repo, &n_meta_packed, cancellable, error))
+    goto out;
+
+  if (opt_content)
+    {
+      if (!ostree_repo_repack_content (repo, (guint64) opt_max_content_size,
+                                       &n_content_packed, cancellable, error))
+        goto out;
+    }
+
+  if (n_meta_packed == 0)
+    g_print ("No loose metadata objects\n");
+  else
+    g_print ("Packed %u metadata objects\n", n_meta_packed);
+  if (opt_content)
+    g_print ("Packed %u content objects\n", n_content_packed);
+
+  ret = TRUE;
+ out:
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
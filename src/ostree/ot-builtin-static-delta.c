@@ -0,0 +1,131 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Colin Walters <walters@verbum.org>
+ */
+
+#include "config.h"
+
+#include "ot-builtins.h"
+#include "ostree.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+static char *opt_from_rev;
+static char *opt_to_rev;
+
+static GOptionEntry options[] = {
+  { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from_rev, "Create delta from revision REV (default: from scratch)", "REV" },
+  { "to", 0, 0, G_OPTION_ARG_STRING, &opt_to_rev, "Create delta to revision REV", "REV" },
+  { NULL }
+};
+
+static void
+usage_error (GOptionContext *context, const char *message, GError **error)
+{
+  gchar *help = g_option_context_get_help (context, TRUE, NULL);
+  g_printerr ("%s\n", help);
+  g_free (help);
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       message);
+}
+
+gboolean
+ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  GOptionContext *context;
+  gboolean ret = FALSE;
+  const char *op;
+
+  context = g_option_context_new ("generate|apply-offline [args] - Manage static deltas");
+  g_option_context_add_main_entries (context, options, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, error))
+    goto out;
+
+  if (argc < 2)
+    {
+      usage_error (context, "OPERATION must be specified", error);
+      goto out;
+    }
+
+  op = argv[1];
+
+  if (!strcmp (op, "generate"))
+    {
+      gs_free char *from_resolved = NULL;
+      gs_free char *to_resolved = NULL;
+
+      if (!opt_to_rev)
+        {
+          usage_error (context, "--to must be specified", error);
+          goto out;
+        }
+
+      if (opt_from_rev)
+        {
+          if (!ostree_repo_resolve_rev (repo, opt_from_rev, FALSE, &from_resolved, error))
+            goto out;
+        }
+      if (!ostree_repo_resolve_rev (repo, opt_to_rev, FALSE, &to_resolved, error))
+        goto out;
+
+      if (from_resolved)
+        g_print ("Generating static delta from %s to %s\n", from_resolved, to_resolved);
+      else
+        g_print ("Generating static delta to %s\n", to_resolved);
+
+      if (!ostree_repo_static_delta_generate (repo, from_resolved, to_resolved, NULL,
+                                              cancellable, error))
+        goto out;
+    }
+  else if (!strcmp (op, "apply-offline"))
+    {
+      gs_unref_object GFile *path = NULL;
+
+      if (argc < 3)
+        {
+          usage_error (context, "PATH must be specified", error);
+          goto out;
+        }
+
+      path = g_file_new_for_path (argv[2]);
+
+      if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+        goto out;
+
+      if (!ostree_repo_static_delta_execute_offline (repo, path, cancellable, error))
+        goto out;
+
+      if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      usage_error (context, "Unknown operation", error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  ostree_repo_abort_transaction (repo, cancellable, NULL);
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
@@ -211,11 +211,24 @@ do_get (OtTrivialHttpd    *self,
     }
   else 
     {
+      gs_free char *etag = NULL;
+      const char *if_none_match;
+
       if (!S_ISREG (stbuf.st_mode))
         {
           soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
           goto out;
         }
+
+      etag = g_strdup_printf ("\"%lx-%lx-%lx.%lx\"", (gulong)stbuf.st_ino, (gulong)stbuf.st_size,
+                              (gulong)stbuf.st_mtim.tv_sec, (gulong)stbuf.st_mtim.tv_nsec);
+      soup_message_headers_replace (msg->response_headers, "ETag", etag);
+      if_none_match = soup_message_headers_get_one (msg->request_headers, "If-None-Match");
+      if (if_none_match && strcmp (if_none_match, etag) == 0)
+        {
+          soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+          goto out;
+        }
       
       if (msg->method == SOUP_METHOD_GET)
         {
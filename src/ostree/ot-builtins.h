@@ -47,6 +47,8 @@ BUILTINPROTO(fsck);
 BUILTINPROTO(show);
 BUILTINPROTO(rev_parse);
 BUILTINPROTO(remote);
+BUILTINPROTO(repack);
+BUILTINPROTO(static_delta);
 BUILTINPROTO(write_refs);
 BUILTINPROTO(trivial_httpd);
 
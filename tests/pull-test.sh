@@ -39,3 +39,46 @@ ${CMD_PREFIX} ostree --repo=repo fsck
 $OSTREE show --print-detached-metadata-key=SIGNATURE main > main-meta
 assert_file_has_content main-meta "HANCOCK"
 echo "ok pull detached metadata"
+
+cd ${test_tmpdir}
+rm repo-fetches -rf
+mkdir repo-fetches
+${CMD_PREFIX} ostree --repo=repo-fetches init
+${CMD_PREFIX} ostree --repo=repo-fetches remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo-fetches config set 'remote "origin".max-concurrent-fetches' 0
+if ${CMD_PREFIX} ostree --repo=repo-fetches pull origin main 2>/dev/null; then
+    echo "Invalid max-concurrent-fetches accepted"; exit 1
+fi
+${CMD_PREFIX} ostree --repo=repo-fetches config set 'remote "origin".min-concurrent-fetches' 1
+${CMD_PREFIX} ostree --repo=repo-fetches config set 'remote "origin".max-concurrent-fetches' 1
+${CMD_PREFIX} ostree --repo=repo-fetches config set 'remote "origin".prioritize-small-objects' false
+${CMD_PREFIX} ostree --repo=repo-fetches pull origin main
+${CMD_PREFIX} ostree --repo=repo-fetches fsck
+rm repo-fetches -rf
+echo "ok pull with concurrent fetch limits"
+
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=repo pull origin main > pull-output
+assert_file_has_content pull-output "is unchanged"
+test -n "$(ls repo/remote-cache/origin)"
+${CMD_PREFIX} ostree --repo=repo pull origin main > pull-output
+assert_file_has_content pull-output "is unchanged"
+ostree --repo=ostree-srv/gnomerepo commit -b main -s "Another commit" --tree=ref=main
+${CMD_PREFIX} ostree --repo=repo pull origin main > pull-output
+assert_file_has_content pull-output "is now"
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok pull unchanged remote"
+
+cd ${test_tmpdir}
+ostree --repo=ostree-srv/gnomerepo repack --content
+assert_file_has_content ostree-srv/gnomerepo/objects/pack/packs "ostdatapack-"
+rm repo-packed checkout-packed -rf
+mkdir repo-packed
+${CMD_PREFIX} ostree --repo=repo-packed init
+${CMD_PREFIX} ostree --repo=repo-packed remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo-packed pull origin main
+${CMD_PREFIX} ostree --repo=repo-packed fsck
+${CMD_PREFIX} ostree --repo=repo-packed checkout origin/main checkout-packed
+assert_file_has_content checkout-packed/baz/cow '^moo$'
+rm repo-packed checkout-packed -rf
+echo "ok pull from repacked remote"
@@ -21,7 +21,7 @@ set -e
 
 . $(dirname $0)/libtest.sh
 
-echo '1..11'
+echo '1..17'
 
 setup_test_repository "archive-z2"
 echo "ok setup"
@@ -36,3 +36,131 @@ ostree --repo=repo2 pull aremote
 ostree --repo=repo2 rev-parse aremote/test2
 ostree --repo=repo2 fsck
 echo "ok pull with from file:/// uri"
+
+cd ${test_tmpdir}
+rm repo2 -rf
+mkdir repo2
+${CMD_PREFIX} ostree --repo=repo2 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo
+ostree --repo=repo2 fsck
+csum=$(ostree --repo=repo ls -C test2 /firstfile | awk '{ print $5 }')
+someobject=objects/$(echo ${csum} | cut -c1-2)/$(echo ${csum} | cut -c3-).filez
+cmp repo/${someobject} repo2/${someobject}
+echo "ok pull-local archive-z2 to archive-z2"
+
+cd ${test_tmpdir}
+rm repo2 -rf
+mkdir repo2
+${CMD_PREFIX} ostree --repo=repo2 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo2 remote add --set=gpg-verify=false aremote file://$(pwd)/repo test2
+ostree --repo=repo2 pull aremote
+ostree --repo=repo2 fsck
+csum=$(ostree --repo=repo ls -C test2 /firstfile | awk '{ print $5 }')
+someobject=objects/$(echo ${csum} | cut -c1-2)/$(echo ${csum} | cut -c3-).filez
+cmp repo/${someobject} repo2/${someobject}
+echo "ok pull archive-z2 to archive-z2"
+
+cd ${test_tmpdir}
+ostree --repo=repo2 repack --content --max-content-size=1 > repack-output
+assert_file_has_content repack-output "Packed 0 content objects"
+assert_has_file repo2/${someobject}
+ostree --repo=repo2 repack --content > repack-output
+assert_not_has_file repo2/${someobject}
+ls repo2/objects/pack/ostdatapack-*.index
+ostree --repo=repo2 fsck
+rm checkout-packed -rf
+ostree --repo=repo2 checkout -U aremote/test2 checkout-packed
+cmp checkout-test2/firstfile checkout-packed/firstfile
+assert_file_has_content repo2/objects/pack/packs "ostdatapack-"
+rev=$(ostree --repo=repo2 rev-parse aremote/test2)
+rm repo-from-packed checkout-packed -rf
+mkdir repo-from-packed
+${CMD_PREFIX} ostree --repo=repo-from-packed init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo-from-packed remote add --set=gpg-verify=false packed file://$(pwd)/repo2
+${CMD_PREFIX} ostree --repo=repo-from-packed pull packed ${rev}
+ostree --repo=repo-from-packed fsck
+cmp repo/${someobject} repo-from-packed/${someobject}
+rm checkout-packed repo-from-packed repack-output -rf
+echo "ok repack content"
+
+cd ${test_tmpdir}
+seq 1 10000 > files/bigfile
+(cd files && $OSTREE commit -b test2 -s "Add bigfile")
+rm repo3 -rf
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo3 remote add --set=gpg-verify=false aremote file://$(pwd)/repo test2
+ostree --repo=repo3 pull aremote
+origrev=$(ostree --repo=repo rev-parse test2)
+sed -i -e 's/^5000$/five thousand/' files/bigfile
+(cd files && $OSTREE commit -b test2 -s "Modify bigfile")
+newrev=$(ostree --repo=repo rev-parse test2)
+ostree --repo=repo static-delta generate --from=${origrev} --to=${newrev}
+assert_has_file repo/deltas/${origrev}-${newrev}/superblock
+assert_has_file repo/deltas/${origrev}-${newrev}/0
+rm repo4 -rf
+mkdir repo4
+${CMD_PREFIX} ostree --repo=repo4 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo4 pull-local repo ${origrev}
+ostree --repo=repo4 static-delta apply-offline repo/deltas/${origrev}-${newrev}
+ostree --repo=repo4 fsck
+rm checkout-delta -rf
+ostree --repo=repo4 checkout -U ${newrev} checkout-delta
+cmp files/bigfile checkout-delta/bigfile
+# Hide the new bigfile object, so the pull can only succeed via the delta
+csum=$(ostree --repo=repo ls -C test2 /bigfile | awk '{ print $5 }')
+bigobject=objects/$(echo ${csum} | cut -c1-2)/$(echo ${csum} | cut -c3-).filez
+mv repo/${bigobject} bigobject.filez
+ostree --repo=repo3 pull aremote
+mv bigobject.filez repo/${bigobject}
+assert_streq $(ostree --repo=repo3 rev-parse aremote/test2) ${newrev}
+cmp repo/${bigobject} repo3/${bigobject}
+ostree --repo=repo3 fsck
+rm checkout-delta -rf
+ostree --repo=repo3 checkout -U aremote/test2 checkout-delta
+cmp files/bigfile checkout-delta/bigfile
+rm checkout-delta -rf
+echo "ok static delta"
+
+cd ${test_tmpdir}
+rm repo5 compression-tree checkout-compression -rf
+mkdir repo5
+${CMD_PREFIX} ostree --repo=repo5 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo5 config set core.zlib-level 1
+mkdir compression-tree
+dd if=/dev/urandom of=compression-tree/random bs=1024 count=256 2>/dev/null
+seq 100000 > compression-tree/text
+${CMD_PREFIX} ostree --repo=repo5 commit -b compression -s "Compression" --tree=dir=compression-tree
+ostree --repo=repo5 fsck
+ostree --repo=repo5 checkout -U compression checkout-compression
+cmp compression-tree/random checkout-compression/random
+cmp compression-tree/text checkout-compression/text
+csum=$(ostree --repo=repo5 ls -C compression /text | awk '{ print $5 }')
+textobject=repo5/objects/$(echo ${csum} | cut -c1-2)/$(echo ${csum} | cut -c3-).filez
+test $(stat -c '%s' ${textobject}) -lt $(stat -c '%s' compression-tree/text)
+${CMD_PREFIX} ostree --repo=repo5 config set core.zlib-level 10
+if ostree --repo=repo5 fsck 2>/dev/null; then
+    echo "Invalid core.zlib-level accepted"; exit 1
+fi
+rm repo5 compression-tree checkout-compression -rf
+echo "ok zlib level and incompressible content"
+
+cd ${test_tmpdir}
+rm repo5 parallel-tree checkout-parallel -rf
+mkdir repo5
+${CMD_PREFIX} ostree --repo=repo5 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo5 config set core.zlib-parallel-threshold 1
+mkdir parallel-tree
+seq 500000 > parallel-tree/text
+dd if=/dev/urandom of=parallel-tree/random bs=1024 count=2100 2>/dev/null
+# Exactly two compression blocks
+head -c 2097152 parallel-tree/text > parallel-tree/exact
+echo small > parallel-tree/small
+${CMD_PREFIX} ostree --repo=repo5 commit -b parallel -s "Parallel" --tree=dir=parallel-tree
+ostree --repo=repo5 fsck
+ostree --repo=repo5 checkout -U parallel checkout-parallel
+for f in text random exact small; do
+    cmp parallel-tree/${f} checkout-parallel/${f}
+done
+rm repo5 parallel-tree checkout-parallel -rf
+echo "ok parallel compression"
@@ -19,7 +19,7 @@
 
 set -e
 
-echo "1..41"
+echo "1..51"
 
 . $(dirname $0)/libtest.sh
 
@@ -123,6 +123,28 @@ cd ${test_tmpdir}
 assert_file_has_content diff-test2-2 'M */four$'
 echo "ok diff file changing type"
 
+cd ${test_tmpdir}
+mkdir -p diff-tree/dir/sub diff-tree/unchanged
+echo 1 > diff-tree/dir/sub/file
+echo same > diff-tree/unchanged/file
+echo file > diff-tree/typechange
+$OSTREE commit -b diff-types -s "Diff base" --tree=dir=diff-tree
+rm diff-tree/typechange
+mkdir diff-tree/typechange
+echo inner > diff-tree/typechange/inner
+chmod 0700 diff-tree/dir
+echo 2 > diff-tree/dir/sub/file
+$OSTREE commit -b diff-types -s "Diff target" --tree=dir=diff-tree
+$OSTREE diff diff-types^ diff-types > diff-types-output
+assert_file_has_content diff-types-output 'M */typechange$'
+assert_not_file_has_content diff-types-output 'typechange/inner'
+assert_file_has_content diff-types-output 'M */dir$'
+assert_file_has_content diff-types-output 'M */dir/sub/file$'
+assert_not_file_has_content diff-types-output 'dir/sub$'
+assert_not_file_has_content diff-types-output 'unchanged'
+rm -rf diff-tree diff-types-output
+echo "ok diff revisions on dirtrees"
+
 cd ${test_tmpdir}
 mkdir repo2
 ${CMD_PREFIX} ostree --repo=repo2 init
@@ -226,6 +248,25 @@ fi
 rm repo3 objlist-before-prune objlist-after-prune -rf
 echo "ok prune"
 
+cd ${test_tmpdir}
+rm repo3 -rf
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init
+${CMD_PREFIX} ostree --repo=repo3 pull-local repo test2
+${CMD_PREFIX} ostree --repo=repo3 prune --refs-only
+find repo3/objects -name '*.commitreachable' > indexes
+assert_file_has_content indexes commitreachable
+# A second prune merges the indexes, and must not delete anything reachable
+${CMD_PREFIX} ostree --repo=repo3 prune --refs-only > prune-output
+assert_file_has_content prune-output "No unreachable objects"
+${CMD_PREFIX} ostree --repo=repo3 fsck
+rm repo3/refs/heads/* repo3/refs/remotes/* -rf
+${CMD_PREFIX} ostree --repo=repo3 prune --refs-only
+find repo3/objects -name '*.commitreachable' > indexes
+assert_not_file_has_content indexes commitreachable
+rm repo3 indexes prune-output -rf
+echo "ok prune with reachable indexes"
+
 cd ${test_tmpdir}
 $OSTREE commit -b test3 -s "Another commit" --tree=ref=test2
 ostree --repo=repo refs > reflist
@@ -239,8 +280,96 @@ cd ${test_tmpdir}
 rm -rf test2-checkout
 $OSTREE checkout test2 test2-checkout
 (cd test2-checkout && $OSTREE commit --link-checkout-speedup -b test2 -s "tmp")
+assert_has_file repo/devino-index
+old_rev=$($OSTREE rev-parse test2)
+(cd test2-checkout && $OSTREE commit --link-checkout-speedup --skip-if-unchanged -b test2 -s "tmp")
+new_rev=$($OSTREE rev-parse test2)
+assert_streq "${old_rev}" "${new_rev}"
 echo "ok commit with link speedup"
 
+cd ${test_tmpdir}
+old_rev=$($OSTREE rev-parse test2)
+(cd test2-checkout && $OSTREE commit --jobs=4 --skip-if-unchanged -b test2 -s "threaded")
+new_rev=$($OSTREE rev-parse test2)
+assert_streq "${old_rev}" "${new_rev}"
+echo "ok commit --jobs"
+
+cd ${test_tmpdir}
+rm -rf stat-cache-tree stat-cache-checkout stat-cache
+mkdir -p stat-cache-tree/subdir
+echo same > stat-cache-tree/subdir/same
+echo before > stat-cache-tree/changed
+ln -s subdir/same stat-cache-tree/link
+# Files changed within a second of the commit are not cached
+sleep 2
+$OSTREE commit --stat-cache=stat-cache -b stat-cache -s "Stat cache 1" --tree=dir=stat-cache-tree
+assert_has_file stat-cache
+# The cache can only be empty if nothing was recorded in it
+test -s stat-cache
+grep -q -a 'stat-cache-tree/subdir/same' stat-cache
+echo after > stat-cache-tree/changed
+$OSTREE commit --stat-cache=stat-cache -b stat-cache -s "Stat cache 2" --tree=dir=stat-cache-tree
+$OSTREE checkout stat-cache stat-cache-checkout
+assert_file_has_content stat-cache-checkout/changed after
+assert_file_has_content stat-cache-checkout/subdir/same same
+assert_streq "$(readlink stat-cache-checkout/link)" subdir/same
+$OSTREE diff stat-cache^ stat-cache > stat-cache-diff
+assert_file_has_content stat-cache-diff 'M */changed$'
+rm -rf stat-cache-tree stat-cache-checkout stat-cache stat-cache-diff
+echo "ok commit --stat-cache"
+
+cd ${test_tmpdir}
+rm -rf test2-checkout-jobs readonly-tree
+mkdir -p readonly-tree/ro
+echo ro > readonly-tree/ro/file
+chmod 0555 readonly-tree/ro
+$OSTREE commit -b readonly -s "Read-only directory" --tree=dir=readonly-tree
+chmod 0755 readonly-tree/ro
+$OSTREE checkout --jobs=4 test2 test2-checkout-jobs
+(cd test2-checkout && find . -printf '%p %y %m %l\n' | sort) > checkout-serial.txt
+(cd test2-checkout-jobs && find . -printf '%p %y %m %l\n' | sort) > checkout-jobs.txt
+cmp checkout-serial.txt checkout-jobs.txt
+cmp test2-checkout/baz/cow test2-checkout-jobs/baz/cow
+$OSTREE checkout -U --jobs=4 readonly readonly-checkout
+assert_streq "$(stat -c '%a' readonly-checkout/ro)" "555"
+assert_file_has_content readonly-checkout/ro/file ro
+chmod 0755 readonly-checkout/ro
+# The deferred mode is masked by the umask, just like mkdirat()
+(umask 027 && $OSTREE checkout -U --jobs=4 readonly readonly-checkout-umask)
+assert_streq "$(stat -c '%a' readonly-checkout-umask/ro)" "550"
+chmod 0755 readonly-checkout-umask/ro
+rm -rf test2-checkout-jobs readonly-tree readonly-checkout readonly-checkout-umask checkout-serial.txt checkout-jobs.txt
+echo "ok checkout --jobs"
+
+cd ${test_tmpdir}
+rm -rf update-tree update-checkout update-fresh
+mkdir -p update-tree/a/b update-tree/gone update-tree/same
+echo one > update-tree/a/b/changed
+echo keep > update-tree/a/kept
+echo bye > update-tree/gone/file
+echo same > update-tree/same/file
+echo removed > update-tree/removed
+$OSTREE commit -b update -s "Update from" --tree=dir=update-tree
+(umask 027 && $OSTREE checkout -U update update-checkout)
+echo two > update-tree/a/b/changed
+rm -rf update-tree/gone update-tree/removed
+mkdir -p update-tree/new/sub
+echo new > update-tree/new/sub/file
+ln -s a/kept update-tree/link
+chmod 0770 update-tree/a
+$OSTREE commit -b update -s "Update to" --tree=dir=update-tree
+# Run under a umask which masks the changed mode of a/
+(umask 027 && $OSTREE checkout -U --update-from=update^ update update-checkout)
+(umask 027 && $OSTREE checkout -U update update-fresh)
+(cd update-checkout && find . -printf '%p %y %m %l\n' | sort) > update-incremental.txt
+(cd update-fresh && find . -printf '%p %y %m %l\n' | sort) > update-fresh.txt
+cmp update-incremental.txt update-fresh.txt
+assert_streq "$(stat -c '%a' update-checkout/a)" "750"
+assert_file_has_content update-checkout/a/b/changed two
+assert_file_has_content update-checkout/new/sub/file new
+rm -rf update-tree update-checkout update-fresh update-incremental.txt update-fresh.txt
+echo "ok checkout --update-from"
+
 cd ${test_tmpdir}
 $OSTREE ls test2
 echo "ok ls with no argument"
@@ -305,3 +434,86 @@ assert_file_has_content repo/config 'tls-permissive=true'
 assert_file_has_content repo/config 'remote\.example\.com'
 echo "ok remote add with set"
 
+
+cd ${test_tmpdir}
+rm repo3 -rf
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init
+${CMD_PREFIX} ostree --repo=repo3 pull-local repo test2
+${CMD_PREFIX} ostree --repo=repo3 repack > repack-output
+assert_file_has_content repack-output "Packed .* metadata objects"
+ls repo3/objects/pack/ostmetapack-*.index
+find repo3/objects -name '*.dirtree' -o -name '*.dirmeta' -o -name '*.commit' > loose-meta
+if test -s loose-meta; then
+    echo "Loose metadata left after repack!"; exit 1
+fi
+${CMD_PREFIX} ostree --repo=repo3 fsck
+${CMD_PREFIX} ostree --repo=repo3 ls test2 / > /dev/null
+rm checkout-repo3 -rf
+${CMD_PREFIX} ostree --repo=repo3 checkout test2 checkout-repo3
+assert_file_has_content checkout-repo3/yet/another/tree/green "leaf"
+# Simulate packs deleted by a concurrent prune between listing
+# objects/pack and opening them: an index which is already gone, and
+# an index whose data is gone.
+gone=0000000000000000000000000000000000000000000000000000000000000000
+ln -s ostmetapack-${gone}.index.deleted repo3/objects/pack/ostmetapack-${gone}.index
+cp $(ls repo3/objects/pack/ostmetapack-*.index | grep -v ${gone}) repo3/objects/pack/ostmetapack-1${gone:1}.index
+${CMD_PREFIX} ostree --repo=repo3 fsck
+${CMD_PREFIX} ostree --repo=repo3 ls test2 / > /dev/null
+rm repo3/objects/pack/ostmetapack-${gone}.index repo3/objects/pack/ostmetapack-1${gone:1}.index
+rm repo3/refs/heads/* -rf
+${CMD_PREFIX} ostree --repo=repo3 prune --refs-only > prune-output
+assert_file_has_content prune-output "Deleted"
+if ls repo3/objects/pack/ostmetapack-*.index 2>/dev/null; then
+    echo "Pack not deleted by prune!"; exit 1
+fi
+rm repo3 checkout-repo3 repack-output loose-meta prune-output -rf
+echo "ok repack metadata"
+
+cd ${test_tmpdir}
+rm repo4 checkout-repo4 -rf
+mkdir repo4
+${CMD_PREFIX} ostree --repo=repo4 init
+${CMD_PREFIX} ostree --repo=repo4 config set core.fsync false
+${CMD_PREFIX} ostree --repo=repo4 pull-local repo test2
+${CMD_PREFIX} ostree --repo=repo4 fsck
+${CMD_PREFIX} ostree --repo=repo4 checkout test2 checkout-repo4
+assert_file_has_content checkout-repo4/baz/cow moo
+rm repo4 checkout-repo4 -rf
+echo "ok core.fsync=false"
+
+cd ${test_tmpdir}
+rm clone-tree checkout-clone -rf
+mkdir clone-tree
+dd if=/dev/urandom of=clone-tree/big bs=1024 count=3000 2>/dev/null
+echo small > clone-tree/small
+$OSTREE commit -b clone -s "Clone" --tree=dir=clone-tree
+$OSTREE fsck
+$OSTREE checkout -U clone checkout-clone
+cmp clone-tree/big checkout-clone/big
+cmp clone-tree/small checkout-clone/small
+assert_streq $(stat -c '%h' checkout-clone/big) 1
+rm clone-tree checkout-clone -rf
+echo "ok commit and user checkout with file cloning"
+
+cd ${test_tmpdir}
+rm repo4 fsck-output -rf
+mkdir repo4
+${CMD_PREFIX} ostree --repo=repo4 init
+${CMD_PREFIX} ostree --repo=repo4 pull-local repo test2
+${CMD_PREFIX} ostree --repo=repo4 fsck --jobs=2
+assert_has_file repo4/fsck-journal
+${CMD_PREFIX} ostree --repo=repo4 fsck --resume > fsck-output
+assert_file_has_content fsck-output "Skipping"
+${CMD_PREFIX} ostree --repo=repo4 fsck --metadata-only --sample=50
+csum=$(ostree --repo=repo4 ls -C test2 /baz/cow | awk '{ print $5 }')
+cowobject=repo4/objects/$(echo ${csum} | cut -c1-2)/$(echo ${csum} | cut -c3-).file
+# Don't write through a hardlink shared with the source repository
+rm -f ${cowobject}
+echo corrupted > ${cowobject}
+${CMD_PREFIX} ostree --repo=repo4 fsck --resume
+if ${CMD_PREFIX} ostree --repo=repo4 fsck 2>/dev/null; then
+    echo "Corrupted object not detected"; exit 1
+fi
+rm repo4 fsck-output -rf
+echo "ok fsck journal"
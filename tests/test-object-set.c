@@ -0,0 +1,115 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "libgsystem.h"
+
+#include "ostree.h"
+
+#define N_OBJECTS 10000
+
+static char *
+nth_checksum (guint n)
+{
+  return g_compute_checksum_for_data (G_CHECKSUM_SHA256, (guint8*)&n, sizeof (n));
+}
+
+static void
+test_add_contains (void)
+{
+  OstreeObjectSet *set = ostree_object_set_new ();
+  guint i;
+
+  g_assert_cmpint (ostree_object_set_size (set), ==, 0);
+
+  for (i = 0; i < N_OBJECTS; i++)
+    {
+      gs_free char *checksum = nth_checksum (i);
+
+      g_assert (!ostree_object_set_contains (set, checksum, OSTREE_OBJECT_TYPE_FILE));
+      g_assert (ostree_object_set_add (set, checksum, OSTREE_OBJECT_TYPE_FILE));
+      g_assert (!ostree_object_set_add (set, checksum, OSTREE_OBJECT_TYPE_FILE));
+    }
+  g_assert_cmpint (ostree_object_set_size (set), ==, N_OBJECTS);
+
+  for (i = 0; i < N_OBJECTS; i++)
+    {
+      gs_free char *checksum = nth_checksum (i);
+
+      g_assert (ostree_object_set_contains (set, checksum, OSTREE_OBJECT_TYPE_FILE));
+      /* The same checksum with another type is a different object */
+      g_assert (!ostree_object_set_contains (set, checksum, OSTREE_OBJECT_TYPE_DIR_TREE));
+    }
+
+  {
+    gs_free char *checksum = nth_checksum (N_OBJECTS);
+    g_assert (!ostree_object_set_contains (set, checksum, OSTREE_OBJECT_TYPE_FILE));
+  }
+
+  ostree_object_set_unref (set);
+}
+
+static void
+test_iter (void)
+{
+  OstreeObjectSet *set = ostree_object_set_new ();
+  OstreeObjectSetIter iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  gs_unref_hashtable GHashTable *seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  guint i;
+
+  for (i = 0; i < N_OBJECTS; i++)
+    {
+      gs_free char *checksum = nth_checksum (i);
+      g_assert (ostree_object_set_add (set, checksum, OSTREE_OBJECT_TYPE_COMMIT));
+      g_assert (ostree_object_set_add (set, checksum, OSTREE_OBJECT_TYPE_DIR_META));
+    }
+
+  ostree_object_set_iter_init (&iter, set);
+  while (ostree_object_set_iter_next (&iter, &csum, &objtype))
+    {
+      gs_free char *checksum = ostree_checksum_from_bytes (csum);
+      char *key;
+
+      g_assert (objtype == OSTREE_OBJECT_TYPE_COMMIT || objtype == OSTREE_OBJECT_TYPE_DIR_META);
+      key = g_strdup_printf ("%s.%s", checksum, ostree_object_type_to_string (objtype));
+      g_assert (!g_hash_table_contains (seen, key));
+      g_hash_table_add (seen, key);
+    }
+  g_assert_cmpint (g_hash_table_size (seen), ==, 2 * N_OBJECTS);
+
+  ostree_object_set_unref (set);
+}
+
+int
+main (int argc, char **argv)
+{
+
+  g_setenv ("GIO_USE_VFS", "local", TRUE);
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/ostree/object-set/add-contains", test_add_contains);
+  g_test_add_func ("/ostree/object-set/iter", test_iter);
+
+  return g_test_run ();
+}
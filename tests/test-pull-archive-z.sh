@@ -23,6 +23,6 @@ set -e
 
 setup_fake_remote_repo1 "archive-z2"
 
-echo '1..2'
+echo '1..6'
 
 . ${SRCDIR}/pull-test.sh